@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/gc.h"
+#include "clox/memory.h"
+#include "clox/object.h"
+#include "clox/vm.h"
+
+// allocations per measurement
+#define CHURN_OPS (16 * 1024 * 1024)
+#define STRING_ROUNDS 200
+#define STRINGS_PER_ROUND (32 * 1024)
+#define THREADS 4
+
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/**
+ * Sizes of the objects the VM makes, a string header plus a short string.
+ */
+static size_t object_size(uint64_t random) {
+  return 40 + random % 176;
+}
+
+typedef struct {
+  size_t live;
+  size_t ops;
+  double ns_per_op;
+} Churn;
+
+/**
+ * Keeps churn->live objects around and replaces a random one with every
+ * allocation, the way a program drops and creates short strings.
+ */
+static void *churn(void *arg) {
+  Churn *churn = arg;
+  void **objects = calloc(churn->live, sizeof(void *));
+  size_t *sizes = calloc(churn->live, sizeof(size_t));
+  uint64_t state = 0x9E3779B97F4A7C15ull;
+
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < churn->ops; i++) {
+    uint64_t random = next_random(&state);
+    size_t slot = random % churn->live;
+    if (objects[slot] != NULL) {
+      slab_free(objects[slot], sizes[slot], MEM_OBJECTS);
+    }
+    sizes[slot] = object_size(random >> 32);
+    objects[slot] = slab_alloc(sizes[slot], MEM_OBJECTS);
+    // touch the object like a constructor would
+    *(volatile char *) objects[slot] = (char) i;
+  }
+  churn->ns_per_op = (double) (bench_now_ns() - start) / churn->ops;
+
+  for (size_t i = 0; i < churn->live; i++) {
+    if (objects[i] != NULL) {
+      slab_free(objects[i], sizes[i], MEM_OBJECTS);
+    }
+  }
+  slab_release_empty();
+  free(objects);
+  free(sizes);
+  return NULL;
+}
+
+static void bench_churn(size_t live) {
+  Churn single = {live, CHURN_OPS, 0};
+  churn(&single);
+
+  // the same workload on several threads at once, each on its own objects
+  pthread_t threads[THREADS];
+  Churn parallel[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    parallel[i] = (Churn) {live, CHURN_OPS / THREADS, 0};
+    pthread_create(&threads[i], NULL, churn, &parallel[i]);
+  }
+  double sum = 0;
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    sum += parallel[i].ns_per_op;
+  }
+
+  fprintf(stdout, "churn %8zu live objects: %7.2f ns/op, %d threads %7.2f ns/op\n",
+      live, single.ns_per_op, THREADS, sum / THREADS);
+}
+
+/**
+ * Interns a batch of fresh strings and lets the collector sweep them all,
+ * so objects are freed in heap order rather than at random.
+ */
+static void bench_strings() {
+  VM vm;
+  init_vm(&vm);
+  char chars[32];
+
+  uint64_t start = bench_now_ns();
+  for (size_t round = 0; round < STRING_ROUNDS; round++) {
+    for (size_t i = 0; i < STRINGS_PER_ROUND; i++) {
+      int length = snprintf(chars, sizeof(chars), "string %zu/%zu", round, i);
+      copy_string(&vm, chars, (size_t) length);
+    }
+    collect_garbage(&vm);
+  }
+  double elapsed = (double) (bench_now_ns() - start);
+
+  fprintf(stdout, "intern and collect: %7.2f ns/string, %zu pages mapped, %zu released\n",
+      elapsed / (STRING_ROUNDS * STRINGS_PER_ROUND),
+      slab_stats()->pages_mapped, slab_stats()->pages_released);
+  free_vm(&vm);
+}
+
+int main() {
+#ifdef CLOX_SLAB_ALLOCATOR
+  fprintf(stdout, "slab allocator\n");
+#else
+  fprintf(stdout, "malloc\n");
+#endif // CLOX_SLAB_ALLOCATOR
+
+  const size_t live[] = {1024, 64 * 1024, 1024 * 1024};
+  for (size_t i = 0; i < sizeof(live) / sizeof(live[0]); i++) {
+    bench_churn(live[i]);
+  }
+  bench_strings();
+  return 0;
+}
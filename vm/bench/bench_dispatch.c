@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/chunk.h"
+#include "clox/vm.h"
+
+#define BLOCKS 2000
+#define ITERATIONS 2000
+
+/**
+ * Builds a chunk made only of short arithmetic opcodes so that the time
+ * spent in the run loop is dominated by dispatch. Stack depth never goes
+ * above two.
+ */
+static size_t build_arithmetic_chunk(Chunk *chunk) {
+  uint8_t one = add_constant(chunk, NUMBER_VAL(1.0));
+  uint8_t two = add_constant(chunk, NUMBER_VAL(2.0));
+  uint8_t half = add_constant(chunk, NUMBER_VAL(0.5));
+  size_t instructions = 0;
+
+  write_chunk(chunk, OP_CONSTANT, 1);
+  write_chunk(chunk, one, 1);
+  instructions++;
+
+  for (size_t i = 0; i < BLOCKS; i++) {
+    write_chunk(chunk, OP_CONSTANT, 1);
+    write_chunk(chunk, two, 1);
+    write_chunk(chunk, OP_ADD, 1);
+    write_chunk(chunk, OP_CONSTANT, 1);
+    write_chunk(chunk, half, 1);
+    write_chunk(chunk, OP_MULTIPLY, 1);
+    write_chunk(chunk, OP_NEGATE, 1);
+    write_chunk(chunk, OP_CONSTANT, 1);
+    write_chunk(chunk, one, 1);
+    write_chunk(chunk, OP_SUBTRACT, 1);
+    write_chunk(chunk, OP_CONSTANT, 1);
+    write_chunk(chunk, two, 1);
+    write_chunk(chunk, OP_DIVIDE, 1);
+    write_chunk(chunk, OP_NEGATE, 1);
+    instructions += 10;
+  }
+
+  // the result is printed, as a script would
+  write_chunk(chunk, OP_PRINT, 1);
+  write_chunk(chunk, OP_RETURN, 1);
+  instructions += 2;
+
+  return instructions;
+}
+
+int main() {
+  Chunk chunk;
+  init_chunk(&chunk);
+  size_t instructions = build_arithmetic_chunk(&chunk);
+
+  VM vm;
+  init_vm(&vm);
+
+  int saved_stdout = bench_silence_stdout();
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ITERATIONS; i++) {
+    if (interpret_chunk(&vm, &chunk) != INTERPRET_OK) {
+      bench_restore_stdout(saved_stdout);
+      fprintf(stderr, "Benchmark chunk failed to run\n");
+      return 1;
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  bench_restore_stdout(saved_stdout);
+
+  free_vm(&vm);
+  free_chunk(&chunk);
+
+#ifdef CLOX_COMPUTED_GOTO
+  const char *dispatch = "computed goto";
+#else
+  const char *dispatch = "switch";
+#endif // CLOX_COMPUTED_GOTO
+  double dispatched = (double) instructions * ITERATIONS;
+  fprintf(stdout, "%-14s %10.3f ms %8.3f ns/instruction\n",
+      dispatch, elapsed / 1e6, elapsed / dispatched);
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/compiler.h"
+#include "clox/vm.h"
+
+#define STATEMENTS 20000
+#define ROUNDS 100
+
+/**
+ * Statements like the ones of the other benchmarks, with the repeated
+ * subexpressions, overwritten assignments and unused values that code
+ * written by hand or generated tends to have.
+ */
+static char *redundant_script() {
+  size_t capacity = 128 + STATEMENTS * 64;
+  char *source = malloc(capacity);
+  size_t length = 0;
+  for (size_t i = 0; i < STATEMENTS; i++) {
+    const char *statement;
+    switch (i % 5) {
+      case 0: statement = "x = x * 0.999 + y - z / 7;\n"; break;
+      case 1: statement = "y = (x - y) * (x + y) / scale + 1;\n"; break;
+      case 2: statement = "f = (x - y) * (x + y); f = f + 1;\n"; break;
+      case 3: statement = "z = z + y + x + 0.5; x + y;\n"; break;
+      default: statement = "f = (x == y) == (z + 1 == x + z);\n"; break;
+    }
+    length += (size_t) snprintf(source + length, capacity - length, "%s", statement);
+  }
+  snprintf(source + length, capacity - length, "print x + y + z;\n");
+  return source;
+}
+
+static size_t instructions(const Chunk *chunk) {
+  size_t count = 0;
+  for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset])) {
+    count++;
+  }
+  return count;
+}
+
+/**
+ * Time per statement to compile the script and to run it over and over.
+ */
+static double run_ns(int opt_level, double *compile_ns, size_t *count) {
+  VM vm;
+  init_vm(&vm);
+  vm.opt_level = opt_level;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+
+  // the values come from another chunk, so the compiler cannot know them
+  interpret(&vm, "var x = 1; var y = 2; var z = 3; var f = nil; var scale = 1000;");
+  char *source = redundant_script();
+  Chunk chunk;
+  init_chunk(&chunk);
+  uint64_t start = bench_now_ns();
+  compile(&vm, source, &chunk);
+  *compile_ns = (double) (bench_now_ns() - start) / STATEMENTS;
+  *count = instructions(&chunk);
+  free(source);
+
+  int saved_stdout = bench_silence_stdout();
+  interpret_chunk(&vm, &chunk);
+  start = bench_now_ns();
+  for (size_t i = 0; i < ROUNDS; i++) {
+    interpret_chunk(&vm, &chunk);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  bench_restore_stdout(saved_stdout);
+
+  free_chunk(&chunk);
+  free_vm(&vm);
+  return (double) elapsed / ((double) ROUNDS * STATEMENTS);
+}
+
+int main() {
+  double plain = 0, optimized = 0;
+  double plain_compile = 0, optimized_compile = 0;
+  size_t plain_count = 0, optimized_count = 0;
+  // the best of a few runs, the others were disturbed by something
+  for (int i = 0; i < 5; i++) {
+    double compile_ns;
+    double ns = run_ns(0, &compile_ns, &plain_count);
+    plain = i == 0 || ns < plain ? ns : plain;
+    plain_compile = i == 0 || compile_ns < plain_compile ? compile_ns : plain_compile;
+    ns = run_ns(1, &compile_ns, &optimized_count);
+    optimized = i == 0 || ns < optimized ? ns : optimized;
+    optimized_compile = i == 0 || compile_ns < optimized_compile ? compile_ns : optimized_compile;
+  }
+  fprintf(stdout, "-O0  run %8.2f ns/statement  compile %8.2f ns/statement  %8.2f instructions/statement\n",
+      plain, plain_compile, (double) plain_count / STATEMENTS);
+  fprintf(stdout, "-O1  run %8.2f ns/statement  compile %8.2f ns/statement  %8.2f instructions/statement (%.2fx)\n",
+      optimized, optimized_compile, (double) optimized_count / STATEMENTS, plain / optimized);
+  return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#include "clox/compiler.h"
+#include "clox/jit.h"
+#include "clox/vm.h"
+
+#define STATEMENTS 20000
+#define ROUNDS 200
+
+/**
+ * A long straight line of arithmetic on globals, the kind of script the
+ * JIT is meant for.
+ */
+static char *arithmetic_script() {
+  size_t capacity = 64 + STATEMENTS * 64;
+  char *source = malloc(capacity);
+  size_t length = (size_t) snprintf(source, capacity, "var x = 1; var y = 2; var z = 3;\n");
+  for (size_t i = 0; i < STATEMENTS; i++) {
+    const char *statement;
+    switch (i % 3) {
+      case 0: statement = "x = x * 0.999 + y - z / 7;\n"; break;
+      case 1: statement = "y = (x - y) * (x + y) / 1000 + 1;\n"; break;
+      default: statement = "z = -z + x * 2 - y;\n"; break;
+    }
+    length += (size_t) snprintf(source + length, capacity - length, "%s", statement);
+  }
+  snprintf(source + length, capacity - length, "print x + y + z;\n");
+  return source;
+}
+
+/**
+ * Time per statement once the chunk is hot, the runs that warm it up and
+ * compile it are not measured.
+ */
+static double run_ns(Chunk *chunk, bool jit) {
+  VM vm;
+  init_vm(&vm);
+  vm.jit = jit;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+
+  // the chunk refers to global slots of the VM it was compiled for, give
+  // this one the same slots
+  char *source = arithmetic_script();
+  init_chunk(chunk);
+  compile(&vm, source, chunk);
+  free(source);
+
+  int saved_stdout = bench_silence_stdout();
+  for (size_t i = 0; i <= JIT_HOT_RUNS; i++) {
+    interpret_chunk(&vm, chunk);
+  }
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ROUNDS; i++) {
+    interpret_chunk(&vm, chunk);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  bench_restore_stdout(saved_stdout);
+
+  free_chunk(chunk);
+  free_vm(&vm);
+  return (double) elapsed / ((double) ROUNDS * STATEMENTS);
+}
+
+/**
+ * What compiling costs per statement, and the size of the code.
+ */
+static double compile_ns(size_t *size) {
+  VM vm;
+  init_vm(&vm);
+  char *source = arithmetic_script();
+  Chunk chunk;
+  init_chunk(&chunk);
+  compile(&vm, source, &chunk);
+  free(source);
+
+  JitCode jit;
+  uint64_t start = bench_now_ns();
+  jit_compile(&chunk, &jit);
+  uint64_t elapsed = bench_now_ns() - start;
+  *size = jit.size;
+
+  jit_free(&jit);
+  free_chunk(&chunk);
+  free_vm(&vm);
+  return (double) elapsed / STATEMENTS;
+}
+
+int main() {
+  if (!jit_available()) {
+    fprintf(stdout, "the JIT is not built in, only the interpreter is measured\n");
+  }
+
+  Chunk chunk;
+  double interpreted = run_ns(&chunk, false);
+  double native = run_ns(&chunk, true);
+  size_t size;
+  double compiling = compile_ns(&size);
+  fprintf(stdout, "interpreter %8.2f ns/statement\n", interpreted);
+  fprintf(stdout, "jit         %8.2f ns/statement (%.1fx)\n", native, interpreted / native);
+  fprintf(stdout, "compiling   %8.2f ns/statement, %.1f bytes/statement\n",
+      compiling, (double) size / STATEMENTS);
+  return 0;
+}
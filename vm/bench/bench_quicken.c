@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/compiler.h"
+#include "clox/vm.h"
+
+#define STATEMENTS 20000
+#define ROUNDS 100
+
+/**
+ * Statements on global numbers that use the instructions the VM quickens,
+ * each workload cycles through its three.
+ */
+typedef struct {
+  const char *name;
+  const char *statements[3];
+} Workload;
+
+static const Workload workloads[] = {
+  {"mixed", {"x = x + y + 1;\n", "y = y + z + x + 0.5;\n", "f = (x == y) == (z + 1 == x + z);\n"}},
+  {"equality", {"f = x == y;\n", "f = (x == z) == (y == z);\n", "f = x + 1 == y;\n"}},
+};
+
+static char *numeric_script(const Workload *workload) {
+  size_t capacity = 64 + STATEMENTS * 64;
+  char *source = malloc(capacity);
+  size_t length = 0;
+  for (size_t i = 0; i < STATEMENTS; i++) {
+    length += (size_t) snprintf(source + length, capacity - length, "%s", workload->statements[i % 3]);
+  }
+  snprintf(source + length, capacity - length, "print x + y;\n");
+  return source;
+}
+
+/**
+ * Time per statement of a chunk that runs over and over, after the first
+ * run had the chance to quicken it. Superinstructions are off, most of
+ * the fused pairs are not quickened and would hide the difference.
+ */
+static double run_ns(const Workload *workload, bool quicken) {
+  VM vm;
+  init_vm(&vm);
+  vm.quicken = quicken;
+  vm.superinstructions = false;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+
+  // the values come from another chunk, so -O1 cannot fold them away
+  interpret(&vm, "var x = 1; var y = 2; var z = 3; var f = nil;");
+  char *source = numeric_script(workload);
+  Chunk chunk;
+  init_chunk(&chunk);
+  compile(&vm, source, &chunk);
+  free(source);
+
+  int saved_stdout = bench_silence_stdout();
+  interpret_chunk(&vm, &chunk);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ROUNDS; i++) {
+    interpret_chunk(&vm, &chunk);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  bench_restore_stdout(saved_stdout);
+
+  free_chunk(&chunk);
+  free_vm(&vm);
+  return (double) elapsed / ((double) ROUNDS * STATEMENTS);
+}
+
+int main() {
+  for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    // the best of a few runs, the others were disturbed by something
+    double generic = run_ns(&workloads[w], false);
+    double quickened = run_ns(&workloads[w], true);
+    for (int i = 0; i < 14; i++) {
+      double ns = run_ns(&workloads[w], false);
+      generic = ns < generic ? ns : generic;
+      ns = run_ns(&workloads[w], true);
+      quickened = ns < quickened ? ns : quickened;
+    }
+    fprintf(stdout, "%-9s generic   %8.2f ns/statement\n", workloads[w].name, generic);
+    fprintf(stdout, "%-9s quickened %8.2f ns/statement (%.2fx)\n", workloads[w].name, quickened, generic / quickened);
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/compiler.h"
+#include "clox/vm.h"
+
+#define STATEMENTS 20000
+#define ROUNDS 100
+
+/**
+ * The statements of bench_superinstructions.
+ */
+static char *mixed_script() {
+  size_t capacity = 128 + STATEMENTS * 64;
+  char *source = malloc(capacity);
+  size_t length = 0;
+  for (size_t i = 0; i < STATEMENTS; i++) {
+    const char *statement;
+    switch (i % 4) {
+      case 0: statement = "x = x * 0.999 + y - z / 7;\n"; break;
+      case 1: statement = "y = (x - y) * (x + y) / 1000 + 1;\n"; break;
+      case 2: statement = "z = z + y + x + 0.5;\n"; break;
+      default: statement = "f = (x == y) == (z + 1 == x + z);\n"; break;
+    }
+    length += (size_t) snprintf(source + length, capacity - length, "%s", statement);
+  }
+  snprintf(source + length, capacity - length, "print x + y + z;\n");
+  return source;
+}
+
+/**
+ * Instructions the run loop dispatches for one run of the chunk, there
+ * are no jumps.
+ */
+static size_t dispatches(const Chunk *chunk) {
+  size_t count = 0;
+  for (size_t offset = 0; offset < chunk->count; count++) {
+    offset += chunk->registers ? register_instruction_length(chunk->code[offset]) :
+      instruction_length(chunk->code[offset]);
+  }
+  return count;
+}
+
+typedef struct {
+  const char *name;
+  bool registers;
+  bool superinstructions;
+  int opt_level;
+  double ns;
+  size_t dispatched;
+} Variant;
+
+/**
+ * Time per statement of a chunk that runs over and over, after the first
+ * run fused and quickened stack code.
+ */
+static double run_ns(const Variant *variant, size_t *dispatched) {
+  VM vm;
+  init_vm(&vm);
+  vm.registers = variant->registers;
+  vm.superinstructions = variant->superinstructions;
+  vm.opt_level = variant->opt_level;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+
+  // the values come from another chunk, so -O1 cannot fold them away
+  interpret(&vm, "var x = 1; var y = 2; var z = 3; var f = nil;");
+  char *source = mixed_script();
+  Chunk chunk;
+  init_chunk(&chunk);
+  compile(&vm, source, &chunk);
+  free(source);
+
+  int saved_stdout = bench_silence_stdout();
+  interpret_chunk(&vm, &chunk);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ROUNDS; i++) {
+    interpret_chunk(&vm, &chunk);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  bench_restore_stdout(saved_stdout);
+
+  *dispatched = dispatches(&chunk);
+  free_chunk(&chunk);
+  free_vm(&vm);
+  return (double) elapsed / ((double) ROUNDS * STATEMENTS);
+}
+
+int main() {
+  Variant variants[] = {
+    {"stack -O0", false, false, 0, 0, 0},
+    {"fused -O0", false, true, 0, 0, 0},
+    {"registers -O0", true, false, 0, 0, 0},
+    {"stack -O1", false, false, 1, 0, 0},
+    {"fused -O1", false, true, 1, 0, 0},
+    {"registers -O1", true, false, 1, 0, 0},
+  };
+  size_t count = sizeof(variants) / sizeof(variants[0]);
+  // the best of a few runs, the others were disturbed by something
+  for (int i = 0; i < 5; i++) {
+    for (size_t v = 0; v < count; v++) {
+      double ns = run_ns(&variants[v], &variants[v].dispatched);
+      variants[v].ns = i == 0 || ns < variants[v].ns ? ns : variants[v].ns;
+    }
+  }
+  // every variant against plain stack code at the same level
+  for (size_t v = 0; v < count; v++) {
+    const Variant *stack = &variants[v - v % 3];
+    fprintf(stdout, "%-14s %8.2f ns/statement %8.2f dispatches/statement (%.2fx, %+.0f%% dispatches)\n",
+        variants[v].name, variants[v].ns, (double) variants[v].dispatched / STATEMENTS,
+        stack->ns / variants[v].ns,
+        100.0 * ((double) variants[v].dispatched / (double) stack->dispatched - 1));
+  }
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/compiler.h"
+#include "clox/vm.h"
+
+#define STATEMENTS 20000
+#define ROUNDS 100
+
+/**
+ * The statements of bench_jit and bench_quicken, which the corpus the
+ * superinstructions were picked from resembles.
+ */
+static char *mixed_script() {
+  size_t capacity = 128 + STATEMENTS * 64;
+  char *source = malloc(capacity);
+  size_t length = (size_t) snprintf(source, capacity, "var x = 1; var y = 2; var z = 3; var f = nil;\n");
+  for (size_t i = 0; i < STATEMENTS; i++) {
+    const char *statement;
+    switch (i % 4) {
+      case 0: statement = "x = x * 0.999 + y - z / 7;\n"; break;
+      case 1: statement = "y = (x - y) * (x + y) / 1000 + 1;\n"; break;
+      case 2: statement = "z = z + y + x + 0.5;\n"; break;
+      default: statement = "f = (x == y) == (z + 1 == x + z);\n"; break;
+    }
+    length += (size_t) snprintf(source + length, capacity - length, "%s", statement);
+  }
+  snprintf(source + length, capacity - length, "print x + y + z;\n");
+  return source;
+}
+
+/**
+ * Instructions the run loop dispatches for one run of the chunk, there
+ * are no jumps.
+ */
+static size_t dispatches(const Chunk *chunk) {
+  size_t count = 0;
+  for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset])) {
+    count++;
+  }
+  return count;
+}
+
+/**
+ * Time per statement of a chunk that runs over and over, after the first
+ * run fused and quickened it.
+ */
+static double run_ns(bool superinstructions, size_t *dispatched) {
+  VM vm;
+  init_vm(&vm);
+  vm.superinstructions = superinstructions;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+
+  char *source = mixed_script();
+  Chunk chunk;
+  init_chunk(&chunk);
+  compile(&vm, source, &chunk);
+  free(source);
+
+  int saved_stdout = bench_silence_stdout();
+  interpret_chunk(&vm, &chunk);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < ROUNDS; i++) {
+    interpret_chunk(&vm, &chunk);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  bench_restore_stdout(saved_stdout);
+
+  *dispatched = dispatches(&chunk);
+  free_chunk(&chunk);
+  free_vm(&vm);
+  return (double) elapsed / ((double) ROUNDS * STATEMENTS);
+}
+
+int main() {
+  size_t plain_dispatches;
+  size_t fused_dispatches;
+  // the best of a few runs, the others were disturbed by something
+  double plain = run_ns(false, &plain_dispatches);
+  double fused = run_ns(true, &fused_dispatches);
+  for (int i = 0; i < 4; i++) {
+    double ns = run_ns(false, &plain_dispatches);
+    plain = ns < plain ? ns : plain;
+    ns = run_ns(true, &fused_dispatches);
+    fused = ns < fused ? ns : fused;
+  }
+  fprintf(stdout, "pairs     %8.2f ns/statement %8.2f dispatches/statement\n",
+      plain, (double) plain_dispatches / STATEMENTS);
+  fprintf(stdout, "fused     %8.2f ns/statement %8.2f dispatches/statement (%.2fx)\n",
+      fused, (double) fused_dispatches / STATEMENTS, plain / fused);
+  return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/object.h"
+#include "clox/table.h"
+#include "clox/vm.h"
+
+// lookups per measurement, spread over all keys of the table
+#define LOOKUPS (16 * 1024 * 1024)
+
+/**
+ * Interns "prefix<i>" for i < count. Keys for misses use another prefix so
+ * they are never in the table.
+ */
+static ObjString **make_keys(VM *vm, const char *prefix, size_t count) {
+  ObjString **keys = malloc(count * sizeof(ObjString *));
+  char chars[32];
+  for (size_t i = 0; i < count; i++) {
+    int length = snprintf(chars, sizeof(chars), "%s%zu", prefix, i);
+    keys[i] = copy_string(vm, chars, (size_t) length);
+  }
+  return keys;
+}
+
+/**
+ * Walks the keys in a scrambled order so the benchmark measures probing
+ * rather than the prefetcher.
+ */
+static double lookup_ns(const Table *table, ObjString **keys, size_t count, size_t *found) {
+  size_t step = 7919;
+  size_t index = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < LOOKUPS; i++) {
+    Value value;
+    *found += table_get(table, keys[index], &value);
+    index = (index + step) % count;
+  }
+  return (double) (bench_now_ns() - start) / LOOKUPS;
+}
+
+static void bench_table_size(size_t count) {
+  VM vm;
+  init_vm(&vm);
+  // the keys are only referenced from C, keep the collector away from them
+  gc_defer(&vm);
+  ObjString **hits = make_keys(&vm, "key", count);
+  ObjString **misses = make_keys(&vm, "missing", count);
+
+  Table table;
+  init_table(&table);
+  uint64_t start = bench_now_ns();
+  for (size_t i = 0; i < count; i++) {
+    table_set(&table, hits[i], NUMBER_VAL(i));
+  }
+  double insert = (double) (bench_now_ns() - start) / count;
+
+  size_t found = 0;
+  double hit = lookup_ns(&table, hits, count, &found);
+  double miss = lookup_ns(&table, misses, count, &found);
+
+  // delete and reinsert half of the keys over and over
+  start = bench_now_ns();
+  size_t churn = 0;
+  for (size_t round = 0; churn < LOOKUPS / 4; round++) {
+    for (size_t i = round % 2; i < count; i += 2, churn++) {
+      table_delete(&table, hits[i]);
+    }
+    for (size_t i = round % 2; i < count; i += 2, churn++) {
+      table_set(&table, hits[i], NUMBER_VAL(i));
+    }
+  }
+  double delete_insert = (double) (bench_now_ns() - start) / churn;
+  double hit_after_churn = lookup_ns(&table, hits, count, &found);
+
+  fprintf(stdout, "%9zu keys: insert %7.2f  hit %7.2f  miss %7.2f  delete/insert %7.2f  hit after churn %7.2f ns/op (%zu)\n",
+      count, insert, hit, miss, delete_insert, hit_after_churn, found);
+
+  free_table(&table);
+  free(hits);
+  free(misses);
+  free_vm(&vm);
+}
+
+int main() {
+#if defined(CLOX_SWISS_TABLE) && defined(__SSE2__)
+  fprintf(stdout, "swiss table, SSE2 group probing\n");
+#elif defined(CLOX_SWISS_TABLE)
+  fprintf(stdout, "swiss table, portable group probing\n");
+#else
+  fprintf(stdout, "linear probing table\n");
+#endif // CLOX_SWISS_TABLE
+
+  const size_t sizes[] = {16, 256, 4 * 1024, 64 * 1024, 1024 * 1024};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    bench_table_size(sizes[i]);
+  }
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+
+#include "clox/value.h"
+#include "clox/vm.h"
+
+#define SWEEP_VALUES (64 * 1024 * 1024)
+#define STACK_ROUNDS 200000
+#define STACK_DEPTH 256
+
+/**
+ * Sums a constant pool of `count` numbers enough times to touch
+ * SWEEP_VALUES values in total. Once the pool no longer fits in a cache
+ * level the cost per value is dominated by its footprint.
+ */
+static void bench_constant_pool(size_t count) {
+  ValueArray pool;
+  init_value_array(&pool);
+  for (size_t i = 0; i < count; i++) {
+    write_value_array(&pool, NUMBER_VAL(i * 0.5));
+  }
+
+  size_t rounds = SWEEP_VALUES / count;
+  double sum = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < pool.count; i++) {
+      if (IS_NUMBER(pool.values[i])) {
+        sum += AS_NUMBER(pool.values[i]);
+      }
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  fprintf(stdout, "constant pool %9zu values %10zu KiB %8.3f ns/value (%g)\n",
+      count, count * sizeof(Value) / 1024,
+      (double) elapsed / ((double) rounds * count), sum);
+
+  free_value_array(&pool);
+}
+
+/**
+ * Pushes STACK_DEPTH values onto the VM stack and drains it again.
+ */
+static void bench_deep_stack() {
+  VM vm;
+  init_vm(&vm);
+  grow_stack(&vm, STACK_DEPTH);
+
+  double sum = 0;
+  uint64_t start = bench_now_ns();
+  for (size_t round = 0; round < STACK_ROUNDS; round++) {
+    for (size_t i = 0; i < STACK_DEPTH; i++) {
+      push(&vm, NUMBER_VAL(i));
+    }
+    for (size_t i = 0; i < STACK_DEPTH; i++) {
+      sum += AS_NUMBER(pop(&vm));
+    }
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+
+  fprintf(stdout, "deep stack    %9d slots  %10zu B   %8.3f ns/push+pop (%g)\n",
+      STACK_DEPTH, STACK_DEPTH * sizeof(Value),
+      (double) elapsed / ((double) STACK_ROUNDS * STACK_DEPTH), sum);
+
+  free_vm(&vm);
+}
+
+int main() {
+#ifdef CLOX_NAN_BOXING
+  fprintf(stdout, "NaN boxed Value, %zu bytes\n", sizeof(Value));
+#else
+  fprintf(stdout, "tagged union Value, %zu bytes\n", sizeof(Value));
+#endif // CLOX_NAN_BOXING
+
+  const size_t pool_sizes[] = {1024, 64 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+  for (size_t i = 0; i < sizeof(pool_sizes) / sizeof(pool_sizes[0]); i++) {
+    bench_constant_pool(pool_sizes[i]);
+  }
+  bench_deep_stack();
+
+  return 0;
+}
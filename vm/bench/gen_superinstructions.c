@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clox/chunk.h"
+#include "clox/debug.h"
+#include "clox/profile.h"
+#include "clox/vm.h"
+
+#ifndef CLOX_PROFILE
+#error "gen_superinstructions records pairs with the profiler, build it with CLOX_PROFILE"
+#endif // CLOX_PROFILE
+
+// how many pairs become superinstructions at most
+#define SUPERINSTRUCTIONS_MAX 8
+// pairs rarer than this share of all recorded pairs are not worth an opcode
+#define MIN_SHARE 0.01
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} Pair;
+
+static uint64_t pairs[PROFILE_OPCODES][PROFILE_OPCODES];
+
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return NULL;
+  }
+  fseek(file, 0L, SEEK_END);
+  size_t size = (size_t) ftell(file);
+  rewind(file);
+
+  char *buffer = malloc(size + 1);
+  if (buffer == NULL || fread(buffer, sizeof(char), size, file) != size) {
+    free(buffer);
+    fclose(file);
+    return NULL;
+  }
+  buffer[size] = '\0';
+  fclose(file);
+  return buffer;
+}
+
+/**
+ * Runs the script at path with the profiler on and adds the opcode pairs
+ * it dispatched to pairs. The VM runs the instructions as the compiler
+ * emitted them, neither quickened nor fused.
+ */
+static bool record(const char *path, FILE *devnull) {
+  char *source = read_file(path);
+  if (source == NULL) {
+    fprintf(stderr, "Could not read %s\n", path);
+    return false;
+  }
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = devnull;
+  vm.quicken = false;
+  vm.superinstructions = false;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+  vm.profiler = new_profiler(NULL);
+  InterpretResult result = vm.profiler != NULL ? interpret(&vm, source) : INTERPRET_RUNTIME_ERROR;
+  free(source);
+
+  if (vm.profiler != NULL) {
+    for (size_t a = 0; a < PROFILE_OPCODES; a++) {
+      for (size_t b = 0; b < PROFILE_OPCODES; b++) {
+        pairs[a][b] += vm.profiler->pairs[a][b];
+      }
+    }
+    // free_vm() would print the report
+    free_profiler(vm.profiler);
+    vm.profiler = NULL;
+  }
+  free_vm(&vm);
+
+  if (result != INTERPRET_OK) {
+    fprintf(stderr, "%s did not run\n", path);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Only instructions the compiler emits can be fused, and nothing runs
+ * after OP_RETURN.
+ */
+static bool fusable(uint8_t first, uint8_t second) {
+  OpCode a;
+  OpCode b;
+  return opcode_name(first) != NULL && opcode_name(second) != NULL &&
+    generic_opcode(first) == first && generic_opcode(second) == second &&
+    !superinstruction_parts(first, &a, &b) && !superinstruction_parts(second, &a, &b) &&
+    first != OP_RETURN;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+  const Pair *x = a;
+  const Pair *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  // ties go by opcode, so the same corpus always gives the same table
+  if (x->first != y->first) {
+    return x->first - y->first;
+  }
+  return x->second - y->second;
+}
+
+/**
+ * OP_GET_GLOBAL and OP_ADD make OP_GET_GLOBAL_ADD.
+ */
+static void superinstruction_name(char *name, size_t size, uint8_t first, uint8_t second) {
+  snprintf(name, size, "OP_%s_%s", opcode_name(first) + 3, opcode_name(second) + 3);
+}
+
+static bool write_table(const char *path) {
+  Pair candidates[PROFILE_OPCODES * 4];
+  size_t count = 0;
+  uint64_t total = 0;
+  for (size_t a = 0; a < PROFILE_OPCODES; a++) {
+    for (size_t b = 0; b < PROFILE_OPCODES; b++) {
+      total += pairs[a][b];
+      if (pairs[a][b] > 0 && fusable((uint8_t) a, (uint8_t) b) &&
+          count < sizeof(candidates) / sizeof(candidates[0])) {
+        candidates[count++] = (Pair) {(uint8_t) a, (uint8_t) b, pairs[a][b]};
+      }
+    }
+  }
+  qsort(candidates, count, sizeof(Pair), compare_pairs);
+
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Could not open %s\n", path);
+    return false;
+  }
+  fprintf(out,
+      "// Generated by bench/gen_superinstructions from the opcode pairs the\n"
+      "// profiler recorded over bench/corpus, do not edit. Regenerate with\n"
+      "//   cmake --build <build dir> --target superinstructions\n"
+      "//\n"
+      "// SUPERINSTRUCTION(name, first, second) fuses instruction first with the\n"
+      "// instruction second right after it. Each line notes the share of all\n"
+      "// recorded pairs.\n");
+  for (size_t i = 0; i < count && i < SUPERINSTRUCTIONS_MAX; i++) {
+    double share = (double) candidates[i].count / (double) total;
+    if (share < MIN_SHARE) {
+      break;
+    }
+    char name[64];
+    superinstruction_name(name, sizeof(name), candidates[i].first, candidates[i].second);
+    fprintf(out, "SUPERINSTRUCTION(%s, %s, %s) // %.1f%%\n", name,
+        opcode_name(candidates[i].first), opcode_name(candidates[i].second), 100.0 * share);
+  }
+  fclose(out);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s output.h script.lox...\n", argv[0]);
+    return 64;
+  }
+
+  FILE *devnull = fopen("/dev/null", "w");
+  bool ok = devnull != NULL;
+  for (int i = 2; i < argc && ok; i++) {
+    ok = record(argv[i], devnull);
+  }
+  if (devnull != NULL) {
+    fclose(devnull);
+  }
+  return ok && write_table(argv[1]) ? 0 : 1;
+}
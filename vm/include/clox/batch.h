@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clox/memory.h"
+#include "clox/trace.h"
+
+/**
+ * How a batch is run. Every worker thread owns one VM that is configured
+ * from these options and reused for all the scripts the worker runs.
+ */
+typedef struct {
+  // number of worker threads, values below 1 mean one per online CPU
+  int jobs;
+  bool print_code;
+  // quickening stats go to the error output of each script
+  bool quicken;
+  bool quicken_stats;
+  bool superinstructions;
+  int opt_level;
+  bool registers;
+  // values on the operand stack of each VM, 0 keeps STACK_LIMIT
+  size_t stack_limit;
+  bool jit;
+  uint32_t jit_hot_runs;
+  // compile cache shared by all workers, NULL for none
+  const char *cache_dir;
+  // ignored unless tracing is compiled in
+  TraceMode trace_mode;
+  // work units per collector step, 0 keeps GC_STEP_BUDGET
+  size_t gc_step_budget;
+  // when set, every worker adds the memory stats of its thread here
+  MemoryStats *memory_stats;
+} BatchOptions;
+
+void init_batch_options(BatchOptions *options);
+
+/**
+ * Runs every script in paths on a pool of worker threads.
+ *
+ * The output of each script is captured and written to out in the order
+ * the scripts were given, as soon as the script and everything before it
+ * has finished. Error messages go to err in the same order, each script
+ * followed by a line with its status and how long it took.
+ *
+ * Returns true if every script could be read and ran without errors.
+ */
+bool run_batch(const char *const *paths, size_t count, const BatchOptions *options,
+    FILE *out, FILE *err);
+
+/**
+ * Reads a manifest with one script path per line. Empty lines and lines
+ * starting with '#' are skipped. Appends the paths to *paths, growing it
+ * as needed, and returns false if the manifest could not be read.
+ */
+bool read_manifest(const char *path, char ***paths, size_t *count, size_t *capacity);
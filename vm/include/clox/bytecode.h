@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clox/chunk.h"
+#include "clox/vm.h"
+
+#define LOXC_MAGIC "LOXC"
+// bump whenever the layout or the meaning of any opcode changes
+#define LOXC_VERSION 3
+
+/**
+ * Fixed header at the start of every .loxc file. All integers are little
+ * endian. The header is followed by
+ *   - code_size bytes of code,
+ *   - padding to a multiple of 4 and line_count LineStart records,
+ *   - constant_count constants, each a one byte tag and its payload,
+ *   - global_count names, one for each global slot the code was compiled
+ *     against, a 4 byte length and the characters.
+ * Code and the line table are laid out so that a loader can use them in
+ * place, only the constants are decoded into Values. Only stack code is
+ * saved, write_bytecode() refuses register code.
+ */
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t code_size;
+  uint32_t line_count;
+  uint32_t constant_count;
+  uint32_t global_count;
+} BytecodeHeader;
+
+/**
+ * A chunk loaded from a mapped .loxc file. The chunk borrows its code and
+ * line table from the mapping, which stays alive until unmap_bytecode().
+ */
+typedef struct {
+  Chunk chunk;
+  void *data;
+  size_t size;
+} BytecodeFile;
+
+// vm is the VM the chunk was compiled for, it knows the global names
+bool write_bytecode(const VM *vm, const Chunk *chunk, FILE *out);
+bool save_bytecode(const VM *vm, const Chunk *chunk, const char *path, FILE *err);
+
+// loaders report why a file was rejected to err, unless it is NULL
+// string constants are interned in vm, so the chunk must not outlive it
+bool read_bytecode(VM *vm, Chunk *chunk, const uint8_t *data, size_t size, FILE *err);
+bool is_bytecode_file(const char *path);
+bool map_bytecode(VM *vm, BytecodeFile *file, const char *path, FILE *err);
+void unmap_bytecode(BytecodeFile *file);
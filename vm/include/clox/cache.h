@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clox/bytecode.h"
+#include "clox/chunk.h"
+
+/**
+ * Persistent compile cache. Every compiled chunk is stored as a .loxc file
+ * named after a hash of its source, its length, the bytecode version and
+ * the compiler version, so a change in any of them is simply a miss.
+ * Entries are written to a temporary file and renamed into place, which
+ * keeps the cache usable from many threads and processes at once.
+ */
+
+uint64_t hash_source(const char *source, size_t length);
+
+bool load_cached_chunk(VM *vm, const char *dir, const char *source, BytecodeFile *file);
+void store_cached_chunk(const VM *vm, const char *dir, const char *source, const Chunk *chunk);
+
+char *default_cache_dir();
+bool make_cache_dir(const char *dir);
@@ -4,28 +4,190 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "clox/memory.h"
 #include "clox/value.h"
 
 typedef enum {
   OP_CONSTANT,
+  OP_CONSTANT_LONG,
   OP_ADD,
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
   OP_RETURN,
   OP_NEGATE,
+  OP_EQUAL,
+  OP_NOT,
+  OP_PRINT,
+  OP_POP,
+  // 16 bit operand, the global's slot in VM.globals
+  OP_DEFINE_GLOBAL,
+  OP_GET_GLOBAL,
+  OP_SET_GLOBAL,
+  // specialized forms the VM rewrites generic instructions into once it
+  // saw their operand types, never emitted by the compiler or saved
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_EQUAL_NUM,
+  // pairs of instructions fused into one, see superinstructions.h
+#define SUPERINSTRUCTION(name, first, second) name,
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
 } OpCode;
 
+/**
+ * Instructions of register code, what the compiler emits instead of the
+ * stack instructions when VM.registers is set.
+ *
+ * Register code runs in a frame of values on the VM stack. The frame
+ * holds copies of the first Chunk.frame_constants constants, then the
+ * values of the globals in Chunk.frame_globals and then
+ * Chunk.register_count registers. Nothing else can touch the globals
+ * while a chunk runs, so the code works on their slots and the values are
+ * written back to VM.globals when it returns or fails.
+ *
+ * Operands are 16 bit little endian frame slots, so any operand can be a
+ * constant or a global. A is the slot the result goes to, a register or
+ * the slot of a global known to be defined. G is the index of a global in
+ * VM.globals, the instructions that use it check that it is defined or
+ * define it.
+ *
+ *   REG_CONSTANT A K         A = constant K, K is a 24 bit index for the
+ *                            constants that did not get a slot
+ *   REG_MOVE A B             A = B
+ *   REG_ADD A B C            A = B + C, likewise the other binary operators
+ *   REG_NEGATE A B           A = -B, likewise REG_NOT
+ *   REG_PRINT A
+ *   REG_CHECK_GLOBAL G       fails unless G is defined
+ *   REG_DEFINE_GLOBAL A G B  defines G, its slot A = B
+ *   REG_SET_GLOBAL A G B     fails unless G is defined, its slot A = B
+ *   REG_RETURN
+ */
+typedef enum {
+  REG_CONSTANT,
+  REG_MOVE,
+  REG_ADD,
+  REG_SUBTRACT,
+  REG_MULTIPLY,
+  REG_DIVIDE,
+  REG_EQUAL,
+  REG_NEGATE,
+  REG_NOT,
+  REG_PRINT,
+  REG_CHECK_GLOBAL,
+  REG_DEFINE_GLOBAL,
+  REG_SET_GLOBAL,
+  REG_RETURN,
+} RegOpCode;
+
+// frame slots are addressed by a 16 bit operand
+#define REG_FRAME_MAX (UINT16_MAX + 1)
+// constants and globals that get a frame slot at most, which leaves half
+// of the frame to the registers
+#define REG_CONSTANT_SLOTS (REG_FRAME_MAX / 4)
+#define REG_GLOBAL_SLOTS (REG_FRAME_MAX / 4)
+
+/**
+ * How often a quickened instruction found the operand types it was
+ * specialized for. A miss turns it back into the generic form, after
+ * QUICKEN_MISSES_MAX of them it stays that way.
+ */
+typedef struct {
+  uint32_t hits;
+  uint32_t misses;
+} QuickSite;
+
+#define QUICKEN_MISSES_MAX 8
+
+/**
+ * Start of a run of bytes that were all emitted for the same source line.
+ * The run lasts until the offset of the next LineStart.
+ */
+typedef struct {
+  uint32_t offset;
+  uint32_t line;
+} LineStart;
+
+/**
+ * Index of the largest constant OP_CONSTANT_LONG can address with its
+ * 24 bit operand.
+ */
+#define CONSTANT_LONG_MAX 0xFFFFFF
+
+// what add_constant() returns when it could not add the constant
+#define NO_CONSTANT SIZE_MAX
+
+/**
+ * Open addressing hash set over Chunk.constants used to find an existing
+ * slot for a constant before appending a new one. Slots hold the constant
+ * index + 1 so that 0 marks an empty slot.
+ */
+typedef struct {
+  size_t capacity;
+  uint32_t *slots;
+} ConstantIndex;
+
+/**
+ * Native code the JIT made for a chunk, in its own executable mapping.
+ * The code refers to the chunk's bytecode and constants. See jit.h.
+ */
+typedef struct {
+  uint8_t *code;
+  size_t size;
+  // values of VM.stack the code uses at most
+  size_t stack_depth;
+} JitCode;
+
 typedef struct {
   size_t count;
   size_t capacity;
   uint8_t *code;
   ValueArray constants;
-  size_t *lines;
+  ConstantIndex constant_index;
+  // run-length encoded line table, sorted by offset
+  size_t line_count;
+  size_t line_capacity;
+  LineStart *lines;
+  // code and lines belong to someone else, e.g. a mapped .loxc file, and
+  // must not be written. writable_code() gives the chunk a copy of the
+  // code it owns.
+  bool borrowed;
+  bool owns_code;
+  // counters of quickened instructions indexed by code offset, NULL until
+  // the first instruction is quickened
+  QuickSite *sites;
+  // fuse_superinstructions() ran over the code
+  bool fused;
+  // everything else the chunk points to, freed all at once by free_chunk()
+  Arena arena;
+  // how often the chunk ran and its native code once it got hot, code is
+  // NULL until then or if the JIT does not support the chunk
+  uint32_t runs;
+  JitCode native;
+  // the code is register code, see RegOpCode, and needs a frame of
+  // frame_constants constants, the globals with the indexes in
+  // frame_globals and register_count registers
+  bool registers;
+  uint32_t frame_constants;
+  uint32_t frame_global_count;
+  uint16_t *frame_globals;
+  uint32_t register_count;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
+bool reserve_chunk(Chunk *chunk, size_t capacity);
 bool write_chunk(Chunk *chunk, uint8_t byte, size_t line);
 void free_chunk(Chunk *chunk);
 
 size_t add_constant(Chunk* chunk, Value value);
+bool write_constant(Chunk *chunk, Value value, size_t line);
+bool same_constant(Value a, Value b);
+size_t hash_constant(Value value);
+size_t get_line(const Chunk *chunk, size_t offset);
+size_t instruction_length(OpCode opcode);
+size_t register_instruction_length(RegOpCode opcode);
+bool writable_code(Chunk *chunk);
+bool quicken_instruction(Chunk *chunk, size_t offset, OpCode opcode);
+OpCode generic_opcode(OpCode opcode);
+bool superinstruction_parts(OpCode opcode, OpCode *first, OpCode *second);
+bool fuse_superinstructions(Chunk *chunk);
@@ -1,5 +1,10 @@
 #pragma once
 
 #include "clox/chunk.h"
+#include "clox/vm.h"
 
-bool compile(const char *source, Chunk *chunk);
+// bump whenever the same source compiles to different bytecode, cached
+// chunks from older compilers are ignored after that
+#define COMPILER_VERSION 3
+
+bool compile(VM *vm, const char *source, Chunk *chunk);
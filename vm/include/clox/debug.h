@@ -1,6 +1,13 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "chunk.h"
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 size_t disassemble_instruction(Chunk *chunk, size_t offset);
+void fdisassemble_chunk(FILE *out, Chunk *chunk, const char *name);
+size_t fdisassemble_instruction(FILE *out, Chunk *chunk, size_t offset);
+size_t fdisassemble_register_instruction(FILE *out, Chunk *chunk, size_t offset);
+const char *opcode_name(uint8_t opcode);
+void report_quickening(FILE *out, const Chunk *chunk);
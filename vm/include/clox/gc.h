@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clox/chunk.h"
+#include "clox/value.h"
+
+// the heap may grow to this many bytes of objects before the first cycle
+#define GC_MIN_HEAP (1024 * 1024)
+// the next cycle starts once the heap has grown by this factor
+#define GC_HEAP_GROW 2
+// bytes allocated during a cycle that buy one step of collector work
+#define GC_STEP_BYTES (16 * 1024)
+// work units per step unless configured otherwise, see Collector.step_budget
+#define GC_STEP_BUDGET 1024
+
+typedef enum {
+  GC_PAUSE,
+  GC_MARK,
+  GC_SWEEP,
+} GcPhase;
+
+/**
+ * Tri-color marking with two whites. The whites swap roles when marking
+ * ends: survivors are black, the garbage keeps the old white and objects
+ * allocated while sweeping get the new white, so the sweeper can tell
+ * them apart without touching the new ones.
+ */
+typedef enum {
+  GC_WHITE_0,
+  GC_WHITE_1,
+  GC_GRAY,
+  GC_BLACK,
+} GcColor;
+
+typedef struct {
+  size_t cycles;
+  size_t steps;
+  size_t objects_freed;
+  size_t bytes_freed;
+  // the most work and the longest time spent in a single step, which is
+  // the longest pause the program saw
+  size_t max_step_work;
+  uint64_t max_step_ns;
+  uint64_t total_ns;
+} GcStats;
+
+/**
+ * Incremental mark and sweep collector of one VM. It is paced by the
+ * bytes of objects allocated: once the heap has grown enough a cycle
+ * starts, and from then on every GC_STEP_BYTES of allocation pay for one
+ * step of at most step_budget units of work. A unit is one object marked
+ * or swept, or one root slot scanned.
+ *
+ * Marking runs interleaved with the program, so the VM keeps two rules
+ * while it lasts: values stored into globals are marked right away, and
+ * the stack is scanned again when marking ends. Constants of the chunk
+ * that is running are roots, other chunks are not.
+ */
+typedef struct {
+  GcPhase phase;
+  // color of objects not marked in this cycle
+  GcColor white;
+  size_t bytes_live;
+  size_t next_cycle;
+  // next_cycle never drops below this, GC_MIN_HEAP unless configured
+  size_t min_heap;
+  // bytes allocated since the last step
+  size_t debt;
+  size_t step_budget;
+  size_t step_bytes;
+  // no cycle starts while this is above 0, e.g. while a chunk is built
+  // and its constants are not reachable from any root yet
+  int deferred;
+
+  // marked objects whose references were not scanned yet
+  Obj **gray;
+  size_t gray_count;
+  size_t gray_capacity;
+  // how far marking got through the globals and the running chunk
+  size_t next_global;
+  const Chunk *chunk;
+  size_t next_constant;
+
+  // link to the next object to sweep
+  Obj **sweep;
+
+  GcStats stats;
+} Collector;
+
+typedef struct VM VM;
+
+void init_collector(Collector *gc);
+void free_collector(Collector *gc);
+
+void gc_before_allocation(VM *vm, size_t size);
+void gc_track(VM *vm, Obj *object, size_t size);
+void gc_forget(VM *vm, size_t size);
+void gc_keep(VM *vm, Obj *object);
+void gc_mark_value(VM *vm, Value value);
+void gc_use_chunk(VM *vm, const Chunk *chunk);
+void gc_defer(VM *vm);
+void gc_resume(VM *vm);
+
+size_t gc_step(VM *vm, size_t budget);
+void collect_garbage(VM *vm);
+void report_gc_stats(const GcStats *stats, FILE *out);
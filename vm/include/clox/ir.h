@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clox/chunk.h"
+#include "clox/value.h"
+#include "clox/vm.h"
+
+/**
+ * Intermediate representation the compiler builds at -O1 instead of
+ * writing bytecode right away. The parser emits the same instructions it
+ * would write to a chunk, the builder turns the operand stack into edges
+ * between them. After the passes ran, lower_ir() writes the chunk, or
+ * lower_ir_registers() writes register code to it.
+ *
+ * A function is a control flow graph of basic blocks. The language has no
+ * branches yet, so every script is a single block that ends in OP_RETURN.
+ */
+
+// types the passes can prove for a value
+typedef enum {
+  IR_ANY,
+  IR_NIL,
+  IR_BOOL,
+  IR_NUMBER,
+  IR_STRING,
+} IrType;
+
+/**
+ * One instruction. Nodes are kept in evaluation order, every operand is
+ * an earlier node of the same block and every node that makes a value has
+ * exactly one user, like the stack code it comes from.
+ */
+typedef struct {
+  OpCode opcode;
+  // constant of OP_CONSTANT
+  Value value;
+  // global slot of OP_DEFINE_GLOBAL, OP_GET_GLOBAL and OP_SET_GLOBAL
+  uint32_t slot;
+  // operand nodes, -1 for none
+  int32_t args[2];
+  // the node that consumes the value, -1 for none
+  int32_t user;
+  uint32_t line;
+  // value number, nodes with the same number have the same value
+  uint32_t number;
+  // the node may stop the script with a runtime error
+  bool can_fail;
+  // a store that is overwritten before anyone can see it
+  bool dead_store;
+  bool live;
+} IrNode;
+
+typedef struct {
+  size_t count;
+  size_t capacity;
+  IrNode *nodes;
+} IrBlock;
+
+typedef struct {
+  VM *vm;
+  size_t block_count;
+  IrBlock *blocks;
+  // nodes whose value is still on the operand stack while building
+  size_t stack_count;
+  size_t stack_capacity;
+  int32_t *stack;
+} IrFunction;
+
+void init_ir(IrFunction *ir, VM *vm);
+void free_ir(IrFunction *ir);
+
+bool ir_emit_constant(IrFunction *ir, Value value, size_t line);
+bool ir_emit(IrFunction *ir, OpCode opcode, uint32_t slot, size_t line);
+
+void optimize_ir(IrFunction *ir);
+bool lower_ir(IrFunction *ir, Chunk *chunk);
+void keep_ir(IrFunction *ir);
+bool lower_ir_registers(IrFunction *ir, Chunk *chunk, const char **error);
+
+bool fold_instruction(VM *vm, OpCode opcode, Value a, Value b, Value *result);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clox/chunk.h"
+
+typedef struct VM VM;
+
+/**
+ * Interpreted runs of a chunk before it is compiled to native code, for
+ * embedders that run a chunk many times. Most chunks run once, for them
+ * compiling costs more than it saves. The command line runs every chunk
+ * once and compiles before the first run instead.
+ */
+#define JIT_HOT_RUNS 1
+
+/**
+ * How native code finished. Anything but JIT_OK is a runtime error, the
+ * code leaves VM.ip behind the failing instruction like run() does.
+ */
+typedef enum {
+  JIT_OK,
+  JIT_NOT_NUMBER,
+  JIT_NOT_NUMBERS,
+  JIT_NOT_ADDABLE,
+  JIT_UNDEFINED,
+  JIT_OUT_OF_MEMORY,
+} JitStatus;
+
+bool jit_available();
+bool jit_compile(const Chunk *chunk, JitCode *jit);
+JitStatus jit_run(const JitCode *jit, VM *vm);
+void jit_free(JitCode *jit);
@@ -2,6 +2,126 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+
+/**
+ * What an allocation is for. Code, lines and constants are bumped out of
+ * a chunk's arena, their bytes are part of the arena blocks and are not
+ * counted a second time in the totals. The same goes for objects that
+ * live in slab pages.
+ */
+typedef enum {
+  MEM_CODE,
+  MEM_LINES,
+  MEM_CONSTANTS,
+  MEM_STACK,
+  MEM_OBJECTS,
+  MEM_TABLES,
+  MEM_GLOBALS,
+  MEM_ARENA,
+  MEM_SLAB,
+  MEM_OTHER,
+  MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+typedef struct {
+  size_t allocations;
+  size_t resizes;
+  size_t frees;
+  size_t live;
+  size_t peak;
+} CategoryStats;
+
+/**
+ * Heap accounting of one thread. Every VM runs on a single thread, so
+ * these are also the numbers of the VM running there.
+ */
+typedef struct {
+  // bytes currently held from malloc and the most ever held at once
+  size_t live;
+  size_t peak;
+  CategoryStats categories[MEM_CATEGORY_COUNT];
+} MemoryStats;
 
 size_t grow_capacity(size_t old_capacity);
-bool reallocate(void **ptr, size_t old_size, size_t new_size);
+bool reallocate(void **ptr, size_t old_size, size_t new_size, MemoryCategory category);
+
+const MemoryStats *memory_stats();
+void add_memory_stats(MemoryStats *into, const MemoryStats *from);
+void report_memory_stats(const MemoryStats *stats, FILE *out);
+
+/**
+ * What an arena did over its lifetime, reported to the stats hook when the
+ * arena is freed.
+ */
+typedef struct {
+  // calls that needed new memory and the bytes they asked for
+  size_t allocations;
+  size_t bytes_allocated;
+  // grows of the newest allocation that did not have to move it
+  size_t grows_in_place;
+  // bytes copied by grows that did have to move
+  size_t bytes_copied;
+  // blocks taken from malloc and their total size
+  size_t blocks;
+  size_t block_bytes;
+} ArenaStats;
+
+typedef struct ArenaBlock ArenaBlock;
+
+/**
+ * Region allocator for data that dies all at once, such as everything a
+ * chunk owns. Memory is bumped out of blocks that double in size and is
+ * only given back when the whole arena is freed.
+ */
+typedef struct {
+  ArenaBlock *blocks;
+  // start of the newest allocation, the only one that can grow in place
+  void *top;
+  ArenaStats stats;
+  // bytes handed out per category, given back to the thread's
+  // MemoryStats when the arena is freed
+  size_t category_bytes[MEM_CATEGORY_COUNT];
+} Arena;
+
+void init_arena(Arena *arena);
+void free_arena(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size, MemoryCategory category);
+bool arena_reallocate(Arena *arena, void **ptr, size_t old_size, size_t new_size, MemoryCategory category);
+
+/**
+ * Called by free_arena() with the stats of every arena that allocated
+ * anything. Set it before any other thread uses an arena, the hook itself
+ * is called from whichever thread frees the arena.
+ */
+typedef void (*ArenaStatsHook)(const ArenaStats *stats, void *context);
+void set_arena_stats_hook(ArenaStatsHook hook, void *context);
+
+// SLAB
+
+// objects up to this size are carved out of slab pages, in size classes
+// SLAB_GRANULE bytes apart
+#define SLAB_MAX_SIZE 256
+#define SLAB_GRANULE 16
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE / SLAB_GRANULE)
+// pages are mapped from the OS one at a time and aligned to their size
+#define SLAB_PAGE_SIZE (64 * 1024)
+
+/**
+ * Slab usage of one thread.
+ */
+typedef struct {
+  // pages currently mapped, how many of them hold no object and how many
+  // were mapped and unmapped over time
+  size_t pages;
+  size_t empty_pages;
+  size_t pages_mapped;
+  size_t pages_released;
+  // allocations served from a free list instead of fresh page space
+  size_t reused;
+} SlabStats;
+
+void *slab_alloc(size_t size, MemoryCategory category);
+void slab_free(void *ptr, size_t size, MemoryCategory category);
+size_t slab_release_empty();
+const SlabStats *slab_stats();
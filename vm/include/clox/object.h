@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "clox/value.h"
+#include "clox/vm.h"
+
+#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+
+#define IS_STRING(value) is_obj_type(value, OBJ_STRING)
+
+#define AS_STRING(value) ((ObjString *) AS_OBJ(value))
+#define AS_CSTRING(value) (((ObjString *) AS_OBJ(value))->chars)
+
+typedef enum {
+  OBJ_STRING,
+} ObjType;
+
+/**
+ * Header shared by every heap object. All objects of a VM are linked
+ * through next so the collector and free_vm() can find them.
+ */
+struct Obj {
+  ObjType type;
+  // a GcColor
+  uint8_t color;
+  struct Obj *next;
+};
+
+/**
+ * Immutable, interned string. The characters are stored right behind the
+ * struct in the same allocation and are always NUL terminated. The hash
+ * is computed once when the string is created.
+ */
+struct ObjString {
+  Obj obj;
+  size_t length;
+  uint32_t hash;
+  char *chars;
+};
+
+static inline bool is_obj_type(Value value, ObjType type) {
+  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+uint32_t hash_string(const char *chars, size_t length);
+ObjString *copy_string(VM *vm, const char *chars, size_t length);
+ObjString *concatenate_strings(VM *vm, const ObjString *a, const ObjString *b);
+
+size_t free_object(Obj *object);
+void free_objects(VM *vm);
+void fprint_object(FILE *out, Value value);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PROFILE_OPCODES (UINT8_MAX + 1)
+
+/**
+ * Execution counts, accumulated time and opcode pair (bigram) counts for
+ * every opcode the VM dispatched. Time is measured in TSC cycles on x86
+ * and in nanoseconds everywhere else, see profile_clock_unit().
+ */
+typedef struct {
+  uint64_t counts[PROFILE_OPCODES];
+  uint64_t cycles[PROFILE_OPCODES];
+  // pairs[a][b] counts how often b was dispatched right after a
+  uint64_t pairs[PROFILE_OPCODES][PROFILE_OPCODES];
+  // opcode dispatched last and when, -1 before the first one of a run
+  int previous;
+  uint64_t previous_start;
+  // where free_vm() writes the CSV report, NULL for none
+  const char *csv_path;
+} Profiler;
+
+Profiler *new_profiler(const char *csv_path);
+void free_profiler(Profiler *profiler);
+
+void profile_start_run(Profiler *profiler);
+void profile_instruction(Profiler *profiler, uint8_t opcode);
+void profile_end_run(Profiler *profiler);
+
+const char *profile_clock_unit();
+void report_profile(const Profiler *profiler, FILE *out);
+bool write_profile_csv(const Profiler *profiler, const char *path);
@@ -0,0 +1,15 @@
+// Generated by bench/gen_superinstructions from the opcode pairs the
+// profiler recorded over bench/corpus, do not edit. Regenerate with
+//   cmake --build <build dir> --target superinstructions
+//
+// SUPERINSTRUCTION(name, first, second) fuses instruction first with the
+// instruction second right after it. Each line notes the share of all
+// recorded pairs.
+SUPERINSTRUCTION(OP_GET_GLOBAL_GET_GLOBAL, OP_GET_GLOBAL, OP_GET_GLOBAL) // 8.9%
+SUPERINSTRUCTION(OP_GET_GLOBAL_ADD, OP_GET_GLOBAL, OP_ADD) // 7.3%
+SUPERINSTRUCTION(OP_POP_GET_GLOBAL, OP_POP, OP_GET_GLOBAL) // 6.8%
+SUPERINSTRUCTION(OP_SET_GLOBAL_POP, OP_SET_GLOBAL, OP_POP) // 6.8%
+SUPERINSTRUCTION(OP_GET_GLOBAL_CONSTANT, OP_GET_GLOBAL, OP_CONSTANT) // 5.8%
+SUPERINSTRUCTION(OP_ADD_GET_GLOBAL, OP_ADD, OP_GET_GLOBAL) // 5.6%
+SUPERINSTRUCTION(OP_CONSTANT_ADD, OP_CONSTANT, OP_ADD) // 5.3%
+SUPERINSTRUCTION(OP_CONSTANT_DEFINE_GLOBAL, OP_CONSTANT, OP_DEFINE_GLOBAL) // 3.5%
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clox/value.h"
+
+typedef struct {
+  // NULL for an empty slot. A tombstone of the linear probing table also
+  // has a true value, the Swiss table keeps it in its control byte.
+  ObjString *key;
+  Value value;
+} Entry;
+
+#ifdef CLOX_SWISS_TABLE
+
+/**
+ * Hash table keyed by interned strings. Keys compare by pointer, the
+ * hash cached in every string picks the slot.
+ *
+ * Open addressing in the style of a Swiss table: every slot has a control
+ * byte that is either empty, deleted or the low 7 bits of the key's hash.
+ * Lookups compare a whole group of 16 control bytes at once and only touch
+ * the entries whose byte matches. Capacity is a power of two, at least one
+ * group.
+ */
+typedef struct {
+  // live entries
+  size_t count;
+  size_t capacity;
+  // inserts into empty slots left before the table has to be rebuilt
+  size_t growth_left;
+  // capacity control bytes followed by a copy of the first group, so a
+  // group can be loaded at any slot without wrapping around
+  int8_t *control;
+  // shares one allocation with control
+  Entry *entries;
+} Table;
+
+#else
+
+/**
+ * Hash table keyed by interned strings. Keys compare by pointer, the
+ * hash cached in every string picks the slot. Open addressing with linear
+ * probing, capacity is always a power of two.
+ */
+typedef struct {
+  // live entries plus tombstones
+  size_t count;
+  size_t capacity;
+  Entry *entries;
+} Table;
+
+#endif // CLOX_SWISS_TABLE
+
+void init_table(Table *table);
+void free_table(Table *table);
+bool table_get(const Table *table, const ObjString *key, Value *value);
+bool table_set(Table *table, ObjString *key, Value value);
+bool table_delete(Table *table, const ObjString *key);
+void table_add_all(const Table *from, Table *to);
+ObjString *table_find_string(const Table *table, const char *chars, size_t length, uint32_t hash);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "clox/chunk.h"
+#include "clox/value.h"
+
+// how many executed instructions the ring buffer remembers
+#define TRACE_CAPACITY 64
+// how many values from the top of the stack are kept per instruction
+#define TRACE_STACK_DEPTH 8
+
+typedef enum {
+  TRACE_OFF,
+  // keep the last TRACE_CAPACITY instructions, dumped on a runtime error
+  TRACE_RING,
+  // print every instruction to the VM output as it executes
+  TRACE_STDOUT
+} TraceMode;
+
+/**
+ * Raw snapshot of one executed instruction. Nothing is formatted until
+ * the buffer is dumped, so recording only costs a few stores.
+ */
+typedef struct {
+  Chunk *chunk;
+  size_t offset;
+  size_t stack_depth;
+  // top of the stack, bottom-most value first
+  Value stack[TRACE_STACK_DEPTH];
+} TraceEntry;
+
+typedef struct {
+  TraceMode mode;
+  size_t next;
+  size_t count;
+  TraceEntry entries[TRACE_CAPACITY];
+} Tracer;
+
+void init_tracer(Tracer *tracer);
+void reset_tracer(Tracer *tracer);
+void trace_instruction(Tracer *tracer, FILE *out, Chunk *chunk, size_t offset,
+    const Value *stack, const Value *stack_top);
+void dump_trace(const Tracer *tracer, FILE *out);
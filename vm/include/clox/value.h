@@ -1,13 +1,69 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
 
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+
+#ifdef CLOX_NAN_BOXING
+
+#include <string.h>
+
+/**
+ * NaN boxing: every Value is a 64 bit word. Numbers are stored as plain
+ * doubles. Everything else lives inside the payload of a quiet NaN, which
+ * real arithmetic never produces with these bits set. Objects also set the
+ * sign bit and keep their 48 bit pointer in the low bits.
+ */
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t) 0x8000000000000000)
+#define QNAN     ((uint64_t) 0x7ffc000000000000)
+
+#define TAG_NIL   1 // 01
+#define TAG_FALSE 2 // 10
+#define TAG_TRUE  3 // 11
+
+#define FALSE_VAL ((Value) (uint64_t) (QNAN | TAG_FALSE))
+#define TRUE_VAL  ((Value) (uint64_t) (QNAN | TAG_TRUE))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL(value) ((Value) (uint64_t) (QNAN | TAG_NIL))
+#define NUMBER_VAL(value) number_to_value(value)
+#define OBJ_VAL(obj) ((Value) (SIGN_BIT | QNAN | (uint64_t) (uintptr_t) (obj)))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_number(value)
+#define AS_OBJ(value) ((Obj *) (uintptr_t) ((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL(0))
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+// memcpy is the portable way to type pun, compilers turn it into a move
+static inline double value_to_number(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+static inline Value number_to_value(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
-  VAL_NUMBER
+  VAL_NUMBER,
+  VAL_OBJ
 } ValueType;
 
 typedef struct {
@@ -15,19 +71,55 @@ typedef struct {
   union {
     bool boolean;
     double number;
+    Obj *obj;
   } as;
 } Value;
 
-#define BOOL_VAL(value) ((Value) {VAL_BOOL, {.boolean = value}})
-#define NIL_VAL(value) ((Value) {VAL_NIL, {.number = 0}})
-#define NUMBER_VAL(value) ((Value) {VAL_NUMBER, {.number = value}})
+#define BOOL_VAL(value) bool_to_value(value)
+#define NIL_VAL(value) nil_value()
+#define NUMBER_VAL(value) number_to_value(value)
+#define OBJ_VAL(object) obj_to_value((Obj *) (object))
 
 #define AS_BOOL(value) ((value).as.boolean)
 #define AS_NUMBER(value) ((value).as.number)
+#define AS_OBJ(value) ((value).as.obj)
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_OBJ(value) ((value).type == VAL_OBJ)
+
+// plain functions instead of compound literals so the header also
+// compiles as C++ for the tests
+static inline Value bool_to_value(bool boolean) {
+  Value value;
+  value.type = VAL_BOOL;
+  value.as.boolean = boolean;
+  return value;
+}
+
+static inline Value nil_value() {
+  Value value;
+  value.type = VAL_NIL;
+  value.as.number = 0;
+  return value;
+}
+
+static inline Value number_to_value(double number) {
+  Value value;
+  value.type = VAL_NUMBER;
+  value.as.number = number;
+  return value;
+}
+
+static inline Value obj_to_value(Obj *obj) {
+  Value value;
+  value.type = VAL_OBJ;
+  value.as.obj = obj;
+  return value;
+}
+
+#endif // CLOX_NAN_BOXING
 
 typedef struct {
   size_t capacity;
@@ -39,4 +131,6 @@ void init_value_array(ValueArray *value_array);
 bool write_value_array(ValueArray *value_array, Value value);
 void free_value_array(ValueArray *value_array);
 
+bool values_equal(Value a, Value b);
 void print_value(Value value);
+void fprint_value(FILE *out, Value value);
@@ -1,16 +1,92 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "clox/value.h"
 #include "clox/chunk.h"
+#include "clox/gc.h"
+#include "clox/profile.h"
+#include "clox/table.h"
+#include "clox/trace.h"
+
+// values the operand stack starts with, it doubles when it is full
+#define STACK_INITIAL 32
+// default for VM.stack_limit
+#define STACK_LIMIT (1024 * 1024)
 
-#define STACK_MAX 256
+// highest level of -O the compiler knows
+#define OPT_LEVEL_MAX 1
 
+// global slots are addressed by a 16 bit operand
+#define GLOBALS_MAX (UINT16_MAX + 1)
+
+/**
+ * A global variable. Slots are handed out by the compiler the first time
+ * it sees a name, the variable only exists once its `var` statement ran.
+ */
 typedef struct {
+  Value value;
+  // for error messages and the REPL
+  ObjString *name;
+  bool defined;
+} Global;
+
+/**
+ * One independent virtual machine. There is no state shared between VMs,
+ * so each thread can run its own.
+ */
+struct VM {
   Chunk *chunk;
   uint8_t *ip;
-  Value stack[STACK_MAX];
+  // operand stack, allocated on the first push and grown up to
+  // stack_limit values. Growing moves it, nothing but stack_top may
+  // point into it.
+  Value *stack;
   Value *stack_top;
-} VM;
+  Value *stack_end;
+  size_t stack_limit;
+  // program output and error messages, stdout and stderr by default
+  FILE *out;
+  FILE *err;
+  // disassemble every chunk after it is compiled
+  bool print_code;
+  // rewrite instructions into forms specialized for the operand types
+  // they see, and report how well that went after every chunk
+  bool quicken;
+  bool quicken_stats;
+  // fuse common pairs of instructions before a chunk first runs
+  bool superinstructions;
+  // 1 compiles through the IR and optimizes it, see ir.h
+  int opt_level;
+  // compile to register code instead of stack code, see RegOpCode
+  bool registers;
+  // run chunks as native code where the JIT supports them, ignored unless
+  // it is built in. Chunks are compiled after jit_hot_runs runs in the
+  // interpreter.
+  bool jit;
+  uint32_t jit_hot_runs;
+  // runs of native code so far
+  size_t native_runs;
+  // where interpret() caches compiled chunks, NULL to always compile
+  const char *cache_dir;
+  // every interned string, the keys are the strings and values are unused
+  Table strings;
+  // all heap objects, the newest first
+  Obj *objects;
+  Collector gc;
+  // global variables indexed by slot, and the slot of every name
+  Global *globals;
+  size_t global_count;
+  size_t global_capacity;
+  Table global_slots;
+#ifdef DEBUG_TRACE_EXECUTION
+  Tracer tracer;
+#endif // DEBUG_TRACE_EXECUTION
+#ifdef CLOX_PROFILE
+  // NULL unless profiling was requested, reported by free_vm()
+  Profiler *profiler;
+#endif // CLOX_PROFILE
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -18,9 +94,13 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-void init_vm();
-void free_vm();
-void push(Value value);
-Value pop();
+void init_vm(VM *vm);
+void free_vm(VM *vm);
+bool grow_stack(VM *vm, size_t count);
+void push(VM *vm, Value value);
+Value pop(VM *vm);
+bool global_slot(VM *vm, ObjString *name, uint32_t *slot);
+void reset_globals(VM *vm);
 
-InterpretResult interpret(const char *source);
+InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpret_chunk(VM *vm, Chunk *chunk);
@@ -0,0 +1,429 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clox/batch.h"
+#include "clox/bytecode.h"
+#include "clox/jit.h"
+#include "clox/memory.h"
+#include "clox/vm.h"
+
+#define CACHE_LINE 64
+
+typedef enum {
+  SCRIPT_OK,
+  SCRIPT_COMPILE_ERROR,
+  SCRIPT_RUNTIME_ERROR,
+  // the script could not be read or its output could not be captured
+  SCRIPT_IO_ERROR
+} ScriptStatus;
+
+static const char *status_names[] = {
+  [SCRIPT_OK] = "ok",
+  [SCRIPT_COMPILE_ERROR] = "compile error",
+  [SCRIPT_RUNTIME_ERROR] = "runtime error",
+  [SCRIPT_IO_ERROR] = "io error",
+};
+
+typedef struct {
+  const char *path;
+  // captured output, owned by the script until it is emitted
+  char *out;
+  size_t out_size;
+  char *err;
+  size_t err_size;
+  ScriptStatus status;
+  uint64_t elapsed_ns;
+  // set under Batch.lock once the fields above are final
+  bool done;
+} Script;
+
+/**
+ * Range of script indices a worker has left, begin in the low and end in
+ * the high 32 bits. Packing both ends into one word lets the owner take
+ * from the front and thieves take from the back with a single CAS each.
+ * Every queue gets its own cache line so workers do not slow each other
+ * down while they drain their own ranges.
+ */
+typedef struct {
+  _Alignas(CACHE_LINE) _Atomic uint64_t range;
+} WorkQueue;
+
+typedef struct {
+  Script *scripts;
+  const BatchOptions *options;
+  WorkQueue *queues;
+  int workers;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+} Batch;
+
+typedef struct {
+  Batch *batch;
+  int id;
+} Worker;
+
+static uint64_t pack_range(uint32_t begin, uint32_t end) {
+  return (uint64_t) end << 32 | begin;
+}
+
+static uint32_t range_begin(uint64_t range) {
+  return (uint32_t) range;
+}
+
+static uint32_t range_end(uint64_t range) {
+  return (uint32_t) (range >> 32);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Takes the next script from the front of the worker's own queue.
+ */
+static bool take_own(WorkQueue *queue, uint32_t *index) {
+  uint64_t range = atomic_load(&queue->range);
+  for (;;) {
+    uint32_t begin = range_begin(range);
+    uint32_t end = range_end(range);
+    if (begin >= end) {
+      return false;
+    }
+    if (atomic_compare_exchange_weak(&queue->range, &range, pack_range(begin + 1, end))) {
+      *index = begin;
+      return true;
+    }
+  }
+}
+
+/**
+ * Steals the back half of another worker's queue. The first stolen script
+ * is returned to run right away, the rest become the thief's own queue.
+ */
+static bool steal(Batch *batch, int thief, uint32_t *index) {
+  for (int i = 1; i < batch->workers; i++) {
+    WorkQueue *victim = &batch->queues[(thief + i) % batch->workers];
+    uint64_t range = atomic_load(&victim->range);
+    for (;;) {
+      uint32_t begin = range_begin(range);
+      uint32_t end = range_end(range);
+      if (begin >= end) {
+        break;
+      }
+      uint32_t stolen = end - (end - begin + 1) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &range, pack_range(begin, stolen))) {
+        // our own queue is empty, nobody else will touch it until this store
+        atomic_store(&batch->queues[thief].range, pack_range(stolen + 1, end));
+        *index = stolen;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static char *read_script(const char *path, FILE *err) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(err, "fopen(%s) failed: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(f, 0L, SEEK_END);
+  size_t file_size = ftell(f);
+  rewind(f);
+
+  char *buffer = malloc(file_size + 1);
+  if (!buffer) {
+    fprintf(err, "Not enough memory to read %s.\n", path);
+    fclose(f);
+    return NULL;
+  }
+  size_t bytes_read = fread(buffer, sizeof(char), file_size, f);
+  fclose(f);
+  if (bytes_read < file_size) {
+    fprintf(err, "Could not read file %s\n", path);
+    free(buffer);
+    return NULL;
+  }
+  buffer[bytes_read] = '\0';
+  return buffer;
+}
+
+static ScriptStatus status_of(InterpretResult result) {
+  switch (result) {
+    case INTERPRET_OK: return SCRIPT_OK;
+    case INTERPRET_COMPILE_ERROR: return SCRIPT_COMPILE_ERROR;
+    case INTERPRET_RUNTIME_ERROR: return SCRIPT_RUNTIME_ERROR;
+  }
+  return SCRIPT_RUNTIME_ERROR;
+}
+
+static void run_script(VM *vm, Script *script) {
+  uint64_t start = now_ns();
+
+  FILE *out = open_memstream(&script->out, &script->out_size);
+  FILE *err = open_memstream(&script->err, &script->err_size);
+  if (out == NULL || err == NULL) {
+    if (out != NULL) fclose(out);
+    if (err != NULL) fclose(err);
+    script->status = SCRIPT_IO_ERROR;
+    script->elapsed_ns = now_ns() - start;
+    return;
+  }
+
+  vm->out = out;
+  vm->err = err;
+  if (is_bytecode_file(script->path)) {
+    BytecodeFile file;
+    if (map_bytecode(vm, &file, script->path, err)) {
+      script->status = status_of(interpret_chunk(vm, &file.chunk));
+      unmap_bytecode(&file);
+    } else {
+      script->status = SCRIPT_IO_ERROR;
+    }
+  } else {
+    char *source = read_script(script->path, err);
+    if (source != NULL) {
+      script->status = status_of(interpret(vm, source));
+      free(source);
+    } else {
+      script->status = SCRIPT_IO_ERROR;
+    }
+  }
+  vm->out = stdout;
+  vm->err = stderr;
+
+  // closing the streams finalizes the buffers and their sizes
+  fclose(out);
+  fclose(err);
+  script->elapsed_ns = now_ns() - start;
+}
+
+static void *work(void *arg) {
+  Worker *worker = arg;
+  Batch *batch = worker->batch;
+
+  VM vm;
+  init_vm(&vm);
+  vm.print_code = batch->options->print_code;
+  vm.quicken = batch->options->quicken;
+  vm.quicken_stats = batch->options->quicken_stats;
+  vm.superinstructions = batch->options->superinstructions;
+  vm.opt_level = batch->options->opt_level;
+  vm.registers = batch->options->registers;
+  if (batch->options->stack_limit > 0) {
+    vm.stack_limit = batch->options->stack_limit;
+  }
+  vm.jit = batch->options->jit;
+  vm.jit_hot_runs = batch->options->jit_hot_runs;
+  vm.cache_dir = batch->options->cache_dir;
+  if (batch->options->gc_step_budget > 0) {
+    vm.gc.step_budget = batch->options->gc_step_budget;
+  }
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = batch->options->trace_mode;
+#endif // DEBUG_TRACE_EXECUTION
+
+  uint32_t index;
+  while (take_own(&batch->queues[worker->id], &index) || steal(batch, worker->id, &index)) {
+    Script *script = &batch->scripts[index];
+    // scripts share the worker's VM but not their globals
+    reset_globals(&vm);
+    run_script(&vm, script);
+
+    pthread_mutex_lock(&batch->lock);
+    script->done = true;
+    pthread_cond_broadcast(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+  }
+
+  free_vm(&vm);
+
+  if (batch->options->memory_stats != NULL) {
+    pthread_mutex_lock(&batch->lock);
+    add_memory_stats(batch->options->memory_stats, memory_stats());
+    pthread_mutex_unlock(&batch->lock);
+  }
+  return NULL;
+}
+
+/**
+ * Waits for every script in order and writes out what it captured.
+ */
+static bool emit_scripts(Batch *batch, size_t count, FILE *out, FILE *err) {
+  bool ok = true;
+  for (size_t i = 0; i < count; i++) {
+    Script *script = &batch->scripts[i];
+    pthread_mutex_lock(&batch->lock);
+    while (!script->done) {
+      pthread_cond_wait(&batch->finished, &batch->lock);
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    if (script->out_size > 0) {
+      fwrite(script->out, sizeof(char), script->out_size, out);
+    }
+    fflush(out);
+    if (script->err_size > 0) {
+      fwrite(script->err, sizeof(char), script->err_size, err);
+    }
+    fprintf(err, "%s: %s in %.3f ms\n", script->path, status_names[script->status],
+        script->elapsed_ns / 1e6);
+    fflush(err);
+
+    free(script->out);
+    free(script->err);
+    script->out = script->err = NULL;
+    ok = ok && script->status == SCRIPT_OK;
+  }
+  return ok;
+}
+
+void init_batch_options(BatchOptions *options) {
+  options->jobs = 0;
+  options->print_code = false;
+  options->quicken = true;
+  options->quicken_stats = false;
+  options->superinstructions = true;
+  options->opt_level = 0;
+  options->registers = false;
+  options->stack_limit = 0;
+  options->jit = false;
+  options->jit_hot_runs = JIT_HOT_RUNS;
+  options->cache_dir = NULL;
+  options->trace_mode = TRACE_OFF;
+  options->gc_step_budget = 0;
+  options->memory_stats = NULL;
+}
+
+bool run_batch(const char *const *paths, size_t count, const BatchOptions *options,
+    FILE *out, FILE *err) {
+  if (count == 0) {
+    return true;
+  }
+  if (count > UINT32_MAX) {
+    fprintf(err, "Too many scripts in one batch: %zu\n", count);
+    return false;
+  }
+
+  long workers = options->jobs;
+  if (workers < 1) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+  if ((size_t) workers > count) {
+    workers = (long) count;
+  }
+
+  Batch batch = {.options = options, .workers = (int) workers};
+  Worker *pool = NULL;
+  pthread_t *threads = NULL;
+  if (!reallocate((void **) &batch.scripts, 0, count * sizeof(Script), MEM_OTHER) ||
+      !reallocate((void **) &pool, 0, workers * sizeof(Worker), MEM_OTHER) ||
+      !reallocate((void **) &threads, 0, workers * sizeof(pthread_t), MEM_OTHER)) {
+    reallocate((void **) &batch.scripts, count * sizeof(Script), 0, MEM_OTHER);
+    reallocate((void **) &pool, workers * sizeof(Worker), 0, MEM_OTHER);
+    return false;
+  }
+  batch.queues = aligned_alloc(CACHE_LINE, workers * sizeof(WorkQueue));
+  if (batch.queues == NULL) {
+    fprintf(err, "Failed to allocate work queues\n");
+    reallocate((void **) &batch.scripts, count * sizeof(Script), 0, MEM_OTHER);
+    reallocate((void **) &pool, workers * sizeof(Worker), 0, MEM_OTHER);
+    reallocate((void **) &threads, workers * sizeof(pthread_t), 0, MEM_OTHER);
+    return false;
+  }
+  pthread_mutex_init(&batch.lock, NULL);
+  pthread_cond_init(&batch.finished, NULL);
+
+  for (size_t i = 0; i < count; i++) {
+    batch.scripts[i] = (Script) {.path = paths[i]};
+  }
+
+  // every worker starts with an equal slice, the rest is left to stealing
+  for (long w = 0; w < workers; w++) {
+    uint32_t begin = (uint32_t) (count * w / workers);
+    uint32_t end = (uint32_t) (count * (w + 1) / workers);
+    atomic_init(&batch.queues[w].range, pack_range(begin, end));
+  }
+
+  long started = 0;
+  for (long w = 0; w < workers; w++) {
+    pool[w] = (Worker) {.batch = &batch, .id = (int) w};
+    if (pthread_create(&threads[started], NULL, work, &pool[w]) != 0) {
+      // the slices of missing workers get stolen by the others
+      break;
+    }
+    started++;
+  }
+  if (started == 0) {
+    work(&pool[0]);
+  }
+
+  bool ok = emit_scripts(&batch, count, out, err);
+
+  for (long w = 0; w < started; w++) {
+    pthread_join(threads[w], NULL);
+  }
+  pthread_cond_destroy(&batch.finished);
+  pthread_mutex_destroy(&batch.lock);
+  free(batch.queues);
+  reallocate((void **) &threads, workers * sizeof(pthread_t), 0, MEM_OTHER);
+  reallocate((void **) &pool, workers * sizeof(Worker), 0, MEM_OTHER);
+  reallocate((void **) &batch.scripts, count * sizeof(Script), 0, MEM_OTHER);
+  return ok;
+}
+
+bool read_manifest(const char *path, char ***paths, size_t *count, size_t *capacity) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    fprintf(stderr, "fopen(%s) failed: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  char *line = NULL;
+  size_t n = 0;
+  ssize_t length;
+  bool ok = true;
+  while ((length = getline(&line, &n, f)) != -1) {
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' ||
+          line[length - 1] == ' ' || line[length - 1] == '\t')) {
+      line[--length] = '\0';
+    }
+    if (length == 0 || line[0] == '#') {
+      continue;
+    }
+
+    if (*count == *capacity) {
+      size_t new_capacity = grow_capacity(*capacity);
+      // the caller owns the list and frees it with free()
+      char **grown = realloc(*paths, new_capacity * sizeof(char *));
+      if (grown == NULL) {
+        ok = false;
+        break;
+      }
+      *paths = grown;
+      *capacity = new_capacity;
+    }
+    char *copy = strdup(line);
+    if (copy == NULL) {
+      ok = false;
+      break;
+    }
+    (*paths)[(*count)++] = copy;
+  }
+
+  free(line);
+  fclose(f);
+  return ok;
+}
@@ -0,0 +1,529 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clox/bytecode.h"
+#include "clox/object.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the line table of a .loxc file is used in place and needs a little endian host"
+#endif
+
+typedef enum {
+  CONSTANT_NUMBER,
+  CONSTANT_BOOL,
+  CONSTANT_NIL,
+  CONSTANT_STRING,
+} ConstantTag;
+
+/**
+ * Loading is also used to probe caches, where failing is expected and
+ * nobody wants to hear about it. Those callers pass a NULL err.
+ */
+static void report(FILE *err, const char *format, ...) {
+  if (err == NULL) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vfprintf(err, format, args);
+  va_end(args);
+}
+
+static size_t align_up(size_t size, size_t alignment) {
+  return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static size_t lines_offset(uint32_t code_size) {
+  return align_up(sizeof(BytecodeHeader) + code_size, _Alignof(LineStart));
+}
+
+static bool write_string(const ObjString *string, FILE *out) {
+  if (string->length > UINT32_MAX) {
+    return false;
+  }
+  uint32_t length = (uint32_t) string->length;
+  return fwrite(&length, sizeof(length), 1, out) == 1 &&
+    fwrite(string->chars, sizeof(char), length, out) == length;
+}
+
+/**
+ * Reads a length prefixed string at *offset and interns it in vm.
+ */
+static ObjString *read_string(VM *vm, const uint8_t *data, size_t size, size_t *offset) {
+  uint32_t length;
+  if (size - *offset < sizeof(length)) {
+    return NULL;
+  }
+  memcpy(&length, data + *offset, sizeof(length));
+  if (size - *offset - sizeof(length) < length) {
+    return NULL;
+  }
+
+  ObjString *string = copy_string(vm, (const char *) data + *offset + sizeof(length), length);
+  if (string != NULL) {
+    *offset += sizeof(length) + length;
+  }
+  return string;
+}
+
+/**
+ * Constants are a tag byte followed by
+ *   - number: the 8 bytes of the double,
+ *   - bool: one byte, 0 or 1,
+ *   - nil: nothing,
+ *   - string: a 4 byte length and the characters without a terminator.
+ */
+static bool write_constant_entry(Value value, FILE *out) {
+  uint8_t tag;
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    tag = CONSTANT_NUMBER;
+    return fwrite(&tag, 1, 1, out) == 1 && fwrite(&number, sizeof(number), 1, out) == 1;
+  }
+  if (IS_BOOL(value)) {
+    uint8_t boolean = AS_BOOL(value);
+    tag = CONSTANT_BOOL;
+    return fwrite(&tag, 1, 1, out) == 1 && fwrite(&boolean, 1, 1, out) == 1;
+  }
+  if (IS_STRING(value)) {
+    tag = CONSTANT_STRING;
+    return fwrite(&tag, 1, 1, out) == 1 && write_string(AS_STRING(value), out);
+  }
+  tag = CONSTANT_NIL;
+  return fwrite(&tag, 1, 1, out) == 1;
+}
+
+/**
+ * Decodes the constant at *offset and moves past it. Strings are interned
+ * in the VM, once per load.
+ */
+static bool read_constant_entry(VM *vm, const uint8_t *data, size_t size, size_t *offset, Value *value) {
+  if (*offset >= size) {
+    return false;
+  }
+  uint8_t tag = data[(*offset)++];
+  size_t left = size - *offset;
+
+  switch ((ConstantTag) tag) {
+    case CONSTANT_NUMBER: {
+      double number;
+      if (left < sizeof(number)) return false;
+      memcpy(&number, data + *offset, sizeof(number));
+      *offset += sizeof(number);
+      *value = NUMBER_VAL(number);
+      return true;
+    }
+    case CONSTANT_BOOL:
+      if (left < 1 || data[*offset] > 1) return false;
+      *value = BOOL_VAL(data[(*offset)++] == 1);
+      return true;
+    case CONSTANT_NIL:
+      *value = NIL_VAL(0);
+      return true;
+    case CONSTANT_STRING: {
+      ObjString *string = read_string(vm, data, size, offset);
+      if (string == NULL) return false;
+      *value = OBJ_VAL(string);
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Writes the code the compiler emitted, quickened instructions go back to
+ * their generic form and superinstructions to their first part.
+ */
+static bool write_code(const Chunk *chunk, FILE *out) {
+  if (chunk->sites == NULL && !chunk->fused) {
+    return fwrite(chunk->code, sizeof(uint8_t), chunk->count, out) == chunk->count;
+  }
+
+  size_t offset = 0;
+  while (offset < chunk->count) {
+    OpCode opcode = generic_opcode(chunk->code[offset]);
+    size_t operands = instruction_length(opcode) - 1;
+    if (fputc(opcode, out) == EOF ||
+        fwrite(chunk->code + offset + 1, sizeof(uint8_t), operands, out) != operands) {
+      return false;
+    }
+    offset += 1 + operands;
+  }
+  return true;
+}
+
+bool write_bytecode(const VM *vm, const Chunk *chunk, FILE *out) {
+  // register code has no file format, it is compiled every time
+  if (chunk->registers) {
+    return false;
+  }
+  if (chunk->count > UINT32_MAX || chunk->line_count > UINT32_MAX ||
+      chunk->constants.count > UINT32_MAX) {
+    return false;
+  }
+
+  BytecodeHeader header = {
+    .magic = {LOXC_MAGIC[0], LOXC_MAGIC[1], LOXC_MAGIC[2], LOXC_MAGIC[3]},
+    .version = LOXC_VERSION,
+    .code_size = (uint32_t) chunk->count,
+    .line_count = (uint32_t) chunk->line_count,
+    .constant_count = (uint32_t) chunk->constants.count,
+    .global_count = (uint32_t) vm->global_count,
+  };
+  static const uint8_t padding[_Alignof(LineStart)] = {0};
+  size_t padding_size = lines_offset(header.code_size) - sizeof(header) - header.code_size;
+
+  if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+      !write_code(chunk, out) ||
+      fwrite(padding, sizeof(uint8_t), padding_size, out) != padding_size ||
+      fwrite(chunk->lines, sizeof(LineStart), chunk->line_count, out) != chunk->line_count) {
+    return false;
+  }
+
+  for (size_t i = 0; i < chunk->constants.count; i++) {
+    if (!write_constant_entry(chunk->constants.values[i], out)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < vm->global_count; i++) {
+    if (!write_string(vm->globals[i].name, out)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool save_bytecode(const VM *vm, const Chunk *chunk, const char *path, FILE *err) {
+  if (chunk->registers) {
+    report(err, "Register code cannot be saved, compile without --registers\n");
+    return false;
+  }
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    report(err, "fopen(%s) failed: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  bool ok = write_bytecode(vm, chunk, f);
+  ok = fclose(f) == 0 && ok;
+  if (!ok) {
+    report(err, "Could not write bytecode to %s\n", path);
+  }
+  return ok;
+}
+
+/**
+ * Walks the code once so that the VM never has to bounds check operands,
+ * constant indexes or global slots of a loaded chunk. Chunks have no
+ * control flow yet, so the stack depth at every instruction is known and
+ * code that would pop more than it pushed is refused as well.
+ */
+static bool verify_code(const Chunk *chunk, size_t global_count) {
+  size_t offset = 0;
+  size_t depth = 0;
+  while (offset < chunk->count) {
+    const uint8_t *operand = chunk->code + offset + 1;
+    size_t left = chunk->count - offset - 1;
+    OpCode opcode = (OpCode) chunk->code[offset];
+    // values the instruction pops and pushes
+    size_t pops = 0;
+    size_t pushes = 0;
+    switch (opcode) {
+      case OP_CONSTANT:
+        if (left < 1 || operand[0] >= chunk->constants.count) return false;
+        pushes = 1;
+        offset += 2;
+        break;
+      case OP_CONSTANT_LONG:
+        if (left < 3 ||
+            (size_t) (operand[0] | (operand[1] << 8) | (operand[2] << 16)) >= chunk->constants.count) {
+          return false;
+        }
+        pushes = 1;
+        offset += 4;
+        break;
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_EQUAL:
+        pops = 2;
+        pushes = 1;
+        offset += 1;
+        break;
+      case OP_NEGATE:
+      case OP_NOT:
+        pops = 1;
+        pushes = 1;
+        offset += 1;
+        break;
+      case OP_PRINT:
+      case OP_POP:
+        pops = 1;
+        offset += 1;
+        break;
+      case OP_RETURN:
+        // nothing may be left for the next chunk to find on the stack
+        if (depth != 0) return false;
+        offset += 1;
+        break;
+      case OP_DEFINE_GLOBAL:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        if (left < 2 || (size_t) (operand[0] | (operand[1] << 8)) >= global_count) return false;
+        pops = opcode == OP_DEFINE_GLOBAL || opcode == OP_SET_GLOBAL;
+        pushes = opcode != OP_DEFINE_GLOBAL;
+        offset += 3;
+        break;
+      default:
+        return false;
+    }
+    if (depth < pops) {
+      return false;
+    }
+    depth = depth - pops + pushes;
+  }
+
+  // the VM stops at OP_RETURN, it must not run off the end of the code
+  return chunk->count > 0 && chunk->code[chunk->count - 1] == OP_RETURN;
+}
+
+/**
+ * Rewrites the global operands of verified code from the slots of the VM
+ * that compiled it to the slots of this one.
+ */
+static void remap_globals(Chunk *chunk, const uint32_t *slots) {
+  size_t offset = 0;
+  while (offset < chunk->count) {
+    uint8_t *operand = chunk->code + offset + 1;
+    switch ((OpCode) chunk->code[offset]) {
+      case OP_CONSTANT:
+        offset += 2;
+        break;
+      case OP_CONSTANT_LONG:
+        offset += 4;
+        break;
+      case OP_DEFINE_GLOBAL:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL: {
+        uint32_t slot = slots[operand[0] | (operand[1] << 8)];
+        operand[0] = (uint8_t) (slot & 0xff);
+        operand[1] = (uint8_t) (slot >> 8);
+        offset += 3;
+        break;
+      }
+      default:
+        offset += 1;
+        break;
+    }
+  }
+}
+
+/**
+ * Looks up the global names of the file in vm and fills slots with the
+ * slot vm has for each of them. Returns false if a name is malformed.
+ */
+static bool read_globals(VM *vm, uint32_t *slots, uint32_t global_count,
+    const uint8_t *data, size_t size, size_t *offset) {
+  for (uint32_t i = 0; i < global_count; i++) {
+    ObjString *name = read_string(vm, data, size, offset);
+    if (name == NULL || !global_slot(vm, name, &slots[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Code compiled against the same slots as vm, which is always the case
+ * for a fresh VM, runs in place. Anything else is copied into the chunk's
+ * arena and patched.
+ */
+static bool relocate_globals(Chunk *chunk, const uint32_t *slots, uint32_t global_count) {
+  bool same_slots = true;
+  for (uint32_t i = 0; i < global_count; i++) {
+    same_slots &= slots[i] == i;
+  }
+  if (same_slots) {
+    return true;
+  }
+
+  if (!writable_code(chunk)) {
+    return false;
+  }
+  remap_globals(chunk, slots);
+  return true;
+}
+
+static bool verify_lines(const Chunk *chunk) {
+  for (size_t i = 0; i < chunk->line_count; i++) {
+    if (chunk->lines[i].offset >= chunk->count ||
+        (i > 0 && chunk->lines[i].offset <= chunk->lines[i - 1].offset)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool read_chunk(VM *vm, Chunk *chunk, const uint8_t *data, size_t size, FILE *err) {
+  init_chunk(chunk);
+
+  BytecodeHeader header;
+  if ((uintptr_t) data % _Alignof(LineStart) != 0) {
+    report(err, "Bytecode is not aligned\n");
+    return false;
+  }
+  if (size < sizeof(header)) {
+    report(err, "Bytecode is too short\n");
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, LOXC_MAGIC, sizeof(header.magic)) != 0) {
+    report(err, "Not a clox bytecode file\n");
+    return false;
+  }
+  if (header.version != LOXC_VERSION) {
+    report(err, "Unsupported bytecode version %u, expected %u\n", header.version, LOXC_VERSION);
+    return false;
+  }
+
+  size_t lines = lines_offset(header.code_size);
+  size_t constants = lines + (size_t) header.line_count * sizeof(LineStart);
+  // every constant takes at least its tag byte
+  if (size < constants || size - constants < header.constant_count ||
+      header.global_count > GLOBALS_MAX) {
+    report(err, "Bytecode is truncated\n");
+    return false;
+  }
+
+  chunk->borrowed = true;
+  chunk->owns_code = false;
+  chunk->code = (uint8_t *) data + sizeof(header);
+  chunk->count = header.code_size;
+  chunk->lines = (LineStart *) (data + lines);
+  chunk->line_count = header.line_count;
+
+  if (header.constant_count > 0) {
+    chunk->constants.values = arena_alloc(&chunk->arena, header.constant_count * sizeof(Value), MEM_CONSTANTS);
+    if (chunk->constants.values == NULL) {
+      free_chunk(chunk);
+      return false;
+    }
+    chunk->constants.capacity = header.constant_count;
+  }
+  size_t offset = constants;
+  for (size_t i = 0; i < header.constant_count; i++) {
+    if (!read_constant_entry(vm, data, size, &offset, &chunk->constants.values[i])) {
+      report(err, "Bytecode has an invalid constant at index %zu\n", i);
+      free_chunk(chunk);
+      return false;
+    }
+    chunk->constants.count++;
+  }
+  uint32_t *slots = NULL;
+  if (header.global_count > 0) {
+    slots = arena_alloc(&chunk->arena, header.global_count * sizeof(uint32_t), MEM_OTHER);
+    if (slots == NULL) {
+      free_chunk(chunk);
+      return false;
+    }
+  }
+  if (!read_globals(vm, slots, header.global_count, data, size, &offset)) {
+    report(err, "Bytecode has an invalid global name\n");
+    free_chunk(chunk);
+    return false;
+  }
+  if (offset != size) {
+    report(err, "Bytecode has trailing data\n");
+    free_chunk(chunk);
+    return false;
+  }
+
+  if (!verify_lines(chunk) || !verify_code(chunk, header.global_count)) {
+    report(err, "Bytecode failed verification\n");
+    free_chunk(chunk);
+    return false;
+  }
+  if (!relocate_globals(chunk, slots, header.global_count)) {
+    free_chunk(chunk);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Points chunk at the code and line table inside data and decodes the
+ * constants. data has to be aligned for LineStart and outlive the chunk,
+ * free_chunk() leaves it alone.
+ */
+bool read_bytecode(VM *vm, Chunk *chunk, const uint8_t *data, size_t size, FILE *err) {
+  // the decoded strings are only reachable once the chunk runs
+  gc_defer(vm);
+  bool ok = read_chunk(vm, chunk, data, size, err);
+  gc_resume(vm);
+  return ok;
+}
+
+bool is_bytecode_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return false;
+  }
+  char magic[4];
+  bool is_bytecode = fread(magic, sizeof(magic), 1, f) == 1 &&
+    memcmp(magic, LOXC_MAGIC, sizeof(magic)) == 0;
+  fclose(f);
+  return is_bytecode;
+}
+
+/**
+ * Maps path read only and loads the chunk straight from the mapping, so
+ * processes running the same file share its pages.
+ */
+bool map_bytecode(VM *vm, BytecodeFile *file, const char *path, FILE *err) {
+  file->data = NULL;
+  file->size = 0;
+  init_chunk(&file->chunk);
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    report(err, "open(%s) failed: %s\n", path, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size == 0) {
+    report(err, "Could not read %s\n", path);
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping keeps its own reference to the file
+  close(fd);
+  if (data == MAP_FAILED) {
+    report(err, "mmap(%s) failed: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  if (!read_bytecode(vm, &file->chunk, data, (size_t) st.st_size, err)) {
+    munmap(data, (size_t) st.st_size);
+    return false;
+  }
+  file->data = data;
+  file->size = (size_t) st.st_size;
+  return true;
+}
+
+void unmap_bytecode(BytecodeFile *file) {
+  free_chunk(&file->chunk);
+  if (file->data != NULL) {
+    munmap(file->data, file->size);
+  }
+  file->data = NULL;
+  file->size = 0;
+}
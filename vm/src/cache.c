@@ -0,0 +1,164 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clox/cache.h"
+#include "clox/compiler.h"
+
+// hash, source length, bytecode and compiler version, optimization level
+#define ENTRY_FORMAT "%s/%016" PRIx64 "-%zx-%u-%u-O%d.loxc"
+
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * Hashes the source 8 bytes at a time, the whole script is read for every
+ * lookup so this has to be much cheaper than compiling it.
+ */
+uint64_t hash_source(const char *source, size_t length) {
+  uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, source + i, sizeof(word));
+    hash = mix(hash ^ word);
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, source + i, length - i);
+  return mix(hash ^ tail);
+}
+
+static char *entry_path(const VM *vm, const char *dir, const char *source) {
+  size_t length = strlen(source);
+  uint64_t hash = hash_source(source, length);
+  int size = snprintf(NULL, 0, ENTRY_FORMAT, dir, hash, length, LOXC_VERSION, COMPILER_VERSION, vm->opt_level);
+
+  char *path = size < 0 ? NULL : malloc((size_t) size + 1);
+  if (path == NULL) {
+    return NULL;
+  }
+  snprintf(path, (size_t) size + 1, ENTRY_FORMAT, dir, hash, length, LOXC_VERSION, COMPILER_VERSION, vm->opt_level);
+  return path;
+}
+
+/**
+ * Maps the cached chunk for source, returns false on a miss. Unreadable
+ * or corrupt entries count as a miss and get replaced by the next store.
+ */
+bool load_cached_chunk(VM *vm, const char *dir, const char *source, BytecodeFile *file) {
+  char *path = entry_path(vm, dir, source);
+  if (path == NULL) {
+    return false;
+  }
+  bool hit = access(path, R_OK) == 0 && map_bytecode(vm, file, path, NULL);
+  free(path);
+  return hit;
+}
+
+/**
+ * Best effort, a chunk that cannot be cached is simply compiled again
+ * next time.
+ */
+void store_cached_chunk(const VM *vm, const char *dir, const char *source, const Chunk *chunk) {
+  char *path = entry_path(vm, dir, source);
+  if (path == NULL) {
+    return;
+  }
+
+  // rename() replaces the entry atomically, readers see all or nothing
+  size_t size = strlen(dir) + sizeof("/.tmp-XXXXXX");
+  char *temp = malloc(size);
+  if (temp == NULL) {
+    free(path);
+    return;
+  }
+  snprintf(temp, size, "%s/.tmp-XXXXXX", dir);
+
+  int fd = mkstemp(temp);
+  FILE *f = fd == -1 ? NULL : fdopen(fd, "wb");
+  if (f == NULL) {
+    if (fd != -1) {
+      close(fd);
+      unlink(temp);
+    }
+  } else {
+    bool ok = write_bytecode(vm, chunk, f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temp, path) != 0) {
+      unlink(temp);
+    }
+  }
+
+  free(temp);
+  free(path);
+}
+
+/**
+ * $CLOX_CACHE_DIR, $XDG_CACHE_HOME/clox or ~/.cache/clox, whichever is
+ * set first. Returns NULL when none of them is, the caller frees the rest.
+ */
+char *default_cache_dir() {
+  const char *dir = getenv("CLOX_CACHE_DIR");
+  if (dir != NULL && *dir != '\0') {
+    return strdup(dir);
+  }
+
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *suffix = "/clox";
+  if (base == NULL || *base == '\0') {
+    base = getenv("HOME");
+    suffix = "/.cache/clox";
+  }
+  if (base == NULL || *base == '\0') {
+    return NULL;
+  }
+
+  size_t size = strlen(base) + strlen(suffix) + 1;
+  char *path = malloc(size);
+  if (path == NULL) {
+    return NULL;
+  }
+  snprintf(path, size, "%s%s", base, suffix);
+  return path;
+}
+
+/**
+ * Creates dir and any missing parents, like mkdir -p.
+ */
+bool make_cache_dir(const char *dir) {
+  if (*dir == '\0') {
+    return false;
+  }
+  char *path = strdup(dir);
+  if (path == NULL) {
+    return false;
+  }
+
+  bool ok = true;
+  for (char *p = path + 1; ok; p++) {
+    if (*p != '/' && *p != '\0') {
+      continue;
+    }
+    char c = *p;
+    *p = '\0';
+    ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+    *p = c;
+    if (c == '\0') {
+      break;
+    }
+  }
+
+  free(path);
+  return ok;
+}
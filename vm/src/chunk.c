@@ -1,50 +1,446 @@
 #include <stdio.h>
+#include <string.h>
 
 #include "clox/memory.h"
 #include "clox/chunk.h"
+#include "clox/jit.h"
 
 void init_chunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
   chunk->lines = NULL;
+  chunk->borrowed = false;
+  chunk->owns_code = true;
+  chunk->sites = NULL;
+  chunk->fused = false;
+  init_arena(&chunk->arena);
+  chunk->runs = 0;
+  chunk->native.code = NULL;
+  chunk->native.size = 0;
+  chunk->native.stack_depth = 0;
+  chunk->registers = false;
+  chunk->frame_constants = 0;
+  chunk->frame_global_count = 0;
+  chunk->frame_globals = NULL;
+  chunk->register_count = 0;
 
   init_value_array(&chunk->constants);
+  chunk->constant_index.capacity = 0;
+  chunk->constant_index.slots = NULL;
 }
 
-bool write_chunk(Chunk *chunk, uint8_t byte, size_t line) {
-  // is there space for one more byte?
-  if (chunk->capacity < chunk->count + 1) {
-    size_t old_capacity = chunk->capacity;
-    chunk->capacity = grow_capacity(old_capacity);
-    if (!reallocate((void **) &chunk->code, old_capacity * sizeof(uint8_t), chunk->capacity * sizeof(uint8_t))) {
-      fprintf(stderr, "Failed to grow chunk\n");
-      return false;
-    }
+/**
+ * Starts a new run in the line table unless the byte at offset continues
+ * the last one.
+ */
+static bool write_line(Chunk *chunk, size_t offset, size_t line) {
+  if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line == line) {
+    return true;
+  }
 
+  if (offset > UINT32_MAX || line > UINT32_MAX) {
+    fprintf(stderr, "Chunk offset or line does not fit in the line table\n");
+    return false;
+  }
 
-    if (!reallocate((void **) &chunk->lines, old_capacity * sizeof(size_t), chunk->capacity * sizeof(size_t))) {
+  if (chunk->line_capacity < chunk->line_count + 1) {
+    size_t old_capacity = chunk->line_capacity;
+    chunk->line_capacity = grow_capacity(old_capacity);
+    if (!arena_reallocate(&chunk->arena, (void **) &chunk->lines, old_capacity * sizeof(LineStart), chunk->line_capacity * sizeof(LineStart), MEM_LINES)) {
       fprintf(stderr, "Failed to grow lines\n");
       return false;
     }
   }
 
+  LineStart *start = &chunk->lines[chunk->line_count++];
+  start->offset = (uint32_t) offset;
+  start->line = (uint32_t) line;
+
+  return true;
+}
+
+/**
+ * Makes room for at least capacity bytes of code up front. The compiler
+ * reserves about as much as it expects to emit, so code is rarely copied
+ * while the chunk grows.
+ */
+bool reserve_chunk(Chunk *chunk, size_t capacity) {
+  if (chunk->capacity >= capacity) {
+    return true;
+  }
+  if (!arena_reallocate(&chunk->arena, (void **) &chunk->code, chunk->capacity * sizeof(uint8_t), capacity * sizeof(uint8_t), MEM_CODE)) {
+    fprintf(stderr, "Failed to grow chunk\n");
+    return false;
+  }
+  chunk->capacity = capacity;
+  return true;
+}
+
+bool write_chunk(Chunk *chunk, uint8_t byte, size_t line) {
+  // is there space for one more byte?
+  if (chunk->capacity < chunk->count + 1 &&
+      !reserve_chunk(chunk, grow_capacity(chunk->capacity))) {
+    return false;
+  }
+
+  if (!write_line(chunk, chunk->count, line)) {
+    return false;
+  }
+
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
 
   return true;
 }
 
 void free_chunk(Chunk *chunk) {
-  reallocate((void **) &chunk->code, chunk->capacity * sizeof(uint8_t), 0);
-  reallocate((void **) &chunk->lines, chunk->capacity * sizeof(size_t), 0);
-  free_value_array(&chunk->constants);
+  jit_free(&chunk->native);
+  free_arena(&chunk->arena);
   init_chunk(chunk);
 }
 
+// CONSTANT DEDUPLICATION
+
+/**
+ * Constants are shared only when they have the exact same representation.
+ * That keeps 0 and -0 apart and lets identical NaNs share a slot.
+ */
+static uint64_t constant_bits(Value value) {
+#ifdef CLOX_NAN_BOXING
+  return value;
+#else
+  uint64_t bits = 0;
+  switch (value.type) {
+    case VAL_BOOL:   bits = value.as.boolean; break;
+    case VAL_NIL:    bits = 0; break;
+    case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+    // strings are interned, equal strings are the same object
+    case VAL_OBJ:    bits = (uint64_t) (uintptr_t) value.as.obj; break;
+  }
+  return bits;
+#endif // CLOX_NAN_BOXING
+}
+
+bool same_constant(Value a, Value b) {
+#ifndef CLOX_NAN_BOXING
+  if (a.type != b.type) {
+    return false;
+  }
+#endif // CLOX_NAN_BOXING
+  return constant_bits(a) == constant_bits(b);
+}
+
+size_t hash_constant(Value value) {
+  // splitmix64 finalizer, doubles that differ only in the low mantissa
+  // bits still land in different slots
+  uint64_t x = constant_bits(value);
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return (size_t) x;
+}
+
+/**
+ * Returns the index slot where value lives or the empty slot where it
+ * should be inserted. Capacity is always a power of two.
+ */
+static uint32_t *find_constant_slot(Chunk *chunk, Value value) {
+  ConstantIndex *index = &chunk->constant_index;
+  size_t mask = index->capacity - 1;
+  for (size_t i = hash_constant(value) & mask;; i = (i + 1) & mask) {
+    uint32_t *slot = &index->slots[i];
+    if (*slot == 0 || same_constant(chunk->constants.values[*slot - 1], value)) {
+      return slot;
+    }
+  }
+}
+
+/**
+ * Rebuilds the index with room for at least min_capacity slots.
+ */
+static bool grow_constant_index(Chunk *chunk, size_t min_capacity) {
+  ConstantIndex *index = &chunk->constant_index;
+  size_t new_capacity = index->capacity;
+  while (new_capacity < min_capacity) {
+    new_capacity = grow_capacity(new_capacity);
+  }
+
+  // the old slots stay in the arena, the index is rebuilt from scratch
+  uint32_t *slots = arena_alloc(&chunk->arena, new_capacity * sizeof(uint32_t), MEM_CONSTANTS);
+  if (slots == NULL) {
+    fprintf(stderr, "Failed to grow constant index\n");
+    return false;
+  }
+  memset(slots, 0, new_capacity * sizeof(uint32_t));
+
+  index->slots = slots;
+  index->capacity = new_capacity;
+  for (size_t i = 0; i < chunk->constants.count; i++) {
+    *find_constant_slot(chunk, chunk->constants.values[i]) = (uint32_t) i + 1;
+  }
+
+  return true;
+}
+
+static bool push_constant(Chunk *chunk, Value value) {
+  ValueArray *constants = &chunk->constants;
+  if (constants->capacity < constants->count + 1) {
+    size_t old_capacity = constants->capacity;
+    size_t new_capacity = grow_capacity(old_capacity);
+    if (!arena_reallocate(&chunk->arena, (void **) &constants->values, old_capacity * sizeof(Value), new_capacity * sizeof(Value), MEM_CONSTANTS)) {
+      fprintf(stderr, "Failed to grow constants\n");
+      return false;
+    }
+    constants->capacity = new_capacity;
+  }
+
+  constants->values[constants->count++] = value;
+  return true;
+}
+
+/**
+ * Adds value to the constant pool unless an identical constant is already
+ * there and returns its index, or NO_CONSTANT when there is no memory.
+ */
 size_t add_constant(Chunk* chunk, Value value) {
-  //TODO: error handle write fail
-  write_value_array(&chunk->constants, value);
+  // keep the index at most half full so probe sequences stay short
+  size_t min_capacity = 2 * (chunk->constants.count + 1);
+  if (chunk->constant_index.capacity < min_capacity &&
+      !grow_constant_index(chunk, min_capacity)) {
+    return NO_CONSTANT;
+  }
+
+  uint32_t *slot = find_constant_slot(chunk, value);
+  if (*slot != 0) {
+    return *slot - 1;
+  }
+
+  if (!push_constant(chunk, value)) {
+    return NO_CONSTANT;
+  }
+  *slot = (uint32_t) chunk->constants.count;
   return chunk->constants.count - 1;
 }
+
+/**
+ * Index of a constant identical to value, NO_CONSTANT if there is none.
+ */
+static size_t find_constant(Chunk *chunk, Value value) {
+  if (chunk->constant_index.capacity == 0) {
+    return NO_CONSTANT;
+  }
+  uint32_t *slot = find_constant_slot(chunk, value);
+  return *slot == 0 ? NO_CONSTANT : *slot - 1;
+}
+
+/**
+ * Emits the instruction that loads value. Indexes that fit in one byte
+ * use OP_CONSTANT, the rest use OP_CONSTANT_LONG with a little endian
+ * 24 bit operand. Returns false when the constant pool is full, which
+ * leaves the pool as it was, or there is no memory.
+ */
+bool write_constant(Chunk *chunk, Value value, size_t line) {
+  // a full pool can still hand out the constants it has
+  size_t constant = chunk->constants.count > CONSTANT_LONG_MAX ?
+    find_constant(chunk, value) : add_constant(chunk, value);
+  if (constant == NO_CONSTANT) {
+    return false;
+  }
+
+  if (constant <= UINT8_MAX) {
+    return write_chunk(chunk, OP_CONSTANT, line) &&
+      write_chunk(chunk, (uint8_t) constant, line);
+  }
+
+  return write_chunk(chunk, OP_CONSTANT_LONG, line) &&
+    write_chunk(chunk, (uint8_t) (constant & 0xFF), line) &&
+    write_chunk(chunk, (uint8_t) ((constant >> 8) & 0xFF), line) &&
+    write_chunk(chunk, (uint8_t) ((constant >> 16) & 0xFF), line);
+}
+
+/**
+ * Finds the source line of the byte at offset with a binary search
+ * over the line runs.
+ */
+size_t get_line(const Chunk *chunk, size_t offset) {
+  size_t lo = 0;
+  size_t hi = chunk->line_count;
+
+  // find the last run that starts at or before offset
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return chunk->line_count > 0 ? chunk->lines[lo].line : 0;
+}
+
+/**
+ * Copies borrowed code into the chunk's arena, so that it can be patched.
+ * The lines stay borrowed.
+ */
+bool writable_code(Chunk *chunk) {
+  if (chunk->owns_code) {
+    return true;
+  }
+  uint8_t *code = arena_alloc(&chunk->arena, chunk->count, MEM_CODE);
+  if (code == NULL) {
+    return false;
+  }
+  memcpy(code, chunk->code, chunk->count);
+  chunk->code = code;
+  chunk->owns_code = true;
+  return true;
+}
+
+// QUICKENING
+
+/**
+ * Rewrites the instruction at offset into opcode, a specialized form of
+ * the same instruction. Fails if the site missed too often already or
+ * there is no memory for the copy of the code or the counters, the
+ * instruction then stays as it is. Moves the code if it was borrowed.
+ */
+bool quicken_instruction(Chunk *chunk, size_t offset, OpCode opcode) {
+  if (chunk->sites == NULL) {
+    chunk->sites = arena_alloc(&chunk->arena, chunk->count * sizeof(QuickSite), MEM_OTHER);
+    if (chunk->sites == NULL) {
+      return false;
+    }
+    memset(chunk->sites, 0, chunk->count * sizeof(QuickSite));
+  }
+  if (chunk->sites[offset].misses >= QUICKEN_MISSES_MAX || !writable_code(chunk)) {
+    return false;
+  }
+
+  chunk->code[offset] = (uint8_t) opcode;
+  return true;
+}
+
+/**
+ * Bytes of an instruction with its operands.
+ */
+size_t instruction_length(OpCode opcode) {
+  switch (opcode) {
+    case OP_CONSTANT: return 2;
+    case OP_CONSTANT_LONG: return 4;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL: return 3;
+#define SUPERINSTRUCTION(name, first, second) \
+    case name: return instruction_length(first) + instruction_length(second);
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+    default: return 1;
+  }
+}
+
+size_t register_instruction_length(RegOpCode opcode) {
+  switch (opcode) {
+    case REG_CONSTANT: return 6;
+    case REG_MOVE:
+    case REG_NEGATE:
+    case REG_NOT: return 5;
+    case REG_ADD:
+    case REG_SUBTRACT:
+    case REG_MULTIPLY:
+    case REG_DIVIDE:
+    case REG_EQUAL:
+    case REG_DEFINE_GLOBAL:
+    case REG_SET_GLOBAL: return 7;
+    case REG_PRINT:
+    case REG_CHECK_GLOBAL: return 3;
+    default: return 1;
+  }
+}
+
+/**
+ * The instruction the compiler emitted for a quickened one. For a
+ * superinstruction that is its first part, the second one is still in
+ * the code right after it.
+ */
+OpCode generic_opcode(OpCode opcode) {
+  switch (opcode) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+      return OP_ADD;
+    case OP_EQUAL_NUM:
+      return OP_EQUAL;
+#define SUPERINSTRUCTION(name, first, second) case name: return first;
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+    default:
+      return opcode;
+  }
+}
+
+// SUPERINSTRUCTIONS
+
+/**
+ * The two instructions a superinstruction stands for. Returns false for
+ * any other opcode.
+ */
+bool superinstruction_parts(OpCode opcode, OpCode *first, OpCode *second) {
+  switch (opcode) {
+#define SUPERINSTRUCTION(name, first_part, second_part) \
+    case name: *first = first_part; *second = second_part; return true;
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+    default:
+      return false;
+  }
+}
+
+static bool find_superinstruction(OpCode first, OpCode second, OpCode *fused) {
+#define SUPERINSTRUCTION(name, first_part, second_part)         \
+  if (first == first_part && second == second_part) {           \
+    *fused = name;                                              \
+    return true;                                                \
+  }
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+  return false;
+}
+
+/**
+ * Replaces the first opcode of every pair in superinstructions.h with the
+ * superinstruction, from left to right. Everything else stays where it
+ * is, including the opcode of the second instruction, so offsets, lines
+ * and operands do not change and the VM simply steps over that byte.
+ * Returns false if borrowed code could not be copied, the chunk then runs
+ * as it is.
+ */
+bool fuse_superinstructions(Chunk *chunk) {
+  chunk->fused = true;
+  size_t offset = 0;
+  while (offset < chunk->count) {
+    OpCode first = chunk->code[offset];
+    size_t length = instruction_length(first);
+    if (offset + length >= chunk->count || first != generic_opcode(first)) {
+      offset += length;
+      continue;
+    }
+
+    OpCode second = chunk->code[offset + length];
+    OpCode fused;
+    if (second != generic_opcode(second) || !find_superinstruction(first, second, &fused)) {
+      offset += length;
+      continue;
+    }
+    if (!writable_code(chunk)) {
+      return false;
+    }
+    chunk->code[offset] = (uint8_t) fused;
+    offset += length + instruction_length(second);
+  }
+  return true;
+}
@@ -1,16 +1,47 @@
 #include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
 
 #include "clox/scanner.h"
 #include "clox/compiler.h"
-#include "clox/debug.h"
+#include "clox/ir.h"
+#include "clox/object.h"
+
+/**
+ * Literals are not emitted right away. They wait here so that an
+ * operator applied to them can be evaluated at compile time instead. The
+ * first byte emitted by anything else flushes them to the chunk, in order.
+ *
+ * An expression either leaves exactly one constant on top of this stack
+ * (the whole expression is a constant) or flushes everything, so an
+ * operator can tell whether its operands are constants by looking at the
+ * count before and after parsing them.
+ */
+#define PENDING_MAX 256
 
 typedef struct {
+  Value values[PENDING_MAX];
+  size_t lines[PENDING_MAX];
+  size_t count;
+} PendingConstants;
+
+/**
+ * State of one compilation. Everything lives here instead of in globals so
+ * that any number of threads can compile at the same time.
+ */
+typedef struct {
+  VM *vm;
+  Scanner scanner;
   Token current;
   Token previous;
   bool had_error;
   bool panic_mode;
+  PendingConstants pending;
+  Chunk *chunk;
+  // at -O1 and for register code instructions go to the IR, which is
+  // lowered to chunk at the end
+  IrFunction *ir;
 } Parser;
 
 typedef enum {
@@ -28,7 +59,7 @@ typedef enum {
 } Precedence;
 
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(Parser *parser, bool can_assign);
 
 typedef struct {
   ParseFn prefix;
@@ -36,10 +67,13 @@ typedef struct {
   Precedence precedence;
 } ParseRule;
 
-static void grouping();
-static void unary();
-static void binary();
-static void number();
+static void grouping(Parser *parser, bool can_assign);
+static void unary(Parser *parser, bool can_assign);
+static void binary(Parser *parser, bool can_assign);
+static void number(Parser *parser, bool can_assign);
+static void string(Parser *parser, bool can_assign);
+static void literal(Parser *parser, bool can_assign);
+static void variable(Parser *parser, bool can_assign);
 
 ParseRule rules[] = {
   [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
@@ -53,67 +87,64 @@ ParseRule rules[] = {
   [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
   [TOKEN_SLASH] = {NULL, binary, PREC_FACTORY},
   [TOKEN_STAR] = {NULL, binary, PREC_FACTORY},
-  [TOKEN_BANG] = {NULL, NULL, PREC_NONE},
-  [TOKEN_BANG_EQUAL] = {NULL, NULL, PREC_NONE},
+  [TOKEN_BANG] = {unary, NULL, PREC_NONE},
+  [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
   [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
-  [TOKEN_EQUAL_EQUAL] = {NULL, NULL, PREC_NONE},
+  [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
   [TOKEN_GREATER] = {NULL, NULL, PREC_NONE},
   [TOKEN_GREATER_EQUAL] = {NULL, NULL, PREC_NONE},
   [TOKEN_LESS] = {NULL, NULL, PREC_NONE},
   [TOKEN_LESS_EQUAL] = {NULL, NULL, PREC_NONE},
-  [TOKEN_IDENTIFIER] = {NULL, NULL, PREC_NONE},
-  [TOKEN_STRING] = {NULL, NULL, PREC_NONE},
+  [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
+  [TOKEN_STRING] = {string, NULL, PREC_NONE},
   [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
   [TOKEN_AND] = {NULL, NULL, PREC_NONE},
   [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
   [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
-  [TOKEN_FALSE] = {NULL, NULL, PREC_NONE},
+  [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
   [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
   [TOKEN_FUN] = {NULL, NULL, PREC_NONE},
   [TOKEN_IF] = {NULL, NULL, PREC_NONE},
-  [TOKEN_NIL] = {NULL, NULL, PREC_NONE},
+  [TOKEN_NIL] = {literal, NULL, PREC_NONE},
   [TOKEN_OR] = {NULL, NULL, PREC_NONE},
   [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
   [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
   [TOKEN_SUPER] = {NULL, NULL, PREC_NONE},
   [TOKEN_THIS] = {NULL, NULL, PREC_NONE},
-  [TOKEN_TRUE] = {NULL, NULL, PREC_NONE},
+  [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
   [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
   [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
   [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
   [TOKEN_EOF] = {NULL, NULL, PREC_NONE},
 };
 
-static Parser parser;
-static Chunk *compiling_chunk;
-
 // ERROR HANDLING FUNCTIONS
 
-static void error_at(Token *token, const char *message) {
-  if (parser.panic_mode) {
+static void error_at(Parser *parser, Token *token, const char *message) {
+  if (parser->panic_mode) {
     return;
   }
-  parser.panic_mode = true;
+  parser->panic_mode = true;
 
-  fprintf(stderr, "[line %ld] Error", token->line);
+  fprintf(parser->vm->err, "[line %ld] Error", token->line);
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, "at end");
+    fprintf(parser->vm->err, " at end");
   } else if (token->type == TOKEN_ERROR) {
     //nothing
   } else {
-    fprintf(stderr, " at '%.*s'", (int) token->length, token->start);
+    fprintf(parser->vm->err, " at '%.*s'", (int) token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
-  parser.had_error = true;
+  fprintf(parser->vm->err, ": %s\n", message);
+  parser->had_error = true;
 }
 
-static void error(const char *message) {
-  error_at(&parser.previous, message);
+static void error(Parser *parser, const char *message) {
+  error_at(parser, &parser->previous, message);
 }
 
-static void error_at_current(const char *message) {
-  error_at(&parser.current, message);
+static void error_at_current(Parser *parser, const char *message) {
+  error_at(parser, &parser->current, message);
 }
 
 // ADVANCE + CONSUME
@@ -122,16 +153,16 @@ static void error_at_current(const char *message) {
  * Save current token in previous and read a new token.
  * New token is saved in current.
  */
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser *parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scan_token();
-    if (parser.current.type != TOKEN_ERROR) {
+    parser->current = scan_token(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR) {
       break;
     }
 
-    error_at_current(parser.current.start);
+    error_at_current(parser, parser->current.start);
   }
 }
 
@@ -139,46 +170,174 @@ static void advance() {
  * Reads the next token but it also validates that the token
  * has an expected type
  */
-static void consume(TokenType type, const char *message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser *parser, TokenType type, const char *message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  error_at_current(message);
+  error_at_current(parser, message);
+}
+
+static bool check(Parser *parser, TokenType type) {
+  return parser->current.type == type;
+}
+
+static bool match(Parser *parser, TokenType type) {
+  if (!check(parser, type)) {
+    return false;
+  }
+  advance(parser);
+  return true;
 }
 
 // CODEGEN
 
-static Chunk *current_chunk() {
-  return compiling_chunk;
+static Chunk *current_chunk(Parser *parser) {
+  return parser->chunk;
 }
 
-static void emit_byte(uint8_t byte) {
-  write_chunk(current_chunk(), byte, parser.previous.line);
+static void write_byte(Parser *parser, uint8_t byte, size_t line) {
+  write_chunk(current_chunk(parser), byte, line);
 }
 
-static void emit_bytes(uint8_t byte1, uint8_t byte2) {
-  emit_byte(byte1);
-  emit_byte(byte2);
+/**
+ * The IR only fails to take an instruction when it runs out of memory or
+ * when an error already left the operand stack short.
+ */
+static void check_ir(Parser *parser, bool ok) {
+  if (!ok && !parser->had_error) {
+    error(parser, "Out of memory.");
+  }
 }
 
-static void emit_return() {
-  emit_byte(OP_RETURN);
+/**
+ * Why a constant could not be written to chunk, a full pool or no memory.
+ */
+static const char *constant_error(const Chunk *chunk) {
+  return chunk->constants.count > CONSTANT_LONG_MAX ?
+    "Too many constants in one chunk." : "Out of memory.";
 }
 
-static uint8_t make_constant(Value value) {
-  int constant = add_constant(current_chunk(), value);
-  if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
-    return 0;
+/**
+ * Emit all constants that are still waiting to be folded.
+ */
+static void flush_constants(Parser *parser) {
+  for (size_t i = 0; i < parser->pending.count; i++) {
+    if (parser->ir != NULL) {
+      check_ir(parser, ir_emit_constant(parser->ir, parser->pending.values[i], parser->pending.lines[i]));
+    } else if (!write_constant(current_chunk(parser), parser->pending.values[i],
+          parser->pending.lines[i])) {
+      error(parser, constant_error(current_chunk(parser)));
+    }
   }
 
-  return (uint8_t) constant;
+  parser->pending.count = 0;
+}
+
+static void emit_byte(Parser *parser, uint8_t byte) {
+  flush_constants(parser);
+  write_byte(parser, byte, parser->previous.line);
+}
+
+static void emit_bytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
+  emit_byte(parser, byte1);
+  emit_byte(parser, byte2);
 }
 
-static void emit_constant(Value value) {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+/**
+ * Emits an instruction without operands.
+ */
+static void emit_op(Parser *parser, OpCode opcode) {
+  if (parser->ir != NULL) {
+    flush_constants(parser);
+    check_ir(parser, ir_emit(parser->ir, opcode, 0, parser->previous.line));
+    return;
+  }
+  emit_byte(parser, opcode);
+}
+
+static void emit_global(Parser *parser, OpCode opcode, uint32_t slot) {
+  if (parser->ir != NULL) {
+    flush_constants(parser);
+    check_ir(parser, ir_emit(parser->ir, opcode, slot, parser->previous.line));
+    return;
+  }
+  emit_byte(parser, opcode);
+  emit_bytes(parser, (uint8_t) (slot & 0xff), (uint8_t) (slot >> 8));
+}
+
+static void emit_return(Parser *parser) {
+  emit_op(parser, OP_RETURN);
+}
+
+static void emit_constant(Parser *parser, Value value) {
+  if (parser->pending.count == PENDING_MAX) {
+    flush_constants(parser);
+  }
+
+  parser->pending.values[parser->pending.count] = value;
+  parser->pending.lines[parser->pending.count] = parser->previous.line;
+  parser->pending.count++;
+}
+
+// CONSTANT FOLDING
+
+/**
+ * True if the operand that was just parsed is a constant which is still
+ * pending. pending_before is the pending count before the operand was parsed.
+ */
+static bool operand_is_constant(Parser *parser, size_t pending_before) {
+  return parser->pending.count == pending_before + 1;
+}
+
+static bool fold_unary(Parser *parser, TokenType operator_type, size_t pending_before) {
+  if (!operand_is_constant(parser, pending_before)) {
+    return false;
+  }
+
+  Value *operand = &parser->pending.values[parser->pending.count - 1];
+  switch (operator_type) {
+    case TOKEN_MINUS: return fold_instruction(parser->vm, OP_NEGATE, *operand, NIL_VAL(0), operand);
+    case TOKEN_BANG:  return fold_instruction(parser->vm, OP_NOT, *operand, NIL_VAL(0), operand);
+    default:          return false;
+  }
+}
+
+/**
+ * Evaluates a binary operator on two constants with the instructions it
+ * compiles to.
+ */
+static bool fold_values(Parser *parser, TokenType operator_type, Value a, Value b, Value *result) {
+  switch (operator_type) {
+    case TOKEN_PLUS:        return fold_instruction(parser->vm, OP_ADD, a, b, result);
+    case TOKEN_MINUS:       return fold_instruction(parser->vm, OP_SUBTRACT, a, b, result);
+    case TOKEN_STAR:        return fold_instruction(parser->vm, OP_MULTIPLY, a, b, result);
+    case TOKEN_SLASH:       return fold_instruction(parser->vm, OP_DIVIDE, a, b, result);
+    case TOKEN_EQUAL_EQUAL: return fold_instruction(parser->vm, OP_EQUAL, a, b, result);
+    case TOKEN_BANG_EQUAL:
+      return fold_instruction(parser->vm, OP_EQUAL, a, b, result) &&
+        fold_instruction(parser->vm, OP_NOT, *result, NIL_VAL(0), result);
+    default:                return false;
+  }
+}
+
+static bool fold_binary(Parser *parser, TokenType operator_type,
+    bool left_is_constant, size_t pending_before) {
+  if (!left_is_constant || !operand_is_constant(parser, pending_before)) {
+    return false;
+  }
+
+  Value result;
+  if (!fold_values(parser, operator_type, parser->pending.values[parser->pending.count - 2],
+        parser->pending.values[parser->pending.count - 1], &result)) {
+    return false;
+  }
+
+  // the folded value keeps the line of the left operand
+  parser->pending.count--;
+  parser->pending.values[parser->pending.count - 1] = result;
+  return true;
 }
 
 // PARSING
@@ -190,48 +349,129 @@ static ParseRule *get_rule(TokenType type) {
 /**
  * Main Pratt algorithm parser
  */
-static void parse_precedence(Precedence precedence) {
-  advance();
-  ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+static void parse_precedence(Parser *parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefix_rule = get_rule(parser->previous.type)->prefix;
   if (prefix_rule == NULL) {
-    error("Expect expression");
+    error(parser, "Expect expression");
     return;
   }
 
-  prefix_rule();
+  // only a variable parsed at assignment precedence may be assigned to,
+  // otherwise `a * b = c` would assign to b
+  bool can_assign = precedence <= PREC_ASSIGNMENT;
+  prefix_rule(parser, can_assign);
+
+  while (precedence <= get_rule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infix_rule = get_rule(parser->previous.type)->infix;
+    infix_rule(parser, can_assign);
+  }
+
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
+  }
+}
 
-  while (precedence <= get_rule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infix_rule = get_rule(parser.previous.type)->infix;
-    infix_rule();
+/**
+ * Slot of the global called name. The VM keeps slots across compilations,
+ * so every chunk compiled for the same VM agrees on them.
+ */
+static uint32_t identifier_slot(Parser *parser, const Token *name) {
+  ObjString *string = copy_string(parser->vm, name->start, name->length);
+  uint32_t slot = 0;
+  if (string == NULL) {
+    error(parser, "Out of memory.");
+  } else if (!global_slot(parser->vm, string, &slot)) {
+    error(parser, "Too many global variables.");
   }
+  return slot;
 }
 
 
 /**
  * Prefix parse function for TOKEN_NUMBER
  */
-static void number() {
-  double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+static void number(Parser *parser, bool can_assign) {
+  (void) can_assign;
+  double value = strtod(parser->previous.start, NULL);
+  emit_constant(parser, NUMBER_VAL(value));
 }
 
+/**
+ * Prefix parse function for TOKEN_STRING. The literal is interned right
+ * away, so every occurrence in the chunk shares one string and one slot
+ * in the constant pool.
+ */
+static void string(Parser *parser, bool can_assign) {
+  (void) can_assign;
+  // drop the quotes
+  ObjString *string = copy_string(parser->vm, parser->previous.start + 1, parser->previous.length - 2);
+  if (string == NULL) {
+    error(parser, "Out of memory.");
+    return;
+  }
+  emit_constant(parser, OBJ_VAL(string));
+}
+
+/**
+ * Prefix parse function for true, false and nil.
+ */
+static void literal(Parser *parser, bool can_assign) {
+  (void) can_assign;
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: emit_constant(parser, BOOL_VAL(false)); break;
+    case TOKEN_TRUE:  emit_constant(parser, BOOL_VAL(true)); break;
+    case TOKEN_NIL:   emit_constant(parser, NIL_VAL(0)); break;
+    default: return;
+  }
+}
+
+
+static void expression(Parser *parser);
+
+/**
+ * Prefix parse function for identifiers, reads or assigns a global.
+ */
+static void variable(Parser *parser, bool can_assign) {
+  uint32_t slot = identifier_slot(parser, &parser->previous);
+
+  if (can_assign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emit_global(parser, OP_SET_GLOBAL, slot);
+  } else {
+    emit_global(parser, OP_GET_GLOBAL, slot);
+  }
+}
 
 /**
  * Infix parse function for binary tokens.
  */
-static void binary() {
-  TokenType operator_type = parser.previous.type;
+static void binary(Parser *parser, bool can_assign) {
+  (void) can_assign;
+  TokenType operator_type = parser->previous.type;
   ParseRule *rule = get_rule(operator_type);
+  // the left operand is already parsed, if it was a constant it is still pending
+  bool left_is_constant = parser->pending.count > 0;
+  size_t pending_before = parser->pending.count;
   // we are using +1 here because binary operators are left-associative
   // We want ((1 + 2) + 3) + 4
-  parse_precedence((Precedence)(rule->precedence + 1));
+  parse_precedence(parser, (Precedence)(rule->precedence + 1));
+
+  if (fold_binary(parser, operator_type, left_is_constant, pending_before)) {
+    return;
+  }
 
   switch (operator_type) {
-    case TOKEN_PLUS:    emit_byte(OP_ADD); break;
-    case TOKEN_MINUS:   emit_byte(OP_SUBTRACT); break;
-    case TOKEN_STAR:    emit_byte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:   emit_byte(OP_DIVIDE); break;
+    case TOKEN_PLUS:    emit_op(parser, OP_ADD); break;
+    case TOKEN_MINUS:   emit_op(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR:    emit_op(parser, OP_MULTIPLY); break;
+    case TOKEN_SLASH:   emit_op(parser, OP_DIVIDE); break;
+    case TOKEN_EQUAL_EQUAL: emit_op(parser, OP_EQUAL); break;
+    case TOKEN_BANG_EQUAL:
+      emit_op(parser, OP_EQUAL);
+      emit_op(parser, OP_NOT);
+      break;
     default:            return;
   }
 }
@@ -240,51 +480,174 @@ static void binary() {
 /**
  * Prefix parse function for unary tokens.
  */
-static void unary() {
-  TokenType operator_type = parser.previous.type;
+static void unary(Parser *parser, bool can_assign) {
+  (void) can_assign;
+  TokenType operator_type = parser->previous.type;
+  size_t pending_before = parser->pending.count;
+
+  parse_precedence(parser, PREC_UNARY);
 
-  parse_precedence(PREC_UNARY);
+  if (fold_unary(parser, operator_type, pending_before)) {
+    return;
+  }
 
   switch(operator_type) {
-    case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
+    case TOKEN_MINUS: emit_op(parser, OP_NEGATE); break;
+    case TOKEN_BANG:  emit_op(parser, OP_NOT); break;
     default: return;
   }
 }
 
 
-static void expression() {
-  parse_precedence(PREC_ASSIGNMENT);
+static void expression(Parser *parser) {
+  parse_precedence(parser, PREC_ASSIGNMENT);
 }
 
-static void grouping() {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void print_statement(Parser *parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emit_op(parser, OP_PRINT);
 }
 
-static void end_compiler() {
-  emit_return();
+static void expression_statement(Parser *parser) {
+  size_t pending_before = parser->pending.count;
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
 
-  if (!parser.had_error) {
-    disassemble_chunk(current_chunk(), "code");
+  // a constant that would only be pushed and popped again is dropped
+  if (operand_is_constant(parser, pending_before)) {
+    parser->pending.count--;
+    return;
   }
+  emit_op(parser, OP_POP);
+}
+
+static void var_declaration(Parser *parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect variable name.");
+  uint32_t slot = identifier_slot(parser, &parser->previous);
+
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+  } else {
+    emit_constant(parser, NIL_VAL(0));
+  }
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  emit_global(parser, OP_DEFINE_GLOBAL, slot);
+}
+
+/**
+ * Skips tokens after an error until something that looks like the start
+ * of the next statement, so one mistake reports one error.
+ */
+static void synchronize(Parser *parser) {
+  parser->panic_mode = false;
+
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) {
+      return;
+    }
+    switch (parser->current.type) {
+      case TOKEN_CLASS:
+      case TOKEN_FUN:
+      case TOKEN_VAR:
+      case TOKEN_FOR:
+      case TOKEN_IF:
+      case TOKEN_WHILE:
+      case TOKEN_PRINT:
+      case TOKEN_RETURN:
+        return;
+      default:
+        break;
+    }
+    advance(parser);
+  }
+}
+
+static void statement(Parser *parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    print_statement(parser);
+  } else {
+    expression_statement(parser);
+  }
+}
+
+static void declaration(Parser *parser) {
+  if (match(parser, TOKEN_VAR)) {
+    var_declaration(parser);
+  } else {
+    statement(parser);
+  }
+
+  if (parser->panic_mode) {
+    synchronize(parser);
+  }
+}
+
+static void grouping(Parser *parser, bool can_assign) {
+  (void) can_assign;
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
+
+static void end_compiler(Parser *parser) {
+  emit_return(parser);
 }
 
 
 /**
  * Compile source and fill chunk with bytecode
  */
-bool compile(const char *source, Chunk *chunk) {
-  init_scanner(source);
-  compiling_chunk = chunk;
+bool compile(VM *vm, const char *source, Chunk *chunk) {
+  Parser parser;
+  parser.vm = vm;
+  init_scanner(&parser.scanner, source);
+  parser.chunk = chunk;
+  IrFunction ir;
+  parser.ir = NULL;
+  if (vm->opt_level >= 1 || vm->registers) {
+    init_ir(&ir, vm);
+    parser.ir = &ir;
+  }
 
   parser.had_error = false;
   parser.panic_mode = false;
+  parser.pending.count = 0;
+  // constants are not reachable from any root until the chunk runs
+  gc_defer(vm);
+
+  // scripts compile to roughly a byte of code per character of source,
+  // reserving that much up front saves growing the code step by step
+  reserve_chunk(chunk, strlen(source) + 1);
 
   // read first token
-  advance();
-  expression();
-  consume(TOKEN_EOF, "Expect end of expression");
-  end_compiler();
+  advance(&parser);
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
+  }
+  end_compiler(&parser);
+
+  if (parser.ir != NULL) {
+    if (!parser.had_error) {
+      if (vm->opt_level >= 1) {
+        optimize_ir(&ir);
+      } else {
+        keep_ir(&ir);
+      }
+      if (!vm->registers) {
+        if (!lower_ir(&ir, chunk)) {
+          error(&parser, constant_error(chunk));
+        }
+      } else {
+        const char *message;
+        if (!lower_ir_registers(&ir, chunk, &message)) {
+          error(&parser, message);
+        }
+      }
+    }
+    free_ir(&ir);
+  }
 
+  gc_resume(vm);
   return !parser.had_error;
 }
@@ -2,47 +2,283 @@
 
 #include "clox/debug.h"
 
-static size_t simple_instruction(const char *name, size_t offset) {
-  fprintf(stdout, "%s\n", name);
+static const char *opcode_names[] = {
+  [OP_CONSTANT]      = "OP_CONSTANT",
+  [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+  [OP_ADD]           = "OP_ADD",
+  [OP_SUBTRACT]      = "OP_SUBTRACT",
+  [OP_MULTIPLY]      = "OP_MULTIPLY",
+  [OP_DIVIDE]        = "OP_DIVIDE",
+  [OP_RETURN]        = "OP_RETURN",
+  [OP_NEGATE]        = "OP_NEGATE",
+  [OP_EQUAL]         = "OP_EQUAL",
+  [OP_NOT]           = "OP_NOT",
+  [OP_PRINT]         = "OP_PRINT",
+  [OP_POP]           = "OP_POP",
+  [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+  [OP_GET_GLOBAL]    = "OP_GET_GLOBAL",
+  [OP_SET_GLOBAL]    = "OP_SET_GLOBAL",
+  [OP_ADD_NUM]       = "OP_ADD_NUM",
+  [OP_ADD_STR]       = "OP_ADD_STR",
+  [OP_EQUAL_NUM]     = "OP_EQUAL_NUM",
+#define SUPERINSTRUCTION(name, first, second) [name] = #name,
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+};
+
+/**
+ * Name of an opcode for reports, NULL for bytes that are not an opcode.
+ */
+const char *opcode_name(uint8_t opcode) {
+  if (opcode >= sizeof(opcode_names) / sizeof(opcode_names[0])) {
+    return NULL;
+  }
+
+  return opcode_names[opcode];
+}
+
+static size_t simple_instruction(FILE *out, const char *name, size_t offset) {
+  fprintf(out, "%s\n", name);
   return offset + 1;
 }
 
-static size_t constant_instruction(const char *name, Chunk *chunk, size_t offset) {
+static size_t constant_instruction(FILE *out, const char *name, Chunk *chunk, size_t offset) {
   uint8_t constant = chunk->code[offset + 1];
-  fprintf(stdout, "%-16s %4d '", name, constant);
-  print_value(chunk->constants.values[constant]);
-  fprintf(stdout, "'\n");
+  fprintf(out, "%-16s %4d '", name, constant);
+  fprint_value(out, chunk->constants.values[constant]);
+  fprintf(out, "'\n");
 
   return offset + 2;
 }
 
+static size_t constant_long_instruction(FILE *out, const char *name, Chunk *chunk, size_t offset) {
+  uint32_t constant = chunk->code[offset + 1] |
+    (chunk->code[offset + 2] << 8) |
+    (chunk->code[offset + 3] << 16);
+  fprintf(out, "%-16s %4d '", name, constant);
+  fprint_value(out, chunk->constants.values[constant]);
+  fprintf(out, "'\n");
+
+  return offset + 4;
+}
+
+/**
+ * Chunks do not know the names of their globals, only the VM does, so
+ * this prints the slot.
+ */
+static size_t global_instruction(FILE *out, const char *name, Chunk *chunk, size_t offset) {
+  uint16_t slot = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+  fprintf(out, "%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+/**
+ * Prints the operands of the instruction at offset, nothing for one
+ * without any.
+ */
+static void print_operands(FILE *out, Chunk *chunk, OpCode opcode, size_t offset) {
+  const uint8_t *code = chunk->code + offset;
+  uint32_t operand = 0;
+  switch (opcode) {
+    case OP_CONSTANT_LONG:
+      operand = code[2] << 8 | code[3] << 16;
+      // fall through
+    case OP_CONSTANT:
+      operand |= code[1];
+      fprintf(out, " %4d '", operand);
+      fprint_value(out, chunk->constants.values[operand]);
+      fprintf(out, "'");
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      fprintf(out, " %4d", code[1] | (code[2] << 8));
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * A superinstruction with the operands of both its parts, the opcode of
+ * the second part in between is not shown.
+ */
+static size_t superinstruction(FILE *out, Chunk *chunk, OpCode opcode, size_t offset) {
+  OpCode first;
+  OpCode second;
+  superinstruction_parts(opcode, &first, &second);
+  fprintf(out, "%-16s", opcode_name(opcode));
+  print_operands(out, chunk, first, offset);
+  print_operands(out, chunk, second, offset + instruction_length(first));
+  fprintf(out, "\n");
+  return offset + instruction_length(opcode);
+}
+
 void disassemble_chunk(Chunk *chunk, const char *name) {
-  fprintf(stdout, "== %s ==\n", name);
+  fdisassemble_chunk(stdout, chunk, name);
+}
+
+void fdisassemble_chunk(FILE *out, Chunk *chunk, const char *name) {
+  fprintf(out, "== %s ==\n", name);
   for (size_t offset = 0; offset < chunk->count;) {
-    offset = disassemble_instruction(chunk, offset);
+    offset = chunk->registers ? fdisassemble_register_instruction(out, chunk, offset) :
+      fdisassemble_instruction(out, chunk, offset);
   }
 }
 
 size_t disassemble_instruction(Chunk *chunk, size_t offset) {
-  fprintf(stdout, "%04ld ", offset);
-  uint8_t instr = chunk->code[offset];
+  return fdisassemble_instruction(stdout, chunk, offset);
+}
 
-  if ((offset > 0) && (chunk->lines[offset] == chunk->lines[offset - 1])) {
-    fprintf(stdout, "   | ");
+/**
+ * The offset and the line of an instruction, or a bar if the one before
+ * is on the same line.
+ */
+static void print_location(FILE *out, Chunk *chunk, size_t offset) {
+  fprintf(out, "%04ld ", offset);
+  size_t line = get_line(chunk, offset);
+  if ((offset > 0) && (line == get_line(chunk, offset - 1))) {
+    fprintf(out, "   | ");
   } else {
-    fprintf(stdout, "%4ld ", chunk->lines[offset]);
+    fprintf(out, "%4ld ", line);
   }
+}
+
+size_t fdisassemble_instruction(FILE *out, Chunk *chunk, size_t offset) {
+  print_location(out, chunk, offset);
+  uint8_t instr = chunk->code[offset];
 
   switch(instr) {
-    case OP_CONSTANT:   return constant_instruction("OP_CONSTANT", chunk, offset);
-    case OP_NEGATE:     return simple_instruction("OP_NEGATE", offset);
-    case OP_ADD:        return simple_instruction("OP_ADD", offset);
-    case OP_DIVIDE:     return simple_instruction("OP_DIVIDE", offset);
-    case OP_MULTIPLY:   return simple_instruction("OP_MULTIPLY", offset);
-    case OP_SUBTRACT:   return simple_instruction("OP_SUBTRACT", offset);
-    case OP_RETURN:     return simple_instruction("OP_RETURN", offset);
+    case OP_CONSTANT:   return constant_instruction(out, "OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+      return constant_long_instruction(out, "OP_CONSTANT_LONG", chunk, offset);
+    case OP_NEGATE:     return simple_instruction(out, "OP_NEGATE", offset);
+    case OP_ADD:        return simple_instruction(out, "OP_ADD", offset);
+    case OP_DIVIDE:     return simple_instruction(out, "OP_DIVIDE", offset);
+    case OP_MULTIPLY:   return simple_instruction(out, "OP_MULTIPLY", offset);
+    case OP_SUBTRACT:   return simple_instruction(out, "OP_SUBTRACT", offset);
+    case OP_RETURN:     return simple_instruction(out, "OP_RETURN", offset);
+    case OP_EQUAL:      return simple_instruction(out, "OP_EQUAL", offset);
+    case OP_NOT:        return simple_instruction(out, "OP_NOT", offset);
+    case OP_PRINT:      return simple_instruction(out, "OP_PRINT", offset);
+    case OP_POP:        return simple_instruction(out, "OP_POP", offset);
+    case OP_DEFINE_GLOBAL:
+      return global_instruction(out, "OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL: return global_instruction(out, "OP_GET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL: return global_instruction(out, "OP_SET_GLOBAL", chunk, offset);
+    case OP_ADD_NUM:    return simple_instruction(out, "OP_ADD_NUM", offset);
+    case OP_ADD_STR:    return simple_instruction(out, "OP_ADD_STR", offset);
+    case OP_EQUAL_NUM:  return simple_instruction(out, "OP_EQUAL_NUM", offset);
+#define SUPERINSTRUCTION(name, first, second) \
+    case name:          return superinstruction(out, chunk, name, offset);
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
      default:
-      fprintf(stderr, "Unknown opcode %d", instr);
+      fprintf(out, "Unknown opcode %d\n", instr);
       return offset + 1;
   }
 }
+
+// REGISTER CODE
+
+static const char *register_opcode_names[] = {
+  [REG_CONSTANT]      = "REG_CONSTANT",
+  [REG_MOVE]          = "REG_MOVE",
+  [REG_ADD]           = "REG_ADD",
+  [REG_SUBTRACT]      = "REG_SUBTRACT",
+  [REG_MULTIPLY]      = "REG_MULTIPLY",
+  [REG_DIVIDE]        = "REG_DIVIDE",
+  [REG_EQUAL]         = "REG_EQUAL",
+  [REG_NEGATE]        = "REG_NEGATE",
+  [REG_NOT]           = "REG_NOT",
+  [REG_PRINT]         = "REG_PRINT",
+  [REG_CHECK_GLOBAL]  = "REG_CHECK_GLOBAL",
+  [REG_DEFINE_GLOBAL] = "REG_DEFINE_GLOBAL",
+  [REG_SET_GLOBAL]    = "REG_SET_GLOBAL",
+  [REG_RETURN]        = "REG_RETURN",
+};
+
+/**
+ * A frame slot as kN with the constant it holds, as gN for the global
+ * with index N or as register rN.
+ */
+static void print_slot(FILE *out, Chunk *chunk, uint32_t slot) {
+  uint32_t registers = chunk->frame_constants + chunk->frame_global_count;
+  if (slot < chunk->frame_constants) {
+    fprintf(out, " k%u '", slot);
+    fprint_value(out, chunk->constants.values[slot]);
+    fprintf(out, "'");
+  } else if (slot < registers) {
+    fprintf(out, " g%u", chunk->frame_globals[slot - chunk->frame_constants]);
+  } else {
+    fprintf(out, " r%u", slot - registers);
+  }
+}
+
+size_t fdisassemble_register_instruction(FILE *out, Chunk *chunk, size_t offset) {
+  print_location(out, chunk, offset);
+  RegOpCode opcode = chunk->code[offset];
+  if (opcode > REG_RETURN) {
+    fprintf(out, "Unknown opcode %d\n", opcode);
+    return offset + 1;
+  }
+
+  const uint8_t *code = chunk->code + offset + 1;
+  fprintf(out, "%-17s", register_opcode_names[opcode]);
+  switch (opcode) {
+    case REG_CONSTANT: {
+      uint32_t constant = code[2] | (code[3] << 8) | (code[4] << 16);
+      print_slot(out, chunk, code[0] | (code[1] << 8));
+      fprintf(out, " %d '", constant);
+      fprint_value(out, chunk->constants.values[constant]);
+      fprintf(out, "'");
+      break;
+    }
+    case REG_CHECK_GLOBAL:
+      fprintf(out, " g%d", code[0] | (code[1] << 8));
+      break;
+    case REG_DEFINE_GLOBAL:
+    case REG_SET_GLOBAL:
+      // A is the slot of global G
+      fprintf(out, " g%d", code[2] | (code[3] << 8));
+      print_slot(out, chunk, code[4] | (code[5] << 8));
+      break;
+    default:
+      for (size_t i = 0; i < (register_instruction_length(opcode) - 1) / 2; i++) {
+        print_slot(out, chunk, code[2 * i] | (code[2 * i + 1] << 8));
+      }
+      break;
+  }
+  fprintf(out, "\n");
+  return offset + register_instruction_length(opcode);
+}
+
+/**
+ * One line per instruction that was ever quickened, with the form it has
+ * now and how often its specialization held.
+ */
+void report_quickening(FILE *out, const Chunk *chunk) {
+  if (chunk->sites == NULL) {
+    return;
+  }
+  fprintf(out, "== quickening ==\n");
+  fprintf(out, "%-6s %5s %-16s %12s %8s %7s\n", "offset", "line", "opcode", "hits", "misses", "rate");
+  for (size_t offset = 0; offset < chunk->count; offset += instruction_length(chunk->code[offset])) {
+    const QuickSite *site = &chunk->sites[offset];
+    OpCode opcode = chunk->code[offset];
+    OpCode first;
+    OpCode second;
+    if ((opcode == generic_opcode(opcode) && site->misses == 0) ||
+        superinstruction_parts(opcode, &first, &second)) {
+      continue;
+    }
+    fprintf(out, "%04zu   %5zu %-16s %12u %8u", offset, get_line(chunk, offset),
+        opcode_name(opcode), site->hits, site->misses);
+    double total = (double) site->hits + site->misses;
+    if (total > 0) {
+      fprintf(out, " %6.1f%%\n", 100.0 * site->hits / total);
+    } else {
+      fprintf(out, " %7s\n", "-");
+    }
+  }
+}
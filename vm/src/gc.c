@@ -0,0 +1,312 @@
+#include <time.h>
+
+#include "clox/gc.h"
+#include "clox/memory.h"
+#include "clox/object.h"
+#include "clox/table.h"
+#include "clox/vm.h"
+
+static uint64_t gc_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void init_collector(Collector *gc) {
+  gc->phase = GC_PAUSE;
+  gc->white = GC_WHITE_0;
+  gc->bytes_live = 0;
+  gc->min_heap = GC_MIN_HEAP;
+  gc->next_cycle = GC_MIN_HEAP;
+  gc->debt = 0;
+  gc->step_budget = GC_STEP_BUDGET;
+  gc->step_bytes = GC_STEP_BYTES;
+  gc->deferred = 0;
+  gc->gray = NULL;
+  gc->gray_count = 0;
+  gc->gray_capacity = 0;
+  gc->next_global = 0;
+  gc->chunk = NULL;
+  gc->next_constant = 0;
+  gc->sweep = NULL;
+  gc->stats = (GcStats) {0};
+}
+
+void free_collector(Collector *gc) {
+  reallocate((void **) &gc->gray, gc->gray_capacity * sizeof(Obj *), 0, MEM_OTHER);
+  gc->gray_count = 0;
+  gc->gray_capacity = 0;
+}
+
+static GcColor other_white(GcColor white) {
+  return white == GC_WHITE_0 ? GC_WHITE_1 : GC_WHITE_0;
+}
+
+// MARKING
+
+/**
+ * Marks the references of a gray object and turns it black.
+ */
+static void blacken_object(Obj *object) {
+  switch (object->type) {
+    case OBJ_STRING:
+      break;
+  }
+  object->color = GC_BLACK;
+}
+
+static void mark_object(VM *vm, Obj *object) {
+  Collector *gc = &vm->gc;
+  if (object == NULL || object->color != gc->white) {
+    return;
+  }
+
+  object->color = GC_GRAY;
+  if (gc->gray_count == gc->gray_capacity) {
+    size_t capacity = grow_capacity(gc->gray_capacity);
+    if (!reallocate((void **) &gc->gray, gc->gray_capacity * sizeof(Obj *),
+          capacity * sizeof(Obj *), MEM_OTHER)) {
+      // without room on the gray stack the object is scanned right away
+      blacken_object(object);
+      return;
+    }
+    gc->gray_capacity = capacity;
+  }
+  gc->gray[gc->gray_count++] = object;
+}
+
+void gc_mark_value(VM *vm, Value value) {
+  if (IS_OBJ(value)) {
+    mark_object(vm, AS_OBJ(value));
+  }
+}
+
+/**
+ * Called for an object that was found through the string table instead
+ * of through a root. The table does not keep strings alive, so one that
+ * was not marked yet, or is about to be swept, has to be saved here.
+ */
+void gc_keep(VM *vm, Obj *object) {
+  Collector *gc = &vm->gc;
+  if (gc->phase == GC_MARK) {
+    mark_object(vm, object);
+  } else if (gc->phase == GC_SWEEP && object->color == other_white(gc->white)) {
+    object->color = gc->white;
+  }
+}
+
+/**
+ * Scans the running chunk's constants from the start whenever it changes.
+ * Constants of a chunk that stops running while marking are simply not
+ * scanned any further, whatever the program took from it is on the stack
+ * or in a global by now.
+ */
+void gc_use_chunk(VM *vm, const Chunk *chunk) {
+  vm->gc.chunk = chunk;
+  vm->gc.next_constant = 0;
+}
+
+static void start_cycle(VM *vm) {
+  Collector *gc = &vm->gc;
+  gc->phase = GC_MARK;
+  gc->next_global = 0;
+  gc->next_constant = 0;
+  gc->debt = 0;
+  gc->stats.cycles++;
+}
+
+/**
+ * The one part of a cycle that is not sliced. It is bounded by the size
+ * of the stack and the trace ring, not by the size of the heap.
+ */
+static size_t finish_marking(VM *vm) {
+  Collector *gc = &vm->gc;
+  size_t work = 0;
+
+  for (Value *slot = vm->stack; slot < vm->stack_top; slot++) {
+    gc_mark_value(vm, *slot);
+    work++;
+  }
+#ifdef DEBUG_TRACE_EXECUTION
+  // a runtime error prints the values recorded in the ring
+  for (size_t i = 0; i < vm->tracer.count; i++) {
+    const TraceEntry *entry = &vm->tracer.entries[i];
+    size_t kept = entry->stack_depth < TRACE_STACK_DEPTH ? entry->stack_depth : TRACE_STACK_DEPTH;
+    for (size_t j = 0; j < kept; j++) {
+      gc_mark_value(vm, entry->stack[j]);
+    }
+    work++;
+  }
+#endif // DEBUG_TRACE_EXECUTION
+  while (gc->gray_count > 0) {
+    blacken_object(gc->gray[--gc->gray_count]);
+    work++;
+  }
+
+  gc->white = other_white(gc->white);
+  gc->phase = GC_SWEEP;
+  gc->sweep = &vm->objects;
+  // switching phases counts as a unit of its own
+  return work + 1;
+}
+
+/**
+ * One unit of marking work, returns false once there is nothing left but
+ * finish_marking().
+ */
+static bool mark_next(VM *vm) {
+  Collector *gc = &vm->gc;
+  if (gc->gray_count > 0) {
+    blacken_object(gc->gray[--gc->gray_count]);
+    return true;
+  }
+  if (gc->next_global < vm->global_count) {
+    Global *global = &vm->globals[gc->next_global++];
+    mark_object(vm, (Obj *) global->name);
+    gc_mark_value(vm, global->value);
+    return true;
+  }
+  if (gc->chunk != NULL && gc->next_constant < gc->chunk->constants.count) {
+    gc_mark_value(vm, gc->chunk->constants.values[gc->next_constant++]);
+    return true;
+  }
+  return false;
+}
+
+// SWEEPING
+
+static void sweep_next(VM *vm) {
+  Collector *gc = &vm->gc;
+  Obj *object = *gc->sweep;
+  if (object->color != other_white(gc->white)) {
+    object->color = gc->white;
+    gc->sweep = &object->next;
+    return;
+  }
+
+  *gc->sweep = object->next;
+  // the string table holds strings weakly, drop the entry before the string
+  if (object->type == OBJ_STRING) {
+    table_delete(&vm->strings, (ObjString *) object);
+  }
+  size_t size = free_object(object);
+  gc->bytes_live -= size;
+  gc->stats.objects_freed++;
+  gc->stats.bytes_freed += size;
+}
+
+static void finish_cycle(VM *vm) {
+  Collector *gc = &vm->gc;
+  gc->phase = GC_PAUSE;
+  gc->sweep = NULL;
+  gc->next_cycle = gc->bytes_live * GC_HEAP_GROW;
+  if (gc->next_cycle < gc->min_heap) {
+    gc->next_cycle = gc->min_heap;
+  }
+  // the sweep emptied its pages one object at a time, hand them back at once
+  slab_release_empty();
+}
+
+/**
+ * Does about budget units of work, the end of marking may add the stack
+ * on top. Returns the work done.
+ */
+size_t gc_step(VM *vm, size_t budget) {
+  Collector *gc = &vm->gc;
+  uint64_t start = gc_clock();
+  size_t work = 0;
+
+  while (work < budget && gc->phase != GC_PAUSE) {
+    if (gc->phase == GC_MARK) {
+      if (mark_next(vm)) {
+        work++;
+      } else {
+        work += finish_marking(vm);
+      }
+    } else if (*gc->sweep != NULL) {
+      sweep_next(vm);
+      work++;
+    } else {
+      finish_cycle(vm);
+    }
+  }
+
+  uint64_t elapsed = gc_clock() - start;
+  gc->stats.steps++;
+  gc->stats.total_ns += elapsed;
+  if (elapsed > gc->stats.max_step_ns) {
+    gc->stats.max_step_ns = elapsed;
+  }
+  if (work > gc->stats.max_step_work) {
+    gc->stats.max_step_work = work;
+  }
+  return work;
+}
+
+// PACING
+
+/**
+ * Called before an object of size bytes is allocated, which may start a
+ * cycle or pay for a step. Doing the work first means the new object
+ * cannot be swept before its caller had a chance to store it.
+ */
+void gc_before_allocation(VM *vm, size_t size) {
+  Collector *gc = &vm->gc;
+  if (gc->phase == GC_PAUSE) {
+    if (gc->deferred > 0 || gc->bytes_live + size < gc->next_cycle) {
+      return;
+    }
+    start_cycle(vm);
+  }
+
+  gc->debt += size;
+  if (gc->debt >= gc->step_bytes) {
+    gc->debt = 0;
+    gc_step(vm, gc->step_budget);
+  }
+}
+
+/**
+ * Colors a new object. While marking it is black, it is alive by
+ * definition, otherwise it gets the current white.
+ */
+void gc_track(VM *vm, Obj *object, size_t size) {
+  Collector *gc = &vm->gc;
+  object->color = gc->phase == GC_MARK ? GC_BLACK : gc->white;
+  gc->bytes_live += size;
+}
+
+/**
+ * For objects freed by their owner right after allocating them.
+ */
+void gc_forget(VM *vm, size_t size) {
+  vm->gc.bytes_live -= size;
+}
+
+void gc_defer(VM *vm) {
+  vm->gc.deferred++;
+}
+
+void gc_resume(VM *vm) {
+  vm->gc.deferred--;
+}
+
+/**
+ * Finishes the cycle in progress and runs a complete one.
+ */
+void collect_garbage(VM *vm) {
+  Collector *gc = &vm->gc;
+  if (gc->phase != GC_PAUSE) {
+    gc_step(vm, SIZE_MAX);
+  }
+  start_cycle(vm);
+  gc_step(vm, SIZE_MAX);
+}
+
+void report_gc_stats(const GcStats *stats, FILE *out) {
+  fprintf(out, "== gc ==\n");
+  fprintf(out, "cycles: %zu, steps: %zu\n", stats->cycles, stats->steps);
+  fprintf(out, "freed: %zu objects, %zu bytes\n", stats->objects_freed, stats->bytes_freed);
+  fprintf(out, "longest step: %zu units, %.3f us\n", stats->max_step_work, stats->max_step_ns / 1e3);
+  fprintf(out, "total: %.3f ms\n", stats->total_ns / 1e6);
+}
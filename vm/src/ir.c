@@ -0,0 +1,1083 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "clox/ir.h"
+#include "clox/memory.h"
+#include "clox/object.h"
+
+#define NO_NODE (-1)
+// value number 0 means unknown
+#define NO_NUMBER 0
+#define NO_SLOT UINT32_MAX
+
+void init_ir(IrFunction *ir, VM *vm) {
+  ir->vm = vm;
+  ir->block_count = 0;
+  ir->blocks = NULL;
+  ir->stack_count = 0;
+  ir->stack_capacity = 0;
+  ir->stack = NULL;
+  // everything goes to the entry block, there are no branches yet
+  if (reallocate((void **) &ir->blocks, 0, sizeof(IrBlock), MEM_OTHER)) {
+    ir->block_count = 1;
+    ir->blocks[0] = (IrBlock) {0, 0, NULL};
+  }
+}
+
+void free_ir(IrFunction *ir) {
+  for (size_t i = 0; i < ir->block_count; i++) {
+    IrBlock *block = &ir->blocks[i];
+    reallocate((void **) &block->nodes, block->capacity * sizeof(IrNode), 0, MEM_OTHER);
+  }
+  reallocate((void **) &ir->blocks, ir->block_count * sizeof(IrBlock), 0, MEM_OTHER);
+  reallocate((void **) &ir->stack, ir->stack_capacity * sizeof(int32_t), 0, MEM_OTHER);
+  ir->block_count = 0;
+  ir->stack_count = 0;
+  ir->stack_capacity = 0;
+}
+
+static bool is_falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/**
+ * Evaluates an instruction on constant operands, b is ignored by unary
+ * ones. Only combinations that cannot fail at runtime are folded, the
+ * others keep their error for the VM to report.
+ */
+bool fold_instruction(VM *vm, OpCode opcode, Value a, Value b, Value *result) {
+  switch (opcode) {
+    case OP_EQUAL: *result = BOOL_VAL(values_equal(a, b)); return true;
+    case OP_NOT:   *result = BOOL_VAL(is_falsey(a)); return true;
+    case OP_NEGATE:
+      if (!IS_NUMBER(a)) return false;
+      *result = NUMBER_VAL(-AS_NUMBER(a));
+      return true;
+    default: break;
+  }
+
+  if (opcode == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+    ObjString *string = concatenate_strings(vm, AS_STRING(a), AS_STRING(b));
+    *result = OBJ_VAL(string);
+    return string != NULL;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+    return false;
+  }
+  switch (opcode) {
+    case OP_ADD:      *result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); return true;
+    case OP_SUBTRACT: *result = NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)); return true;
+    case OP_MULTIPLY: *result = NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b)); return true;
+    case OP_DIVIDE:   *result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b)); return true;
+    default:          return false;
+  }
+}
+
+// BUILDING
+
+static IrBlock *current_block(IrFunction *ir) {
+  return &ir->blocks[ir->block_count - 1];
+}
+
+static bool push_node(IrFunction *ir, int32_t node) {
+  if (ir->stack_count == ir->stack_capacity) {
+    size_t capacity = grow_capacity(ir->stack_capacity);
+    if (!reallocate((void **) &ir->stack, ir->stack_capacity * sizeof(int32_t),
+          capacity * sizeof(int32_t), MEM_OTHER)) {
+      return false;
+    }
+    ir->stack_capacity = capacity;
+  }
+  ir->stack[ir->stack_count++] = node;
+  return true;
+}
+
+/**
+ * Appends a node that takes its operands from the top of the stack.
+ * Returns its index, or NO_NODE if there is no memory or the stack has
+ * fewer operands than the node needs, which only happens in code with
+ * syntax errors that is never lowered.
+ */
+static int32_t add_node(IrFunction *ir, OpCode opcode, int arity, size_t line) {
+  if (ir->block_count == 0) {
+    return NO_NODE;
+  }
+  IrBlock *block = current_block(ir);
+  if (block->count == block->capacity) {
+    size_t capacity = grow_capacity(block->capacity);
+    if (block->count >= INT32_MAX ||
+        !reallocate((void **) &block->nodes, block->capacity * sizeof(IrNode),
+          capacity * sizeof(IrNode), MEM_OTHER)) {
+      return NO_NODE;
+    }
+    block->capacity = capacity;
+  }
+
+  int32_t index = (int32_t) block->count++;
+  IrNode *node = &block->nodes[index];
+  *node = (IrNode) {
+    .opcode = opcode, .value = NIL_VAL(0), .slot = 0, .args = {NO_NODE, NO_NODE},
+    .user = NO_NODE, .line = (uint32_t) line, .number = NO_NUMBER,
+    .can_fail = false, .dead_store = false, .live = false,
+  };
+  if (ir->stack_count < (size_t) arity) {
+    ir->stack_count = 0;
+    return NO_NODE;
+  }
+  for (int i = 0; i < arity; i++) {
+    int32_t arg = ir->stack[ir->stack_count - arity + i];
+    node->args[i] = arg;
+    block->nodes[arg].user = index;
+  }
+  ir->stack_count -= arity;
+  return index;
+}
+
+bool ir_emit_constant(IrFunction *ir, Value value, size_t line) {
+  int32_t node = add_node(ir, OP_CONSTANT, 0, line);
+  if (node == NO_NODE) {
+    return false;
+  }
+  current_block(ir)->nodes[node].value = value;
+  return push_node(ir, node);
+}
+
+/**
+ * Adds the instruction the parser would have written to the chunk. slot
+ * is the operand of the global instructions and ignored by the others.
+ */
+bool ir_emit(IrFunction *ir, OpCode opcode, uint32_t slot, size_t line) {
+  int arity = 0;
+  bool value = true;
+  switch (opcode) {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+      arity = 2;
+      break;
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_SET_GLOBAL:
+      arity = 1;
+      break;
+    case OP_GET_GLOBAL:
+      break;
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_POP:
+      arity = 1;
+      value = false;
+      break;
+    case OP_RETURN:
+      value = false;
+      break;
+    default:
+      return false;
+  }
+
+  int32_t node = add_node(ir, opcode, arity, line);
+  if (node == NO_NODE) {
+    return false;
+  }
+  current_block(ir)->nodes[node].slot = slot;
+  return !value || push_node(ir, node);
+}
+
+// VALUE NUMBERING
+
+/**
+ * What is known about the value with some number, and the expression
+ * that computes it. Constants are keyed by their value, everything else
+ * by the operation and the numbers of its operands.
+ */
+typedef struct {
+  IrType type;
+  bool constant;
+  Value value;
+  // a global that holds the value right now, NO_SLOT for none
+  uint32_t home;
+  OpCode opcode;
+  uint32_t a;
+  uint32_t b;
+} ValueInfo;
+
+typedef struct {
+  IrFunction *ir;
+  IrBlock *block;
+  size_t info_count;
+  ValueInfo *info;
+  // open addressing over numbers, NO_NUMBER marks an empty slot. Values
+  // that come from globals are not in here, they have no expression.
+  size_t expression_capacity;
+  uint32_t *expressions;
+  // per global slot, the number of its value or NO_NUMBER, and whether
+  // it is known to be defined here
+  size_t global_count;
+  uint32_t *contents;
+  bool *defined;
+  // per node, see is_removable()
+  bool *removable;
+} Numbering;
+
+static IrType type_of(Value value) {
+  if (IS_NUMBER(value)) return IR_NUMBER;
+  if (IS_BOOL(value)) return IR_BOOL;
+  if (IS_NIL(value)) return IR_NIL;
+  if (IS_STRING(value)) return IR_STRING;
+  return IR_ANY;
+}
+
+static size_t hash_expression(const ValueInfo *key) {
+  uint64_t x = key->opcode == OP_CONSTANT ? hash_constant(key->value) :
+    ((uint64_t) key->a << 32 | key->b) ^ ((uint64_t) key->opcode << 56);
+  x ^= x >> 31;
+  x *= 0x9e3779b97f4a7c15ull;
+  x ^= x >> 29;
+  return (size_t) x;
+}
+
+static bool same_expression(const ValueInfo *a, const ValueInfo *b) {
+  if (a->opcode != b->opcode) {
+    return false;
+  }
+  if (a->opcode == OP_CONSTANT) {
+    return same_constant(a->value, b->value);
+  }
+  return a->a == b->a && a->b == b->b;
+}
+
+/**
+ * The slot where key is or should be inserted. There are never more
+ * expressions than nodes and the table has twice as many slots.
+ */
+static uint32_t *find_expression(Numbering *numbering, const ValueInfo *key) {
+  size_t mask = numbering->expression_capacity - 1;
+  for (size_t i = hash_expression(key) & mask;; i = (i + 1) & mask) {
+    uint32_t *slot = &numbering->expressions[i];
+    if (*slot == NO_NUMBER || same_expression(&numbering->info[*slot], key)) {
+      return slot;
+    }
+  }
+}
+
+static uint32_t new_number(Numbering *numbering, const ValueInfo *info) {
+  uint32_t number = (uint32_t) numbering->info_count++;
+  numbering->info[number] = *info;
+  return number;
+}
+
+static uint32_t unknown_number(Numbering *numbering) {
+  ValueInfo info = {IR_ANY, false, NIL_VAL(0), NO_SLOT, OP_GET_GLOBAL, 0, 0};
+  return new_number(numbering, &info);
+}
+
+static uint32_t constant_number(Numbering *numbering, Value value) {
+  ValueInfo key = {type_of(value), true, value, NO_SLOT, OP_CONSTANT, 0, 0};
+  uint32_t *slot = find_expression(numbering, &key);
+  if (*slot == NO_NUMBER) {
+    *slot = new_number(numbering, &key);
+  }
+  return *slot;
+}
+
+static bool operands_removable(const Numbering *numbering, const IrNode *node) {
+  for (int i = 0; i < 2; i++) {
+    if (node->args[i] != NO_NODE && !numbering->removable[node->args[i]]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * A node is removable if dropping it changes nothing but its value: it
+ * has no effect, cannot fail and neither can anything it uses.
+ */
+static bool is_removable(const Numbering *numbering, const IrNode *node) {
+  switch (node->opcode) {
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_RETURN:
+      return false;
+    default:
+      return !node->can_fail && operands_removable(numbering, node);
+  }
+}
+
+/**
+ * Turns the node into a load of something that already has its value,
+ * a constant or a global holding it. The operands are left without a
+ * user, the dead code pass drops them.
+ */
+static bool rematerialize(Numbering *numbering, IrNode *node, uint32_t number) {
+  const ValueInfo *info = &numbering->info[number];
+  if (!info->constant && info->home == NO_SLOT) {
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (node->args[i] != NO_NODE) {
+      numbering->block->nodes[node->args[i]].user = NO_NODE;
+      node->args[i] = NO_NODE;
+    }
+  }
+  if (info->constant) {
+    node->opcode = OP_CONSTANT;
+    node->value = info->value;
+  } else {
+    node->opcode = OP_GET_GLOBAL;
+    node->slot = info->home;
+  }
+  node->number = number;
+  node->can_fail = false;
+  return true;
+}
+
+static void store_global(Numbering *numbering, uint32_t slot, uint32_t number) {
+  uint32_t old = numbering->contents[slot];
+  if (old != NO_NUMBER && numbering->info[old].home == slot) {
+    numbering->info[old].home = NO_SLOT;
+  }
+  numbering->contents[slot] = number;
+  numbering->defined[slot] = true;
+  if (numbering->info[number].home == NO_SLOT) {
+    numbering->info[number].home = slot;
+  }
+}
+
+/**
+ * Once an instruction succeeded its operands had the types it accepts.
+ */
+static void learn_operand_types(Numbering *numbering, OpCode opcode, uint32_t a, uint32_t b) {
+  ValueInfo *x = &numbering->info[a];
+  ValueInfo *y = b != NO_NUMBER ? &numbering->info[b] : NULL;
+  switch (opcode) {
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      x->type = IR_NUMBER;
+      y->type = IR_NUMBER;
+      break;
+    case OP_NEGATE:
+      x->type = IR_NUMBER;
+      break;
+    case OP_ADD:
+      // both numbers or both strings
+      if (x->type == IR_ANY) x->type = y->type;
+      if (y->type == IR_ANY) y->type = x->type;
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Whether an instruction can fail on operands of these types and what
+ * type its result has.
+ */
+static bool operation_can_fail(OpCode opcode, IrType a, IrType b, IrType *result) {
+  switch (opcode) {
+    case OP_EQUAL:
+    case OP_NOT:
+      *result = IR_BOOL;
+      return false;
+    case OP_NEGATE:
+      *result = IR_NUMBER;
+      return a != IR_NUMBER;
+    case OP_ADD:
+      if (a == b && (a == IR_NUMBER || a == IR_STRING)) {
+        *result = a;
+        return false;
+      }
+      *result = a == IR_STRING || b == IR_STRING ? IR_STRING :
+        (a == IR_NUMBER || b == IR_NUMBER ? IR_NUMBER : IR_ANY);
+      return true;
+    default:
+      *result = IR_NUMBER;
+      return a != IR_NUMBER || b != IR_NUMBER;
+  }
+}
+
+static void number_operation(Numbering *numbering, IrNode *node) {
+  bool removable = operands_removable(numbering, node);
+  uint32_t a = numbering->block->nodes[node->args[0]].number;
+  uint32_t b = node->args[1] != NO_NODE ? numbering->block->nodes[node->args[1]].number : NO_NUMBER;
+  const ValueInfo *x = &numbering->info[a];
+  const ValueInfo *y = b != NO_NUMBER ? &numbering->info[b] : NULL;
+
+  Value folded;
+  if (x->constant && (y == NULL || y->constant) &&
+      fold_instruction(numbering->ir->vm, node->opcode, x->value, y != NULL ? y->value : NIL_VAL(0), &folded)) {
+    uint32_t number = constant_number(numbering, folded);
+    if (removable) {
+      rematerialize(numbering, node, number);
+    } else {
+      node->number = number;
+    }
+    return;
+  }
+
+  ValueInfo key = {IR_ANY, false, NIL_VAL(0), NO_SLOT, node->opcode, a, b};
+  if (node->opcode == OP_EQUAL && a > b) {
+    // equality is symmetric
+    key.a = b;
+    key.b = a;
+  }
+  uint32_t *slot = find_expression(numbering, &key);
+  if (*slot != NO_NUMBER) {
+    // the same operation on the same values succeeded before
+    node->number = *slot;
+    node->can_fail = false;
+    if (removable) {
+      rematerialize(numbering, node, *slot);
+    }
+    return;
+  }
+
+  node->can_fail = operation_can_fail(node->opcode, x->type, y != NULL ? y->type : IR_ANY, &key.type);
+  learn_operand_types(numbering, node->opcode, a, b);
+  *slot = new_number(numbering, &key);
+  node->number = *slot;
+}
+
+/**
+ * Gives every value a number, equal numbers for values that are provably
+ * the same. Globals are followed through stores, so a global read after
+ * a store has the stored value. On the way:
+ *  - operations on constants are folded,
+ *  - reads of globals with a known constant value become that constant,
+ *  - an operation that was already computed is replaced by a read of a
+ *    global that still holds its result (common subexpressions),
+ *  - nodes that provably cannot fail are marked so.
+ */
+static bool number_values(IrFunction *ir, IrBlock *block) {
+  Numbering numbering;
+  numbering.ir = ir;
+  numbering.block = block;
+  numbering.info_count = 1;
+  numbering.info = NULL;
+  numbering.expression_capacity = 1;
+  while (numbering.expression_capacity < 2 * block->count + 2) {
+    numbering.expression_capacity *= 2;
+  }
+  numbering.expressions = NULL;
+  numbering.global_count = ir->vm->global_count;
+  numbering.contents = NULL;
+  numbering.defined = NULL;
+  numbering.removable = NULL;
+
+  size_t info_size = (block->count + 1) * sizeof(ValueInfo);
+  size_t expressions_size = numbering.expression_capacity * sizeof(uint32_t);
+  bool ok = reallocate((void **) &numbering.info, 0, info_size, MEM_OTHER) &&
+    reallocate((void **) &numbering.expressions, 0, expressions_size, MEM_OTHER) &&
+    reallocate((void **) &numbering.contents, 0, numbering.global_count * sizeof(uint32_t) + 1, MEM_OTHER) &&
+    reallocate((void **) &numbering.defined, 0, numbering.global_count * sizeof(bool) + 1, MEM_OTHER) &&
+    reallocate((void **) &numbering.removable, 0, block->count * sizeof(bool) + 1, MEM_OTHER);
+
+  if (ok) {
+    memset(numbering.expressions, 0, expressions_size);
+    memset(numbering.contents, 0, numbering.global_count * sizeof(uint32_t));
+    memset(numbering.defined, 0, numbering.global_count * sizeof(bool));
+
+    for (size_t i = 0; i < block->count; i++) {
+      IrNode *node = &block->nodes[i];
+      switch (node->opcode) {
+        case OP_CONSTANT:
+          node->number = constant_number(&numbering, node->value);
+          break;
+        case OP_GET_GLOBAL: {
+          node->can_fail = !numbering.defined[node->slot];
+          uint32_t known = numbering.contents[node->slot];
+          if (known != NO_NUMBER) {
+            node->number = known;
+            if (numbering.info[known].constant) {
+              rematerialize(&numbering, node, known);
+            }
+          } else {
+            node->number = unknown_number(&numbering);
+            store_global(&numbering, node->slot, node->number);
+          }
+          break;
+        }
+        case OP_SET_GLOBAL:
+          node->can_fail = !numbering.defined[node->slot];
+          node->number = block->nodes[node->args[0]].number;
+          store_global(&numbering, node->slot, node->number);
+          break;
+        case OP_DEFINE_GLOBAL:
+          store_global(&numbering, node->slot, block->nodes[node->args[0]].number);
+          break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_EQUAL:
+        case OP_NEGATE:
+        case OP_NOT:
+          number_operation(&numbering, node);
+          break;
+        default:
+          break;
+      }
+      numbering.removable[i] = is_removable(&numbering, node);
+    }
+  }
+
+  reallocate((void **) &numbering.info, numbering.info == NULL ? 0 : info_size, 0, MEM_OTHER);
+  reallocate((void **) &numbering.expressions, numbering.expressions == NULL ? 0 : expressions_size, 0, MEM_OTHER);
+  reallocate((void **) &numbering.contents, numbering.contents == NULL ? 0 : numbering.global_count * sizeof(uint32_t) + 1, 0, MEM_OTHER);
+  reallocate((void **) &numbering.defined, numbering.defined == NULL ? 0 : numbering.global_count * sizeof(bool) + 1, 0, MEM_OTHER);
+  reallocate((void **) &numbering.removable, numbering.removable == NULL ? 0 : block->count * sizeof(bool) + 1, 0, MEM_OTHER);
+  return ok;
+}
+
+// DEAD STORES AND DEAD CODE
+
+/**
+ * Marks stores to a global that is stored again before anything reads it.
+ * A runtime error in between lets the next chunk see the first value, so
+ * an instruction that may fail keeps every store before it. Only the
+ * last store of a chunk is seen by the chunks after it.
+ */
+static bool eliminate_dead_stores(IrFunction *ir, IrBlock *block) {
+  // index + 1 of the last store to each global, valid only if it was
+  // made in the current epoch, which ends at every node that may fail
+  size_t global_count = ir->vm->global_count;
+  uint32_t *last = NULL;
+  uint32_t *epochs = NULL;
+  if (!reallocate((void **) &last, 0, global_count * sizeof(uint32_t) + 1, MEM_OTHER) ||
+      !reallocate((void **) &epochs, 0, global_count * sizeof(uint32_t) + 1, MEM_OTHER)) {
+    reallocate((void **) &last, last == NULL ? 0 : global_count * sizeof(uint32_t) + 1, 0, MEM_OTHER);
+    return false;
+  }
+  memset(last, 0, global_count * sizeof(uint32_t));
+  uint32_t epoch = 0;
+
+  for (size_t i = 0; i < block->count; i++) {
+    IrNode *node = &block->nodes[i];
+    if (node->can_fail) {
+      epoch++;
+    }
+    switch (node->opcode) {
+      case OP_GET_GLOBAL:
+        last[node->slot] = 0;
+        break;
+      case OP_SET_GLOBAL:
+      case OP_DEFINE_GLOBAL: {
+        uint32_t previous = last[node->slot];
+        if (previous != 0 && epochs[node->slot] == epoch) {
+          IrNode *store = &block->nodes[previous - 1];
+          // a definition can only be dropped if this one defines again,
+          // and an assignment that may fail has to stay to report it
+          if ((node->opcode == OP_DEFINE_GLOBAL || store->opcode == OP_SET_GLOBAL) && !store->can_fail) {
+            store->dead_store = true;
+          }
+        }
+        last[node->slot] = (uint32_t) i + 1;
+        epochs[node->slot] = epoch;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  reallocate((void **) &last, global_count * sizeof(uint32_t) + 1, 0, MEM_OTHER);
+  reallocate((void **) &epochs, global_count * sizeof(uint32_t) + 1, 0, MEM_OTHER);
+  return true;
+}
+
+static bool has_effect(const IrNode *node) {
+  switch (node->opcode) {
+    case OP_PRINT:
+    case OP_RETURN:
+      return true;
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+      return !node->dead_store;
+    default:
+      return node->can_fail;
+  }
+}
+
+/**
+ * Marks the nodes that have to run: those with an effect, those that may
+ * fail and everything whose value they use. A popped value is not used.
+ */
+static void eliminate_dead_code(IrBlock *block) {
+  for (size_t i = block->count; i-- > 0;) {
+    IrNode *node = &block->nodes[i];
+    const IrNode *user = node->user != NO_NODE ? &block->nodes[node->user] : NULL;
+    node->live = node->opcode != OP_POP &&
+      (has_effect(node) || (user != NULL && user->live && user->opcode != OP_POP));
+  }
+}
+
+void optimize_ir(IrFunction *ir) {
+  for (size_t i = 0; i < ir->block_count; i++) {
+    IrBlock *block = &ir->blocks[i];
+    // without the facts the first passes find the rest has to assume the
+    // worst, which keeps every node
+    if (number_values(ir, block)) {
+      eliminate_dead_stores(ir, block);
+    }
+    eliminate_dead_code(block);
+  }
+}
+
+// LOWERING
+
+static bool produces_value(OpCode opcode) {
+  switch (opcode) {
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_RETURN:
+      return false;
+    default:
+      return true;
+  }
+}
+
+static bool write_global(Chunk *chunk, OpCode opcode, uint32_t slot, size_t line) {
+  return write_chunk(chunk, opcode, line) &&
+    write_chunk(chunk, (uint8_t) (slot & 0xff), line) &&
+    write_chunk(chunk, (uint8_t) (slot >> 8), line);
+}
+
+/**
+ * Writes the live nodes to chunk in evaluation order. A value whose user
+ * is gone is popped right away, a dead store that still passes its value
+ * on writes nothing. Returns false if the chunk is full.
+ */
+bool lower_ir(IrFunction *ir, Chunk *chunk) {
+  for (size_t b = 0; b < ir->block_count; b++) {
+    IrBlock *block = &ir->blocks[b];
+    for (size_t i = 0; i < block->count; i++) {
+      IrNode *node = &block->nodes[i];
+      if (!node->live) {
+        continue;
+      }
+
+      bool ok = true;
+      switch (node->opcode) {
+        case OP_CONSTANT:
+          ok = write_constant(chunk, node->value, node->line);
+          break;
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+          if (node->dead_store) {
+            // a definition that is dropped still takes its value
+            ok = node->opcode == OP_SET_GLOBAL || write_chunk(chunk, OP_POP, node->line);
+          } else {
+            ok = write_global(chunk, node->opcode, node->slot, node->line);
+          }
+          break;
+        case OP_GET_GLOBAL:
+          ok = write_global(chunk, node->opcode, node->slot, node->line);
+          break;
+        default:
+          ok = write_chunk(chunk, node->opcode, node->line);
+          break;
+      }
+
+      const IrNode *user = node->user != NO_NODE ? &block->nodes[node->user] : NULL;
+      if (ok && produces_value(node->opcode) &&
+          (user == NULL || !user->live || user->opcode == OP_POP)) {
+        ok = write_chunk(chunk, OP_POP, node->line);
+      }
+      if (!ok) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// REGISTER ALLOCATION
+
+/**
+ * Marks every node but the pops live, for code that is lowered without
+ * running optimize_ir() first.
+ */
+void keep_ir(IrFunction *ir) {
+  for (size_t b = 0; b < ir->block_count; b++) {
+    IrBlock *block = &ir->blocks[b];
+    for (size_t i = 0; i < block->count; i++) {
+      block->nodes[i].live = block->nodes[i].opcode != OP_POP;
+    }
+  }
+}
+
+static bool value_is_used(const IrBlock *block, const IrNode *node) {
+  const IrNode *user = node->user != NO_NODE ? &block->nodes[node->user] : NULL;
+  return user != NULL && user->live && user->opcode != OP_POP;
+}
+
+static bool write_operand(Chunk *chunk, uint32_t operand, size_t line) {
+  return write_chunk(chunk, (uint8_t) (operand & 0xff), line) &&
+    write_chunk(chunk, (uint8_t) (operand >> 8), line);
+}
+
+static RegOpCode register_opcode(OpCode opcode) {
+  switch (opcode) {
+    case OP_ADD:      return REG_ADD;
+    case OP_SUBTRACT: return REG_SUBTRACT;
+    case OP_MULTIPLY: return REG_MULTIPLY;
+    case OP_DIVIDE:   return REG_DIVIDE;
+    case OP_EQUAL:    return REG_EQUAL;
+    case OP_NEGATE:   return REG_NEGATE;
+    case OP_NOT:      return REG_NOT;
+    case OP_PRINT:    return REG_PRINT;
+    default:          return REG_RETURN;
+  }
+}
+
+typedef struct {
+  IrFunction *ir;
+  Chunk *chunk;
+  IrBlock *block;
+  // frame slot of each node's value, NO_SLOT while it has none
+  uint32_t *slots;
+  // per node that reads or assigns a global, the next node that stores
+  // to it, NO_NODE for none
+  int32_t *next_store;
+  // per global, its index in Chunk.frame_globals or NO_SLOT, and whether
+  // it is known to be defined at the current node
+  uint32_t *globals;
+  bool *defined;
+  uint32_t constants;
+  // frame slot of the first register
+  uint32_t registers;
+  uint32_t depth;
+  uint32_t max_depth;
+  // the node whose instruction was written last, if it is an operation
+  // with its result in a fresh register, and where its A operand is
+  int32_t last_operation;
+  size_t last_result;
+  const char **error;
+} RegisterLowering;
+
+static bool is_register(const RegisterLowering *lowering, uint32_t slot) {
+  return slot != NO_SLOT && slot >= lowering->registers;
+}
+
+static uint32_t global_frame_slot(const RegisterLowering *lowering, uint32_t global) {
+  return lowering->constants + lowering->globals[global];
+}
+
+static bool new_register(RegisterLowering *lowering, uint32_t *slot) {
+  if (lowering->registers + lowering->depth >= REG_FRAME_MAX) {
+    *lowering->error = "Too many registers in one chunk.";
+    return false;
+  }
+  *slot = lowering->registers + lowering->depth++;
+  if (lowering->depth > lowering->max_depth) {
+    lowering->max_depth = lowering->depth;
+  }
+  return true;
+}
+
+/**
+ * Writes an instruction with up to three 16 bit operands, the length of
+ * the instruction says how many are used.
+ */
+static bool write_register_instruction(RegisterLowering *lowering, RegOpCode opcode,
+    uint32_t a, uint32_t b, uint32_t c, size_t line) {
+  uint32_t operands[] = {a, b, c};
+  size_t count = (register_instruction_length(opcode) - 1) / 2;
+  lowering->last_operation = NO_NODE;
+  bool ok = write_chunk(lowering->chunk, opcode, line);
+  for (size_t i = 0; ok && i < count; i++) {
+    ok = write_operand(lowering->chunk, operands[i], line);
+  }
+  return ok;
+}
+
+/**
+ * Gives every live node that touches a global the next node that stores
+ * to the same global. A value read from a global can stay in the global's
+ * slot until then.
+ */
+static void find_next_stores(RegisterLowering *lowering, int32_t *next_write) {
+  IrBlock *block = lowering->block;
+  for (size_t i = 0; i < lowering->ir->vm->global_count; i++) {
+    next_write[i] = NO_NODE;
+  }
+  for (size_t i = block->count; i-- > 0;) {
+    const IrNode *node = &block->nodes[i];
+    lowering->next_store[i] = NO_NODE;
+    if (!node->live) {
+      continue;
+    }
+    switch (node->opcode) {
+      case OP_GET_GLOBAL:
+        lowering->next_store[i] = next_write[node->slot];
+        break;
+      case OP_SET_GLOBAL:
+      case OP_DEFINE_GLOBAL:
+        lowering->next_store[i] = next_write[node->slot];
+        if (!node->dead_store) {
+          next_write[node->slot] = (int32_t) i;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+/**
+ * Where a value read from a global is kept: in the global's slot unless
+ * the global is stored to before the value is used.
+ */
+static bool lower_get_global(RegisterLowering *lowering, size_t index, uint32_t *result) {
+  IrNode *node = &lowering->block->nodes[index];
+  uint32_t slot = global_frame_slot(lowering, node->slot);
+  if (!lowering->defined[node->slot]) {
+    lowering->defined[node->slot] = true;
+    if (!write_register_instruction(lowering, REG_CHECK_GLOBAL, node->slot, 0, 0, node->line)) {
+      return false;
+    }
+  }
+  if (!value_is_used(lowering->block, node)) {
+    return true;
+  }
+  int32_t store = lowering->next_store[index];
+  if (store == NO_NODE || store >= node->user) {
+    *result = slot;
+    return true;
+  }
+  return new_register(lowering, result) &&
+    write_register_instruction(lowering, REG_MOVE, *result, slot, 0, node->line);
+}
+
+/**
+ * An assignment to a global that is known to be defined and whose value
+ * nobody reads is written by the operation that computes the value.
+ * Otherwise the value is copied to the global and passed on in a register
+ * or as a constant.
+ */
+static bool lower_set_global(RegisterLowering *lowering, size_t index, uint32_t value, uint32_t *result) {
+  IrNode *node = &lowering->block->nodes[index];
+  uint32_t slot = global_frame_slot(lowering, node->slot);
+  bool used = value_is_used(lowering->block, node);
+  if (!used && !node->dead_store && lowering->defined[node->slot] &&
+      lowering->last_operation == node->args[0] && is_register(lowering, value)) {
+    lowering->chunk->code[lowering->last_result] = (uint8_t) (slot & 0xff);
+    lowering->chunk->code[lowering->last_result + 1] = (uint8_t) (slot >> 8);
+    lowering->last_operation = NO_NODE;
+    return true;
+  }
+
+  // a global's slot may change before the user reads it
+  if (used && value >= lowering->constants && !is_register(lowering, value)) {
+    uint32_t copy;
+    if (!new_register(lowering, &copy) ||
+        !write_register_instruction(lowering, REG_MOVE, copy, value, 0, node->line)) {
+      return false;
+    }
+    value = copy;
+  } else if (is_register(lowering, value)) {
+    lowering->depth++;
+  }
+  *result = value;
+
+  if (node->dead_store) {
+    return true;
+  }
+  RegOpCode opcode = lowering->defined[node->slot] ? REG_MOVE : REG_SET_GLOBAL;
+  lowering->defined[node->slot] = true;
+  return opcode == REG_MOVE ?
+    write_register_instruction(lowering, REG_MOVE, slot, value, 0, node->line) :
+    write_register_instruction(lowering, REG_SET_GLOBAL, slot, node->slot, value, node->line);
+}
+
+static bool lower_register_node(RegisterLowering *lowering, size_t index) {
+  IrBlock *block = lowering->block;
+  IrNode *node = &block->nodes[index];
+  // the operands are on top of the register stack, the right one last
+  uint32_t operands[2] = {NO_SLOT, NO_SLOT};
+  for (int a = 1; a >= 0; a--) {
+    if (node->args[a] != NO_NODE) {
+      operands[a] = lowering->slots[node->args[a]];
+      if (is_register(lowering, operands[a])) {
+        lowering->depth--;
+      }
+    }
+  }
+
+  *lowering->error = "Out of memory.";
+  uint32_t result = NO_SLOT;
+  bool ok = true;
+  switch (node->opcode) {
+    case OP_CONSTANT:
+      if (node->slot < lowering->constants) {
+        result = node->slot;
+      } else {
+        ok = new_register(lowering, &result) &&
+          write_chunk(lowering->chunk, REG_CONSTANT, node->line) &&
+          write_operand(lowering->chunk, result, node->line) &&
+          write_chunk(lowering->chunk, (uint8_t) (node->slot & 0xff), node->line) &&
+          write_chunk(lowering->chunk, (uint8_t) ((node->slot >> 8) & 0xff), node->line) &&
+          write_chunk(lowering->chunk, (uint8_t) (node->slot >> 16), node->line);
+        lowering->last_operation = NO_NODE;
+      }
+      break;
+    case OP_GET_GLOBAL:
+      ok = lower_get_global(lowering, index, &result);
+      break;
+    case OP_SET_GLOBAL:
+      ok = lower_set_global(lowering, index, operands[0], &result);
+      break;
+    case OP_DEFINE_GLOBAL:
+      // a definition that is dropped just frees its operand
+      if (!node->dead_store) {
+        lowering->defined[node->slot] = true;
+        ok = write_register_instruction(lowering, REG_DEFINE_GLOBAL,
+            global_frame_slot(lowering, node->slot), node->slot, operands[0], node->line);
+      }
+      break;
+    case OP_PRINT:
+      ok = write_register_instruction(lowering, REG_PRINT, operands[0], 0, 0, node->line);
+      break;
+    case OP_RETURN:
+      ok = write_register_instruction(lowering, REG_RETURN, 0, 0, 0, node->line);
+      break;
+    default: {
+      // the lowest free register, the left operand's if it had one
+      size_t offset = lowering->chunk->count + 1;
+      ok = new_register(lowering, &result) &&
+        write_register_instruction(lowering, register_opcode(node->opcode),
+          result, operands[0], operands[1], node->line);
+      lowering->last_operation = (int32_t) index;
+      lowering->last_result = offset;
+      break;
+    }
+  }
+  lowering->slots[index] = result;
+
+  // nobody reads the value, its register is free again right away
+  if (ok && is_register(lowering, result) && !value_is_used(block, node)) {
+    lowering->depth--;
+  }
+  return ok;
+}
+
+/**
+ * Writes the live nodes to chunk as register code, see RegOpCode.
+ *
+ * Every value has one user and values are used in the order of the
+ * stack code they come from, so the values that are alive at any point
+ * form a stack. Registers are allocated like one: a value goes to the
+ * register above all the values that are alive, and the operands of a
+ * node are the topmost of them. An operation writes to the register of
+ * its left operand, which is free by then.
+ *
+ * Constants and globals take no register, they are read from their frame
+ * slot. A global that may be undefined is checked the first time it is
+ * read, after that it is known to be defined.
+ *
+ * Returns false with a message in *error if the chunk or the frame is full.
+ */
+bool lower_ir_registers(IrFunction *ir, Chunk *chunk, const char **error) {
+  size_t global_count = ir->vm->global_count;
+  RegisterLowering lowering;
+  lowering.ir = ir;
+  lowering.chunk = chunk;
+  lowering.error = error;
+  lowering.globals = NULL;
+  lowering.defined = NULL;
+  int32_t *next_write = NULL;
+  *error = "Out of memory.";
+  bool ok = reallocate((void **) &lowering.globals, 0, global_count * sizeof(uint32_t) + 1, MEM_OTHER) &&
+    reallocate((void **) &lowering.defined, 0, global_count * sizeof(bool) + 1, MEM_OTHER) &&
+    reallocate((void **) &next_write, 0, global_count * sizeof(int32_t) + 1, MEM_OTHER);
+
+  // constants and globals come first in the frame, so they are all added
+  // up front
+  uint32_t frame_globals = 0;
+  if (ok) {
+    for (size_t i = 0; i < global_count; i++) {
+      lowering.globals[i] = NO_SLOT;
+      lowering.defined[i] = false;
+    }
+    for (size_t b = 0; ok && b < ir->block_count; b++) {
+      IrBlock *block = &ir->blocks[b];
+      for (size_t i = 0; ok && i < block->count; i++) {
+        IrNode *node = &block->nodes[i];
+        if (!node->live) {
+          continue;
+        }
+        if (node->opcode == OP_CONSTANT && value_is_used(block, node)) {
+          size_t constant = add_constant(chunk, node->value);
+          *error = constant == NO_CONSTANT ? "Out of memory." : "Too many constants in one chunk.";
+          ok = constant <= CONSTANT_LONG_MAX;
+          node->slot = (uint32_t) constant;
+        } else if ((node->opcode == OP_GET_GLOBAL || node->opcode == OP_SET_GLOBAL ||
+              node->opcode == OP_DEFINE_GLOBAL) && lowering.globals[node->slot] == NO_SLOT) {
+          *error = "Too many globals in one chunk.";
+          ok = frame_globals < REG_GLOBAL_SLOTS;
+          lowering.globals[node->slot] = frame_globals++;
+        }
+      }
+    }
+  }
+  if (ok && frame_globals > 0) {
+    chunk->frame_globals = arena_alloc(&chunk->arena, frame_globals * sizeof(uint16_t), MEM_OTHER);
+    *error = "Out of memory.";
+    ok = chunk->frame_globals != NULL;
+  }
+  if (ok) {
+    for (size_t i = 0; i < global_count; i++) {
+      if (lowering.globals[i] != NO_SLOT) {
+        chunk->frame_globals[lowering.globals[i]] = (uint16_t) i;
+      }
+    }
+  }
+  lowering.constants = chunk->constants.count < REG_CONSTANT_SLOTS ?
+    (uint32_t) chunk->constants.count : REG_CONSTANT_SLOTS;
+  lowering.registers = lowering.constants + frame_globals;
+  lowering.depth = 0;
+  lowering.max_depth = 0;
+  lowering.last_operation = NO_NODE;
+
+  for (size_t b = 0; ok && b < ir->block_count; b++) {
+    IrBlock *block = &ir->blocks[b];
+    lowering.block = block;
+    lowering.slots = NULL;
+    lowering.next_store = NULL;
+    *error = "Out of memory.";
+    ok = reallocate((void **) &lowering.slots, 0, block->count * sizeof(uint32_t) + 1, MEM_OTHER) &&
+      reallocate((void **) &lowering.next_store, 0, block->count * sizeof(int32_t) + 1, MEM_OTHER);
+    if (ok) {
+      find_next_stores(&lowering, next_write);
+    }
+    for (size_t i = 0; ok && i < block->count; i++) {
+      IrNode *node = &block->nodes[i];
+      lowering.slots[i] = NO_SLOT;
+      // a constant nobody reads is not even loaded
+      if (node->live && (node->opcode != OP_CONSTANT || value_is_used(block, node))) {
+        ok = lower_register_node(&lowering, i);
+      }
+    }
+    reallocate((void **) &lowering.slots, lowering.slots == NULL ? 0 : block->count * sizeof(uint32_t) + 1, 0, MEM_OTHER);
+    reallocate((void **) &lowering.next_store, lowering.next_store == NULL ? 0 : block->count * sizeof(int32_t) + 1, 0, MEM_OTHER);
+  }
+
+  reallocate((void **) &lowering.globals, lowering.globals == NULL ? 0 : global_count * sizeof(uint32_t) + 1, 0, MEM_OTHER);
+  reallocate((void **) &lowering.defined, lowering.defined == NULL ? 0 : global_count * sizeof(bool) + 1, 0, MEM_OTHER);
+  reallocate((void **) &next_write, next_write == NULL ? 0 : global_count * sizeof(int32_t) + 1, 0, MEM_OTHER);
+  if (!ok) {
+    return false;
+  }
+  chunk->registers = true;
+  chunk->frame_constants = lowering.constants;
+  chunk->frame_global_count = frame_globals;
+  chunk->register_count = lowering.max_depth;
+  return true;
+}
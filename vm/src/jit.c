@@ -0,0 +1,1003 @@
+#include <string.h>
+#include <sys/mman.h>
+
+#include "clox/jit.h"
+#include "clox/memory.h"
+#include "clox/object.h"
+#include "clox/vm.h"
+
+// builds with tagged values, e.g. some benchmarks, fall back to the stubs
+#if defined(CLOX_JIT) && defined(CLOX_NAN_BOXING) && defined(__x86_64__)
+
+/**
+ * Baseline compiler from bytecode to x86-64. Every opcode has a template
+ * that is stamped out in bytecode order, there is no optimization across
+ * instructions beyond keeping the operand stack out of memory and
+ * remembering which globals hold numbers.
+ *
+ * Chunks have no control flow yet, so the stack depth at every
+ * instruction is known while compiling. Each stack slot is tracked as a
+ * constant or a global that is not loaded yet, a number in an xmm
+ * register or a value in its slot of VM.stack. Arithmetic works on xmm
+ * registers and only touches memory when a value has an unknown type or
+ * is handed to C. Paths that are rarely taken, runtime errors and the
+ * collector's write barrier, are out of line behind the code of the
+ * chunk.
+ *
+ * Registers while native code runs:
+ *   r12          SIGN_BIT
+ *   r13          VM.globals
+ *   r14          the VM
+ *   r15          QNAN
+ *   rbx          VM.stack, which has room for the whole chunk and does
+ *                not move while native code runs
+ *   xmm0..xmm13  the stack slot with the same index, if it is a number
+ *   rax rcx rdx rsi rdi xmm14 xmm15  scratch
+ *
+ * The generated function is int (*)(VM *vm, Value *stack) and returns a
+ * JitStatus.
+ */
+
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+// slots above this are not cached in registers, chunks that need them
+// stay in the interpreter
+#define XMM_SLOTS 14
+// deeper stacks than this are left to the interpreter, the native code
+// reserves what it uses of VM.stack before it starts
+#define JIT_STACK_MAX 256
+#define XMM_SCRATCH_A 14
+#define XMM_SCRATCH_B 15
+
+// condition codes of jcc and setcc
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_NP 0xB
+
+typedef enum {
+  LOC_SLOT,
+  LOC_CONSTANT,
+  LOC_GLOBAL,
+  LOC_XMM,
+} Location;
+
+typedef struct {
+  Location location;
+  // known to hold a number, always true in an xmm register
+  bool number;
+  Value constant;
+  uint32_t global;
+} StackEntry;
+
+typedef enum {
+  // sets VM.ip and leaves with a runtime error
+  STUB_ERROR,
+  // calls gc_mark_value() on rcx and goes back to resume
+  STUB_BARRIER,
+} StubKind;
+
+// a negative status means the status is in eax already
+#define STATUS_IN_EAX -1
+
+/**
+ * Out of line code that jumps at patches lead to. Consecutive checks that
+ * fail the same way share their stub.
+ */
+typedef struct {
+  StubKind kind;
+  size_t patches[2];
+  size_t patch_count;
+  // STUB_ERROR: offset of VM.ip in the chunk and the status
+  uint32_t offset;
+  int status;
+  // STUB_BARRIER: where to continue and the xmm registers in use
+  size_t resume;
+  uint16_t xmm;
+} Stub;
+
+typedef struct {
+  const Chunk *chunk;
+  uint8_t *code;
+  size_t count;
+  size_t capacity;
+  bool failed;
+
+  Stub *stubs;
+  size_t stub_count;
+  size_t stub_capacity;
+  size_t exit;
+
+  StackEntry stack[JIT_STACK_MAX];
+  size_t depth;
+  size_t max_depth;
+  // what is known about each global at the current instruction
+  uint8_t globals[GLOBALS_MAX];
+} Assembler;
+
+// bits of Assembler.globals
+#define KNOWN_DEFINED 1
+#define KNOWN_NUMBER 2
+
+// EMITTING
+
+static void emit8(Assembler *as, uint8_t byte) {
+  if (as->count == as->capacity) {
+    size_t capacity = grow_capacity(as->capacity);
+    if (!reallocate((void **) &as->code, as->capacity, capacity, MEM_OTHER)) {
+      as->failed = true;
+      return;
+    }
+    as->capacity = capacity;
+  }
+  as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    emit8(as, (uint8_t) (value >> (8 * i)));
+  }
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+  for (int i = 0; i < 8; i++) {
+    emit8(as, (uint8_t) (value >> (8 * i)));
+  }
+}
+
+static void patch32(Assembler *as, size_t at, uint32_t value) {
+  if (as->failed) {
+    return;
+  }
+  for (int i = 0; i < 4; i++) {
+    as->code[at + i] = (uint8_t) (value >> (8 * i));
+  }
+}
+
+/**
+ * Points the rel32 at patch to the current position.
+ */
+static void land(Assembler *as, size_t patch) {
+  patch32(as, patch, (uint32_t) (as->count - (patch + 4)));
+}
+
+static void rex(Assembler *as, bool wide, int reg, int rm) {
+  uint8_t byte = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (rm >> 3);
+  if (byte != 0x40) {
+    emit8(as, byte);
+  }
+}
+
+static void modrm(Assembler *as, int mod, int reg, int rm) {
+  emit8(as, (uint8_t) ((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+/**
+ * [base + disp32], base must not be rsp or r12.
+ */
+static void memory(Assembler *as, int reg, int base, int32_t disp) {
+  modrm(as, 2, reg, base);
+  emit32(as, (uint32_t) disp);
+}
+
+static void mov_imm64(Assembler *as, int reg, uint64_t value) {
+  rex(as, true, 0, reg);
+  emit8(as, 0xB8 + (reg & 7));
+  emit64(as, value);
+}
+
+static void mov_imm32(Assembler *as, int reg, uint32_t value) {
+  rex(as, false, 0, reg);
+  emit8(as, 0xB8 + (reg & 7));
+  emit32(as, value);
+}
+
+static void mov_load(Assembler *as, int reg, int base, int32_t disp) {
+  rex(as, true, reg, base);
+  emit8(as, 0x8B);
+  memory(as, reg, base, disp);
+}
+
+static void mov_store(Assembler *as, int base, int32_t disp, int reg) {
+  rex(as, true, reg, base);
+  emit8(as, 0x89);
+  memory(as, reg, base, disp);
+}
+
+static void lea(Assembler *as, int reg, int base, int32_t disp) {
+  rex(as, true, reg, base);
+  emit8(as, 0x8D);
+  memory(as, reg, base, disp);
+}
+
+static void mov_rr(Assembler *as, int dst, int src) {
+  rex(as, true, src, dst);
+  emit8(as, 0x89);
+  modrm(as, 3, src, dst);
+}
+
+// and, or, add and cmp between two 64 bit registers
+#define ALU_ADD 0x01
+#define ALU_OR 0x09
+#define ALU_AND 0x21
+#define ALU_CMP 0x39
+
+static void alu_rr(Assembler *as, uint8_t op, int dst, int src) {
+  rex(as, true, src, dst);
+  emit8(as, op);
+  modrm(as, 3, src, dst);
+}
+
+/**
+ * Same as alu_rr() on the low bytes of eax, ecx, edx or ebx.
+ */
+static void alu_rr8(Assembler *as, uint8_t op, int dst, int src) {
+  emit8(as, op - 1);
+  modrm(as, 3, src, dst);
+}
+
+// the same operations with a sign extended 8 bit immediate
+#define ALU_IMM_ADD 0
+#define ALU_IMM_CMP 7
+
+static void alu_ri8(Assembler *as, int op, int dst, int8_t value) {
+  rex(as, true, 0, dst);
+  emit8(as, 0x83);
+  modrm(as, 3, op, dst);
+  emit8(as, (uint8_t) value);
+}
+
+static void setcc(Assembler *as, int cc, int reg) {
+  emit8(as, 0x0F);
+  emit8(as, 0x90 + cc);
+  modrm(as, 3, 0, reg);
+}
+
+static void movzx_eax_al(Assembler *as) {
+  emit8(as, 0x0F);
+  emit8(as, 0xB6);
+  modrm(as, 3, RAX, RAX);
+}
+
+static void test_eax(Assembler *as) {
+  emit8(as, 0x85);
+  modrm(as, 3, RAX, RAX);
+}
+
+static void cmp_mem32_imm8(Assembler *as, int base, int32_t disp, int8_t value) {
+  rex(as, false, 0, base);
+  emit8(as, 0x83);
+  memory(as, ALU_IMM_CMP, base, disp);
+  emit8(as, (uint8_t) value);
+}
+
+static void cmp_mem8_imm(Assembler *as, int base, int32_t disp, uint8_t value) {
+  rex(as, false, 0, base);
+  emit8(as, 0x80);
+  memory(as, ALU_IMM_CMP, base, disp);
+  emit8(as, value);
+}
+
+static void mov_mem8_imm(Assembler *as, int base, int32_t disp, uint8_t value) {
+  rex(as, false, 0, base);
+  emit8(as, 0xC6);
+  memory(as, 0, base, disp);
+  emit8(as, value);
+}
+
+static void movq_load(Assembler *as, int xmm, int base, int32_t disp) {
+  emit8(as, 0xF3);
+  rex(as, false, xmm, base);
+  emit8(as, 0x0F);
+  emit8(as, 0x7E);
+  memory(as, xmm, base, disp);
+}
+
+static void movq_store(Assembler *as, int base, int32_t disp, int xmm) {
+  emit8(as, 0x66);
+  rex(as, false, xmm, base);
+  emit8(as, 0x0F);
+  emit8(as, 0xD6);
+  memory(as, xmm, base, disp);
+}
+
+static void movq_from_gpr(Assembler *as, int xmm, int reg) {
+  emit8(as, 0x66);
+  rex(as, true, xmm, reg);
+  emit8(as, 0x0F);
+  emit8(as, 0x6E);
+  modrm(as, 3, xmm, reg);
+}
+
+static void movq_to_gpr(Assembler *as, int reg, int xmm) {
+  emit8(as, 0x66);
+  rex(as, true, xmm, reg);
+  emit8(as, 0x0F);
+  emit8(as, 0x7E);
+  modrm(as, 3, xmm, reg);
+}
+
+// scalar double arithmetic, prefix and opcode
+#define SSE_ADDSD 0xF258
+#define SSE_SUBSD 0xF25C
+#define SSE_MULSD 0xF259
+#define SSE_DIVSD 0xF25E
+#define SSE_XORPD 0x6657
+#define SSE_UCOMISD 0x662E
+
+static void sse_rr(Assembler *as, uint16_t op, int dst, int src) {
+  emit8(as, (uint8_t) (op >> 8));
+  rex(as, false, dst, src);
+  emit8(as, 0x0F);
+  emit8(as, (uint8_t) op);
+  modrm(as, 3, dst, src);
+}
+
+/**
+ * Emits a jcc, or a jmp for cc < 0, and returns where its rel32 goes.
+ */
+static size_t jump(Assembler *as, int cc) {
+  if (cc < 0) {
+    emit8(as, 0xE9);
+  } else {
+    emit8(as, 0x0F);
+    emit8(as, 0x80 + cc);
+  }
+  size_t patch = as->count;
+  emit32(as, 0);
+  return patch;
+}
+
+static void jump_back(Assembler *as, size_t target) {
+  emit8(as, 0xE9);
+  emit32(as, (uint32_t) (target - (as->count + 4)));
+}
+
+static void call(Assembler *as, uint64_t function) {
+  mov_imm64(as, RAX, function);
+  emit8(as, 0xFF);
+  modrm(as, 3, 2, RAX);
+}
+
+#define FUNCTION(f) ((uint64_t) (uintptr_t) (f))
+
+static void push_reg(Assembler *as, int reg) {
+  rex(as, false, 0, reg);
+  emit8(as, 0x50 + (reg & 7));
+}
+
+static void pop_reg(Assembler *as, int reg) {
+  rex(as, false, 0, reg);
+  emit8(as, 0x58 + (reg & 7));
+}
+
+// HELPERS CALLED FROM NATIVE CODE
+
+/**
+ * OP_ADD on operands that are not both numbers, the operands are the top
+ * two values of VM.stack so they stay reachable while concatenating.
+ */
+static int jit_add(VM *vm) {
+  Value b = vm->stack_top[-1];
+  Value a = vm->stack_top[-2];
+  if (!IS_STRING(a) || !IS_STRING(b)) {
+    return JIT_NOT_ADDABLE;
+  }
+  ObjString *result = concatenate_strings(vm, AS_STRING(a), AS_STRING(b));
+  if (result == NULL) {
+    return JIT_OUT_OF_MEMORY;
+  }
+  vm->stack_top[-2] = OBJ_VAL(result);
+  vm->stack_top--;
+  return JIT_OK;
+}
+
+static void jit_print(VM *vm, Value value) {
+  fprint_value(vm->out, value);
+  fprintf(vm->out, "\n");
+}
+
+// STACK
+
+static int32_t slot(size_t index) {
+  return (int32_t) (index * sizeof(Value));
+}
+
+static int32_t global_field(uint32_t index, size_t field) {
+  return (int32_t) (index * sizeof(Global) + field);
+}
+
+static StackEntry *peek_entry(Assembler *as, size_t distance) {
+  return &as->stack[as->depth - 1 - distance];
+}
+
+static void push_entry(Assembler *as, StackEntry entry) {
+  if (as->depth == JIT_STACK_MAX) {
+    as->failed = true;
+    return;
+  }
+  as->stack[as->depth++] = entry;
+  if (as->depth > as->max_depth) {
+    as->max_depth = as->depth;
+  }
+}
+
+/**
+ * Loads the value of stack slot index into a general purpose register.
+ */
+static void materialize(Assembler *as, size_t index, int reg) {
+  StackEntry *entry = &as->stack[index];
+  switch (entry->location) {
+    case LOC_SLOT: mov_load(as, reg, RBX, slot(index)); break;
+    case LOC_CONSTANT: mov_imm64(as, reg, entry->constant); break;
+    case LOC_GLOBAL: mov_load(as, reg, R13, global_field(entry->global, offsetof(Global, value))); break;
+    case LOC_XMM: movq_to_gpr(as, reg, (int) index); break;
+  }
+}
+
+/**
+ * Writes stack slot index to memory without changing where it is tracked.
+ * Clobbers rax.
+ */
+static void write_slot(Assembler *as, size_t index) {
+  StackEntry *entry = &as->stack[index];
+  if (entry->location == LOC_XMM) {
+    movq_store(as, RBX, slot(index), (int) index);
+  } else if (entry->location != LOC_SLOT) {
+    materialize(as, index, RAX);
+    mov_store(as, RBX, slot(index), RAX);
+  }
+}
+
+/**
+ * Moves stack slot index into memory. Clobbers rax.
+ */
+static void spill(Assembler *as, size_t index) {
+  write_slot(as, index);
+  as->stack[index].location = LOC_SLOT;
+}
+
+/**
+ * Slots that still read a global have to be loaded before it changes.
+ */
+static void before_global_store(Assembler *as, uint32_t index) {
+  for (size_t i = 0; i < as->depth; i++) {
+    if (as->stack[i].location == LOC_GLOBAL && as->stack[i].global == index) {
+      spill(as, i);
+    }
+  }
+}
+
+/**
+ * The xmm registers of slots below count, the ones a call into C must
+ * not lose.
+ */
+static uint16_t xmm_in_use(Assembler *as, size_t count) {
+  uint16_t mask = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (as->stack[i].location == LOC_XMM) {
+      mask |= (uint16_t) (1u << i);
+    }
+  }
+  return mask;
+}
+
+static void save_registers(Assembler *as, uint16_t mask) {
+  for (int i = 0; i < XMM_SLOTS; i++) {
+    if (mask & (1u << i)) {
+      movq_store(as, RBX, slot((size_t) i), i);
+    }
+  }
+}
+
+static void restore_registers(Assembler *as, uint16_t mask) {
+  for (int i = 0; i < XMM_SLOTS; i++) {
+    if (mask & (1u << i)) {
+      movq_load(as, i, RBX, slot((size_t) i));
+    }
+  }
+}
+
+// STUBS
+
+static Stub *add_stub(Assembler *as, Stub stub) {
+  if (as->stub_count == as->stub_capacity) {
+    size_t capacity = grow_capacity(as->stub_capacity);
+    if (!reallocate((void **) &as->stubs, as->stub_capacity * sizeof(Stub),
+          capacity * sizeof(Stub), MEM_OTHER)) {
+      as->failed = true;
+      return NULL;
+    }
+    as->stub_capacity = capacity;
+  }
+  as->stubs[as->stub_count] = stub;
+  return &as->stubs[as->stub_count++];
+}
+
+/**
+ * Leaves with a runtime error if cc holds, or always for cc < 0. ip is
+ * where VM.ip points while the failing instruction runs.
+ */
+static void error_jump(Assembler *as, int cc, const uint8_t *ip, int status) {
+  uint32_t offset = (uint32_t) (ip - as->chunk->code);
+  size_t patch = jump(as, cc);
+  if (as->stub_count > 0) {
+    Stub *last = &as->stubs[as->stub_count - 1];
+    if (last->kind == STUB_ERROR && last->offset == offset && last->status == status &&
+        last->patch_count < 2) {
+      last->patches[last->patch_count++] = patch;
+      return;
+    }
+  }
+  add_stub(as, (Stub) {STUB_ERROR, {patch, 0}, 1, offset, status, 0, 0});
+}
+
+static void emit_stubs(Assembler *as) {
+  for (size_t i = 0; i < as->stub_count && !as->failed; i++) {
+    Stub *stub = &as->stubs[i];
+    for (size_t j = 0; j < stub->patch_count; j++) {
+      land(as, stub->patches[j]);
+    }
+    if (stub->kind == STUB_ERROR) {
+      mov_imm32(as, RCX, stub->offset);
+      if (stub->status != STATUS_IN_EAX) {
+        mov_imm32(as, RAX, (uint32_t) stub->status);
+      }
+      jump_back(as, as->exit);
+    } else {
+      save_registers(as, stub->xmm);
+      mov_rr(as, RDI, R14);
+      mov_rr(as, RSI, RCX);
+      call(as, FUNCTION(gc_mark_value));
+      restore_registers(as, stub->xmm);
+      jump_back(as, stub->resume);
+    }
+  }
+}
+
+/**
+ * Sets ZF if rax is not a number. Clobbers rcx.
+ */
+static void test_not_number(Assembler *as) {
+  mov_rr(as, RCX, RAX);
+  alu_rr(as, ALU_AND, RCX, R15);
+  alu_rr(as, ALU_CMP, RCX, R15);
+}
+
+/**
+ * Brings stack slot index into its xmm register, leaving with status if
+ * it does not hold a number.
+ */
+static void load_number(Assembler *as, size_t index, const uint8_t *ip, JitStatus status) {
+  StackEntry *entry = &as->stack[index];
+  if (entry->location == LOC_XMM) {
+    return;
+  }
+  if (index >= XMM_SLOTS) {
+    as->failed = true;
+    return;
+  }
+
+  if (entry->location == LOC_CONSTANT && !entry->number) {
+    error_jump(as, -1, ip, status);
+  }
+  materialize(as, index, RAX);
+  if (entry->location != LOC_CONSTANT && !entry->number) {
+    test_not_number(as);
+    error_jump(as, CC_E, ip, status);
+  }
+  movq_from_gpr(as, (int) index, RAX);
+  entry->location = LOC_XMM;
+  entry->number = true;
+}
+
+// TEMPLATES
+
+static void binary_number(Assembler *as, uint16_t op, const uint8_t *ip, JitStatus status) {
+  size_t a = as->depth - 2;
+  size_t b = as->depth - 1;
+  load_number(as, a, ip, status);
+  load_number(as, b, ip, status);
+  sse_rr(as, op, (int) a, (int) b);
+  as->depth--;
+}
+
+static bool known_number(Assembler *as, size_t distance) {
+  return peek_entry(as, distance)->number;
+}
+
+/**
+ * Adds numbers inline and hands everything else to jit_add(). Once one
+ * operand is known to be a number, anything but another number is an
+ * error.
+ */
+static void add(Assembler *as, const uint8_t *ip) {
+  if (known_number(as, 0) || known_number(as, 1)) {
+    binary_number(as, SSE_ADDSD, ip, JIT_NOT_ADDABLE);
+    return;
+  }
+
+  size_t a = as->depth - 2;
+  size_t b = as->depth - 1;
+  spill(as, a);
+  spill(as, b);
+
+  mov_load(as, RAX, RBX, slot(a));
+  test_not_number(as);
+  size_t a_slow = jump(as, CC_E);
+  movq_from_gpr(as, XMM_SCRATCH_A, RAX);
+  mov_load(as, RAX, RBX, slot(b));
+  test_not_number(as);
+  size_t b_slow = jump(as, CC_E);
+  movq_from_gpr(as, XMM_SCRATCH_B, RAX);
+  sse_rr(as, SSE_ADDSD, XMM_SCRATCH_A, XMM_SCRATCH_B);
+  movq_store(as, RBX, slot(a), XMM_SCRATCH_A);
+  size_t done = jump(as, -1);
+
+  land(as, a_slow);
+  land(as, b_slow);
+  // the collector scans VM.stack up to stack_top while concatenating, so
+  // every slot below has to hold its current value
+  uint16_t xmm = xmm_in_use(as, a);
+  for (size_t i = 0; i < a; i++) {
+    write_slot(as, i);
+  }
+  lea(as, RAX, RBX, slot(as->depth));
+  mov_store(as, R14, offsetof(VM, stack_top), RAX);
+  mov_rr(as, RDI, R14);
+  call(as, FUNCTION(jit_add));
+  test_eax(as);
+  error_jump(as, CC_NE, ip, STATUS_IN_EAX);
+  restore_registers(as, xmm);
+  land(as, done);
+
+  as->depth--;
+  as->stack[a] = (StackEntry) {LOC_SLOT, false, 0, 0};
+}
+
+/**
+ * Turns al into a bool in the slot of the entry on top.
+ */
+static void store_bool(Assembler *as) {
+  size_t top = as->depth - 1;
+  movzx_eax_al(as);
+  alu_rr(as, ALU_OR, RAX, R15);
+  alu_ri8(as, ALU_IMM_ADD, RAX, (int8_t) (FALSE_VAL - QNAN));
+  mov_store(as, RBX, slot(top), RAX);
+  as->stack[top] = (StackEntry) {LOC_SLOT, false, 0, 0};
+}
+
+static void equal(Assembler *as, const uint8_t *ip) {
+  size_t a = as->depth - 2;
+  size_t b = as->depth - 1;
+  if (known_number(as, 0) && known_number(as, 1)) {
+    load_number(as, a, ip, JIT_OK);
+    load_number(as, b, ip, JIT_OK);
+    // unordered, a NaN is involved, counts as not equal
+    sse_rr(as, SSE_UCOMISD, (int) a, (int) b);
+    setcc(as, CC_E, RAX);
+    setcc(as, CC_NP, RCX);
+    alu_rr8(as, ALU_AND, RAX, RCX);
+  } else {
+    materialize(as, a, RDI);
+    materialize(as, b, RSI);
+    uint16_t xmm = xmm_in_use(as, a);
+    save_registers(as, xmm);
+    call(as, FUNCTION(values_equal));
+    restore_registers(as, xmm);
+  }
+  as->depth--;
+  store_bool(as);
+}
+
+static void logical_not(Assembler *as) {
+  StackEntry *top = peek_entry(as, 0);
+  if (top->number) {
+    *top = (StackEntry) {LOC_CONSTANT, false, FALSE_VAL, 0};
+    return;
+  }
+  if (top->location == LOC_CONSTANT) {
+    bool falsey = IS_NIL(top->constant) || (IS_BOOL(top->constant) && !AS_BOOL(top->constant));
+    *top = (StackEntry) {LOC_CONSTANT, false, BOOL_VAL(falsey), 0};
+    return;
+  }
+
+  materialize(as, as->depth - 1, RAX);
+  lea(as, RCX, R15, (int32_t) (NIL_VAL(0) - QNAN));
+  alu_rr(as, ALU_CMP, RAX, RCX);
+  setcc(as, CC_E, RDX);
+  lea(as, RCX, R15, (int32_t) (FALSE_VAL - QNAN));
+  alu_rr(as, ALU_CMP, RAX, RCX);
+  setcc(as, CC_E, RAX);
+  alu_rr8(as, ALU_OR, RAX, RDX);
+  store_bool(as);
+}
+
+static void negate(Assembler *as, const uint8_t *ip) {
+  size_t top = as->depth - 1;
+  load_number(as, top, ip, JIT_NOT_NUMBER);
+  movq_from_gpr(as, XMM_SCRATCH_A, R12);
+  sse_rr(as, SSE_XORPD, (int) top, XMM_SCRATCH_A);
+}
+
+static void print(Assembler *as) {
+  materialize(as, as->depth - 1, RSI);
+  as->depth--;
+  uint16_t xmm = xmm_in_use(as, as->depth);
+  save_registers(as, xmm);
+  mov_rr(as, RDI, R14);
+  call(as, FUNCTION(jit_print));
+  restore_registers(as, xmm);
+}
+
+/**
+ * Globals never go away again, each one is checked once per chunk.
+ */
+static void check_defined(Assembler *as, uint32_t index, const uint8_t *ip) {
+  if (as->globals[index] & KNOWN_DEFINED) {
+    return;
+  }
+  cmp_mem8_imm(as, R13, global_field(index, offsetof(Global, defined)), 0);
+  error_jump(as, CC_E, ip, JIT_UNDEFINED);
+  as->globals[index] |= KNOWN_DEFINED;
+}
+
+/**
+ * Stores rcx into a global, with the collector's write barrier out of
+ * line. Only the chunk itself changes globals while it runs, a number it
+ * stores is still a number when the global is read again.
+ */
+static void store_global(Assembler *as, uint32_t index, bool number) {
+  before_global_store(as, index);
+  as->globals[index] = (uint8_t) (KNOWN_DEFINED | (number ? KNOWN_NUMBER : 0));
+  mov_store(as, R13, global_field(index, offsetof(Global, value)), RCX);
+  cmp_mem32_imm8(as, R14, offsetof(VM, gc) + offsetof(Collector, phase), GC_MARK);
+  size_t patch = jump(as, CC_E);
+  add_stub(as, (Stub) {STUB_BARRIER, {patch, 0}, 1, 0, 0, as->count, xmm_in_use(as, as->depth)});
+}
+
+static void define_global(Assembler *as, uint32_t index) {
+  materialize(as, as->depth - 1, RCX);
+  bool number = peek_entry(as, 0)->number;
+  as->depth--;
+  if (!(as->globals[index] & KNOWN_DEFINED)) {
+    mov_mem8_imm(as, R13, global_field(index, offsetof(Global, defined)), 1);
+  }
+  store_global(as, index, number);
+}
+
+/**
+ * The global is loaded where it is used, until then the slot refers to
+ * the global itself.
+ */
+static void get_global(Assembler *as, uint32_t index, const uint8_t *ip) {
+  check_defined(as, index, ip);
+  bool number = as->globals[index] & KNOWN_NUMBER;
+  push_entry(as, (StackEntry) {LOC_GLOBAL, number, 0, index});
+}
+
+static void set_global(Assembler *as, uint32_t index, const uint8_t *ip) {
+  check_defined(as, index, ip);
+  materialize(as, as->depth - 1, RCX);
+  store_global(as, index, peek_entry(as, 0)->number);
+}
+
+/**
+ * Leaves the stack in memory the way run() would and returns JIT_OK.
+ */
+static void return_ok(Assembler *as, const uint8_t *ip) {
+  for (size_t i = 0; i < as->depth; i++) {
+    spill(as, i);
+  }
+  lea(as, RAX, RBX, slot(as->depth));
+  mov_store(as, R14, offsetof(VM, stack_top), RAX);
+  mov_imm32(as, RCX, (uint32_t) (ip - as->chunk->code));
+  mov_imm32(as, RAX, JIT_OK);
+  jump_back(as, as->exit);
+}
+
+/**
+ * Sets up the pinned registers and places the shared exits in front of
+ * the body, so every jump to them goes backwards.
+ */
+static void prologue(Assembler *as) {
+  // five pushes keep rsp 16 byte aligned for calls
+  push_reg(as, RBX);
+  push_reg(as, R12);
+  push_reg(as, R13);
+  push_reg(as, R14);
+  push_reg(as, R15);
+  mov_rr(as, R14, RDI);
+  mov_rr(as, RBX, RSI);
+  mov_load(as, R13, R14, offsetof(VM, globals));
+  mov_imm64(as, R15, QNAN);
+  mov_imm64(as, R12, SIGN_BIT);
+  size_t body = jump(as, -1);
+
+  // every exit comes here with the offset of VM.ip in ecx and the status
+  // in eax. The code is found through the VM, the interpreter moves it
+  // when it quickens borrowed code.
+  as->exit = as->count;
+  mov_load(as, RDX, R14, offsetof(VM, chunk));
+  mov_load(as, RDX, RDX, offsetof(Chunk, code));
+  alu_rr(as, ALU_ADD, RDX, RCX);
+  mov_store(as, R14, offsetof(VM, ip), RDX);
+  pop_reg(as, R15);
+  pop_reg(as, R14);
+  pop_reg(as, R13);
+  pop_reg(as, R12);
+  pop_reg(as, RBX);
+  emit8(as, 0xC3);
+  land(as, body);
+}
+
+/**
+ * Translates the chunk instruction by instruction. Fails on anything the
+ * templates do not cover, the chunk then runs in the interpreter.
+ */
+static bool translate(Assembler *as) {
+  const Chunk *chunk = as->chunk;
+  prologue(as);
+
+  size_t offset = 0;
+  while (offset < chunk->count && !as->failed) {
+    const uint8_t *code = chunk->code + offset;
+    // where VM.ip points while the instruction runs, for error messages
+    const uint8_t *ip = code + 1;
+    // quickened instructions do the same as their generic form, and a
+    // superinstruction as its first part, the second one follows in the
+    // code as it was
+    OpCode opcode = generic_opcode(*code);
+    size_t needed = 0;
+    switch (opcode) {
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG: {
+        uint32_t index = code[1];
+        if (opcode == OP_CONSTANT_LONG) {
+          index |= (uint32_t) code[2] << 8 | (uint32_t) code[3] << 16;
+          offset += 2;
+        }
+        Value constant = chunk->constants.values[index];
+        push_entry(as, (StackEntry) {LOC_CONSTANT, IS_NUMBER(constant), constant, 0});
+        offset += 2;
+        continue;
+      }
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_EQUAL:
+        needed = 2;
+        break;
+      case OP_NEGATE:
+      case OP_NOT:
+      case OP_PRINT:
+      case OP_POP:
+      case OP_DEFINE_GLOBAL:
+      case OP_SET_GLOBAL:
+        needed = 1;
+        break;
+      case OP_GET_GLOBAL:
+      case OP_RETURN:
+        break;
+      default:
+        return false;
+    }
+    // bytecode that would underflow the stack is left to the interpreter
+    if (as->depth < needed) {
+      return false;
+    }
+
+    switch (opcode) {
+      case OP_ADD: add(as, ip); break;
+      case OP_SUBTRACT: binary_number(as, SSE_SUBSD, ip, JIT_NOT_NUMBERS); break;
+      case OP_MULTIPLY: binary_number(as, SSE_MULSD, ip, JIT_NOT_NUMBERS); break;
+      case OP_DIVIDE: binary_number(as, SSE_DIVSD, ip, JIT_NOT_NUMBERS); break;
+      case OP_NEGATE: negate(as, ip); break;
+      case OP_EQUAL: equal(as, ip); break;
+      case OP_NOT: logical_not(as); break;
+      case OP_PRINT: print(as); break;
+      case OP_POP: as->depth--; break;
+      case OP_RETURN: return_ok(as, ip); break;
+      case OP_DEFINE_GLOBAL:
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL: {
+        uint32_t index = code[1] | (uint32_t) code[2] << 8;
+        ip = code + 3;
+        if (opcode == OP_DEFINE_GLOBAL) define_global(as, index);
+        if (opcode == OP_GET_GLOBAL) get_global(as, index, ip);
+        if (opcode == OP_SET_GLOBAL) set_global(as, index, ip);
+        offset += 2;
+        break;
+      }
+      default:
+        break;
+    }
+    offset++;
+  }
+
+  emit_stubs(as);
+  return !as->failed;
+}
+
+bool jit_available() {
+  return true;
+}
+
+bool jit_compile(const Chunk *chunk, JitCode *jit) {
+  jit->code = NULL;
+  jit->size = 0;
+  Assembler *as = NULL;
+  if (!reallocate((void **) &as, 0, sizeof(Assembler), MEM_OTHER)) {
+    return false;
+  }
+  memset(as, 0, sizeof(Assembler));
+  as->chunk = chunk;
+
+  // most instructions take a few dozen bytes
+  as->capacity = chunk->count * 32 + 256;
+  bool ok = reallocate((void **) &as->code, 0, as->capacity, MEM_OTHER) && translate(as);
+  if (ok) {
+    void *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+      ok = false;
+    } else {
+      memcpy(code, as->code, as->count);
+      if (mprotect(code, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, as->count);
+        ok = false;
+      } else {
+        jit->code = code;
+        jit->size = as->count;
+        jit->stack_depth = as->max_depth;
+      }
+    }
+  }
+
+  reallocate((void **) &as->code, as->code == NULL ? 0 : as->capacity, 0, MEM_OTHER);
+  reallocate((void **) &as->stubs, as->stub_capacity * sizeof(Stub), 0, MEM_OTHER);
+  reallocate((void **) &as, sizeof(Assembler), 0, MEM_OTHER);
+  return ok;
+}
+
+JitStatus jit_run(const JitCode *jit, VM *vm) {
+  int (*function)(VM *, Value *);
+  // object and function pointers do not convert into each other in ISO C
+  memcpy(&function, &jit->code, sizeof(function));
+  return (JitStatus) function(vm, vm->stack);
+}
+
+void jit_free(JitCode *jit) {
+  if (jit->code != NULL) {
+    munmap(jit->code, jit->size);
+  }
+  jit->code = NULL;
+  jit->size = 0;
+}
+
+#else
+
+bool jit_available() {
+  return false;
+}
+
+bool jit_compile(const Chunk *chunk, JitCode *jit) {
+  (void) chunk;
+  jit->code = NULL;
+  jit->size = 0;
+  return false;
+}
+
+JitStatus jit_run(const JitCode *jit, VM *vm) {
+  (void) jit;
+  (void) vm;
+  return JIT_OK;
+}
+
+void jit_free(JitCode *jit) {
+  (void) jit;
+}
+
+#endif // CLOX_JIT
@@ -3,13 +3,21 @@
 #include <string.h>
 #include <errno.h>
 
+#include "clox/batch.h"
+#include "clox/bytecode.h"
+#include "clox/cache.h"
 #include "clox/chunk.h"
+#include "clox/compiler.h"
 #include "clox/debug.h"
+#include "clox/jit.h"
+#include "clox/memory.h"
 #include "clox/vm.h"
 
-static void repl() {
+static void repl(VM *vm) {
   char *line = NULL;
   size_t n = 0;
+  // REPL lines are rarely repeated, caching them would only fill the cache
+  vm->cache_dir = NULL;
 
   for (;;) {
     fprintf(stdout, "> ");
@@ -18,7 +26,7 @@ static void repl() {
       break;
     }
 
-    interpret(line);
+    interpret(vm, line);
   }
 }
 
@@ -48,24 +56,352 @@ static char *read_file(const char *filename) {
   return buffer;
 }
 
-static void run_file(const char *filename) {
-  char *source = read_file(filename);
-  InterpretResult result = interpret(source);
-  free(source);
+static void run_file(VM *vm, const char *filename) {
+  InterpretResult result;
+  if (is_bytecode_file(filename)) {
+    BytecodeFile file;
+    if (!map_bytecode(vm, &file, filename, vm->err)) {
+      exit(1337);
+    }
+    result = interpret_chunk(vm, &file.chunk);
+    unmap_bytecode(&file);
+  } else {
+    char *source = read_file(filename);
+    result = interpret(vm, source);
+    free(source);
+  }
 
   if (result == INTERPRET_COMPILE_ERROR) exit(1337);
   if (result == INTERPRET_RUNTIME_ERROR) exit(1337);
 }
 
+/**
+ * Compiles a script to a .loxc file without running it.
+ */
+static void compile_file(VM *vm, const char *filename, const char *output) {
+  char *source = read_file(filename);
+  Chunk chunk;
+  init_chunk(&chunk);
+  bool ok = compile(vm, source, &chunk);
+  free(source);
+
+  if (ok && vm->print_code) {
+    fdisassemble_chunk(vm->out, &chunk, "code");
+  }
+  ok = ok && save_bytecode(vm, &chunk, output, vm->err);
+  free_chunk(&chunk);
+
+  if (!ok) exit(1337);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [--print-code] [--trace[=stdout]] [--profile[=out.csv]] [--cache[=dir]] [--mem-stats] [--gc-step=N] [--gc-stats] [--stack-limit=N] [--no-quicken] [--quicken-stats] [--no-superinstructions] [--jit[=N]] [--jit-stats] [-O0|-O1] [--registers] [path]\n", name);
+  fprintf(stderr, "       %s [--print-code] [--trace[=stdout]] [--cache[=dir]] [--mem-stats] [--gc-step=N] [--stack-limit=N] [--no-quicken] [--quicken-stats] [--no-superinstructions] [--jit[=N]] [-O0|-O1] [--registers] [--jobs N] [--manifest file] [path...]\n", name);
+  fprintf(stderr, "       %s [--print-code] [-O0|-O1] --compile path [-o out.loxc]\n", name);
+  fprintf(stderr, "--jit compiles every chunk before its first run, --jit=N after N runs in the interpreter.\n");
+  exit(64);
+}
+
+static void add_path(char ***paths, size_t *count, size_t *capacity, const char *path) {
+  if (*count == *capacity) {
+    size_t new_capacity = grow_capacity(*capacity);
+    char **grown = realloc(*paths, new_capacity * sizeof(char *));
+    if (!grown) {
+      fprintf(stderr, "Not enough memory for the script list.");
+      exit(1337);
+    }
+    *paths = grown;
+    *capacity = new_capacity;
+  }
+  (*paths)[(*count)++] = (char *) path;
+}
+
+// --mem-stats, the report is printed at exit and includes the stats of
+// all batch workers
+static bool report_memory = false;
+static MemoryStats worker_memory;
+
+// --gc-stats, printed before the VM is freed
+static bool report_gc = false;
+
+// --jit-stats, printed before the VM is freed
+static bool report_jit = false;
+
+static void print_memory_stats() {
+  MemoryStats total = worker_memory;
+  add_memory_stats(&total, memory_stats());
+  report_memory_stats(&total, stderr);
+}
+
+/**
+ * Runs all scripts on a pool of VMs configured like the given one.
+ */
+static void run_batch_files(VM *vm, int jobs, const char *const *paths, size_t count) {
+  BatchOptions options;
+  init_batch_options(&options);
+  options.jobs = jobs;
+  options.print_code = vm->print_code;
+  options.quicken = vm->quicken;
+  options.quicken_stats = vm->quicken_stats;
+  options.superinstructions = vm->superinstructions;
+  options.opt_level = vm->opt_level;
+  options.registers = vm->registers;
+  options.stack_limit = vm->stack_limit;
+  options.jit = vm->jit;
+  options.jit_hot_runs = vm->jit_hot_runs;
+  options.cache_dir = vm->cache_dir;
+  options.gc_step_budget = vm->gc.step_budget;
+  options.memory_stats = report_memory ? &worker_memory : NULL;
+#ifdef DEBUG_TRACE_EXECUTION
+  options.trace_mode = vm->tracer.mode;
+#endif // DEBUG_TRACE_EXECUTION
+#ifdef CLOX_PROFILE
+  if (vm->profiler != NULL) {
+    fprintf(stderr, "Profiling is not supported in batch mode, ignoring --profile.\n");
+    free_profiler(vm->profiler);
+    vm->profiler = NULL;
+  }
+#endif // CLOX_PROFILE
+  if (report_gc) {
+    fprintf(stderr, "Collector stats are not supported in batch mode, ignoring --gc-stats.\n");
+    report_gc = false;
+  }
+  if (report_jit) {
+    fprintf(stderr, "JIT stats are not supported in batch mode, ignoring --jit-stats.\n");
+    report_jit = false;
+  }
+
+  if (!run_batch(paths, count, &options, stdout, stderr)) {
+    exit(1337);
+  }
+}
+
+// owned copy of VM.cache_dir
+static char *cache_dir = NULL;
+
+/**
+ * Applies an option to the VM, returns false if the option is unknown.
+ */
+static bool parse_option(VM *vm, const char *option) {
+  if (!strcmp(option, "--print-code")) {
+    vm->print_code = true;
+    return true;
+  }
+
+  if (!strcmp(option, "--trace") || !strcmp(option, "--trace=stdout")) {
+#ifdef DEBUG_TRACE_EXECUTION
+    vm->tracer.mode = strcmp(option, "--trace") ? TRACE_STDOUT : TRACE_RING;
+#else
+    fprintf(stderr, "Tracing is not compiled in, rebuild with CLOX_TRACE_EXECUTION.\n");
+#endif // DEBUG_TRACE_EXECUTION
+    return true;
+  }
+
+  if (!strcmp(option, "--profile") || !strncmp(option, "--profile=", 10)) {
+#ifdef CLOX_PROFILE
+    const char *csv_path = option[9] == '=' ? option + 10 : NULL;
+    if (vm->profiler == NULL) {
+      vm->profiler = new_profiler(csv_path);
+    }
+#else
+    fprintf(stderr, "Profiling is not compiled in, rebuild with CLOX_PROFILE.\n");
+#endif // CLOX_PROFILE
+    return true;
+  }
+
+  if (!strcmp(option, "--mem-stats")) {
+    if (!report_memory) {
+      atexit(print_memory_stats);
+    }
+    report_memory = true;
+    return true;
+  }
+
+  if (!strcmp(option, "--jit") || !strncmp(option, "--jit=", 6)) {
+    if (option[5] == '=') {
+      // interpreted runs before a chunk is compiled, 0 compiles right away
+      char *end;
+      long runs = strtol(option + 6, &end, 10);
+      if (option[6] == '\0' || *end != '\0' || runs < 0 || runs > UINT32_MAX) {
+        return false;
+      }
+      vm->jit_hot_runs = (uint32_t) runs;
+    } else {
+      // scripts and REPL lines run once, waiting for a second run never compiles
+      vm->jit_hot_runs = 0;
+    }
+    if (!jit_available()) {
+      fprintf(stderr, "The JIT is not built in, rebuild with CLOX_JIT on x86-64.\n");
+    }
+    vm->jit = true;
+    return true;
+  }
+
+  if (!strncmp(option, "--gc-step=", 10)) {
+    char *end;
+    long budget = strtol(option + 10, &end, 10);
+    if (option[10] == '\0' || *end != '\0' || budget < 1) {
+      return false;
+    }
+    vm->gc.step_budget = (size_t) budget;
+    return true;
+  }
+
+  if (!strncmp(option, "--stack-limit=", 14)) {
+    char *end;
+    long limit = strtol(option + 14, &end, 10);
+    if (option[14] == '\0' || *end != '\0' || limit < 1) {
+      return false;
+    }
+    vm->stack_limit = (size_t) limit;
+    return true;
+  }
+
+  if (!strcmp(option, "--gc-stats")) {
+    report_gc = true;
+    return true;
+  }
+
+  if (!strcmp(option, "--jit-stats")) {
+    report_jit = true;
+    return true;
+  }
+
+  if (!strcmp(option, "--no-quicken")) {
+    vm->quicken = false;
+    return true;
+  }
+
+  if (!strcmp(option, "--no-superinstructions")) {
+    vm->superinstructions = false;
+    return true;
+  }
+
+  if (!strncmp(option, "-O", 2)) {
+    char *end;
+    long level = strtol(option + 2, &end, 10);
+    if (option[2] < '0' || option[2] > '9' || *end != '\0' || level > OPT_LEVEL_MAX) {
+      return false;
+    }
+    vm->opt_level = (int) level;
+    return true;
+  }
+
+  if (!strcmp(option, "--registers")) {
+    vm->registers = true;
+    return true;
+  }
+
+  if (!strcmp(option, "--quicken-stats")) {
+    vm->quicken_stats = true;
+    return true;
+  }
+
+  if (!strcmp(option, "--cache") || !strncmp(option, "--cache=", 8)) {
+    free(cache_dir);
+    cache_dir = option[7] == '=' ? strdup(option + 8) : default_cache_dir();
+    if (cache_dir == NULL || !make_cache_dir(cache_dir)) {
+      fprintf(stderr, "Could not create the compile cache, compiling every script.\n");
+      free(cache_dir);
+      cache_dir = NULL;
+    }
+    vm->cache_dir = cache_dir;
+    return true;
+  }
+
+  return false;
+}
+
 int main(int argc, const char* argv[]) {
-  init_vm();
+  VM vm;
+  init_vm(&vm);
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  // paths given on the command line are borrowed from argv, the ones
+  // read from manifests are owned and freed at the end
+  char **paths = NULL;
+  size_t path_count = 0, path_capacity = 0;
+  char **manifest_paths = NULL;
+  size_t manifest_count = 0, manifest_capacity = 0;
+  // 0 picks one job per CPU once batch mode is on
+  int jobs = 0;
+  bool batch = false;
+  bool compile_only = false;
+  const char *output = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--jobs") || !strncmp(argv[i], "--jobs=", 7)) {
+      const char *value = argv[i][6] == '=' ? argv[i] + 7 : (i + 1 < argc ? argv[++i] : "");
+      char *end;
+      long n = strtol(value, &end, 10);
+      if (*value == '\0' || *end != '\0' || n < 1 || n > 1024) {
+        usage(argv[0]);
+      }
+      jobs = (int) n;
+      batch = true;
+    } else if (!strcmp(argv[i], "--manifest") || !strncmp(argv[i], "--manifest=", 11)) {
+      const char *manifest = argv[i][10] == '=' ? argv[i] + 11 : (i + 1 < argc ? argv[++i] : NULL);
+      if (manifest == NULL) {
+        usage(argv[0]);
+      }
+      size_t first = manifest_count;
+      if (!read_manifest(manifest, &manifest_paths, &manifest_count, &manifest_capacity)) {
+        exit(1337);
+      }
+      for (size_t j = first; j < manifest_count; j++) {
+        add_path(&paths, &path_count, &path_capacity, manifest_paths[j]);
+      }
+      batch = true;
+    } else if (!strcmp(argv[i], "--compile")) {
+      compile_only = true;
+    } else if (!strcmp(argv[i], "-o")) {
+      if (i + 1 == argc) {
+        usage(argv[0]);
+      }
+      output = argv[++i];
+    } else if (!strncmp(argv[i], "--", 2) || !strncmp(argv[i], "-O", 2)) {
+      if (!parse_option(&vm, argv[i])) {
+        usage(argv[0]);
+      }
+    } else {
+      add_path(&paths, &path_count, &path_capacity, argv[i]);
+    }
+  }
+
+  if (compile_only || output != NULL) {
+    if (!compile_only || batch || path_count != 1) {
+      usage(argv[0]);
+    }
+    if (output == NULL) {
+      // in.lox becomes in.loxc
+      size_t length = strlen(paths[0]);
+      char *default_output = malloc(length + 2);
+      if (!default_output) exit(1337);
+      memcpy(default_output, paths[0], length);
+      memcpy(default_output + length, "c", 2);
+      compile_file(&vm, paths[0], default_output);
+      free(default_output);
+    } else {
+      compile_file(&vm, paths[0], output);
+    }
+  } else if (batch || path_count > 1) {
+    run_batch_files(&vm, jobs, (const char *const *) paths, path_count);
+  } else if (path_count == 0) {
+    repl(&vm);
   } else {
-    fprintf(stderr, "Usage: %s [path]\n", argv[0]);
+    run_file(&vm, paths[0]);
+  }
+  if (report_gc) {
+    report_gc_stats(&vm.gc.stats, stderr);
+  }
+  if (report_jit) {
+    fprintf(stderr, "== jit ==\nnative runs: %zu\n", vm.native_runs);
+  }
+  free_vm(&vm);
+
+  for (size_t i = 0; i < manifest_count; i++) {
+    free(manifest_paths[i]);
   }
-  free_vm();
+  free(manifest_paths);
+  free(paths);
+  free(cache_dir);
 }
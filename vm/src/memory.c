@@ -1,8 +1,22 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "clox/memory.h"
 
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+// freed slab blocks stay poisoned so ASan still catches use after free
+#define POISON(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#define UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#define POISON(ptr, size) ((void) (ptr), (void) (size))
+#define UNPOISON(ptr, size) ((void) (ptr), (void) (size))
+#endif
+
 #define MIN_CAPACITY 8
 #define GROW_FACTOR 2
 
@@ -10,7 +24,82 @@ size_t grow_capacity(size_t old_capacity) {
   return old_capacity < MIN_CAPACITY ? MIN_CAPACITY : old_capacity * GROW_FACTOR;
 }
 
-bool reallocate(void **ptr, size_t old_size, size_t new_size) {
+// ACCOUNTING
+
+static _Thread_local MemoryStats stats;
+
+static const char *category_names[] = {
+  [MEM_CODE] = "code",
+  [MEM_LINES] = "lines",
+  [MEM_CONSTANTS] = "constants",
+  [MEM_STACK] = "stack",
+  [MEM_OBJECTS] = "objects",
+  [MEM_TABLES] = "tables",
+  [MEM_GLOBALS] = "globals",
+  [MEM_ARENA] = "arena",
+  [MEM_SLAB] = "slab",
+  [MEM_OTHER] = "other",
+};
+
+/**
+ * Records a successful resize from old_size to new_size bytes.
+ */
+static void count_category(MemoryCategory category, size_t old_size, size_t new_size) {
+  CategoryStats *counts = &stats.categories[category];
+  if (old_size == 0) {
+    counts->allocations++;
+  } else if (new_size == 0) {
+    counts->frees++;
+  } else {
+    counts->resizes++;
+  }
+
+  counts->live = counts->live - old_size + new_size;
+  if (counts->live > counts->peak) {
+    counts->peak = counts->live;
+  }
+}
+
+static void count_heap(size_t old_size, size_t new_size) {
+  stats.live = stats.live - old_size + new_size;
+  if (stats.live > stats.peak) {
+    stats.peak = stats.live;
+  }
+}
+
+const MemoryStats *memory_stats() {
+  return &stats;
+}
+
+/**
+ * Sums up the stats of several threads. Peaks are added as well, which
+ * makes them an upper bound of the combined peak.
+ */
+void add_memory_stats(MemoryStats *into, const MemoryStats *from) {
+  into->live += from->live;
+  into->peak += from->peak;
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    into->categories[i].allocations += from->categories[i].allocations;
+    into->categories[i].resizes += from->categories[i].resizes;
+    into->categories[i].frees += from->categories[i].frees;
+    into->categories[i].live += from->categories[i].live;
+    into->categories[i].peak += from->categories[i].peak;
+  }
+}
+
+void report_memory_stats(const MemoryStats *stats, FILE *out) {
+  fprintf(out, "== memory ==\n");
+  fprintf(out, "%-10s %12s %12s %12s %12s %12s\n",
+      "category", "allocs", "resizes", "frees", "live", "peak");
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    const CategoryStats *counts = &stats->categories[i];
+    fprintf(out, "%-10s %12zu %12zu %12zu %12zu %12zu\n", category_names[i],
+        counts->allocations, counts->resizes, counts->frees, counts->live, counts->peak);
+  }
+  fprintf(out, "heap: %zu bytes live, %zu bytes peak\n", stats->live, stats->peak);
+}
+
+bool reallocate(void **ptr, size_t old_size, size_t new_size, MemoryCategory category) {
   // realloc api is a little bit weird. manpage says that the return
   // value if new_size=0 would be either NULL or a pointer suitable
   // to be passed to free. We would need to include that into our checks
@@ -18,6 +107,10 @@ bool reallocate(void **ptr, size_t old_size, size_t new_size) {
   // the free for the case when new_size is 0.
   if (new_size == 0) {
     free(*ptr);
+    if (*ptr != NULL) {
+      count_category(category, old_size, 0);
+      count_heap(old_size, 0);
+    }
     return true;
   }
 
@@ -27,7 +120,348 @@ bool reallocate(void **ptr, size_t old_size, size_t new_size) {
     return false;
   }
 
+  count_category(category, old_size, new_size);
+  count_heap(old_size, new_size);
+  *ptr = new_ptr;
+  return true;
+}
+
+
+// ARENA
+
+// size of the first block, later ones double up to MAX_BLOCK_SIZE
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (1024 * 1024)
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size;
+  size_t used;
+  _Alignas(max_align_t) unsigned char data[];
+};
+
+static ArenaStatsHook stats_hook = NULL;
+static void *stats_context = NULL;
+
+static size_t align_size(size_t size) {
+  return (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+}
+
+void set_arena_stats_hook(ArenaStatsHook hook, void *context) {
+  stats_hook = hook;
+  stats_context = context;
+}
+
+void init_arena(Arena *arena) {
+  arena->blocks = NULL;
+  arena->top = NULL;
+  arena->stats = (ArenaStats) {0};
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    arena->category_bytes[i] = 0;
+  }
+}
+
+/**
+ * Bytes bumped out of an arena only show up in their category, the heap
+ * totals already hold the blocks they live in.
+ */
+static void count_arena(Arena *arena, MemoryCategory category, size_t old_size, size_t new_size) {
+  arena->category_bytes[category] = arena->category_bytes[category] - old_size + new_size;
+  count_category(category, old_size, new_size);
+}
+
+void free_arena(Arena *arena) {
+  if (stats_hook != NULL && arena->stats.allocations > 0) {
+    stats_hook(&arena->stats, stats_context);
+  }
+
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    if (arena->category_bytes[i] > 0) {
+      count_arena(arena, (MemoryCategory) i, arena->category_bytes[i], 0);
+    }
+  }
+
+  ArenaBlock *block = arena->blocks;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    reallocate((void **) &block, sizeof(ArenaBlock) + block->size, 0, MEM_ARENA);
+    block = next;
+  }
+  init_arena(arena);
+}
+
+/**
+ * Starts a new block big enough for size. A request larger than the next
+ * block would be gets a block of its own.
+ */
+static ArenaBlock *new_block(Arena *arena, size_t size) {
+  size_t block_size = arena->blocks == NULL ? MIN_BLOCK_SIZE : arena->blocks->size * 2;
+  if (block_size > MAX_BLOCK_SIZE) {
+    block_size = MAX_BLOCK_SIZE;
+  }
+  if (block_size < size) {
+    block_size = size;
+  }
+
+  ArenaBlock *block = NULL;
+  if (!reallocate((void **) &block, 0, sizeof(ArenaBlock) + block_size, MEM_ARENA)) {
+    fprintf(stderr, "Failed to allocate arena block\n");
+    return NULL;
+  }
+  block->next = arena->blocks;
+  block->size = block_size;
+  block->used = 0;
+  arena->blocks = block;
+
+  arena->stats.blocks++;
+  arena->stats.block_bytes += block_size;
+  return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size, MemoryCategory category) {
+  size = align_size(size);
+  ArenaBlock *block = arena->blocks;
+  if (block == NULL || block->size - block->used < size) {
+    block = new_block(arena, size);
+    if (block == NULL) {
+      return NULL;
+    }
+  }
+
+  void *ptr = block->data + block->used;
+  block->used += size;
+  arena->top = ptr;
+  arena->stats.allocations++;
+  arena->stats.bytes_allocated += size;
+  count_arena(arena, category, 0, size);
+  return ptr;
+}
+
+/**
+ * Same contract as reallocate(). The newest allocation grows in place as
+ * long as its block has room, anything else moves to fresh memory and the
+ * old copy stays in the arena until it is freed.
+ */
+bool arena_reallocate(Arena *arena, void **ptr, size_t old_size, size_t new_size, MemoryCategory category) {
+  if (new_size <= old_size) {
+    return true;
+  }
+
+  ArenaBlock *block = arena->blocks;
+  if (*ptr != NULL && *ptr == arena->top) {
+    size_t start = (unsigned char *) *ptr - block->data;
+    size_t aligned = align_size(new_size);
+    if (block->size - start >= aligned) {
+      arena->stats.bytes_allocated += aligned - (block->used - start);
+      count_arena(arena, category, block->used - start, aligned);
+      block->used = start + aligned;
+      arena->stats.grows_in_place++;
+      return true;
+    }
+  }
+
+  void *new_ptr = arena_alloc(arena, new_size, category);
+  if (new_ptr == NULL) {
+    return false;
+  }
+  if (old_size > 0) {
+    memcpy(new_ptr, *ptr, old_size);
+    arena->stats.bytes_copied += old_size;
+  }
   *ptr = new_ptr;
   return true;
 }
 
+
+// SLAB
+
+static _Thread_local SlabStats slab;
+
+const SlabStats *slab_stats() {
+  return &slab;
+}
+
+#ifdef CLOX_SLAB_ALLOCATOR
+typedef struct SlabPage SlabPage;
+
+/**
+ * Header at the start of every slab page. All blocks of a page have the
+ * same size, so a block's page is found by rounding its address down.
+ */
+struct SlabPage {
+  // neighbours in the list of pages of its class that have a free block,
+  // full pages are in no list
+  SlabPage *next;
+  SlabPage *prev;
+  // blocks freed on this page, linked through their first word
+  void *free;
+  uint32_t block_size;
+  uint32_t capacity;
+  // blocks handed out, and blocks ever carved out of the page
+  uint32_t live;
+  uint32_t carved;
+  _Alignas(max_align_t) unsigned char data[];
+};
+
+/**
+ * Pages are owned by the thread that mapped them, every VM runs on one
+ * thread so its objects are always freed where they were allocated.
+ */
+static _Thread_local SlabPage *available[SLAB_CLASS_COUNT];
+
+static size_t slab_class(size_t size) {
+  return (size - 1) / SLAB_GRANULE;
+}
+
+static void link_page(SlabPage *page, size_t class) {
+  page->prev = NULL;
+  page->next = available[class];
+  if (page->next != NULL) {
+    page->next->prev = page;
+  }
+  available[class] = page;
+}
+
+static void unlink_page(SlabPage *page, size_t class) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    available[class] = page->next;
+  }
+  if (page->next != NULL) {
+    page->next->prev = page->prev;
+  }
+}
+
+/**
+ * Maps twice the page size and trims it down to one aligned page.
+ */
+static SlabPage *map_page(size_t class) {
+  size_t size = 2 * SLAB_PAGE_SIZE;
+  unsigned char *start = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) {
+    fprintf(stderr, "Failed to map slab page\n");
+    return NULL;
+  }
+  unsigned char *aligned = (unsigned char *) (((uintptr_t) start + SLAB_PAGE_SIZE - 1) & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+  if (aligned > start) {
+    munmap(start, aligned - start);
+  }
+  munmap(aligned + SLAB_PAGE_SIZE, start + size - (aligned + SLAB_PAGE_SIZE));
+
+  SlabPage *page = (SlabPage *) aligned;
+  page->free = NULL;
+  page->block_size = (uint32_t) ((class + 1) * SLAB_GRANULE);
+  page->capacity = (uint32_t) ((SLAB_PAGE_SIZE - sizeof(SlabPage)) / page->block_size);
+  page->live = 0;
+  page->carved = 0;
+  POISON(page->data, SLAB_PAGE_SIZE - sizeof(SlabPage));
+  link_page(page, class);
+
+  slab.pages++;
+  slab.empty_pages++;
+  slab.pages_mapped++;
+  count_category(MEM_SLAB, 0, SLAB_PAGE_SIZE);
+  count_heap(0, SLAB_PAGE_SIZE);
+  return page;
+}
+
+static void unmap_page(SlabPage *page) {
+  // the next mapping at this address must not inherit the poison
+  UNPOISON(page, SLAB_PAGE_SIZE);
+  munmap(page, SLAB_PAGE_SIZE);
+  slab.pages--;
+  slab.empty_pages--;
+  slab.pages_released++;
+  count_category(MEM_SLAB, SLAB_PAGE_SIZE, 0);
+  count_heap(SLAB_PAGE_SIZE, 0);
+}
+#endif // CLOX_SLAB_ALLOCATOR
+
+/**
+ * Allocates size bytes for an object that is never resized. Small sizes
+ * come from the thread's slab pages, anything above SLAB_MAX_SIZE, or
+ * everything when the slab allocator is not built in, from reallocate().
+ */
+void *slab_alloc(size_t size, MemoryCategory category) {
+#ifdef CLOX_SLAB_ALLOCATOR
+  if (size > 0 && size <= SLAB_MAX_SIZE) {
+    size_t class = slab_class(size);
+    SlabPage *page = available[class];
+    if (page == NULL && (page = map_page(class)) == NULL) {
+      return NULL;
+    }
+
+    void *block;
+    if (page->free != NULL) {
+      block = page->free;
+      UNPOISON(block, page->block_size);
+      page->free = *(void **) block;
+      slab.reused++;
+    } else {
+      block = page->data + (size_t) page->carved++ * page->block_size;
+      UNPOISON(block, page->block_size);
+    }
+    if (page->live++ == 0) {
+      slab.empty_pages--;
+    }
+    if (page->live == page->capacity) {
+      unlink_page(page, class);
+    }
+    count_category(category, 0, size);
+    return block;
+  }
+#endif // CLOX_SLAB_ALLOCATOR
+
+  void *ptr = NULL;
+  return reallocate(&ptr, 0, size, category) ? ptr : NULL;
+}
+
+/**
+ * Frees memory from slab_alloc(), size has to be the size it was
+ * allocated with. Pages left empty are kept for reuse until
+ * slab_release_empty() gives them back.
+ */
+void slab_free(void *ptr, size_t size, MemoryCategory category) {
+#ifdef CLOX_SLAB_ALLOCATOR
+  if (ptr != NULL && size <= SLAB_MAX_SIZE) {
+    SlabPage *page = (SlabPage *) ((uintptr_t) ptr & ~(uintptr_t) (SLAB_PAGE_SIZE - 1));
+    if (page->live == page->capacity) {
+      link_page(page, slab_class(page->block_size));
+    }
+    *(void **) ptr = page->free;
+    page->free = ptr;
+    POISON(ptr, page->block_size);
+    if (--page->live == 0) {
+      slab.empty_pages++;
+    }
+    count_category(category, size, 0);
+    return;
+  }
+#endif // CLOX_SLAB_ALLOCATOR
+
+  reallocate(&ptr, size, 0, category);
+}
+
+/**
+ * Unmaps every empty page of the calling thread at once. Returns the
+ * number of pages released.
+ */
+size_t slab_release_empty() {
+  size_t released = 0;
+#ifdef CLOX_SLAB_ALLOCATOR
+  for (size_t class = 0; class < SLAB_CLASS_COUNT && slab.empty_pages > 0; class++) {
+    SlabPage *page = available[class];
+    while (page != NULL) {
+      SlabPage *next = page->next;
+      if (page->live == 0) {
+        unlink_page(page, class);
+        unmap_page(page);
+        released++;
+      }
+      page = next;
+    }
+  }
+#endif // CLOX_SLAB_ALLOCATOR
+  return released;
+}
@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include "clox/memory.h"
+#include "clox/object.h"
+#include "clox/table.h"
+
+static Obj *allocate_object(VM *vm, size_t size, ObjType type) {
+  gc_before_allocation(vm, size);
+  Obj *object = slab_alloc(size, MEM_OBJECTS);
+  if (object == NULL) {
+    return NULL;
+  }
+
+  object->type = type;
+  gc_track(vm, object, size);
+  object->next = vm->objects;
+  vm->objects = object;
+  return object;
+}
+
+static size_t string_size(size_t length) {
+  return sizeof(ObjString) + length + 1;
+}
+
+/**
+ * Allocates a string with room for length characters, the caller fills
+ * them in and interns it.
+ */
+static ObjString *allocate_string(VM *vm, size_t length) {
+  ObjString *string = (ObjString *) allocate_object(vm, string_size(length), OBJ_STRING);
+  if (string == NULL) {
+    return NULL;
+  }
+
+  string->length = length;
+  string->chars = (char *) (string + 1);
+  string->chars[length] = '\0';
+  return string;
+}
+
+/**
+ * Frees a string that was never interned. It is always the newest object,
+ * so it sits at the head of the object list.
+ */
+static void discard_string(VM *vm, ObjString *string) {
+  vm->objects = string->obj.next;
+  gc_forget(vm, string_size(string->length));
+  slab_free(string, string_size(string->length), MEM_OBJECTS);
+}
+
+/**
+ * FNV-1a
+ */
+uint32_t hash_string(const char *chars, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t) chars[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+/**
+ * Returns the interned string with these characters, creating it the
+ * first time they are seen. NULL when there is no memory for the string
+ * or its entry in VM.strings.
+ */
+ObjString *copy_string(VM *vm, const char *chars, size_t length) {
+  uint32_t hash = hash_string(chars, length);
+  ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
+  if (interned != NULL) {
+    gc_keep(vm, &interned->obj);
+    return interned;
+  }
+
+  ObjString *string = allocate_string(vm, length);
+  if (string == NULL) {
+    return NULL;
+  }
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  // a string that is not interned would break pointer equality
+  if (!table_set(&vm->strings, string, NIL_VAL(0))) {
+    discard_string(vm, string);
+    return NULL;
+  }
+  return string;
+}
+
+ObjString *concatenate_strings(VM *vm, const ObjString *a, const ObjString *b) {
+  size_t length = a->length + b->length;
+  ObjString *string = allocate_string(vm, length);
+  if (string == NULL) {
+    return NULL;
+  }
+  memcpy(string->chars, a->chars, a->length);
+  memcpy(string->chars + a->length, b->chars, b->length);
+  string->hash = hash_string(string->chars, length);
+
+  ObjString *interned = table_find_string(&vm->strings, string->chars, length, string->hash);
+  if (interned != NULL) {
+    discard_string(vm, string);
+    gc_keep(vm, &interned->obj);
+    return interned;
+  }
+
+  if (!table_set(&vm->strings, string, NIL_VAL(0))) {
+    discard_string(vm, string);
+    return NULL;
+  }
+  return string;
+}
+
+/**
+ * Frees one object and returns how many bytes it took.
+ */
+size_t free_object(Obj *object) {
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString *string = (ObjString *) object;
+      size_t size = string_size(string->length);
+      slab_free(string, size, MEM_OBJECTS);
+      return size;
+    }
+  }
+  return 0;
+}
+
+void free_objects(VM *vm) {
+  Obj *object = vm->objects;
+  while (object != NULL) {
+    Obj *next = object->next;
+    free_object(object);
+    object = next;
+  }
+  vm->objects = NULL;
+}
+
+void fprint_object(FILE *out, Value value) {
+  switch (OBJ_TYPE(value)) {
+    case OBJ_STRING:
+      fwrite(AS_CSTRING(value), sizeof(char), AS_STRING(value)->length, out);
+      break;
+  }
+}
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_USE_TSC
+#endif
+
+#include "clox/debug.h"
+#include "clox/memory.h"
+#include "clox/profile.h"
+
+// number of opcode pairs listed in the text report
+#define REPORT_PAIRS 20
+
+static uint64_t profile_clock() {
+#ifdef PROFILE_USE_TSC
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif // PROFILE_USE_TSC
+}
+
+const char *profile_clock_unit() {
+#ifdef PROFILE_USE_TSC
+  return "cycles";
+#else
+  return "ns";
+#endif // PROFILE_USE_TSC
+}
+
+Profiler *new_profiler(const char *csv_path) {
+  Profiler *profiler = NULL;
+  if (!reallocate((void **) &profiler, 0, sizeof(Profiler), MEM_OTHER)) {
+    fprintf(stderr, "Failed to allocate profiler\n");
+    return NULL;
+  }
+
+  memset(profiler, 0, sizeof(Profiler));
+  profiler->previous = -1;
+  profiler->csv_path = csv_path;
+  return profiler;
+}
+
+void free_profiler(Profiler *profiler) {
+  reallocate((void **) &profiler, sizeof(Profiler), 0, MEM_OTHER);
+}
+
+void profile_start_run(Profiler *profiler) {
+  profiler->previous = -1;
+}
+
+/**
+ * Called right before opcode executes. The time since the previous call is
+ * charged to the previous opcode, which includes its share of dispatch.
+ */
+void profile_instruction(Profiler *profiler, uint8_t opcode) {
+  uint64_t now = profile_clock();
+
+  if (profiler->previous >= 0) {
+    profiler->cycles[profiler->previous] += now - profiler->previous_start;
+    profiler->pairs[profiler->previous][opcode]++;
+  }
+
+  profiler->counts[opcode]++;
+  profiler->previous = opcode;
+  profiler->previous_start = profile_clock();
+}
+
+void profile_end_run(Profiler *profiler) {
+  if (profiler->previous >= 0) {
+    profiler->cycles[profiler->previous] += profile_clock() - profiler->previous_start;
+  }
+  profiler->previous = -1;
+}
+
+typedef struct {
+  uint8_t first;
+  uint8_t second;
+  uint64_t count;
+} PairCount;
+
+static int compare_by_count(uint64_t a, uint64_t b) {
+  return a < b ? 1 : (a > b ? -1 : 0);
+}
+
+typedef struct {
+  uint8_t opcode;
+  uint64_t count;
+} OpcodeCount;
+
+static int compare_opcodes(const void *a, const void *b) {
+  return compare_by_count(((const OpcodeCount *) a)->count, ((const OpcodeCount *) b)->count);
+}
+
+static int compare_pairs(const void *a, const void *b) {
+  return compare_by_count(((const PairCount *) a)->count, ((const PairCount *) b)->count);
+}
+
+static const char *name_of(uint8_t opcode) {
+  const char *name = opcode_name(opcode);
+  return name != NULL ? name : "UNKNOWN";
+}
+
+/**
+ * Collects all pairs that were seen, most frequent first. Returns the number
+ * of pairs, the caller frees *pairs.
+ */
+static size_t sorted_pairs(const Profiler *profiler, PairCount **pairs) {
+  size_t count = 0;
+  for (size_t a = 0; a < PROFILE_OPCODES; a++) {
+    for (size_t b = 0; b < PROFILE_OPCODES; b++) {
+      count += profiler->pairs[a][b] > 0;
+    }
+  }
+
+  *pairs = NULL;
+  if (count == 0 || !reallocate((void **) pairs, 0, count * sizeof(PairCount), MEM_OTHER)) {
+    return 0;
+  }
+
+  size_t i = 0;
+  for (size_t a = 0; a < PROFILE_OPCODES; a++) {
+    for (size_t b = 0; b < PROFILE_OPCODES; b++) {
+      if (profiler->pairs[a][b] > 0) {
+        (*pairs)[i++] = (PairCount) {(uint8_t) a, (uint8_t) b, profiler->pairs[a][b]};
+      }
+    }
+  }
+
+  qsort(*pairs, count, sizeof(PairCount), compare_pairs);
+  return count;
+}
+
+/**
+ * Prints opcodes sorted by execution count and the most frequent pairs.
+ */
+void report_profile(const Profiler *profiler, FILE *out) {
+  OpcodeCount opcodes[PROFILE_OPCODES];
+  size_t executed = 0;
+  uint64_t total = 0;
+  for (size_t op = 0; op < PROFILE_OPCODES; op++) {
+    if (profiler->counts[op] > 0) {
+      opcodes[executed++] = (OpcodeCount) {(uint8_t) op, profiler->counts[op]};
+      total += profiler->counts[op];
+    }
+  }
+  qsort(opcodes, executed, sizeof(OpcodeCount), compare_opcodes);
+
+  const char *unit = profile_clock_unit();
+  char unit_per_op[16];
+  snprintf(unit_per_op, sizeof(unit_per_op), "%s/op", unit);
+  fprintf(out, "== opcode profile ==\n");
+  fprintf(out, "%-20s %12s %7s %14s %13s\n", "opcode", "count", "%", unit, unit_per_op);
+  for (size_t i = 0; i < executed; i++) {
+    uint8_t op = opcodes[i].opcode;
+    fprintf(out, "%-20s %12lu %6.2f%% %14lu %13.1f\n", name_of(op),
+        profiler->counts[op], 100.0 * profiler->counts[op] / total,
+        profiler->cycles[op], (double) profiler->cycles[op] / profiler->counts[op]);
+  }
+
+  PairCount *pairs;
+  size_t pair_count = sorted_pairs(profiler, &pairs);
+  uint64_t pair_total = 0;
+  for (size_t i = 0; i < pair_count; i++) {
+    pair_total += pairs[i].count;
+  }
+
+  fprintf(out, "== top opcode pairs ==\n");
+  for (size_t i = 0; i < pair_count && i < REPORT_PAIRS; i++) {
+    fprintf(out, "%-20s -> %-20s %12lu %6.2f%%\n", name_of(pairs[i].first),
+        name_of(pairs[i].second), pairs[i].count, 100.0 * pairs[i].count / pair_total);
+  }
+
+  reallocate((void **) &pairs, pair_count * sizeof(PairCount), 0, MEM_OTHER);
+}
+
+/**
+ * Writes one row per executed opcode and one per opcode pair:
+ * kind,opcode,next,count,<unit>
+ */
+bool write_profile_csv(const Profiler *profiler, const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Could not open %s for the profile report\n", path);
+    return false;
+  }
+
+  fprintf(f, "kind,opcode,next,count,%s\n", profile_clock_unit());
+  for (size_t op = 0; op < PROFILE_OPCODES; op++) {
+    if (profiler->counts[op] > 0) {
+      fprintf(f, "opcode,%s,,%lu,%lu\n", name_of((uint8_t) op),
+          profiler->counts[op], profiler->cycles[op]);
+    }
+  }
+
+  PairCount *pairs;
+  size_t pair_count = sorted_pairs(profiler, &pairs);
+  for (size_t i = 0; i < pair_count; i++) {
+    fprintf(f, "pair,%s,%s,%lu,\n", name_of(pairs[i].first),
+        name_of(pairs[i].second), pairs[i].count);
+  }
+  reallocate((void **) &pairs, pair_count * sizeof(PairCount), 0, MEM_OTHER);
+
+  fclose(f);
+  return true;
+}
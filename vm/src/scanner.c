@@ -5,37 +5,29 @@
 
 #include "clox/scanner.h"
 
-typedef struct {
-  const char *start;
-  const char *current;
-  size_t line;
-} Scanner;
-
-Scanner scanner;
-
-void init_scanner(const char *source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void init_scanner(Scanner *scanner, const char *source) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = 1;
 }
 
-static bool is_at_end() {
-  return *scanner.current == '\0';
+static bool is_at_end(Scanner *scanner) {
+  return *scanner->current == '\0';
 }
 
-static Token make_token(TokenType token_type) {
+static Token make_token(Scanner *scanner, TokenType token_type) {
   Token token;
   token.type = token_type;
-  token.line = scanner.line;
-  token.start = scanner.start;
-  token.length = scanner.current - scanner.start;
+  token.line = scanner->line;
+  token.start = scanner->start;
+  token.length = scanner->current - scanner->start;
 
   return token;
 }
 
-static Token error_token(const char *error_str) {
+static Token error_token(Scanner *scanner, const char *error_str) {
   Token token;
-  token.line = scanner.line;
+  token.line = scanner->line;
   token.type = TOKEN_ERROR;
   token.start = error_str;
   token.length = strlen(error_str);
@@ -43,54 +35,54 @@ static Token error_token(const char *error_str) {
   return token;
 }
 
-static char advance() {
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner *scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static bool match(char expected) {
-  if (is_at_end()) {
+static bool match(Scanner *scanner, char expected) {
+  if (is_at_end(scanner)) {
     return false;
   }
 
-  if (*scanner.current != expected) {
+  if (*scanner->current != expected) {
     return false;
   }
 
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
-static char peek() {
-  return *scanner.current;
+static char peek(Scanner *scanner) {
+  return *scanner->current;
 }
 
-static char peek_next() {
-  if (is_at_end()) {
+static char peek_next(Scanner *scanner) {
+  if (is_at_end(scanner)) {
     return '\0';
   }
 
-  return scanner.current[1];
+  return scanner->current[1];
 }
 
-static void skip_whitespace() {
+static void skip_whitespace(Scanner *scanner) {
   for (;;) {
-    char c = peek();
+    char c = peek(scanner);
 
     switch(c) {
       case ' ':
       case '\r':
       case '\t':
-        advance();
+        advance(scanner);
         break;
       case '\n':
-        scanner.line++;
-        advance();
+        scanner->line++;
+        advance(scanner);
         break;
       case '/':
-        if (peek_next() == '/') {
+        if (peek_next(scanner) == '/') {
           // we are in a comment, eat the whole line
-          while(peek() != '\n' && !is_at_end()) advance();
+          while(peek(scanner) != '\n' && !is_at_end(scanner)) advance(scanner);
           break;
         } else {
           return;
@@ -101,124 +93,124 @@ static void skip_whitespace() {
   }
 }
 
-static Token string() {
-  while (peek() != '"' && !is_at_end()) {
-    if (peek() == '\n') {
-      scanner.line++;
+static Token string(Scanner *scanner) {
+  while (peek(scanner) != '"' && !is_at_end(scanner)) {
+    if (peek(scanner) == '\n') {
+      scanner->line++;
     }
 
-    advance();
+    advance(scanner);
   }
 
-  if (is_at_end()) {
-    return error_token("Unterminated string.");
+  if (is_at_end(scanner)) {
+    return error_token(scanner, "Unterminated string.");
   }
 
   // eat closing quote
-  advance();
-  return make_token(TOKEN_STRING);
+  advance(scanner);
+  return make_token(scanner, TOKEN_STRING);
 }
 
-static Token number() {
-  while (isdigit(peek())) advance();
+static Token number(Scanner *scanner) {
+  while (isdigit(peek(scanner))) advance(scanner);
 
-  if (peek() == '.' && isdigit(peek_next())) {
+  if (peek(scanner) == '.' && isdigit(peek_next(scanner))) {
     // eat '.'
-    advance();
+    advance(scanner);
 
-    while (isdigit(peek())) advance();
+    while (isdigit(peek(scanner))) advance(scanner);
   }
 
-  return make_token(TOKEN_NUMBER);
+  return make_token(scanner, TOKEN_NUMBER);
 }
 
-static TokenType check_keyword(size_t start, size_t length, const char *rest,
-    TokenType type) {
-  if ((size_t)(scanner.current - scanner.start) == start + length &&
-      !memcmp(scanner.start + start, rest, length)) {
+static TokenType check_keyword(Scanner *scanner, size_t start, size_t length,
+    const char *rest, TokenType type) {
+  if ((size_t)(scanner->current - scanner->start) == start + length &&
+      !memcmp(scanner->start + start, rest, length)) {
     return type;
   }
 
   return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifier_type() {
-  switch(scanner.start[0]) {
-    case 'a': return check_keyword(1, 2, "nd", TOKEN_AND);
-    case 'c': return check_keyword(1, 4, "lass", TOKEN_CLASS);
-    case 'e': return check_keyword(1, 3, "lse", TOKEN_ELSE);
+static TokenType identifier_type(Scanner *scanner) {
+  switch(scanner->start[0]) {
+    case 'a': return check_keyword(scanner, 1, 2, "nd", TOKEN_AND);
+    case 'c': return check_keyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+    case 'e': return check_keyword(scanner, 1, 3, "lse", TOKEN_ELSE);
     case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch(scanner.start[1]) {
-          case 'a': return check_keyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return check_keyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return check_keyword(2, 1, "n", TOKEN_FUN);
+      if (scanner->current - scanner->start > 1) {
+        switch(scanner->start[1]) {
+          case 'a': return check_keyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+          case 'o': return check_keyword(scanner, 2, 1, "r", TOKEN_FOR);
+          case 'u': return check_keyword(scanner, 2, 1, "n", TOKEN_FUN);
         }
       }
       break;
-    case 'i': return check_keyword(1, 1, "f", TOKEN_IF);
-    case 'n': return check_keyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return check_keyword(1, 1, "r", TOKEN_OR);
-    case 'p': return check_keyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's': return check_keyword(1, 4, "uper", TOKEN_SUPER);
+    case 'i': return check_keyword(scanner, 1, 1, "f", TOKEN_IF);
+    case 'n': return check_keyword(scanner, 1, 2, "il", TOKEN_NIL);
+    case 'o': return check_keyword(scanner, 1, 1, "r", TOKEN_OR);
+    case 'p': return check_keyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+    case 'r': return check_keyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+    case 's': return check_keyword(scanner, 1, 4, "uper", TOKEN_SUPER);
     case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch(scanner.start[1]) {
-          case 'h': return check_keyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return check_keyword(2, 2, "ue", TOKEN_TRUE);
+      if (scanner->current - scanner->start > 1) {
+        switch(scanner->start[1]) {
+          case 'h': return check_keyword(scanner, 2, 2, "is", TOKEN_THIS);
+          case 'r': return check_keyword(scanner, 2, 2, "ue", TOKEN_TRUE);
         }
       }
       break;
-    case 'v': return check_keyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return check_keyword(1, 4, "hile", TOKEN_WHILE);
+    case 'v': return check_keyword(scanner, 1, 2, "ar", TOKEN_VAR);
+    case 'w': return check_keyword(scanner, 1, 4, "hile", TOKEN_WHILE);
   }
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-  while (isalpha(peek()) || isdigit(peek()) || peek() == '_') advance();
-  return make_token(identifier_type());
+static Token identifier(Scanner *scanner) {
+  while (isalpha(peek(scanner)) || isdigit(peek(scanner)) || peek(scanner) == '_') advance(scanner);
+  return make_token(scanner, identifier_type(scanner));
 }
 
-Token scan_token() {
-  skip_whitespace();
-  scanner.start = scanner.current;
+Token scan_token(Scanner *scanner) {
+  skip_whitespace(scanner);
+  scanner->start = scanner->current;
 
-  if (is_at_end()) {
-    return make_token(TOKEN_EOF);
+  if (is_at_end(scanner)) {
+    return make_token(scanner, TOKEN_EOF);
   }
 
-  char c = advance();
+  char c = advance(scanner);
 
   if (isdigit(c)) {
-    return number();
+    return number(scanner);
   }
 
   if (isalpha(c) || c == '_') {
-    return identifier();
+    return identifier(scanner);
   }
 
   switch(c) {
-    case '(': return make_token(TOKEN_LEFT_PAREN);
-    case ')': return make_token(TOKEN_RIGHT_PAREN);
-    case '{': return make_token(TOKEN_LEFT_BRACE);
-    case '}': return make_token(TOKEN_RIGHT_BRACE);
-    case ';': return make_token(TOKEN_SEMICOLON);
-    case ',': return make_token(TOKEN_COMMA);
-    case '.': return make_token(TOKEN_DOT);
-    case '-': return make_token(TOKEN_MINUS);
-    case '+': return make_token(TOKEN_PLUS);
-    case '/': return make_token(TOKEN_SLASH);
-    case '*': return make_token(TOKEN_STAR);
-
-    case '!': return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-    case '=': return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-    case '>': return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-    case '<': return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-
-    case '"': return string();
+    case '(': return make_token(scanner, TOKEN_LEFT_PAREN);
+    case ')': return make_token(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return make_token(scanner, TOKEN_LEFT_BRACE);
+    case '}': return make_token(scanner, TOKEN_RIGHT_BRACE);
+    case ';': return make_token(scanner, TOKEN_SEMICOLON);
+    case ',': return make_token(scanner, TOKEN_COMMA);
+    case '.': return make_token(scanner, TOKEN_DOT);
+    case '-': return make_token(scanner, TOKEN_MINUS);
+    case '+': return make_token(scanner, TOKEN_PLUS);
+    case '/': return make_token(scanner, TOKEN_SLASH);
+    case '*': return make_token(scanner, TOKEN_STAR);
+
+    case '!': return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    case '=': return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    case '>': return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '<': return make_token(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+
+    case '"': return string(scanner);
   }
 
-  return error_token("Unexpected character");
+  return error_token(scanner, "Unexpected character");
 }
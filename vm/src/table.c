@@ -0,0 +1,422 @@
+#include <string.h>
+
+#include "clox/memory.h"
+#include "clox/object.h"
+#include "clox/table.h"
+
+#ifdef CLOX_SWISS_TABLE
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+#define GROUP_WIDTH 16
+
+// control bytes of free slots have the sign bit set, full slots hold the
+// low 7 bits of their key's hash
+#define CONTROL_EMPTY ((int8_t) -128)
+#define CONTROL_DELETED ((int8_t) -2)
+
+// bit i stands for slot i of a group
+typedef uint32_t GroupMask;
+
+static GroupMask match_byte(const int8_t *group, int8_t byte) {
+#ifdef __SSE2__
+  __m128i control = _mm_loadu_si128((const __m128i *) group);
+  return (GroupMask) _mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (GroupMask) (group[i] == byte) << i;
+  }
+  return mask;
+#endif // __SSE2__
+}
+
+static GroupMask match_empty(const int8_t *group) {
+  return match_byte(group, CONTROL_EMPTY);
+}
+
+static GroupMask match_free(const int8_t *group) {
+#ifdef __SSE2__
+  return (GroupMask) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) group));
+#else
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    mask |= (GroupMask) (group[i] < 0) << i;
+  }
+  return mask;
+#endif // __SSE2__
+}
+
+static size_t probe_start(uint32_t hash) {
+  return hash >> 7;
+}
+
+static int8_t control_byte(uint32_t hash) {
+  return (int8_t) (hash & 0x7f);
+}
+
+// the table is rebuilt once live entries and deleted slots fill 7/8 of it
+static size_t max_load(size_t capacity) {
+  return capacity - capacity / 8;
+}
+
+static size_t slots_size(size_t capacity) {
+  return capacity == 0 ? 0 : capacity * sizeof(Entry) + capacity + GROUP_WIDTH;
+}
+
+void init_table(Table *table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->growth_left = 0;
+  table->control = NULL;
+  table->entries = NULL;
+}
+
+void free_table(Table *table) {
+  reallocate((void **) &table->entries, slots_size(table->capacity), 0, MEM_TABLES);
+  init_table(table);
+}
+
+static void set_control(Table *table, size_t index, int8_t byte) {
+  table->control[index] = byte;
+  if (index < GROUP_WIDTH) {
+    table->control[table->capacity + index] = byte;
+  }
+}
+
+/**
+ * Returns the first empty or deleted slot on the probe sequence of hash.
+ * There always is one, the load limit keeps empty slots around.
+ */
+static size_t find_free_slot(const Table *table, uint32_t hash) {
+  size_t mask = table->capacity - 1;
+  for (size_t pos = probe_start(hash) & mask;; pos = (pos + GROUP_WIDTH) & mask) {
+    GroupMask free_slots = match_free(table->control + pos);
+    if (free_slots != 0) {
+      return (pos + __builtin_ctz(free_slots)) & mask;
+    }
+  }
+}
+
+static Entry *find_entry(const Table *table, const ObjString *key) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  size_t mask = table->capacity - 1;
+  int8_t byte = control_byte(key->hash);
+  for (size_t pos = probe_start(key->hash) & mask;; pos = (pos + GROUP_WIDTH) & mask) {
+    const int8_t *group = table->control + pos;
+    for (GroupMask matches = match_byte(group, byte); matches != 0; matches &= matches - 1) {
+      Entry *entry = &table->entries[(pos + __builtin_ctz(matches)) & mask];
+      if (entry->key == key) {
+        return entry;
+      }
+    }
+    // the key would have gone into this group's empty slot
+    if (match_empty(group) != 0) {
+      return NULL;
+    }
+  }
+}
+
+/**
+ * Moves every live entry into a fresh array of capacity slots, which also
+ * gets rid of deleted slots.
+ */
+static bool resize(Table *table, size_t capacity) {
+  Table resized;
+  init_table(&resized);
+  if (!reallocate((void **) &resized.entries, 0, slots_size(capacity), MEM_TABLES)) {
+    return false;
+  }
+  resized.capacity = capacity;
+  resized.control = (int8_t *) (resized.entries + capacity);
+  memset(resized.control, (uint8_t) CONTROL_EMPTY, capacity + GROUP_WIDTH);
+
+  for (size_t i = 0; i < table->capacity; i++) {
+    if (table->control[i] < 0) {
+      continue;
+    }
+    size_t index = find_free_slot(&resized, table->entries[i].key->hash);
+    set_control(&resized, index, table->control[i]);
+    resized.entries[index] = table->entries[i];
+  }
+  resized.count = table->count;
+  resized.growth_left = max_load(capacity) - table->count;
+
+  free_table(table);
+  *table = resized;
+  return true;
+}
+
+/**
+ * Makes room for one more entry. A table that is mostly deleted slots is
+ * rebuilt at the same size, otherwise it doubles.
+ */
+static bool grow(Table *table) {
+  if (table->capacity == 0) {
+    return resize(table, GROUP_WIDTH);
+  }
+  size_t capacity = table->count * 2 < max_load(table->capacity) ? table->capacity : table->capacity * 2;
+  return resize(table, capacity);
+}
+
+bool table_get(const Table *table, const ObjString *key, Value *value) {
+  Entry *entry = find_entry(table, key);
+  if (entry == NULL) {
+    return false;
+  }
+
+  *value = entry->value;
+  return true;
+}
+
+/**
+ * Returns true if key was not in the table before.
+ */
+bool table_set(Table *table, ObjString *key, Value value) {
+  Entry *entry = find_entry(table, key);
+  if (entry != NULL) {
+    entry->value = value;
+    return false;
+  }
+
+  if (table->capacity == 0 && !grow(table)) {
+    return false;
+  }
+  size_t index = find_free_slot(table, key->hash);
+  // reusing a deleted slot is always fine, an empty one uses up growth
+  if (table->control[index] == CONTROL_EMPTY && table->growth_left == 0) {
+    if (!grow(table)) {
+      return false;
+    }
+    index = find_free_slot(table, key->hash);
+  }
+
+  table->growth_left -= table->control[index] == CONTROL_EMPTY;
+  set_control(table, index, control_byte(key->hash));
+  table->entries[index] = (Entry) {key, value};
+  table->count++;
+  return true;
+}
+
+bool table_delete(Table *table, const ObjString *key) {
+  Entry *entry = find_entry(table, key);
+  if (entry == NULL) {
+    return false;
+  }
+
+  // A lookup only gives up in a group that has an empty slot. If the run
+  // of non-empty slots around this one is shorter than a group, every
+  // group covering it has an empty slot already and lookups stopping
+  // there still stop there, so the slot can simply become empty.
+  size_t mask = table->capacity - 1;
+  size_t index = (size_t) (entry - table->entries);
+  GroupMask empty_before = match_empty(table->control + ((index - GROUP_WIDTH) & mask));
+  GroupMask empty_after = match_empty(table->control + index);
+  int full_before = empty_before == 0 ? GROUP_WIDTH : __builtin_clz(empty_before) - (32 - GROUP_WIDTH);
+  int full_after = empty_after == 0 ? GROUP_WIDTH : __builtin_ctz(empty_after);
+
+  if (full_before + full_after < GROUP_WIDTH) {
+    set_control(table, index, CONTROL_EMPTY);
+    table->growth_left++;
+  } else {
+    set_control(table, index, CONTROL_DELETED);
+  }
+  entry->key = NULL;
+  table->count--;
+  return true;
+}
+
+void table_add_all(const Table *from, Table *to) {
+  for (size_t i = 0; i < from->capacity; i++) {
+    if (from->control[i] >= 0) {
+      table_set(to, from->entries[i].key, from->entries[i].value);
+    }
+  }
+}
+
+/**
+ * Looks a string up by its characters instead of by pointer. This is the
+ * one place that compares string contents, everything else relies on
+ * interned strings being unique.
+ */
+ObjString *table_find_string(const Table *table, const char *chars, size_t length, uint32_t hash) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  size_t mask = table->capacity - 1;
+  int8_t byte = control_byte(hash);
+  for (size_t pos = probe_start(hash) & mask;; pos = (pos + GROUP_WIDTH) & mask) {
+    const int8_t *group = table->control + pos;
+    for (GroupMask matches = match_byte(group, byte); matches != 0; matches &= matches - 1) {
+      ObjString *key = table->entries[(pos + __builtin_ctz(matches)) & mask].key;
+      if (key->length == length && key->hash == hash && memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+    }
+    if (match_empty(group) != 0) {
+      return NULL;
+    }
+  }
+}
+
+#else
+
+// grow once live entries and tombstones fill three quarters of the slots
+#define TABLE_MAX_LOAD 0.75
+
+void init_table(Table *table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void free_table(Table *table) {
+  reallocate((void **) &table->entries, table->capacity * sizeof(Entry), 0, MEM_TABLES);
+  init_table(table);
+}
+
+/**
+ * Returns the entry for key, or the slot where it should be inserted. The
+ * first tombstone on the probe sequence is reused for inserts.
+ */
+static Entry *find_entry(Entry *entries, size_t capacity, const ObjString *key) {
+  size_t mask = capacity - 1;
+  Entry *tombstone = NULL;
+
+  for (size_t index = key->hash & mask;; index = (index + 1) & mask) {
+    Entry *entry = &entries[index];
+    if (entry->key == NULL) {
+      if (IS_NIL(entry->value)) {
+        return tombstone != NULL ? tombstone : entry;
+      }
+      if (tombstone == NULL) {
+        tombstone = entry;
+      }
+    } else if (entry->key == key) {
+      return entry;
+    }
+  }
+}
+
+static bool adjust_capacity(Table *table, size_t capacity) {
+  Entry *entries = NULL;
+  if (!reallocate((void **) &entries, 0, capacity * sizeof(Entry), MEM_TABLES)) {
+    return false;
+  }
+  for (size_t i = 0; i < capacity; i++) {
+    entries[i].key = NULL;
+    entries[i].value = NIL_VAL(0);
+  }
+
+  // tombstones are dropped while rehashing
+  table->count = 0;
+  for (size_t i = 0; i < table->capacity; i++) {
+    Entry *entry = &table->entries[i];
+    if (entry->key == NULL) {
+      continue;
+    }
+
+    Entry *dest = find_entry(entries, capacity, entry->key);
+    dest->key = entry->key;
+    dest->value = entry->value;
+    table->count++;
+  }
+
+  reallocate((void **) &table->entries, table->capacity * sizeof(Entry), 0, MEM_TABLES);
+  table->entries = entries;
+  table->capacity = capacity;
+  return true;
+}
+
+bool table_get(const Table *table, const ObjString *key, Value *value) {
+  if (table->count == 0) {
+    return false;
+  }
+
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  if (entry->key == NULL) {
+    return false;
+  }
+
+  *value = entry->value;
+  return true;
+}
+
+/**
+ * Returns true if key was not in the table before.
+ */
+bool table_set(Table *table, ObjString *key, Value value) {
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD &&
+      !adjust_capacity(table, grow_capacity(table->capacity))) {
+    return false;
+  }
+
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  bool is_new_key = entry->key == NULL;
+  // reusing a tombstone does not change the count, it was counted already
+  if (is_new_key && IS_NIL(entry->value)) {
+    table->count++;
+  }
+
+  entry->key = key;
+  entry->value = value;
+  return is_new_key;
+}
+
+bool table_delete(Table *table, const ObjString *key) {
+  if (table->count == 0) {
+    return false;
+  }
+
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  if (entry->key == NULL) {
+    return false;
+  }
+
+  // leave a tombstone so probe sequences running through it stay intact
+  entry->key = NULL;
+  entry->value = BOOL_VAL(true);
+  return true;
+}
+
+void table_add_all(const Table *from, Table *to) {
+  for (size_t i = 0; i < from->capacity; i++) {
+    Entry *entry = &from->entries[i];
+    if (entry->key != NULL) {
+      table_set(to, entry->key, entry->value);
+    }
+  }
+}
+
+/**
+ * Looks a string up by its characters instead of by pointer. This is the
+ * one place that compares string contents, everything else relies on
+ * interned strings being unique.
+ */
+ObjString *table_find_string(const Table *table, const char *chars, size_t length, uint32_t hash) {
+  if (table->count == 0) {
+    return NULL;
+  }
+
+  size_t mask = table->capacity - 1;
+  for (size_t index = hash & mask;; index = (index + 1) & mask) {
+    Entry *entry = &table->entries[index];
+    if (entry->key == NULL) {
+      // stop at an empty slot, keep going past tombstones
+      if (IS_NIL(entry->value)) {
+        return NULL;
+      }
+    } else if (entry->key->length == length && entry->key->hash == hash &&
+        memcmp(entry->key->chars, chars, length) == 0) {
+      return entry->key;
+    }
+  }
+}
+
+#endif // CLOX_SWISS_TABLE
@@ -0,0 +1,68 @@
+#include "clox/debug.h"
+#include "clox/trace.h"
+
+void init_tracer(Tracer *tracer) {
+  tracer->mode = TRACE_OFF;
+  reset_tracer(tracer);
+}
+
+void reset_tracer(Tracer *tracer) {
+  tracer->next = 0;
+  tracer->count = 0;
+}
+
+static void print_stack(FILE *out, const Value *values, size_t count, bool truncated) {
+  fprintf(out, "    ");
+  if (truncated) {
+    fprintf(out, "... ");
+  }
+  for (size_t i = 0; i < count; i++) {
+    fprintf(out, "[ ");
+    fprint_value(out, values[i]);
+    fprintf(out, " ]");
+  }
+  fprintf(out, "\n");
+}
+
+/**
+ * Records the instruction at offset, or prints it to out right away
+ * in TRACE_STDOUT mode.
+ */
+void trace_instruction(Tracer *tracer, FILE *out, Chunk *chunk, size_t offset,
+    const Value *stack, const Value *stack_top) {
+  size_t depth = stack_top - stack;
+
+  if (tracer->mode == TRACE_STDOUT) {
+    print_stack(out, stack, depth, false);
+    fdisassemble_instruction(out, chunk, offset);
+    return;
+  }
+
+  TraceEntry *entry = &tracer->entries[tracer->next];
+  entry->chunk = chunk;
+  entry->offset = offset;
+  entry->stack_depth = depth;
+
+  size_t kept = depth < TRACE_STACK_DEPTH ? depth : TRACE_STACK_DEPTH;
+  for (size_t i = 0; i < kept; i++) {
+    entry->stack[i] = stack_top[(ptrdiff_t) i - (ptrdiff_t) kept];
+  }
+
+  tracer->next = (tracer->next + 1) % TRACE_CAPACITY;
+  if (tracer->count < TRACE_CAPACITY) {
+    tracer->count++;
+  }
+}
+
+/**
+ * Prints the recorded instructions, oldest first.
+ */
+void dump_trace(const Tracer *tracer, FILE *out) {
+  size_t first = (tracer->next + TRACE_CAPACITY - tracer->count) % TRACE_CAPACITY;
+  for (size_t i = 0; i < tracer->count; i++) {
+    const TraceEntry *entry = &tracer->entries[(first + i) % TRACE_CAPACITY];
+    size_t kept = entry->stack_depth < TRACE_STACK_DEPTH ? entry->stack_depth : TRACE_STACK_DEPTH;
+    print_stack(out, entry->stack, kept, kept < entry->stack_depth);
+    fdisassemble_instruction(out, entry->chunk, entry->offset);
+  }
+}
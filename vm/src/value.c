@@ -1,6 +1,8 @@
+#include <math.h>
 #include <stdio.h>
 
 #include "clox/memory.h"
+#include "clox/object.h"
 #include "clox/value.h"
 
 //TODO: this is a copy paste from chunk
@@ -14,7 +16,7 @@ bool write_value_array(ValueArray *value_array, Value value) {
   if (value_array->capacity < value_array->count + 1) {
     size_t old_capacity = value_array->capacity;
     value_array->capacity = grow_capacity(old_capacity);
-    if (!reallocate((void **) &value_array->values, old_capacity * sizeof(Value), value_array->capacity * sizeof(Value))) {
+    if (!reallocate((void **) &value_array->values, old_capacity * sizeof(Value), value_array->capacity * sizeof(Value), MEM_CONSTANTS)) {
       fprintf(stderr, "Failed to grow value array\n");
       return false;
     }
@@ -27,10 +29,51 @@ bool write_value_array(ValueArray *value_array, Value value) {
 }
 
 void free_value_array(ValueArray *value_array) {
-  reallocate((void **) &value_array->values, value_array->capacity * sizeof(Value), 0);
+  reallocate((void **) &value_array->values, value_array->capacity * sizeof(Value), 0, MEM_CONSTANTS);
   init_value_array(value_array);
 }
 
+/**
+ * Strings are interned, so two strings are equal exactly when they are the
+ * same object and every object compares by identity.
+ */
+bool values_equal(Value a, Value b) {
+#ifdef CLOX_NAN_BOXING
+  // NaN is not equal to itself, everything else compares by its bits
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b;
+#else
+  if (a.type != b.type) {
+    return false;
+  }
+  switch (a.type) {
+    case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NIL:    return true;
+    case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+  }
+  return false;
+#endif // CLOX_NAN_BOXING
+}
+
 void print_value(Value value) {
-  fprintf(stdout, "%g", AS_NUMBER(value));
+  fprint_value(stdout, value);
+}
+
+void fprint_value(FILE *out, Value value) {
+  if (IS_BOOL(value)) {
+    fprintf(out, AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    fprintf(out, "nil");
+  } else if (IS_NUMBER(value)) {
+    // which NaN an operation returns depends on the order the C compiler
+    // or the JIT picked for its operands, printing is the only place the
+    // sign would show
+    double number = AS_NUMBER(value);
+    fprintf(out, "%g", isnan(number) ? NAN : number);
+  } else if (IS_OBJ(value)) {
+    fprint_object(out, value);
+  }
 }
@@ -1,126 +1,995 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <string.h>
 
+#include "clox/cache.h"
 #include "clox/compiler.h"
+#include "clox/debug.h"
+#include "clox/jit.h"
+#include "clox/object.h"
 #include "clox/vm.h"
 
-#define DEBUG_TRACE_EXECUTION
-#ifdef DEBUG_TRACE_EXECUTION
-#include "clox/debug.h"
-#endif // DEBUG_TRACE_EXECUTION
+#if defined(DEBUG_TRACE_EXECUTION) || defined(CLOX_PROFILE)
+#define CLOX_INSTRUMENTED
+#endif
 
-VM vm;
+// a stack that grew beyond this many values is given back after the run,
+// so an idle VM holds little more than its globals
+#define STACK_KEEP 1024
 
-static void reset_stack() {
-  vm.stack_top = vm.stack;
+static void reset_stack(VM *vm) {
+  vm->stack_top = vm->stack;
 }
 
-static void runtime_error(const char *format, ...) {
+static void runtime_error(VM *vm, const char *format, ...) {
   va_list args;
   va_start(args, format);
-  vfprintf(stderr, format, args);
+  vfprintf(vm->err, format, args);
   va_end(args);
-  fputs("\n", stderr);
+  fputs("\n", vm->err);
 
   // we need -1 because we advance past each instr before
   // executing it
-  size_t instruction = vm.ip - vm.chunk->code - 1;
+  size_t instruction = vm->ip - vm->chunk->code - 1;
   // check what line we were executing
-  int line = vm.chunk->lines[instruction];
-  fprintf(stderr, "[line %d] in script\n", line);
-  reset_stack();
+  size_t line = get_line(vm->chunk, instruction);
+  fprintf(vm->err, "[line %ld] in script\n", line);
+
+#ifdef DEBUG_TRACE_EXECUTION
+  if (vm->tracer.mode == TRACE_RING && vm->tracer.count > 0) {
+    fprintf(vm->err, "Last %ld executed instructions:\n", vm->tracer.count);
+    dump_trace(&vm->tracer, vm->err);
+  }
+#endif // DEBUG_TRACE_EXECUTION
+
+  reset_stack(vm);
+}
+
+void init_vm(VM *vm) {
+  vm->stack = NULL;
+  vm->stack_end = NULL;
+  vm->stack_limit = STACK_LIMIT;
+  reset_stack(vm);
+  vm->out = stdout;
+  vm->err = stderr;
+  vm->print_code = false;
+  vm->quicken = true;
+  vm->quicken_stats = false;
+  vm->superinstructions = true;
+  vm->opt_level = 0;
+  vm->registers = false;
+  vm->jit = false;
+  vm->jit_hot_runs = JIT_HOT_RUNS;
+  vm->native_runs = 0;
+  vm->cache_dir = NULL;
+  init_table(&vm->strings);
+  vm->objects = NULL;
+  init_collector(&vm->gc);
+  vm->globals = NULL;
+  vm->global_count = 0;
+  vm->global_capacity = 0;
+  init_table(&vm->global_slots);
+#ifdef DEBUG_TRACE_EXECUTION
+  init_tracer(&vm->tracer);
+#endif // DEBUG_TRACE_EXECUTION
+#ifdef CLOX_PROFILE
+  vm->profiler = NULL;
+#endif // CLOX_PROFILE
+}
+
+static void free_stack(VM *vm) {
+  if (vm->stack != NULL) {
+    Value *slots = vm->stack - 1;
+    reallocate((void **) &slots, (size_t) (vm->stack_end - slots) * sizeof(Value), 0, MEM_STACK);
+  }
+  vm->stack = NULL;
+  vm->stack_end = NULL;
+  reset_stack(vm);
+}
+
+void free_vm(VM *vm) {
+  free_stack(vm);
+  free_table(&vm->strings);
+  free_table(&vm->global_slots);
+  reallocate((void **) &vm->globals, vm->global_capacity * sizeof(Global), 0, MEM_GLOBALS);
+  vm->global_count = 0;
+  vm->global_capacity = 0;
+  free_objects(vm);
+  free_collector(&vm->gc);
+  slab_release_empty();
+#ifdef CLOX_PROFILE
+  if (vm->profiler != NULL) {
+    report_profile(vm->profiler, vm->err);
+    if (vm->profiler->csv_path != NULL) {
+      write_profile_csv(vm->profiler, vm->profiler->csv_path);
+    }
+    free_profiler(vm->profiler);
+    vm->profiler = NULL;
+  }
+#endif // CLOX_PROFILE
+}
+
+#ifdef CLOX_INSTRUMENTED
+/**
+ * True if the run loop has to call into the tracer or the profiler.
+ */
+static bool instrumented(VM *vm) {
+  bool on = false;
+#ifdef DEBUG_TRACE_EXECUTION
+  on |= vm->tracer.mode != TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+#ifdef CLOX_PROFILE
+  on |= vm->profiler != NULL;
+#endif // CLOX_PROFILE
+  return on;
+}
+
+/**
+ * Hands the instruction at vm->ip to the tracer and the profiler.
+ */
+static void instrument_instruction(VM *vm) {
+#ifdef DEBUG_TRACE_EXECUTION
+  if (vm->tracer.mode != TRACE_OFF) {
+    trace_instruction(&vm->tracer, vm->out, vm->chunk,
+        (size_t)(vm->ip - vm->chunk->code), vm->stack, vm->stack_top);
+  }
+#endif // DEBUG_TRACE_EXECUTION
+#ifdef CLOX_PROFILE
+  if (vm->profiler != NULL) {
+    profile_instruction(vm->profiler, *vm->ip);
+  }
+#endif // CLOX_PROFILE
+}
+#endif // CLOX_INSTRUMENTED
+
+/**
+ * Makes room for count more values, moving the stack if it has to grow.
+ * Fails if that would take more than vm->stack_limit values or there is
+ * no memory. One more value is allocated below VM.stack, run() spills its
+ * cached top there while the stack is empty.
+ */
+bool grow_stack(VM *vm, size_t count) {
+  size_t depth = vm->stack == NULL ? 0 : (size_t) (vm->stack_top - vm->stack);
+  size_t capacity = vm->stack == NULL ? 0 : (size_t) (vm->stack_end - vm->stack);
+  if (count <= capacity - depth) {
+    return true;
+  }
+  if (count > vm->stack_limit || depth > vm->stack_limit - count) {
+    return false;
+  }
+
+  size_t new_capacity = capacity < STACK_INITIAL ? STACK_INITIAL : capacity;
+  while (new_capacity < depth + count) {
+    new_capacity = new_capacity > vm->stack_limit / 2 ? vm->stack_limit : new_capacity * 2;
+  }
+  if (new_capacity > vm->stack_limit) {
+    new_capacity = vm->stack_limit;
+  }
+  Value *slots = vm->stack == NULL ? NULL : vm->stack - 1;
+  size_t old_size = vm->stack == NULL ? 0 : (capacity + 1) * sizeof(Value);
+  if (!reallocate((void **) &slots, old_size, (new_capacity + 1) * sizeof(Value), MEM_STACK)) {
+    return false;
+  }
+  if (vm->stack == NULL) {
+    slots[0] = NIL_VAL(0);
+  }
+  vm->stack = slots + 1;
+  vm->stack_top = vm->stack + depth;
+  vm->stack_end = vm->stack + new_capacity;
+  return true;
+}
+
+/**
+ * Reports why the stack could not take one more value.
+ */
+static void stack_error(VM *vm) {
+  size_t depth = vm->stack == NULL ? 0 : (size_t) (vm->stack_top - vm->stack);
+  if (depth >= vm->stack_limit) {
+    runtime_error(vm, "Stack overflow.");
+  } else {
+    runtime_error(vm, "Out of memory.");
+  }
+}
+
+/**
+ * The caller makes sure there is room, see grow_stack().
+ */
+void push(VM *vm, Value value) {
+  *vm->stack_top = value;
+  vm->stack_top++;
 }
 
-void init_vm() {
-  reset_stack();
+Value pop(VM *vm) {
+  assert(vm->stack_top >= vm->stack);
+  vm->stack_top--;
+  return *vm->stack_top;
 }
 
-void free_vm() {
+static bool is_falsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-void push(Value value) {
-  *vm.stack_top = value;
-  vm.stack_top++;
+/**
+ * Finds the slot of the global called name. A name seen for the first time
+ * gets the next free slot, still undefined. Fails once all GLOBALS_MAX
+ * slots are taken.
+ */
+bool global_slot(VM *vm, ObjString *name, uint32_t *slot) {
+  Value index;
+  if (table_get(&vm->global_slots, name, &index)) {
+    *slot = (uint32_t) AS_NUMBER(index);
+    return true;
+  }
+
+  if (vm->global_count == GLOBALS_MAX) {
+    return false;
+  }
+  if (vm->global_count == vm->global_capacity) {
+    size_t capacity = grow_capacity(vm->global_capacity);
+    if (!reallocate((void **) &vm->globals, vm->global_capacity * sizeof(Global),
+          capacity * sizeof(Global), MEM_GLOBALS)) {
+      return false;
+    }
+    vm->global_capacity = capacity;
+  }
+  // the name is new, so false can only mean the table failed to grow
+  if (!table_set(&vm->global_slots, name, NUMBER_VAL(vm->global_count))) {
+    return false;
+  }
+
+  vm->globals[vm->global_count] = (Global) {NIL_VAL(0), name, false};
+  *slot = (uint32_t) vm->global_count++;
+  return true;
 }
 
-Value pop() {
-  assert(vm.stack_top >= vm.stack);
-  vm.stack_top--;
-  return *vm.stack_top;
+/**
+ * Forgets every global and its slot, so the next script run in the VM
+ * starts without them. The array keeps its capacity.
+ */
+void reset_globals(VM *vm) {
+  free_table(&vm->global_slots);
+  init_table(&vm->global_slots);
+  vm->global_count = 0;
+  // a collection that is marking scans the slots that get reused again
+  vm->gc.next_global = 0;
 }
 
-static Value peek(int distance) {
-  return vm.stack_top[-1 - distance];
+/**
+ * Rewrites the instruction that just ran into opcode, its form for the
+ * operand types it saw. The code may move when it is made writable.
+ */
+static void quicken(VM *vm, OpCode opcode) {
+  if (!vm->quicken) {
+    return;
+  }
+  size_t offset = (size_t) (vm->ip - 1 - vm->chunk->code);
+  if (quicken_instruction(vm->chunk, offset, opcode)) {
+    vm->ip = vm->chunk->code + offset + 1;
+  }
 }
 
+/**
+ * Main interpreter loop.
+ *
+ * With CLOX_COMPUTED_GOTO every handler jumps straight to the next one
+ * through dispatch_table, so each opcode gets its own indirect branch and
+ * the branch predictor can learn opcode sequences. Without it we fall back
+ * to the portable switch where every instruction goes through one jump.
+ *
+ * ip, the stack pointer and the value on top of the stack live in locals
+ * the compiler can keep in registers. The top value is not written to its
+ * slot until something outside the loop looks at the stack: the
+ * collector, the tracer, a stack that grows, or the caller once the chunk
+ * returned. SPILL() writes all three back to the VM and RELOAD() reads
+ * them again. While the stack is empty top is junk and goes to the slot
+ * below VM.stack, which is there for just that.
+ */
+static InterpretResult run(VM *vm) {
+  // the cached top needs somewhere to go from the start
+  if (vm->stack == NULL && !grow_stack(vm, 1)) {
+    fprintf(vm->err, "Out of memory.\n");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  uint8_t *ip = vm->ip;
+  Value *sp = vm->stack_top;
+  Value top = sp[-1];
+  // fixed for the run, a local keeps the check off memory
+  const bool quicken_stats = vm->quicken_stats;
+
+#define SPILL()                                                 \
+  do {                                                          \
+    vm->ip = ip;                                                \
+    sp[-1] = top;                                               \
+    vm->stack_top = sp;                                         \
+  } while (0)
+#define RELOAD()                                                \
+  do {                                                          \
+    ip = vm->ip;                                                \
+    sp = vm->stack_top;                                         \
+    top = sp[-1];                                               \
+  } while (0)
+#define PUSH(value)                                             \
+  do {                                                          \
+    Value pushed = (value);                                     \
+    sp[-1] = top;                                               \
+    sp++;                                                       \
+    top = pushed;                                               \
+  } while (0)
+#define DROP()                                                  \
+  do {                                                          \
+    sp--;                                                       \
+    top = sp[-1];                                               \
+  } while (0)
+// the value below the top, only the top itself is cached
+#define SECOND() (sp[-2])
+// runtime_error() only needs to know where we are, it empties the stack
+#define RUNTIME_ERROR(...)                                      \
+  do {                                                          \
+    vm->ip = ip;                                                \
+    runtime_error(vm, __VA_ARGS__);                             \
+    return INTERPRET_RUNTIME_ERROR;                             \
+  } while (0)
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG()                                            \
+  (ip += 3,                                                             \
+   vm->chunk->constants.values[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define READ_GLOBAL() (ip += 2, &vm->globals[ip[-2] | (ip[-1] << 8)])
+// the collector may have scanned the global already, a value stored while
+// it marks has to be marked right away
+#define GLOBAL_BARRIER(value)                                   \
+  do {                                                          \
+    if (vm->gc.phase == GC_MARK) gc_mark_value(vm, value);      \
+  } while (0)
+// quickening may copy the code to make it writable, ip follows it
+#define QUICKEN(opcode)                                         \
+  do {                                                          \
+    vm->ip = ip;                                                \
+    quicken(vm, opcode);                                        \
+    ip = vm->ip;                                                \
+  } while (0)
+// quickened instructions count their hits while stats are on, a miss
+// turns them back into the generic form, which runs again right away
+#define SITE() (&vm->chunk->sites[ip - 1 - vm->chunk->code])
+#define HIT()                                                   \
+  do {                                                          \
+    if (quicken_stats) {                                        \
+      QuickSite *site = SITE();                                 \
+      if (site->hits < UINT32_MAX) site->hits++;                \
+    }                                                           \
+  } while (0)
+#define DEOPTIMIZE(generic)                                     \
+  do {                                                          \
+    SITE()->misses++;                                           \
+    ip[-1] = generic;                                           \
+    ip--;                                                       \
+  } while (0)
+// only the instructions that load a value push more than they pop, they
+// check for room first. Growing moves the stack.
+#define RESERVE_STACK()                                         \
+  do {                                                          \
+    if (sp == vm->stack_end) {                                  \
+      SPILL();                                                  \
+      if (!grow_stack(vm, 1)) {                                 \
+        stack_error(vm);                                        \
+        return INTERPRET_RUNTIME_ERROR;                         \
+      }                                                         \
+      RELOAD();                                                 \
+    }                                                           \
+  } while (0)
+#define BINARY_OP(valueType, op)                                \
+  do {                                                          \
+    Value b = top;                                              \
+    Value a = SECOND();                                         \
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {                       \
+      RUNTIME_ERROR("Operands must be numbers.");               \
+    }                                                           \
+    sp--;                                                       \
+    top = valueType(AS_NUMBER(a) op AS_NUMBER(b));              \
+  } while (0)
+
+// Bodies of the instructions the compiler emits, shared by their own
+// handlers and by the superinstructions they are part of. quickening is
+// false inside a superinstruction, its parts must not rewrite the code.
+#define DO_OP_CONSTANT(quickening)                              \
+  do {                                                          \
+    RESERVE_STACK();                                            \
+    PUSH(READ_CONSTANT());                                      \
+  } while (0)
+#define DO_OP_CONSTANT_LONG(quickening)                         \
+  do {                                                          \
+    RESERVE_STACK();                                            \
+    PUSH(READ_CONSTANT_LONG());                                 \
+  } while (0)
+#define DO_OP_ADD(quickening)                                   \
+  do {                                                          \
+    Value b = top;                                              \
+    Value a = SECOND();                                         \
+    if (IS_STRING(a) && IS_STRING(b)) {                         \
+      /* the collector may run, it finds both operands on the stack */ \
+      SPILL();                                                  \
+      ObjString *result = concatenate_strings(vm, AS_STRING(a), AS_STRING(b)); \
+      if (result == NULL) {                                     \
+        RUNTIME_ERROR("Out of memory.");                        \
+      }                                                         \
+      sp--;                                                     \
+      top = OBJ_VAL(result);                                    \
+      if (quickening) QUICKEN(OP_ADD_STR);                      \
+    } else if (IS_NUMBER(a) && IS_NUMBER(b)) {                  \
+      sp--;                                                     \
+      top = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));            \
+      if (quickening) QUICKEN(OP_ADD_NUM);                      \
+    } else {                                                    \
+      RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+    }                                                           \
+  } while (0)
+#define DO_OP_SUBTRACT(quickening) BINARY_OP(NUMBER_VAL, -)
+#define DO_OP_MULTIPLY(quickening) BINARY_OP(NUMBER_VAL, *)
+#define DO_OP_DIVIDE(quickening) BINARY_OP(NUMBER_VAL, /)
+#define DO_OP_NEGATE(quickening)                                \
+  do {                                                          \
+    if (!IS_NUMBER(top)) {                                      \
+      RUNTIME_ERROR("Operand must be a number.");               \
+    }                                                           \
+    top = NUMBER_VAL(-AS_NUMBER(top));                          \
+  } while (0)
+#define DO_OP_EQUAL(quickening)                                 \
+  do {                                                          \
+    Value b = top;                                              \
+    Value a = SECOND();                                         \
+    sp--;                                                       \
+    top = BOOL_VAL(values_equal(a, b));                         \
+    if ((quickening) && IS_NUMBER(a) && IS_NUMBER(b)) {         \
+      QUICKEN(OP_EQUAL_NUM);                                    \
+    }                                                           \
+  } while (0)
+#define DO_OP_NOT(quickening) top = BOOL_VAL(is_falsey(top))
+#define DO_OP_PRINT(quickening)                                 \
+  do {                                                          \
+    fprint_value(vm->out, top);                                 \
+    fprintf(vm->out, "\n");                                     \
+    DROP();                                                     \
+  } while (0)
+#define DO_OP_POP(quickening) DROP()
+#define DO_OP_DEFINE_GLOBAL(quickening)                         \
+  do {                                                          \
+    Global *global = READ_GLOBAL();                             \
+    global->value = top;                                        \
+    global->defined = true;                                     \
+    GLOBAL_BARRIER(global->value);                              \
+    DROP();                                                     \
+  } while (0)
+#define DO_OP_GET_GLOBAL(quickening)                            \
+  do {                                                          \
+    Global *global = READ_GLOBAL();                             \
+    if (!global->defined) {                                     \
+      RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars); \
+    }                                                           \
+    RESERVE_STACK();                                            \
+    PUSH(global->value);                                        \
+  } while (0)
+// assignment is an expression, its value stays on the stack
+#define DO_OP_SET_GLOBAL(quickening)                            \
+  do {                                                          \
+    Global *global = READ_GLOBAL();                             \
+    if (!global->defined) {                                     \
+      RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars); \
+    }                                                           \
+    global->value = top;                                        \
+    GLOBAL_BARRIER(global->value);                              \
+  } while (0)
+#define DO_OP_RETURN(quickening)                                \
+  do {                                                          \
+    SPILL();                                                    \
+    return INTERPRET_OK;                                        \
+  } while (0)
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(valueType, op)                        \
-  do {                                                  \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {   \
-      runtime_error("Operands must be numbers.");       \
-      return INTERPRET_RUNTIME_ERROR;                   \
-    }                                                   \
-    double b = AS_NUMBER(pop());                        \
-    double a = AS_NUMBER(pop());                        \
-    push(valueType(a op b));                            \
-  } while(0)
+#ifdef CLOX_COMPUTED_GOTO
+// labels as values and range initializers are GNU extensions, silence
+// -pedantic just for the table and the indirect jumps
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void *dispatch_table[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&unknown_opcode,
+    [OP_CONSTANT]      = &&TARGET_OP_CONSTANT,
+    [OP_CONSTANT_LONG] = &&TARGET_OP_CONSTANT_LONG,
+    [OP_ADD]           = &&TARGET_OP_ADD,
+    [OP_SUBTRACT]      = &&TARGET_OP_SUBTRACT,
+    [OP_MULTIPLY]      = &&TARGET_OP_MULTIPLY,
+    [OP_DIVIDE]        = &&TARGET_OP_DIVIDE,
+    [OP_RETURN]        = &&TARGET_OP_RETURN,
+    [OP_NEGATE]        = &&TARGET_OP_NEGATE,
+    [OP_EQUAL]         = &&TARGET_OP_EQUAL,
+    [OP_NOT]           = &&TARGET_OP_NOT,
+    [OP_PRINT]         = &&TARGET_OP_PRINT,
+    [OP_POP]           = &&TARGET_OP_POP,
+    [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+    [OP_GET_GLOBAL]    = &&TARGET_OP_GET_GLOBAL,
+    [OP_SET_GLOBAL]    = &&TARGET_OP_SET_GLOBAL,
+    [OP_ADD_NUM]       = &&TARGET_OP_ADD_NUM,
+    [OP_ADD_STR]       = &&TARGET_OP_ADD_STR,
+    [OP_EQUAL_NUM]     = &&TARGET_OP_EQUAL_NUM,
+#define SUPERINSTRUCTION(name, first, second) [name] = &&TARGET_##name,
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+  };
+  void **dispatch = dispatch_table;
+
+#ifdef CLOX_INSTRUMENTED
+  // While tracing or profiling every opcode first goes through
+  // instrument_next, which records the instruction and then jumps to the
+  // real handler. With both off the loop never looks at them, so they
+  // cost nothing.
+  static void *instrument_table[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX] = &&instrument_next,
+  };
+  if (instrumented(vm)) {
+    dispatch = instrument_table;
+  }
+#endif // CLOX_INSTRUMENTED
+
+#define TARGET(op) TARGET_##op
+#define DISPATCH() goto *dispatch[READ_BYTE()]
+
+  DISPATCH();
+
+#ifdef CLOX_INSTRUMENTED
+instrument_next:
+  ip--;
+  // the tracer prints the stack as it is in memory
+  SPILL();
+  instrument_instruction(vm);
+  goto *dispatch_table[READ_BYTE()];
+#endif // CLOX_INSTRUMENTED
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
+#endif // CLOX_COMPUTED_GOTO
+
+#if defined(CLOX_INSTRUMENTED) && !defined(CLOX_COMPUTED_GOTO)
+  bool instrument = instrumented(vm);
+#endif
 
   for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    fprintf(stdout, "    ");
-    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-      fprintf(stdout, "[ ");
-      print_value(*slot);
-      fprintf(stdout, " ]");
+#if defined(CLOX_INSTRUMENTED) && !defined(CLOX_COMPUTED_GOTO)
+    if (instrument) {
+      SPILL();
+      instrument_instruction(vm);
     }
-    fprintf(stdout, "\n");
-    disassemble_instruction(vm.chunk, (size_t)(vm.ip - vm.chunk->code));
-#endif // DEBUG_TRACE_EXECUTION
-    uint8_t instr;
-    switch(instr = READ_BYTE()) {
-      case OP_CONSTANT: push(READ_CONSTANT()); break;
-      case OP_ADD:      BINARY_OP(NUMBER_VAL, +); break;
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
+#endif
+    switch(READ_BYTE()) {
+      TARGET(OP_CONSTANT): DO_OP_CONSTANT(true); DISPATCH();
+      TARGET(OP_CONSTANT_LONG): DO_OP_CONSTANT_LONG(true); DISPATCH();
+      TARGET(OP_ADD): DO_OP_ADD(true); DISPATCH();
+      TARGET(OP_SUBTRACT): DO_OP_SUBTRACT(true); DISPATCH();
+      TARGET(OP_MULTIPLY): DO_OP_MULTIPLY(true); DISPATCH();
+      TARGET(OP_DIVIDE): DO_OP_DIVIDE(true); DISPATCH();
+      TARGET(OP_NEGATE): DO_OP_NEGATE(true); DISPATCH();
+      TARGET(OP_EQUAL): DO_OP_EQUAL(true); DISPATCH();
+      TARGET(OP_NOT): DO_OP_NOT(true); DISPATCH();
+      TARGET(OP_PRINT): DO_OP_PRINT(true); DISPATCH();
+      TARGET(OP_POP): DO_OP_POP(true); DISPATCH();
+      TARGET(OP_DEFINE_GLOBAL): DO_OP_DEFINE_GLOBAL(true); DISPATCH();
+      TARGET(OP_GET_GLOBAL): DO_OP_GET_GLOBAL(true); DISPATCH();
+      TARGET(OP_SET_GLOBAL): DO_OP_SET_GLOBAL(true); DISPATCH();
+      TARGET(OP_ADD_NUM): {
+        Value b = top;
+        Value a = SECOND();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
         }
-
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_RETURN:
-        print_value(pop());
-        fprintf(stdout, "\n");
-        return INTERPRET_OK;
+        HIT();
+        sp--;
+        top = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        DISPATCH();
+      }
+      TARGET(OP_ADD_STR): {
+        Value b = top;
+        Value a = SECOND();
+        if (!IS_STRING(a) || !IS_STRING(b)) {
+          DEOPTIMIZE(OP_ADD);
+          DISPATCH();
+        }
+        HIT();
+        SPILL();
+        ObjString *result = concatenate_strings(vm, AS_STRING(a), AS_STRING(b));
+        if (result == NULL) {
+          RUNTIME_ERROR("Out of memory.");
+        }
+        sp--;
+        top = OBJ_VAL(result);
+        DISPATCH();
+      }
+      TARGET(OP_EQUAL_NUM): {
+        Value b = top;
+        Value a = SECOND();
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+          DEOPTIMIZE(OP_EQUAL);
+          DISPATCH();
+        }
+        HIT();
+        sp--;
+        top = BOOL_VAL(AS_NUMBER(a) == AS_NUMBER(b));
+        DISPATCH();
+      }
+      // both parts run back to back, the opcode of the second one is
+      // still in the code and skipped
+#define SUPERINSTRUCTION(name, first, second)                           \
+      TARGET(name): DO_##first(false); ip++; DO_##second(false); DISPATCH();
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+      TARGET(OP_RETURN): DO_OP_RETURN(true);
+      default:
+        goto unknown_opcode;
     }
   }
 
+unknown_opcode:
+  RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+
+#ifdef CLOX_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif // CLOX_COMPUTED_GOTO
+
+#undef SPILL
+#undef RELOAD
+#undef PUSH
+#undef DROP
+#undef SECOND
+#undef RUNTIME_ERROR
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
+#undef READ_GLOBAL
+#undef GLOBAL_BARRIER
+#undef QUICKEN
+#undef SITE
+#undef HIT
+#undef DEOPTIMIZE
+#undef RESERVE_STACK
+#undef BINARY_OP
+#undef DO_OP_CONSTANT
+#undef DO_OP_CONSTANT_LONG
+#undef DO_OP_ADD
+#undef DO_OP_SUBTRACT
+#undef DO_OP_MULTIPLY
+#undef DO_OP_DIVIDE
+#undef DO_OP_NEGATE
+#undef DO_OP_EQUAL
+#undef DO_OP_NOT
+#undef DO_OP_PRINT
+#undef DO_OP_POP
+#undef DO_OP_DEFINE_GLOBAL
+#undef DO_OP_GET_GLOBAL
+#undef DO_OP_SET_GLOBAL
+#undef DO_OP_RETURN
+#undef TARGET
+#undef DISPATCH
+}
+
+/**
+ * Writes the globals of a register code frame back to VM.globals.
+ */
+static void store_frame_globals(VM *vm, const Chunk *chunk, const Value *frame) {
+  const Value *values = frame + chunk->frame_constants;
+  for (size_t i = 0; i < chunk->frame_global_count; i++) {
+    Global *global = &vm->globals[chunk->frame_globals[i]];
+    global->value = values[i];
+    if (vm->gc.phase == GC_MARK) gc_mark_value(vm, global->value);
+  }
+}
+
+/**
+ * Run loop for register code, see RegOpCode. The frame is pushed on the
+ * stack, where the collector finds the registers and globals, and popped
+ * on return.
+ *
+ * Handlers find ip at their first operand and skip their operands when
+ * they dispatch, so runtime_error() finds the instruction that failed
+ * behind vm->ip like it does in run(). Register code is not traced or
+ * profiled.
+ */
+static InterpretResult run_registers(VM *vm) {
+  Chunk *chunk = vm->chunk;
+  uint8_t *ip = vm->ip;
+  size_t globals = (size_t) chunk->frame_constants + chunk->frame_global_count;
+  size_t frame_size = globals + chunk->register_count;
+  if (!grow_stack(vm, frame_size)) {
+    size_t depth = vm->stack == NULL ? 0 : (size_t) (vm->stack_top - vm->stack);
+    vm->ip = ip + 1;
+    runtime_error(vm, depth > vm->stack_limit || frame_size > vm->stack_limit - depth ?
+        "Stack overflow." : "Out of memory.");
+    return INTERPRET_RUNTIME_ERROR;
+  }
+  Value *frame = vm->stack_top;
+  // an empty frame may sit on a stack that was never allocated
+  if (chunk->frame_constants > 0) {
+    memcpy(frame, chunk->constants.values, chunk->frame_constants * sizeof(Value));
+  }
+  for (size_t i = 0; i < chunk->frame_global_count; i++) {
+    frame[chunk->frame_constants + i] = vm->globals[chunk->frame_globals[i]].value;
+  }
+  for (size_t i = globals; i < frame_size; i++) {
+    frame[i] = NIL_VAL(0);
+  }
+  vm->stack_top = frame + frame_size;
+
+#define OPERAND(n) (ip[2 * (n)] | (ip[2 * (n) + 1] << 8))
+#define SLOT(n) (frame[OPERAND(n)])
+#define RUNTIME_ERROR(...)                                      \
+  do {                                                          \
+    vm->ip = ip;                                                \
+    store_frame_globals(vm, chunk, frame);                      \
+    runtime_error(vm, __VA_ARGS__);                             \
+    return INTERPRET_RUNTIME_ERROR;                             \
+  } while (0)
+#define BINARY_OP(valueType, op)                                \
+  do {                                                          \
+    Value b = SLOT(1);                                          \
+    Value c = SLOT(2);                                          \
+    if (!IS_NUMBER(b) || !IS_NUMBER(c)) {                       \
+      RUNTIME_ERROR("Operands must be numbers.");               \
+    }                                                           \
+    SLOT(0) = valueType(AS_NUMBER(b) op AS_NUMBER(c));          \
+  } while (0)
+
+#ifdef CLOX_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Woverride-init"
+  static void *dispatch_table[UINT8_MAX + 1] = {
+    [0 ... UINT8_MAX]   = &&unknown_opcode,
+    [REG_CONSTANT]      = &&TARGET_REG_CONSTANT,
+    [REG_MOVE]          = &&TARGET_REG_MOVE,
+    [REG_ADD]           = &&TARGET_REG_ADD,
+    [REG_SUBTRACT]      = &&TARGET_REG_SUBTRACT,
+    [REG_MULTIPLY]      = &&TARGET_REG_MULTIPLY,
+    [REG_DIVIDE]        = &&TARGET_REG_DIVIDE,
+    [REG_EQUAL]         = &&TARGET_REG_EQUAL,
+    [REG_NEGATE]        = &&TARGET_REG_NEGATE,
+    [REG_NOT]           = &&TARGET_REG_NOT,
+    [REG_PRINT]         = &&TARGET_REG_PRINT,
+    [REG_CHECK_GLOBAL]  = &&TARGET_REG_CHECK_GLOBAL,
+    [REG_DEFINE_GLOBAL] = &&TARGET_REG_DEFINE_GLOBAL,
+    [REG_SET_GLOBAL]    = &&TARGET_REG_SET_GLOBAL,
+    [REG_RETURN]        = &&TARGET_REG_RETURN,
+  };
+#define TARGET(op) TARGET_##op
+#define NEXT(length) ip += (length) - 1; goto *dispatch_table[*ip++]
+
+  goto *dispatch_table[*ip++];
+#else
+#define TARGET(op) case op
+#define NEXT(length) ip += (length) - 1; continue
+#endif // CLOX_COMPUTED_GOTO
+
+  for (;;) {
+    switch (*ip++) {
+      TARGET(REG_CONSTANT): {
+        uint32_t constant = ip[2] | (ip[3] << 8) | (ip[4] << 16);
+        SLOT(0) = chunk->constants.values[constant];
+        NEXT(6);
+      }
+      TARGET(REG_MOVE):
+        SLOT(0) = SLOT(1);
+        NEXT(5);
+      TARGET(REG_ADD): {
+        Value b = SLOT(1);
+        Value c = SLOT(2);
+        if (IS_NUMBER(b) && IS_NUMBER(c)) {
+          SLOT(0) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+        } else if (IS_STRING(b) && IS_STRING(c)) {
+          // both operands are in the frame, the collector sees them
+          ObjString *result = concatenate_strings(vm, AS_STRING(b), AS_STRING(c));
+          if (result == NULL) {
+            RUNTIME_ERROR("Out of memory.");
+          }
+          SLOT(0) = OBJ_VAL(result);
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        NEXT(7);
+      }
+      TARGET(REG_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT(7);
+      TARGET(REG_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT(7);
+      TARGET(REG_DIVIDE): BINARY_OP(NUMBER_VAL, /); NEXT(7);
+      TARGET(REG_EQUAL):
+        SLOT(0) = BOOL_VAL(values_equal(SLOT(1), SLOT(2)));
+        NEXT(7);
+      TARGET(REG_NEGATE): {
+        Value b = SLOT(1);
+        if (!IS_NUMBER(b)) {
+          RUNTIME_ERROR("Operand must be a number.");
+        }
+        SLOT(0) = NUMBER_VAL(-AS_NUMBER(b));
+        NEXT(5);
+      }
+      TARGET(REG_NOT):
+        SLOT(0) = BOOL_VAL(is_falsey(SLOT(1)));
+        NEXT(5);
+      TARGET(REG_PRINT):
+        fprint_value(vm->out, SLOT(0));
+        fprintf(vm->out, "\n");
+        NEXT(3);
+      TARGET(REG_CHECK_GLOBAL): {
+        Global *global = &vm->globals[OPERAND(0)];
+        if (!global->defined) {
+          RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+        }
+        NEXT(3);
+      }
+      TARGET(REG_DEFINE_GLOBAL):
+        vm->globals[OPERAND(1)].defined = true;
+        SLOT(0) = SLOT(2);
+        NEXT(7);
+      TARGET(REG_SET_GLOBAL): {
+        Global *global = &vm->globals[OPERAND(1)];
+        if (!global->defined) {
+          RUNTIME_ERROR("Undefined variable '%s'.", global->name->chars);
+        }
+        SLOT(0) = SLOT(2);
+        NEXT(7);
+      }
+      TARGET(REG_RETURN):
+        vm->ip = ip;
+        store_frame_globals(vm, chunk, frame);
+        vm->stack_top = frame;
+        return INTERPRET_OK;
+      default:
+        goto unknown_opcode;
+    }
+  }
+
+unknown_opcode:
+  RUNTIME_ERROR("Unknown opcode %d.", ip[-1]);
+
+#ifdef CLOX_COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif // CLOX_COMPUTED_GOTO
+
+#undef OPERAND
+#undef SLOT
+#undef RUNTIME_ERROR
 #undef BINARY_OP
+#undef TARGET
+#undef NEXT
 }
 
-InterpretResult interpret(const char *source) {
+/**
+ * Runs native code for the current chunk and turns its status into the
+ * same runtime errors run() reports.
+ */
+static InterpretResult run_native(VM *vm, const JitCode *jit) {
+  switch (jit_run(jit, vm)) {
+    case JIT_OK:
+      return INTERPRET_OK;
+    case JIT_NOT_NUMBER:
+      runtime_error(vm, "Operand must be a number.");
+      break;
+    case JIT_NOT_NUMBERS:
+      runtime_error(vm, "Operands must be numbers.");
+      break;
+    case JIT_NOT_ADDABLE:
+      runtime_error(vm, "Operands must be two numbers or two strings.");
+      break;
+    case JIT_UNDEFINED:
+      runtime_error(vm, "Undefined variable '%s'.",
+          vm->globals[vm->ip[-2] | (vm->ip[-1] << 8)].name->chars);
+      break;
+    case JIT_OUT_OF_MEMORY:
+      runtime_error(vm, "Out of memory.");
+      break;
+  }
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+/**
+ * Runs the chunk as native code once it got hot. Native code skips the
+ * tracer and the profiler, the interpreter runs whenever either is on.
+ */
+static bool run_jit(VM *vm, InterpretResult *result) {
+  if (!vm->jit) {
+    return false;
+  }
+#ifdef CLOX_INSTRUMENTED
+  if (instrumented(vm)) {
+    return false;
+  }
+#endif // CLOX_INSTRUMENTED
+
+  Chunk *chunk = vm->chunk;
+  if (chunk->native.code == NULL) {
+    // a chunk the JIT does not support is tried once only
+    bool hot = chunk->runs == vm->jit_hot_runs;
+    if (chunk->runs < UINT32_MAX) {
+      chunk->runs++;
+    }
+    if (!hot || !jit_compile(chunk, &chunk->native)) {
+      return false;
+    }
+  }
+  // native code does not check for room, it gets all it needs up front.
+  // Without that much the interpreter reports where the stack ran out.
+  if (!grow_stack(vm, chunk->native.stack_depth)) {
+    return false;
+  }
+  vm->native_runs++;
+  *result = run_native(vm, &chunk->native);
+  return true;
+}
+
+InterpretResult interpret_chunk(VM *vm, Chunk *chunk) {
+  if (vm->superinstructions && !chunk->fused && !chunk->registers) {
+    fuse_superinstructions(chunk);
+  }
+  if (vm->print_code) {
+    fdisassemble_chunk(vm->out, chunk, "code");
+  }
+
+  vm->chunk = chunk;
+  vm->ip = vm->chunk->code;
+  gc_use_chunk(vm, chunk);
+#ifdef DEBUG_TRACE_EXECUTION
+  // entries from an earlier run point into chunks that are gone by now
+  reset_tracer(&vm->tracer);
+#endif // DEBUG_TRACE_EXECUTION
+
+  InterpretResult result;
+  if (chunk->registers) {
+    result = run_registers(vm);
+  } else if (!run_jit(vm, &result)) {
+#ifdef CLOX_PROFILE
+    if (vm->profiler != NULL) {
+      profile_start_run(vm->profiler);
+    }
+#endif // CLOX_PROFILE
+    result = run(vm);
+#ifdef CLOX_PROFILE
+    if (vm->profiler != NULL) {
+      profile_end_run(vm->profiler);
+    }
+#endif // CLOX_PROFILE
+  }
+
+  if (vm->quicken_stats) {
+    report_quickening(vm->err, chunk);
+  }
+  if (vm->stack_end - vm->stack > STACK_KEEP && vm->stack_top == vm->stack) {
+    free_stack(vm);
+  }
+  // the chunk may be freed once we return
+  gc_use_chunk(vm, NULL);
+  return result;
+}
+
+InterpretResult interpret(VM *vm, const char *source) {
+  // register code is never saved, see write_bytecode()
+  if (vm->cache_dir != NULL && !vm->registers) {
+    BytecodeFile cached;
+    if (load_cached_chunk(vm, vm->cache_dir, source, &cached)) {
+      InterpretResult result = interpret_chunk(vm, &cached.chunk);
+      unmap_bytecode(&cached);
+      return result;
+    }
+  }
+
   Chunk chunk;
   init_chunk(&chunk);
 
   // compile the source and fill the chunk with bytecode
-  if (!compile(source, &chunk)) {
+  if (!compile(vm, source, &chunk)) {
     free_chunk(&chunk);
     return INTERPRET_COMPILE_ERROR;
   }
 
-  vm.chunk = &chunk;
-  vm.ip = vm.chunk->code;
+  if (vm->cache_dir != NULL && !vm->registers) {
+    store_cached_chunk(vm, vm->cache_dir, source, &chunk);
+  }
 
-  InterpretResult result = run();
+  InterpretResult result = interpret_chunk(vm, &chunk);
 
   free_chunk(&chunk);
   return result;
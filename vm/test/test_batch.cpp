@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "clox/batch.h"
+}
+
+class TestBatch : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char pattern[] = "/tmp/clox_batch_XXXXXX";
+    ASSERT_NE(mkdtemp(pattern), nullptr);
+    dir = pattern;
+  }
+
+  void TearDown() override {
+    for (const std::string &file : files) {
+      std::remove(file.c_str());
+    }
+    rmdir(dir.c_str());
+  }
+
+  std::string write(const std::string &name, const std::string &content) {
+    std::string path = dir + "/" + name;
+    std::ofstream(path) << content;
+    files.push_back(path);
+    return path;
+  }
+
+  std::string dir;
+  std::vector<std::string> files;
+};
+
+/**
+ * Runs paths as one batch, capturing what it writes to out and err.
+ */
+static bool run(const std::vector<std::string> &paths, int jobs, std::string *out, std::string *err) {
+  std::vector<const char *> raw;
+  for (const std::string &path : paths) {
+    raw.push_back(path.c_str());
+  }
+
+  char *out_buffer = NULL, *err_buffer = NULL;
+  size_t out_size = 0, err_size = 0;
+  FILE *out_stream = open_memstream(&out_buffer, &out_size);
+  FILE *err_stream = open_memstream(&err_buffer, &err_size);
+
+  BatchOptions options;
+  init_batch_options(&options);
+  options.jobs = jobs;
+  bool ok = run_batch(raw.data(), raw.size(), &options, out_stream, err_stream);
+
+  fclose(out_stream);
+  fclose(err_stream);
+  *out = std::string(out_buffer, out_size);
+  *err = std::string(err_buffer, err_size);
+  free(out_buffer);
+  free(err_buffer);
+  return ok;
+}
+
+TEST_F(TestBatch, OutputKeepsScriptOrder) {
+  std::vector<std::string> paths;
+  std::string expected;
+  for (int i = 0; i < 500; i++) {
+    paths.push_back(write("s" + std::to_string(i) + ".lox", "print " + std::to_string(i) + " + 1;"));
+    expected += std::to_string(i + 1) + "\n";
+  }
+
+  for (int jobs : {1, 3, 8}) {
+    std::string out, err;
+    EXPECT_TRUE(run(paths, jobs, &out, &err));
+    EXPECT_EQ(out, expected) << jobs << " jobs";
+  }
+}
+
+TEST_F(TestBatch, ReportsStatusAndTimingPerScript) {
+  std::vector<std::string> paths = {
+    write("good.lox", "print 1 + 2;"),
+    write("bad.lox", "print 1 +;"),
+    dir + "/missing.lox",
+  };
+
+  std::string out, err;
+  EXPECT_FALSE(run(paths, 2, &out, &err));
+  EXPECT_EQ(out, "3\n");
+
+  size_t good = err.find(paths[0] + ": ok in ");
+  size_t bad = err.find(paths[1] + ": compile error in ");
+  size_t missing = err.find(paths[2] + ": io error in ");
+  ASSERT_NE(good, std::string::npos);
+  ASSERT_NE(bad, std::string::npos);
+  ASSERT_NE(missing, std::string::npos);
+  EXPECT_LT(good, bad);
+  EXPECT_LT(bad, missing);
+  // the compile error is reported right before the status of its script
+  EXPECT_NE(err.substr(good, bad - good).find("Expect expression"), std::string::npos);
+}
+
+TEST_F(TestBatch, ScriptsDoNotSeeEachOthersGlobals) {
+  std::vector<std::string> paths = {
+    write("define.lox", "var x = 1; print x;"),
+    write("read.lox", "print x;"),
+  };
+
+  for (int jobs : {1, 2}) {
+    std::string out, err;
+    EXPECT_FALSE(run(paths, jobs, &out, &err)) << jobs << " jobs";
+    EXPECT_EQ(out, "1\n") << jobs << " jobs";
+    EXPECT_NE(err.find("Undefined variable 'x'."), std::string::npos) << jobs << " jobs";
+    EXPECT_NE(err.find(paths[1] + ": runtime error in "), std::string::npos) << jobs << " jobs";
+  }
+}
+
+TEST_F(TestBatch, ReadManifestSkipsBlankLinesAndComments) {
+  std::string manifest = write("manifest.txt", "# scripts\na.lox\n\n  \nb.lox  \r\n#c.lox\n");
+
+  char **paths = NULL;
+  size_t count = 0, capacity = 0;
+  ASSERT_TRUE(read_manifest(manifest.c_str(), &paths, &count, &capacity));
+  ASSERT_EQ(count, 2u);
+  EXPECT_STREQ(paths[0], "a.lox");
+  EXPECT_STREQ(paths[1], "b.lox");
+
+  for (size_t i = 0; i < count; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+}
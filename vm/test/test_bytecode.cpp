@@ -0,0 +1,315 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "clox/bytecode.h"
+#include "clox/compiler.h"
+#include "clox/object.h"
+#include "clox/vm.h"
+}
+
+/**
+ * Serializes chunk, compiled for vm, into a string.
+ */
+static std::string serialize(const VM *vm, const Chunk *chunk) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  EXPECT_TRUE(write_bytecode(vm, chunk, out));
+  fclose(out);
+  std::string bytes(buffer, size);
+  free(buffer);
+  return bytes;
+}
+
+/**
+ * Copies bytes into malloc'ed storage, which is suitably aligned for
+ * read_bytecode(), and loads it into vm.
+ */
+static bool load(VM *vm, const std::string &bytes, Chunk *chunk, uint8_t **storage) {
+  *storage = (uint8_t *) malloc(bytes.size());
+  memcpy(*storage, bytes.data(), bytes.size());
+  FILE *err = fopen("/dev/null", "w");
+  bool ok = read_bytecode(vm, chunk, *storage, bytes.size(), err);
+  fclose(err);
+  return ok;
+}
+
+class TestBytecode : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    init_vm(&vm);
+  }
+
+  void TearDown() override {
+    free_vm(&vm);
+  }
+
+  bool deserialize(const std::string &bytes, Chunk *chunk, uint8_t **storage);
+
+  // owns the strings of loaded chunks
+  VM vm;
+};
+
+bool TestBytecode::deserialize(const std::string &bytes, Chunk *chunk, uint8_t **storage) {
+  return load(&vm, bytes, chunk, storage);
+}
+
+/**
+ * 300 distinct constants so the chunk uses both OP_CONSTANT and
+ * OP_CONSTANT_LONG, spread over a few lines.
+ */
+static void fill_chunk(Chunk *chunk) {
+  init_chunk(chunk);
+  for (int i = 0; i < 300; i++) {
+    write_constant(chunk, NUMBER_VAL(i + 0.5), 1 + i / 100);
+    write_chunk(chunk, OP_POP, 1 + i / 100);
+  }
+  write_constant(chunk, BOOL_VAL(true), 4);
+  write_constant(chunk, NIL_VAL(0), 4);
+  write_chunk(chunk, OP_EQUAL, 4);
+  write_chunk(chunk, OP_POP, 4);
+  write_chunk(chunk, OP_RETURN, 5);
+}
+
+TEST_F(TestBytecode, RoundTrip) {
+  Chunk chunk;
+  fill_chunk(&chunk);
+  std::string bytes = serialize(&vm, &chunk);
+
+  Chunk loaded;
+  uint8_t *storage;
+  ASSERT_TRUE(deserialize(bytes, &loaded, &storage));
+  EXPECT_TRUE(loaded.borrowed);
+  // the code is used in place, not copied
+  EXPECT_EQ(loaded.code, storage + sizeof(BytecodeHeader));
+
+  ASSERT_EQ(loaded.count, chunk.count);
+  EXPECT_EQ(memcmp(loaded.code, chunk.code, chunk.count), 0);
+  ASSERT_EQ(loaded.line_count, chunk.line_count);
+  for (size_t offset = 0; offset < chunk.count; offset++) {
+    EXPECT_EQ(get_line(&loaded, offset), get_line(&chunk, offset));
+  }
+  ASSERT_EQ(loaded.constants.count, chunk.constants.count);
+  for (int i = 0; i < 300; i++) {
+    EXPECT_EQ(AS_NUMBER(loaded.constants.values[i]), i + 0.5);
+  }
+  EXPECT_TRUE(IS_BOOL(loaded.constants.values[300]));
+  EXPECT_TRUE(AS_BOOL(loaded.constants.values[300]));
+  EXPECT_TRUE(IS_NIL(loaded.constants.values[301]));
+
+  free_chunk(&loaded);
+  free(storage);
+  free_chunk(&chunk);
+}
+
+TEST_F(TestBytecode, RejectsBadHeaders) {
+  Chunk chunk;
+  fill_chunk(&chunk);
+  std::string bytes = serialize(&vm, &chunk);
+  free_chunk(&chunk);
+
+  Chunk loaded;
+  uint8_t *storage;
+
+  std::string bad_magic = bytes;
+  bad_magic[0] = 'X';
+  EXPECT_FALSE(deserialize(bad_magic, &loaded, &storage));
+  free(storage);
+
+  std::string bad_version = bytes;
+  bad_version[4] = LOXC_VERSION + 1;
+  EXPECT_FALSE(deserialize(bad_version, &loaded, &storage));
+  free(storage);
+
+  EXPECT_FALSE(deserialize(bytes.substr(0, bytes.size() - 1), &loaded, &storage));
+  free(storage);
+  EXPECT_FALSE(deserialize(bytes + '\0', &loaded, &storage));
+  free(storage);
+}
+
+TEST_F(TestBytecode, RejectsOutOfRangeConstant) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  write_constant(&chunk, NUMBER_VAL(1), 1);
+  write_chunk(&chunk, OP_POP, 1);
+  write_chunk(&chunk, OP_RETURN, 1);
+  std::string bytes = serialize(&vm, &chunk);
+  free_chunk(&chunk);
+
+  // point OP_CONSTANT at the missing constant 1
+  bytes[sizeof(BytecodeHeader) + 1] = 1;
+  Chunk loaded;
+  uint8_t *storage;
+  EXPECT_FALSE(deserialize(bytes, &loaded, &storage));
+  free(storage);
+}
+
+TEST_F(TestBytecode, RejectsStackUnderflow) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print 1;", &chunk));
+  std::string bytes = serialize(&vm, &chunk);
+  free_chunk(&chunk);
+
+  // OP_CONSTANT 0, OP_PRINT, OP_RETURN becomes OP_PRINT x2, OP_RETURN
+  size_t code = sizeof(BytecodeHeader);
+  ASSERT_EQ(bytes[code + 2], OP_PRINT);
+  bytes[code] = OP_PRINT;
+  bytes[code + 1] = OP_PRINT;
+  Chunk loaded;
+  uint8_t *storage;
+  EXPECT_FALSE(deserialize(bytes, &loaded, &storage));
+  free(storage);
+}
+
+TEST_F(TestBytecode, RejectsValuesLeftOnTheStack) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print 1;", &chunk));
+  std::string bytes = serialize(&vm, &chunk);
+  free_chunk(&chunk);
+
+  // OP_CONSTANT 0, OP_PRINT, OP_RETURN becomes OP_CONSTANT 0, OP_NOT, OP_RETURN
+  size_t code = sizeof(BytecodeHeader);
+  ASSERT_EQ(bytes[code + 2], OP_PRINT);
+  bytes[code + 2] = OP_NOT;
+  Chunk loaded;
+  uint8_t *storage;
+  EXPECT_FALSE(deserialize(bytes, &loaded, &storage));
+  free(storage);
+}
+
+TEST_F(TestBytecode, RunsMappedFile) {
+  char path[] = "/tmp/clox_bytecode_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(fd, -1);
+  close(fd);
+
+  Chunk chunk;
+  init_chunk(&chunk);
+  write_constant(&chunk, NUMBER_VAL(42), 1);
+  write_chunk(&chunk, OP_NEGATE, 1);
+  write_chunk(&chunk, OP_PRINT, 1);
+  write_chunk(&chunk, OP_RETURN, 1);
+  ASSERT_TRUE(save_bytecode(&vm, &chunk, path, stderr));
+  free_chunk(&chunk);
+  EXPECT_TRUE(is_bytecode_file(path));
+
+  BytecodeFile file;
+  ASSERT_TRUE(map_bytecode(&vm, &file, path, stderr));
+
+  char *buffer = NULL;
+  size_t size = 0;
+  vm.out = open_memstream(&buffer, &size);
+  EXPECT_EQ(interpret_chunk(&vm, &file.chunk), INTERPRET_OK);
+  fclose(vm.out);
+  vm.out = stdout;
+  EXPECT_STREQ(buffer, "-42\n");
+  free(buffer);
+
+  unmap_bytecode(&file);
+  remove(path);
+}
+
+TEST_F(TestBytecode, StringConstantsAreInterned) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  write_constant(&chunk, OBJ_VAL(copy_string(&vm, "hello", 5)), 1);
+  write_constant(&chunk, OBJ_VAL(copy_string(&vm, "", 0)), 1);
+  write_chunk(&chunk, OP_EQUAL, 1);
+  write_chunk(&chunk, OP_POP, 1);
+  write_chunk(&chunk, OP_RETURN, 1);
+  std::string bytes = serialize(&vm, &chunk);
+
+  Chunk loaded;
+  uint8_t *storage;
+  ASSERT_TRUE(deserialize(bytes, &loaded, &storage));
+  ASSERT_EQ(loaded.constants.count, 2u);
+  // loading into the same VM finds the strings that are already there
+  EXPECT_EQ(AS_OBJ(loaded.constants.values[0]), AS_OBJ(chunk.constants.values[0]));
+  EXPECT_STREQ(AS_CSTRING(loaded.constants.values[0]), "hello");
+  EXPECT_EQ(AS_STRING(loaded.constants.values[1])->length, 0u);
+  free_chunk(&loaded);
+  free(storage);
+
+  // a string running past the end of the file
+  std::string truncated = bytes.substr(0, bytes.size() - 1);
+  EXPECT_FALSE(deserialize(truncated, &loaded, &storage));
+  free(storage);
+  free_chunk(&chunk);
+}
+
+/**
+ * Compiles source in vm, saves it and returns what running the file in
+ * other prints.
+ */
+static std::string compile_and_run_in(VM *vm, const char *source, VM *other) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  EXPECT_TRUE(compile(vm, source, &chunk));
+  std::string bytes = serialize(vm, &chunk);
+  free_chunk(&chunk);
+
+  Chunk loaded;
+  uint8_t *storage;
+  EXPECT_TRUE(load(other, bytes, &loaded, &storage));
+
+  char *buffer = NULL;
+  size_t size = 0;
+  other->out = open_memstream(&buffer, &size);
+  EXPECT_EQ(interpret_chunk(other, &loaded), INTERPRET_OK);
+  fclose(other->out);
+  other->out = stdout;
+  std::string printed(buffer, size);
+  free(buffer);
+
+  free_chunk(&loaded);
+  free(storage);
+  return printed;
+}
+
+TEST_F(TestBytecode, GlobalsKeepTheirSlotsInAFreshVM) {
+  VM fresh;
+  init_vm(&fresh);
+  EXPECT_EQ(compile_and_run_in(&vm, "var a = 1; var b = a + 1; print b;", &fresh), "2\n");
+  ASSERT_EQ(fresh.global_count, 2u);
+  EXPECT_STREQ(fresh.globals[0].name->chars, "a");
+  EXPECT_STREQ(fresh.globals[1].name->chars, "b");
+  free_vm(&fresh);
+}
+
+TEST_F(TestBytecode, GlobalsAreRemappedToTheLoadingVM) {
+  VM other;
+  init_vm(&other);
+  // other already has globals, so b and a end up in different slots
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&other, "var x = 10; var b = 20;", &chunk));
+  ASSERT_EQ(interpret_chunk(&other, &chunk), INTERPRET_OK);
+  free_chunk(&chunk);
+
+  EXPECT_EQ(compile_and_run_in(&vm, "var a = 1; print a + b;", &other), "21\n");
+  EXPECT_EQ(other.global_count, 3u);
+  free_vm(&other);
+}
+
+TEST_F(TestBytecode, RejectsGlobalSlotOutsideTheFile) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "var a = 1;", &chunk));
+  std::string bytes = serialize(&vm, &chunk);
+  free_chunk(&chunk);
+
+  // OP_CONSTANT 0, OP_DEFINE_GLOBAL 0 0, point it at slot 1
+  size_t operand = sizeof(BytecodeHeader) + 3;
+  ASSERT_EQ(bytes[operand], 0);
+  bytes[operand] = 1;
+  Chunk loaded;
+  uint8_t *storage;
+  EXPECT_FALSE(deserialize(bytes, &loaded, &storage));
+  free(storage);
+}
@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+
+#include <dirent.h>
+
+extern "C" {
+#include "clox/cache.h"
+#include "clox/vm.h"
+}
+
+class TestCache : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char pattern[] = "/tmp/clox_cache_XXXXXX";
+    ASSERT_NE(mkdtemp(pattern), nullptr);
+    dir = pattern;
+    init_vm(&vm);
+  }
+
+  void TearDown() override {
+    free_vm(&vm);
+    DIR *d = opendir(dir.c_str());
+    while (struct dirent *entry = readdir(d)) {
+      remove((dir + "/" + entry->d_name).c_str());
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+  }
+
+  int entries() {
+    int count = 0;
+    DIR *d = opendir(dir.c_str());
+    while (struct dirent *entry = readdir(d)) {
+      count += entry->d_name[0] != '.';
+    }
+    closedir(d);
+    return count;
+  }
+
+  std::string interpret_cached(const char *source) {
+    char *buffer = NULL;
+    size_t size = 0;
+    VM vm;
+    init_vm(&vm);
+    vm.cache_dir = dir.c_str();
+    vm.out = open_memstream(&buffer, &size);
+    EXPECT_EQ(interpret(&vm, source), INTERPRET_OK);
+    fclose(vm.out);
+    free_vm(&vm);
+    std::string printed(buffer, size);
+    free(buffer);
+    return printed;
+  }
+
+  std::string dir;
+  // interns the strings of chunks loaded straight from the cache
+  VM vm;
+};
+
+TEST_F(TestCache, HashDependsOnEveryByte) {
+  std::string source = "1 + 2 * 3 - 4 / 5";
+  uint64_t hash = hash_source(source.c_str(), source.size());
+  EXPECT_EQ(hash, hash_source(source.c_str(), source.size()));
+  for (size_t i = 0; i < source.size(); i++) {
+    std::string changed = source;
+    changed[i] ^= 1;
+    EXPECT_NE(hash, hash_source(changed.c_str(), changed.size())) << i;
+  }
+  EXPECT_NE(hash, hash_source(source.c_str(), source.size() - 1));
+}
+
+TEST_F(TestCache, MissThenHit) {
+  BytecodeFile file;
+  EXPECT_FALSE(load_cached_chunk(&vm, dir.c_str(), "print 1 + 2;", &file));
+
+  EXPECT_EQ(interpret_cached("print 1 + 2;"), "3\n");
+  EXPECT_EQ(entries(), 1);
+  EXPECT_FALSE(load_cached_chunk(&vm, dir.c_str(), "print 1 + 3;", &file));
+  ASSERT_TRUE(load_cached_chunk(&vm, dir.c_str(), "print 1 + 2;", &file));
+  unmap_bytecode(&file);
+
+  EXPECT_EQ(interpret_cached("print 1 + 2;"), "3\n");
+  EXPECT_EQ(entries(), 1);
+}
+
+TEST_F(TestCache, HitSkipsCompiler) {
+  // plant a chunk that the compiler would never produce for this source
+  Chunk chunk;
+  init_chunk(&chunk);
+  write_constant(&chunk, NUMBER_VAL(99), 1);
+  write_chunk(&chunk, OP_PRINT, 1);
+  write_chunk(&chunk, OP_RETURN, 1);
+  store_cached_chunk(&vm, dir.c_str(), "print 1 + 2;", &chunk);
+  free_chunk(&chunk);
+
+  EXPECT_EQ(interpret_cached("print 1 + 2;"), "99\n");
+}
+
+TEST_F(TestCache, CorruptEntryIsAMiss) {
+  EXPECT_EQ(interpret_cached("print 4 * 5;"), "20\n");
+
+  DIR *d = opendir(dir.c_str());
+  std::string entry;
+  while (struct dirent *e = readdir(d)) {
+    if (e->d_name[0] != '.') entry = dir + "/" + e->d_name;
+  }
+  closedir(d);
+  FILE *f = fopen(entry.c_str(), "wb");
+  fputs("garbage", f);
+  fclose(f);
+
+  EXPECT_EQ(interpret_cached("print 4 * 5;"), "20\n");
+  BytecodeFile file;
+  ASSERT_TRUE(load_cached_chunk(&vm, dir.c_str(), "print 4 * 5;", &file));
+  unmap_bytecode(&file);
+}
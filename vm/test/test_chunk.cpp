@@ -22,7 +22,7 @@ TEST(TestChunk, GrowTestChunk) {
   }
 
   ASSERT_EQ(chunk.count, 9);
-  ASSERT_EQ(chunk.lines[8], 8);
+  ASSERT_EQ(get_line(&chunk, 8), 8);
   ASSERT_EQ(chunk.capacity, 16);
   free_chunk(&chunk);
 }
@@ -30,9 +30,7 @@ TEST(TestChunk, GrowTestChunk) {
 TEST(TestChunk, BasicConstantTest) {
   Chunk chunk;
   init_chunk(&chunk);
-  Value v;
-  v.as.number = 1.2;
-  v.type = VAL_NUMBER;
+  Value v = NUMBER_VAL(1.2);
 
   size_t constant = add_constant(&chunk, v);
   write_chunk(&chunk, OP_CONSTANT, 123);
@@ -45,4 +43,132 @@ TEST(TestChunk, BasicConstantTest) {
   EXPECT_DOUBLE_EQ(AS_NUMBER(chunk.constants.values[0]), 1.2);
 
   EXPECT_EQ(chunk.code[2], OP_RETURN);
+  free_chunk(&chunk);
+}
+
+TEST(TestChunk, LinesAreRunLengthEncoded) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (int i = 0; i < 10; i++) {
+    write_chunk(&chunk, OP_NEGATE, 1);
+  }
+  for (int i = 0; i < 5; i++) {
+    write_chunk(&chunk, OP_NEGATE, 3);
+  }
+  write_chunk(&chunk, OP_RETURN, 4);
+
+  ASSERT_EQ(chunk.count, 16);
+  ASSERT_EQ(chunk.line_count, 3);
+
+  for (size_t offset = 0; offset < 10; offset++) {
+    EXPECT_EQ(get_line(&chunk, offset), 1);
+  }
+  for (size_t offset = 10; offset < 15; offset++) {
+    EXPECT_EQ(get_line(&chunk, offset), 3);
+  }
+  EXPECT_EQ(get_line(&chunk, 15), 4);
+  free_chunk(&chunk);
+}
+
+TEST(TestChunk, LineLookupOverManyRuns) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (size_t line = 1; line <= 1000; line++) {
+    for (size_t i = 0; i < line % 4 + 1; i++) {
+      write_chunk(&chunk, OP_NEGATE, line);
+    }
+  }
+
+  ASSERT_EQ(chunk.line_count, 1000);
+  size_t offset = 0;
+  for (size_t line = 1; line <= 1000; line++) {
+    for (size_t i = 0; i < line % 4 + 1; i++) {
+      ASSERT_EQ(get_line(&chunk, offset++), line);
+    }
+  }
+  free_chunk(&chunk);
+}
+
+TEST(TestChunk, IdenticalConstantsShareASlot) {
+  Chunk chunk;
+  init_chunk(&chunk);
+
+  size_t a = add_constant(&chunk, NUMBER_VAL(1.5));
+  size_t b = add_constant(&chunk, NUMBER_VAL(2.5));
+  EXPECT_NE(a, b);
+  EXPECT_EQ(add_constant(&chunk, NUMBER_VAL(1.5)), a);
+  EXPECT_EQ(add_constant(&chunk, NUMBER_VAL(2.5)), b);
+
+  // same value, different representation
+  size_t zero = add_constant(&chunk, NUMBER_VAL(0.0));
+  size_t negative_zero = add_constant(&chunk, NUMBER_VAL(-0.0));
+  EXPECT_NE(zero, negative_zero);
+
+  // same bits, different type
+  size_t nil = add_constant(&chunk, NIL_VAL(0));
+  size_t f = add_constant(&chunk, BOOL_VAL(false));
+  EXPECT_NE(nil, zero);
+  EXPECT_NE(f, zero);
+  EXPECT_NE(nil, f);
+  EXPECT_EQ(add_constant(&chunk, BOOL_VAL(false)), f);
+
+  EXPECT_EQ(chunk.constants.count, 6);
+  free_chunk(&chunk);
+}
+
+TEST(TestChunk, DeduplicationSurvivesIndexGrowth) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_EQ(add_constant(&chunk, NUMBER_VAL(i)), (size_t) i);
+  }
+  for (int i = 0; i < 10000; i++) {
+    ASSERT_EQ(add_constant(&chunk, NUMBER_VAL(i)), (size_t) i);
+  }
+  EXPECT_EQ(chunk.constants.count, 10000);
+  free_chunk(&chunk);
+}
+
+TEST(TestChunk, WideConstantOperands) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (int i = 0; i < 70000; i++) {
+    ASSERT_TRUE(write_constant(&chunk, NUMBER_VAL(i), 1));
+  }
+
+  // 256 short instructions and the rest with a 24 bit operand
+  ASSERT_EQ(chunk.count, 256 * 2 + (70000 - 256) * 4);
+  EXPECT_EQ(chunk.code[0], OP_CONSTANT);
+  EXPECT_EQ(chunk.code[255 * 2], OP_CONSTANT);
+  EXPECT_EQ(chunk.code[255 * 2 + 1], 255);
+
+  size_t offset = 256 * 2 + (65537 - 256) * 4;
+  EXPECT_EQ(chunk.code[offset], OP_CONSTANT_LONG);
+  EXPECT_EQ(chunk.code[offset + 1], 0x01);
+  EXPECT_EQ(chunk.code[offset + 2], 0x00);
+  EXPECT_EQ(chunk.code[offset + 3], 0x01);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(chunk.constants.values[65537]), 65537);
+
+  // repeating a literal reuses its slot and its short form
+  size_t count = chunk.count;
+  ASSERT_TRUE(write_constant(&chunk, NUMBER_VAL(7), 2));
+  EXPECT_EQ(chunk.count, count + 2);
+  EXPECT_EQ(chunk.code[count + 1], 7);
+  EXPECT_EQ(chunk.constants.count, 70000);
+  free_chunk(&chunk);
+}
+
+TEST(TestChunk, ReservedCodeDoesNotMove) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(reserve_chunk(&chunk, 1024));
+  uint8_t *code = chunk.code;
+  // 256 short and 44 long constant loads take 688 bytes
+  for (int i = 0; i < 300; i++) {
+    ASSERT_TRUE(write_constant(&chunk, NUMBER_VAL(i), i));
+  }
+
+  EXPECT_EQ(chunk.code, code);
+  EXPECT_EQ(chunk.capacity, 1024);
+  free_chunk(&chunk);
 }
@@ -0,0 +1,175 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+#include "clox/compiler.h"
+#include "clox/object.h"
+}
+
+TEST(TestCompiler, FoldsConstantExpression) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print (-1 + 2) * 3 - -4;", &chunk));
+
+  ASSERT_EQ(chunk.count, 4);
+  EXPECT_EQ(chunk.code[0], OP_CONSTANT);
+  EXPECT_EQ(chunk.code[1], 0);
+  EXPECT_EQ(chunk.code[2], OP_PRINT);
+  EXPECT_EQ(chunk.code[3], OP_RETURN);
+
+  // no dead intermediates in the constant pool
+  ASSERT_EQ(chunk.constants.count, 1);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(chunk.constants.values[0]), 7);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, FoldingRespectsPrecedence) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print 1 + 2 * 3 - 8 / 4 / 2;", &chunk));
+
+  ASSERT_EQ(chunk.constants.count, 1);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(chunk.constants.values[0]), 6);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, FoldedConstantKeepsItsLine) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "\n\nprint -(1 +\n 2);\n", &chunk));
+
+  ASSERT_EQ(chunk.count, 4);
+  EXPECT_EQ(get_line(&chunk, 0), 3);
+  EXPECT_DOUBLE_EQ(AS_NUMBER(chunk.constants.values[0]), -3);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, MoreThan256Constants) {
+  // deep nesting keeps more literals pending than the folder can hold,
+  // so the literals reach the chunk and need wide operands
+  std::string source = "print ";
+  for (int i = 0; i < 300; i++) {
+    source += std::to_string(i + 1) + " + (";
+  }
+  source += "0";
+  for (int i = 0; i < 300; i++) {
+    source += ")";
+  }
+  source += ";";
+
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, source.c_str(), &chunk));
+  ASSERT_GT(chunk.constants.count, 256);
+
+  size_t long_constants = 0;
+  for (size_t offset = 0; offset < chunk.count;) {
+    switch (chunk.code[offset]) {
+      case OP_CONSTANT:      offset += 2; break;
+      case OP_CONSTANT_LONG: offset += 4; long_constants++; break;
+      default:               offset += 1; break;
+    }
+  }
+  EXPECT_EQ(long_constants, chunk.constants.count - 256);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, FoldsStringsAndEquality) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print \"a\" + \"b\" + \"c\";", &chunk));
+  ASSERT_EQ(chunk.constants.count, 1);
+  EXPECT_EQ(AS_STRING(chunk.constants.values[0]), copy_string(&vm, "abc", 3));
+  free_chunk(&chunk);
+
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print !(1 + 1 == 2) != nil;", &chunk));
+  ASSERT_EQ(chunk.count, 4);
+  EXPECT_TRUE(AS_BOOL(chunk.constants.values[0]));
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, GlobalsGetDenseSlots) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "var a = 1; var b = a; b = a;", &chunk));
+
+  ASSERT_EQ(vm.global_count, 2u);
+  EXPECT_STREQ(vm.globals[0].name->chars, "a");
+  EXPECT_STREQ(vm.globals[1].name->chars, "b");
+  // slots exist from compile time on, the variables only once they run
+  EXPECT_FALSE(vm.globals[0].defined);
+
+  const uint8_t expected[] = {
+    OP_CONSTANT, 0, OP_DEFINE_GLOBAL, 0, 0,
+    OP_GET_GLOBAL, 0, 0, OP_DEFINE_GLOBAL, 1, 0,
+    OP_GET_GLOBAL, 0, 0, OP_SET_GLOBAL, 1, 0, OP_POP,
+    OP_RETURN,
+  };
+  ASSERT_EQ(chunk.count, sizeof(expected));
+  for (size_t i = 0; i < sizeof(expected); i++) {
+    EXPECT_EQ(chunk.code[i], expected[i]) << i;
+  }
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, ConstantExpressionStatementsEmitNothing) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "1 + 2; \"a\";", &chunk));
+  ASSERT_EQ(chunk.count, 1);
+  EXPECT_EQ(chunk.code[0], OP_RETURN);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, RejectsInvalidAssignmentTarget) {
+  VM vm;
+  init_vm(&vm);
+  vm.err = fopen("/dev/null", "w");
+  Chunk chunk;
+  init_chunk(&chunk);
+  EXPECT_FALSE(compile(&vm, "var a; var b; a + b = 1;", &chunk));
+  fclose(vm.err);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestCompiler, ReportsErrorsAtTheEnd) {
+  char *buffer = NULL;
+  size_t size = 0;
+  VM vm;
+  init_vm(&vm);
+  vm.err = open_memstream(&buffer, &size);
+  Chunk chunk;
+  init_chunk(&chunk);
+  EXPECT_FALSE(compile(&vm, "print 1 +", &chunk));
+  fclose(vm.err);
+  EXPECT_EQ(std::string(buffer, size), "[line 1] Error at end: Expect expression\n");
+  free(buffer);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
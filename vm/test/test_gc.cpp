@@ -0,0 +1,164 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "clox/gc.h"
+#include "clox/object.h"
+#include "clox/table.h"
+#include "clox/trace.h"
+}
+
+static ObjString *find_string(VM *vm, const std::string &chars) {
+  return table_find_string(&vm->strings, chars.c_str(), chars.size(),
+      hash_string(chars.c_str(), chars.size()));
+}
+
+/**
+ * Makes the collector run all the time: a cycle starts with the first
+ * allocation and every allocation pays for a step of budget units.
+ */
+static void stress(VM *vm, size_t budget) {
+  vm->gc.min_heap = 0;
+  vm->gc.next_cycle = 0;
+  vm->gc.step_bytes = 1;
+  vm->gc.step_budget = budget;
+}
+
+TEST(TestGC, FreesGarbageAndKeepsGlobals) {
+  VM vm;
+  init_vm(&vm);
+  FILE *out = fopen("/dev/null", "w");
+  vm.out = out;
+
+  // "ab" only exists while the compiler folds the constants
+  ASSERT_EQ(interpret(&vm, "var kept = \"a\" + \"b\" + \"c\"; print \"gone\";"), INTERPRET_OK);
+  ASSERT_NE(find_string(&vm, "ab"), nullptr);
+  collect_garbage(&vm);
+
+  EXPECT_EQ(find_string(&vm, "a"), nullptr);
+  EXPECT_EQ(find_string(&vm, "ab"), nullptr);
+  EXPECT_EQ(find_string(&vm, "gone"), nullptr);
+  ObjString *kept = find_string(&vm, "abc");
+  ASSERT_NE(kept, nullptr);
+  // the name of a global stays, too
+  EXPECT_NE(find_string(&vm, "kept"), nullptr);
+  EXPECT_EQ(vm.gc.phase, GC_PAUSE);
+  EXPECT_EQ(vm.gc.stats.objects_freed, 5u);
+
+  // the survivor is white again and the next cycle keeps it as well
+  collect_garbage(&vm);
+  EXPECT_EQ(find_string(&vm, "abc"), kept);
+  EXPECT_EQ(vm.gc.stats.cycles, 2u);
+
+  free_vm(&vm);
+  fclose(out);
+}
+
+TEST(TestGC, BytesLiveMatchObjectMemory) {
+  size_t before = memory_stats()->categories[MEM_OBJECTS].live;
+  VM vm;
+  init_vm(&vm);
+  FILE *out = fopen("/dev/null", "w");
+  vm.out = out;
+
+  ASSERT_EQ(interpret(&vm, "var a = \"x\"; a = a + \"y\"; a = a + \"z\"; print a == \"xyz\";"), INTERPRET_OK);
+  EXPECT_EQ(vm.gc.bytes_live, memory_stats()->categories[MEM_OBJECTS].live - before);
+  collect_garbage(&vm);
+  EXPECT_EQ(vm.gc.bytes_live, memory_stats()->categories[MEM_OBJECTS].live - before);
+
+  free_vm(&vm);
+  fclose(out);
+}
+
+TEST(TestGC, IncrementalCollectionKeepsProgramCorrect) {
+  // every global is built from the one before while the collector runs a
+  // step on every allocation, so objects are allocated, marked and swept
+  // at all kinds of points of a cycle. Each line is a chunk of its own, as
+  // in the REPL, which leaves the constants of the last one as garbage.
+  std::vector<std::string> lines = {"var s0 = \"\";"};
+  std::string expected;
+  std::string value;
+  for (int i = 1; i < 500; i++) {
+    std::string name = "s" + std::to_string(i);
+    std::string previous = "s" + std::to_string(i - 1);
+    std::string piece = std::to_string(i % 10);
+    lines.push_back("var " + name + " = " + previous + " + \"" + piece + "\";"
+        + previous + " = \"dropped\" + " + name + ";"
+        + "print " + name + ";");
+    value += piece;
+    expected += value + "\n";
+  }
+
+  for (size_t budget : {1, 3, 64}) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buffer, &size);
+    VM vm;
+    init_vm(&vm);
+    vm.out = out;
+    stress(&vm, budget);
+
+    for (const std::string &line : lines) {
+      ASSERT_EQ(interpret(&vm, line.c_str()), INTERPRET_OK) << budget << ": " << line;
+    }
+    fflush(out);
+    EXPECT_EQ(std::string(buffer, size), expected) << budget;
+    EXPECT_GT(vm.gc.stats.cycles, 1u) << budget;
+    EXPECT_GT(vm.gc.stats.objects_freed, 0u) << budget;
+
+    // a step never does much more than its budget, the rest of the
+    // marking at the end of a cycle is bounded by the stack and the ring
+    size_t stack_capacity = (size_t) (vm.stack_end - vm.stack);
+    size_t bound = budget + 2 * stack_capacity + TRACE_CAPACITY * (TRACE_STACK_DEPTH + 1);
+    EXPECT_LE(vm.gc.stats.max_step_work, bound) << budget;
+
+    free_vm(&vm);
+    fclose(out);
+    free(buffer);
+  }
+}
+
+TEST(TestGC, InterningRevivesStringAboutToBeSwept) {
+  VM vm;
+  init_vm(&vm);
+  ObjString *dead = copy_string(&vm, "dead", 4);
+  stress(&vm, 1);
+  // the allocation starts a cycle, there are no roots so its only step
+  // ends marking before anything is swept
+  copy_string(&vm, "trigger", 7);
+  ASSERT_EQ(vm.gc.phase, GC_SWEEP);
+
+  // found through the string table, not through a root
+  EXPECT_EQ(copy_string(&vm, "dead", 4), dead);
+  gc_step(&vm, SIZE_MAX);
+  EXPECT_EQ(vm.gc.phase, GC_PAUSE);
+  EXPECT_EQ(find_string(&vm, "dead"), dead);
+  EXPECT_STREQ(dead->chars, "dead");
+
+  // unreferenced, it goes with the next complete cycle
+  collect_garbage(&vm);
+  EXPECT_EQ(find_string(&vm, "dead"), nullptr);
+  EXPECT_EQ(find_string(&vm, "trigger"), nullptr);
+
+  free_vm(&vm);
+}
+
+TEST(TestGC, NoCycleStartsWhileDeferred) {
+  VM vm;
+  init_vm(&vm);
+  stress(&vm, 1);
+  gc_defer(&vm);
+  for (int i = 0; i < 100; i++) {
+    std::string chars = std::to_string(i);
+    copy_string(&vm, chars.c_str(), chars.size());
+  }
+  EXPECT_EQ(vm.gc.phase, GC_PAUSE);
+  EXPECT_EQ(vm.gc.stats.cycles, 0u);
+  gc_resume(&vm);
+
+  copy_string(&vm, "x", 1);
+  EXPECT_EQ(vm.gc.stats.cycles, 1u);
+  free_vm(&vm);
+}
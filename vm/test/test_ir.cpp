@@ -0,0 +1,208 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "clox/compiler.h"
+#include "clox/ir.h"
+#include "clox/object.h"
+#include "clox/vm.h"
+}
+
+struct Outcome {
+  InterpretResult result;
+  std::string out;
+  std::string err;
+};
+
+static Outcome run(const std::string &source, int opt_level, bool jit = false) {
+  char *out_buffer = NULL, *err_buffer = NULL;
+  size_t out_size = 0, err_size = 0;
+  FILE *out = open_memstream(&out_buffer, &out_size);
+  FILE *err = open_memstream(&err_buffer, &err_size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  vm.err = err;
+  vm.opt_level = opt_level;
+  vm.jit = jit;
+  vm.jit_hot_runs = 0;
+  Outcome run;
+  run.result = interpret(&vm, source.c_str());
+  free_vm(&vm);
+  fclose(out);
+  fclose(err);
+
+  run.out = std::string(out_buffer, out_size);
+  run.err = std::string(err_buffer, err_size);
+  free(out_buffer);
+  free(err_buffer);
+  return run;
+}
+
+class TestIr : public ::testing::Test {
+protected:
+  VM vm;
+  Chunk chunk;
+
+  void SetUp() override {
+    init_vm(&vm);
+    vm.err = fopen("/dev/null", "w");
+    vm.opt_level = 1;
+    init_chunk(&chunk);
+  }
+
+  void TearDown() override {
+    free_chunk(&chunk);
+    fclose(vm.err);
+    free_vm(&vm);
+  }
+
+  /**
+   * Instructions of the compiled chunk, without operands.
+   */
+  std::vector<OpCode> compile_opcodes(const char *source) {
+    EXPECT_TRUE(compile(&vm, source, &chunk)) << source;
+    std::vector<OpCode> opcodes;
+    for (size_t offset = 0; offset < chunk.count; offset += instruction_length((OpCode) chunk.code[offset])) {
+      opcodes.push_back((OpCode) chunk.code[offset]);
+    }
+    return opcodes;
+  }
+
+  size_t count(const std::vector<OpCode> &opcodes, OpCode opcode) {
+    return (size_t) std::count(opcodes.begin(), opcodes.end(), opcode);
+  }
+};
+
+static const char *scripts[] = {
+  "var a = 1 + 2; var b = a * 3; print a + b; print b - a; print -a; print !a;",
+  "var a = 1; var b = 2; print a + b; print a + b; print (a + b) * (a + b);",
+  "var s = \"a\"; var t = s + \"b\"; print t + t == \"abab\"; print t;",
+  "var x = 1; x = 2; x = 3; print x; x = x + 1; x = x + 1; print x;",
+  "var a = 1; var a = 2; print a; a = nil; print a == nil;",
+  "1 + 2; \"a\" + \"b\"; var a = 3; a; -a; a == a; print a;",
+  // runtime errors must still happen, on the same line
+  "var a = 1;\nprint a + 1;\nprint missing;\nprint a;",
+  "var a = \"s\";\nvar b = a - 1;\nprint b;",
+  "var a = 1;\nmissing = 2;\nmissing = 3;\nprint a;",
+  "var a = 1;\na + nil;\nprint a;",
+  "var a = -\"s\";",
+  "print u; var u = 1;",
+  // an assignment before an error is seen by nobody but the error
+  "var x = 1;\nx = 2;\nx = x + nil;",
+  "var x = 1;\nx = 2;\nprint y;\nx = 3;",
+  "var a = 1; var b = a + 1; var c = a + 1; var d = b == c; print d;",
+  "var a = 0 / 0; print a == a; var b = a + 1; var c = a + 1; print b == c;",
+  "var x = 1; var y = 2; var z = 3;\n"
+  "x = x * 0.999 + y - z / 7;\n"
+  "y = (x - y) * (x + y) / 1000 + 1;\n"
+  "z = -z + x * 2 - y;\n"
+  "print x + y + z;",
+};
+
+TEST_F(TestIr, RunsLikeTheUnoptimizedCode) {
+  for (const char *script : scripts) {
+    Outcome plain = run(script, 0);
+    Outcome optimized = run(script, 1);
+    EXPECT_EQ(optimized.result, plain.result) << script;
+    EXPECT_EQ(optimized.out, plain.out) << script;
+    EXPECT_EQ(optimized.err, plain.err) << script;
+  }
+}
+
+TEST_F(TestIr, JitRunsOptimizedCode) {
+  for (const char *script : scripts) {
+    Outcome plain = run(script, 0);
+    Outcome native = run(script, 1, true);
+    EXPECT_EQ(native.result, plain.result) << script;
+    EXPECT_EQ(native.out, plain.out) << script;
+    EXPECT_EQ(native.err, plain.err) << script;
+  }
+}
+
+TEST_F(TestIr, GlobalsWithKnownValuesBecomeConstants) {
+  std::vector<OpCode> opcodes = compile_opcodes("var a = 1 + 2; var b = a * 3; print a + b;");
+  EXPECT_EQ(count(opcodes, OP_GET_GLOBAL), 0u);
+  EXPECT_EQ(count(opcodes, OP_ADD), 0u);
+  EXPECT_EQ(count(opcodes, OP_MULTIPLY), 0u);
+  EXPECT_EQ(opcodes.size(), 7u);
+}
+
+TEST_F(TestIr, CommonSubexpressionsAreReadBack) {
+  std::vector<OpCode> opcodes = compile_opcodes("var b = x + y; var c = x + y; print b;");
+  // the second sum is read from b, which still holds it
+  EXPECT_EQ(count(opcodes, OP_ADD), 1u);
+  // x, y, b for c and b for the print
+  EXPECT_EQ(count(opcodes, OP_GET_GLOBAL), 4u);
+}
+
+TEST_F(TestIr, UnusedPureExpressionsAreDropped) {
+  std::vector<OpCode> opcodes = compile_opcodes("var a = 1; a; -a; a == a; a + a; print a;");
+  EXPECT_EQ(count(opcodes, OP_POP), 0u);
+  EXPECT_EQ(count(opcodes, OP_NEGATE), 0u);
+  EXPECT_EQ(count(opcodes, OP_EQUAL), 0u);
+}
+
+TEST_F(TestIr, OperationsThatMayFailAreKept) {
+  std::vector<OpCode> opcodes = compile_opcodes("x; -x; x + 1;");
+  EXPECT_EQ(count(opcodes, OP_GET_GLOBAL), 2u);
+  EXPECT_EQ(count(opcodes, OP_NEGATE), 1u);
+  // once -x ran x is a number, so x + 1 cannot fail any more
+  EXPECT_EQ(count(opcodes, OP_ADD), 0u);
+}
+
+TEST_F(TestIr, OverwrittenStoresAreDropped) {
+  std::vector<OpCode> opcodes = compile_opcodes("var x = 1; x = 2; x = 3; var y = 1; var y = 2; print x + y;");
+  // the last store to each global stays for the chunks that run later
+  EXPECT_EQ(count(opcodes, OP_SET_GLOBAL), 1u);
+  EXPECT_EQ(count(opcodes, OP_DEFINE_GLOBAL), 2u);
+}
+
+TEST_F(TestIr, StoresBeforeAPossibleErrorAreKept) {
+  std::vector<OpCode> opcodes = compile_opcodes("var x = 1; x = 2; print y; x = 3;");
+  EXPECT_EQ(count(opcodes, OP_SET_GLOBAL), 2u);
+}
+
+TEST_F(TestIr, AssignmentsThatMayFailAreKept) {
+  // the first one reports that y is undefined
+  std::vector<OpCode> opcodes = compile_opcodes("y = 1; y = 2;");
+  EXPECT_EQ(count(opcodes, OP_SET_GLOBAL), 2u);
+}
+
+TEST_F(TestIr, OffByDefault) {
+  vm.opt_level = 0;
+  std::vector<OpCode> opcodes = compile_opcodes("var a = 1; a; print a;");
+  EXPECT_EQ(count(opcodes, OP_POP), 1u);
+  EXPECT_EQ(count(opcodes, OP_GET_GLOBAL), 2u);
+}
+
+TEST_F(TestIr, SyntaxErrorsAreReportedOnce) {
+  Outcome plain = run("print ;\nvar = 1;\nprint 1 +;", 0);
+  Outcome optimized = run("print ;\nvar = 1;\nprint 1 +;", 1);
+  EXPECT_EQ(optimized.result, INTERPRET_COMPILE_ERROR);
+  EXPECT_EQ(optimized.err, plain.err);
+}
+
+TEST(TestFoldInstruction, FoldsOnlyWhatCannotFail) {
+  VM vm;
+  init_vm(&vm);
+  Value result;
+  ASSERT_TRUE(fold_instruction(&vm, OP_ADD, NUMBER_VAL(1), NUMBER_VAL(2), &result));
+  EXPECT_EQ(AS_NUMBER(result), 3);
+  ASSERT_TRUE(fold_instruction(&vm, OP_NEGATE, NUMBER_VAL(1), NIL_VAL(0), &result));
+  EXPECT_EQ(AS_NUMBER(result), -1);
+  ASSERT_TRUE(fold_instruction(&vm, OP_NOT, NIL_VAL(0), NIL_VAL(0), &result));
+  EXPECT_TRUE(AS_BOOL(result));
+  ASSERT_TRUE(fold_instruction(&vm, OP_EQUAL, NIL_VAL(0), BOOL_VAL(false), &result));
+  EXPECT_FALSE(AS_BOOL(result));
+
+  EXPECT_FALSE(fold_instruction(&vm, OP_SUBTRACT, NUMBER_VAL(1), NIL_VAL(0), &result));
+  EXPECT_FALSE(fold_instruction(&vm, OP_NEGATE, BOOL_VAL(true), NIL_VAL(0), &result));
+  EXPECT_FALSE(fold_instruction(&vm, OP_PRINT, NUMBER_VAL(1), NUMBER_VAL(1), &result));
+  free_vm(&vm);
+}
@@ -0,0 +1,284 @@
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "clox/compiler.h"
+#include "clox/jit.h"
+#include "clox/vm.h"
+}
+
+struct Outcome {
+  InterpretResult result;
+  std::string out;
+  std::string err;
+};
+
+static Outcome run(const std::string &source, bool jit, bool stress_gc = false) {
+  char *out_buffer = NULL, *err_buffer = NULL;
+  size_t out_size = 0, err_size = 0;
+  FILE *out = open_memstream(&out_buffer, &out_size);
+  FILE *err = open_memstream(&err_buffer, &err_size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  vm.err = err;
+  vm.jit = jit;
+  vm.jit_hot_runs = 0;
+  if (stress_gc) {
+    // a collector step on every allocation
+    vm.gc.min_heap = 0;
+    vm.gc.next_cycle = 0;
+    vm.gc.step_bytes = 1;
+    vm.gc.step_budget = 2;
+  }
+#ifdef DEBUG_TRACE_EXECUTION
+  // the ring would send the JIT back to the interpreter
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+  Outcome run;
+  run.result = interpret(&vm, source.c_str());
+  free_vm(&vm);
+  fclose(out);
+  fclose(err);
+
+  run.out = std::string(out_buffer, out_size);
+  run.err = std::string(err_buffer, err_size);
+  free(out_buffer);
+  free(err_buffer);
+  return run;
+}
+
+/**
+ * Runs source in the interpreter and as native code and expects the same
+ * output, errors and result.
+ */
+static void expect_same(const std::string &source) {
+  Outcome interpreted = run(source, false);
+  Outcome native = run(source, true);
+  EXPECT_EQ(native.result, interpreted.result) << source;
+  EXPECT_EQ(native.out, interpreted.out) << source;
+  EXPECT_EQ(native.err, interpreted.err) << source;
+}
+
+static bool compiles_natively(const std::string &source) {
+  VM vm;
+  init_vm(&vm);
+  Chunk chunk;
+  init_chunk(&chunk);
+  EXPECT_TRUE(compile(&vm, source.c_str(), &chunk));
+  JitCode jit;
+  bool compiled = jit_compile(&chunk, &jit);
+  jit_free(&jit);
+  free_chunk(&chunk);
+  free_vm(&vm);
+  return compiled;
+}
+
+TEST(TestJit, CompilesEveryOpcode) {
+  if (!jit_available()) {
+    GTEST_SKIP() << "the JIT is not built in";
+  }
+  EXPECT_TRUE(compiles_natively(
+      "var a = 1; var b = \"s\"; a = -a * 2 / 4 - 1 + a; b = b + b;"
+      "print a == 1; print !b; print nil; a;"));
+}
+
+TEST(TestJit, Arithmetic) {
+  expect_same("print 1 + 2 * 3 - 4 / 5;");
+  expect_same("var a = 3; var b = 4; print (a * a + b * b) / (a - b) - -a;");
+  expect_same("var x = 0.1; x = x + 0.2; print x; print x == 0.3;");
+  expect_same("var zero = 0; print 1 / zero; print -1 / zero; print zero / zero == zero / zero;");
+}
+
+TEST(TestJit, StringsAndEquality) {
+  expect_same("var a = \"foo\"; var b = a + \"bar\"; print b; print b == \"foobar\"; print a == b;");
+  expect_same("var t = true; print !t; print !nil; print !0; print nil == false; print t == !!t;");
+  expect_same("var s = \"x\"; s = s + s; s = s + s; print s + \"!\";");
+}
+
+TEST(TestJit, Globals) {
+  expect_same("var a = 1; var b = a = 2; print a; print b;");
+  expect_same("var a; print a; a = \"now\"; print a;");
+  // a global that held a number no longer does
+  expect_same("var a = 1; print a + 1; a = \"s\"; print a + \"t\";\nprint a + 1;");
+  expect_same("var a = 1; var b = a; a = nil; print b * 2;\nprint a * 2;");
+  expect_same("var a = 1; var a = \"again\"; print a + a;\nprint -a;");
+}
+
+TEST(TestJit, CompilesHotChunksOnce) {
+  VM vm;
+  init_vm(&vm);
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  vm.out = out;
+  vm.jit = true;
+#ifdef DEBUG_TRACE_EXECUTION
+  vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+
+  Chunk chunk;
+  init_chunk(&chunk);
+  // the interpreted runs quicken the addition and the comparison
+  ASSERT_TRUE(compile(&vm, "var a = 1; print a + a == 2;", &chunk));
+  std::string expected;
+  for (uint32_t run = 0; run <= JIT_HOT_RUNS + 2; run++) {
+    ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+    expected += "true\n";
+    if (run < JIT_HOT_RUNS || !jit_available()) {
+      EXPECT_EQ(chunk.native.code, nullptr) << run;
+    } else {
+      EXPECT_NE(chunk.native.code, nullptr) << run;
+    }
+  }
+  fflush(out);
+  EXPECT_EQ(std::string(buffer, size), expected);
+
+  free_chunk(&chunk);
+  free_vm(&vm);
+  fclose(out);
+  free(buffer);
+}
+
+TEST(TestJit, RuntimeErrors) {
+  expect_same("var a = \"s\"; print 1;\nprint -a;");
+  expect_same("var a = nil;\nprint a * 2;");
+  expect_same("print 1;\nprint \"a\" + 1;");
+  expect_same("var a = 1; var s = \"s\";\nprint s + a;");
+  expect_same("print 1;\nprint missing;");
+  expect_same("print 1;\nmissing = 2;");
+}
+
+TEST(TestJit, StackBeyondTheLimitIsLeftToTheInterpreter) {
+  if (!jit_available()) {
+    GTEST_SKIP() << "the JIT is not built in";
+  }
+  std::string source = "var a = 1;\nprint 0;\nprint a + (a + (a + (a + (a + a))));";
+  for (size_t limit : {6, 5}) {
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *err = open_memstream(&buffer, &size);
+    VM vm;
+    init_vm(&vm);
+    vm.out = fopen("/dev/null", "w");
+    vm.err = err;
+    vm.jit = true;
+    vm.jit_hot_runs = 0;
+    vm.stack_limit = limit;
+#ifdef DEBUG_TRACE_EXECUTION
+    vm.tracer.mode = TRACE_OFF;
+#endif // DEBUG_TRACE_EXECUTION
+    Chunk chunk;
+    init_chunk(&chunk);
+    ASSERT_TRUE(compile(&vm, source.c_str(), &chunk));
+    InterpretResult result = interpret_chunk(&vm, &chunk);
+    EXPECT_EQ(chunk.native.stack_depth, 6u);
+    fflush(err);
+    if (limit == 6) {
+      EXPECT_EQ(result, INTERPRET_OK);
+    } else {
+      // the interpreter ran until the stack was full
+      EXPECT_EQ(result, INTERPRET_RUNTIME_ERROR);
+      EXPECT_EQ(std::string(buffer, size), "Stack overflow.\n[line 3] in script\n");
+    }
+    free_chunk(&chunk);
+    fclose(vm.out);
+    free_vm(&vm);
+    fclose(err);
+    free(buffer);
+  }
+}
+
+TEST(TestJit, NaNSignsMatchInterpreter) {
+  // with two NaN operands the result is one of them, which one depends on
+  // the order of the operands, the sign must not show
+  expect_same("var a = 0/0; var b = -a;"
+      "print a + b; print b + a; print a - b; print b - a;"
+      "print a * b; print b * a; print a / b; print b / a;"
+      "print a + 1; print 1 + b; print -a; print -b;");
+}
+
+/**
+ * Random straight line programs over globals of every type. Most of them
+ * end in a runtime error somewhere, which is compared as well. Every
+ * other program only does arithmetic on numbers, so that it gets to the
+ * end and its NaNs meet.
+ */
+TEST(TestJit, RandomProgramsMatchInterpreter) {
+  std::mt19937 random(1234);
+  // the numbers come first, with NaNs of both signs, whose sign in a
+  // result depends on the order of the operands
+  const char *literals[] = {"0", "1", "2.5", "-3", "(0/0)", "-(0/0)", "\"a\"", "\"bc\"", "true", "false", "nil"};
+  const size_t numbers = 6;
+  const char *binary[] = {"+", "-", "*", "/", "==", "!="};
+  const int globals = 6;
+  bool numeric = false;
+
+  auto operand = [&]() -> std::string {
+    if (random() % 2 == 0) {
+      return "g" + std::to_string(random() % globals);
+    }
+    return literals[random() % (numeric ? numbers : sizeof(literals) / sizeof(literals[0]))];
+  };
+  std::function<std::string(int)> expression = [&](int depth) -> std::string {
+    if (depth == 0 || random() % 4 == 0) {
+      return operand();
+    }
+    switch (random() % 4) {
+      case 0: return "-" + expression(depth - 1);
+      case 1: return (numeric ? "-" : "!") + expression(depth - 1);
+      default:
+        return "(" + expression(depth - 1) + " " + binary[random() % (numeric ? 4 : 6)] + " " +
+          expression(depth - 1) + ")";
+    }
+  };
+
+  for (int program = 0; program < 300; program++) {
+    numeric = program % 2 == 1;
+    std::string source;
+    for (int i = 0; i < globals; i++) {
+      // mostly numbers so that programs get further before an error
+      std::string value = std::to_string(i);
+      switch (random() % 4) {
+        case 0: value = random() % 2 ? "(0/0)" : "-(0/0)"; break;
+        case 1: value = numeric ? value : operand(); break;
+        default: break;
+      }
+      source += "var g" + std::to_string(i) + " = " + value + ";\n";
+    }
+    for (int statement = 0; statement < 20; statement++) {
+      switch (random() % 3) {
+        case 0: source += "print " + expression(4) + ";\n"; break;
+        case 1: source += "g" + std::to_string(random() % globals) + " = " + expression(3) + ";\n"; break;
+        default: source += expression(4) + ";\n"; break;
+      }
+    }
+    expect_same(source);
+    if (jit_available()) {
+      EXPECT_TRUE(compiles_natively(source)) << source;
+    }
+    if (HasFailure()) {
+      break;
+    }
+  }
+}
+
+TEST(TestJit, CollectorRunsDuringNativeCode) {
+  // strings built in native code only live in VM.stack and the globals
+  std::string source = "var s = \"\"; var t = \"\";";
+  for (int i = 0; i < 300; i++) {
+    source += "t = s + \"" + std::to_string(i % 10) + "\"; s = t + \"\";"
+        "print s + \"\" == t;";
+  }
+  source += "print s;";
+  Outcome interpreted = run(source, false, true);
+  Outcome native = run(source, true, true);
+  EXPECT_EQ(native.result, INTERPRET_OK);
+  EXPECT_EQ(native.out, interpreted.out);
+  EXPECT_EQ(native.err, interpreted.err);
+}
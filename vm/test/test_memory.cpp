@@ -0,0 +1,228 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "clox/chunk.h"
+#include "clox/memory.h"
+}
+
+TEST(TestArena, AllocationsAreAligned) {
+  Arena arena;
+  init_arena(&arena);
+  for (size_t size = 1; size < 100; size += 7) {
+    void *ptr = arena_alloc(&arena, size, MEM_OTHER);
+    ASSERT_NE(ptr, nullptr);
+    EXPECT_EQ((uintptr_t) ptr % alignof(max_align_t), 0u);
+    memset(ptr, 0xAB, size);
+  }
+  EXPECT_EQ(arena.stats.blocks, 1u);
+  free_arena(&arena);
+}
+
+TEST(TestArena, NewestAllocationGrowsInPlace) {
+  Arena arena;
+  init_arena(&arena);
+
+  void *ptr = NULL;
+  ASSERT_TRUE(arena_reallocate(&arena, &ptr, 0, 16, MEM_OTHER));
+  void *first = ptr;
+  memset(ptr, 1, 16);
+  ASSERT_TRUE(arena_reallocate(&arena, &ptr, 16, 64, MEM_OTHER));
+  EXPECT_EQ(ptr, first);
+  EXPECT_EQ(arena.stats.grows_in_place, 1u);
+  EXPECT_EQ(arena.stats.bytes_copied, 0u);
+
+  // once something else is allocated after it, growing has to move
+  arena_alloc(&arena, 8, MEM_OTHER);
+  ASSERT_TRUE(arena_reallocate(&arena, &ptr, 64, 128, MEM_OTHER));
+  EXPECT_NE(ptr, first);
+  EXPECT_EQ(arena.stats.bytes_copied, 64u);
+  for (int i = 0; i < 16; i++) {
+    EXPECT_EQ(((unsigned char *) ptr)[i], 1);
+  }
+  free_arena(&arena);
+}
+
+TEST(TestArena, LargeRequestsGetTheirOwnBlock) {
+  Arena arena;
+  init_arena(&arena);
+  void *small = arena_alloc(&arena, 8, MEM_OTHER);
+  void *large = arena_alloc(&arena, 1 << 22, MEM_OTHER);
+  ASSERT_NE(small, nullptr);
+  ASSERT_NE(large, nullptr);
+  memset(large, 0, 1 << 22);
+  EXPECT_EQ(arena.stats.blocks, 2u);
+  EXPECT_GE(arena.stats.block_bytes, (size_t) (1 << 22));
+  free_arena(&arena);
+  EXPECT_EQ(arena.blocks, nullptr);
+}
+
+static void record_stats(const ArenaStats *stats, void *context) {
+  *(ArenaStats *) context = *stats;
+}
+
+TEST(TestArena, StatsHookSeesChunkAllocations) {
+  ArenaStats seen = {};
+  set_arena_stats_hook(record_stats, &seen);
+
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (int i = 0; i < 1000; i++) {
+    write_constant(&chunk, NUMBER_VAL(i), i);
+  }
+  write_chunk(&chunk, OP_RETURN, 1000);
+  ArenaStats expected = chunk.arena.stats;
+  free_chunk(&chunk);
+  set_arena_stats_hook(NULL, NULL);
+
+  EXPECT_GT(seen.allocations, 0u);
+  EXPECT_EQ(seen.allocations, expected.allocations);
+  EXPECT_EQ(seen.bytes_allocated, expected.bytes_allocated);
+  EXPECT_EQ(seen.blocks, expected.blocks);
+  EXPECT_GE(seen.block_bytes, seen.bytes_allocated);
+}
+
+TEST(TestMemoryStats, ReallocateTracksLiveAndPeakBytes) {
+  MemoryStats before = *memory_stats();
+
+  void *ptr = NULL;
+  ASSERT_TRUE(reallocate(&ptr, 0, 100, MEM_OBJECTS));
+  ASSERT_TRUE(reallocate(&ptr, 100, 300, MEM_OBJECTS));
+  EXPECT_EQ(memory_stats()->live, before.live + 300);
+  ASSERT_TRUE(reallocate(&ptr, 300, 0, MEM_OBJECTS));
+
+  const MemoryStats *after = memory_stats();
+  const CategoryStats *objects = &after->categories[MEM_OBJECTS];
+  EXPECT_EQ(after->live, before.live);
+  EXPECT_GE(after->peak, before.live + 300);
+  EXPECT_EQ(objects->allocations, before.categories[MEM_OBJECTS].allocations + 1);
+  EXPECT_EQ(objects->resizes, before.categories[MEM_OBJECTS].resizes + 1);
+  EXPECT_EQ(objects->frees, before.categories[MEM_OBJECTS].frees + 1);
+  EXPECT_EQ(objects->live, before.categories[MEM_OBJECTS].live);
+}
+
+TEST(TestMemoryStats, ChunkDataIsCountedInsideItsArena) {
+  MemoryStats before = *memory_stats();
+
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (int i = 0; i < 1000; i++) {
+    write_constant(&chunk, NUMBER_VAL(i), i);
+  }
+  const MemoryStats *during = memory_stats();
+  EXPECT_GT(during->categories[MEM_CODE].live, before.categories[MEM_CODE].live);
+  EXPECT_GT(during->categories[MEM_LINES].live, before.categories[MEM_LINES].live);
+  EXPECT_GT(during->categories[MEM_CONSTANTS].live, before.categories[MEM_CONSTANTS].live);
+  // only the arena blocks count towards the heap
+  EXPECT_EQ(during->live - before.live, during->categories[MEM_ARENA].live - before.categories[MEM_ARENA].live);
+  free_chunk(&chunk);
+
+  const MemoryStats *after = memory_stats();
+  EXPECT_EQ(after->live, before.live);
+  for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+    EXPECT_EQ(after->categories[i].live, before.categories[i].live) << i;
+  }
+}
+
+TEST(TestMemoryStats, StatsArePerThread) {
+  void *ptr = NULL;
+  ASSERT_TRUE(reallocate(&ptr, 0, 1 << 20, MEM_OTHER));
+  size_t main_live = memory_stats()->live;
+
+  size_t thread_live = 0;
+  std::thread([&thread_live]() {
+    thread_live = memory_stats()->live;
+  }).join();
+  EXPECT_EQ(thread_live, 0u);
+  EXPECT_GE(main_live, (size_t) 1 << 20);
+  reallocate(&ptr, 1 << 20, 0, MEM_OTHER);
+}
+
+TEST(TestSlab, LargeObjectsComeFromMalloc) {
+  SlabStats before = *slab_stats();
+  size_t live = memory_stats()->categories[MEM_OTHER].live;
+  void *ptr = slab_alloc(SLAB_MAX_SIZE + 1, MEM_OTHER);
+  ASSERT_NE(ptr, nullptr);
+  EXPECT_EQ(memory_stats()->categories[MEM_OTHER].live, live + SLAB_MAX_SIZE + 1);
+  EXPECT_EQ(slab_stats()->pages_mapped, before.pages_mapped);
+  slab_free(ptr, SLAB_MAX_SIZE + 1, MEM_OTHER);
+  EXPECT_EQ(memory_stats()->categories[MEM_OTHER].live, live);
+}
+
+#ifdef CLOX_SLAB_ALLOCATOR
+TEST(TestSlab, FreedBlocksAreReusedWithinTheirClass) {
+  void *a = slab_alloc(40, MEM_OBJECTS);
+  void *b = slab_alloc(40, MEM_OBJECTS);
+  void *other = slab_alloc(100, MEM_OBJECTS);
+  ASSERT_NE(a, nullptr);
+  ASSERT_NE(b, nullptr);
+  EXPECT_GE((uintptr_t) b - (uintptr_t) a, 40u);
+  EXPECT_EQ((uintptr_t) a % alignof(max_align_t), 0u);
+  memset(a, 1, 40);
+  memset(b, 2, 40);
+
+  size_t reused = slab_stats()->reused;
+  slab_free(a, 40, MEM_OBJECTS);
+  // 33 to 48 bytes share a class
+  EXPECT_EQ(slab_alloc(33, MEM_OBJECTS), a);
+  EXPECT_EQ(slab_stats()->reused, reused + 1);
+  EXPECT_NE(slab_alloc(100, MEM_OBJECTS), a);
+
+  slab_free(a, 33, MEM_OBJECTS);
+  slab_free(b, 40, MEM_OBJECTS);
+  slab_free(other, 100, MEM_OBJECTS);
+  slab_release_empty();
+}
+
+TEST(TestSlab, EmptyPagesAreReleasedInBulk) {
+  MemoryStats before = *memory_stats();
+  SlabStats slab_before = *slab_stats();
+
+  // enough blocks for several pages
+  std::vector<void *> blocks;
+  for (size_t i = 0; i < 4 * SLAB_PAGE_SIZE / 64; i++) {
+    blocks.push_back(slab_alloc(64, MEM_OBJECTS));
+    ASSERT_NE(blocks.back(), nullptr);
+  }
+  size_t pages = slab_stats()->pages - slab_before.pages;
+  EXPECT_GE(pages, 4u);
+  EXPECT_EQ(memory_stats()->live, before.live + pages * SLAB_PAGE_SIZE);
+  EXPECT_EQ(memory_stats()->categories[MEM_OBJECTS].live,
+      before.categories[MEM_OBJECTS].live + blocks.size() * 64);
+
+  for (void *block : blocks) {
+    slab_free(block, 64, MEM_OBJECTS);
+  }
+  // empty pages are kept until they are released
+  EXPECT_EQ(slab_stats()->pages, slab_before.pages + pages);
+  EXPECT_EQ(slab_stats()->empty_pages, slab_before.empty_pages + pages);
+  EXPECT_EQ(memory_stats()->categories[MEM_OBJECTS].live, before.categories[MEM_OBJECTS].live);
+
+  EXPECT_EQ(slab_release_empty(), slab_before.empty_pages + pages);
+  EXPECT_EQ(slab_stats()->pages, slab_before.pages - slab_before.empty_pages);
+  EXPECT_EQ(slab_stats()->empty_pages, 0u);
+  EXPECT_EQ(memory_stats()->live, before.live - slab_before.empty_pages * SLAB_PAGE_SIZE);
+}
+
+TEST(TestSlab, PagesBelongToTheirThread) {
+  void *ptr = slab_alloc(24, MEM_OBJECTS);
+  size_t pages = slab_stats()->pages;
+
+  size_t thread_pages = 0;
+  std::thread([&thread_pages]() {
+    void *own = slab_alloc(24, MEM_OBJECTS);
+    thread_pages = slab_stats()->pages;
+    slab_free(own, 24, MEM_OBJECTS);
+    slab_release_empty();
+  }).join();
+  EXPECT_EQ(thread_pages, 1u);
+  EXPECT_EQ(slab_stats()->pages, pages);
+
+  slab_free(ptr, 24, MEM_OBJECTS);
+  slab_release_empty();
+}
+#endif // CLOX_SLAB_ALLOCATOR
@@ -0,0 +1,160 @@
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include "clox/object.h"
+#include "clox/table.h"
+}
+
+TEST(TestObject, EqualStringsAreInterned) {
+  VM vm;
+  init_vm(&vm);
+  ObjString *a = copy_string(&vm, "hello", 5);
+  ObjString *b = copy_string(&vm, "hello world", 5);
+  ObjString *c = copy_string(&vm, "help", 4);
+  EXPECT_EQ(a, b);
+  EXPECT_NE(a, c);
+  EXPECT_STREQ(a->chars, "hello");
+  EXPECT_EQ(a->hash, hash_string("hello", 5));
+  EXPECT_TRUE(values_equal(OBJ_VAL(a), OBJ_VAL(b)));
+  EXPECT_FALSE(values_equal(OBJ_VAL(a), OBJ_VAL(c)));
+  free_vm(&vm);
+}
+
+TEST(TestObject, ConcatenationFindsInternedString) {
+  VM vm;
+  init_vm(&vm);
+  ObjString *whole = copy_string(&vm, "foobar", 6);
+  ObjString *foo = copy_string(&vm, "foo", 3);
+  ObjString *bar = copy_string(&vm, "bar", 3);
+  const Obj *newest = vm.objects;
+
+  EXPECT_EQ(concatenate_strings(&vm, foo, bar), whole);
+  // the temporary copy was freed again
+  EXPECT_EQ(vm.objects, newest);
+
+  ObjString *barfoo = concatenate_strings(&vm, bar, foo);
+  EXPECT_STREQ(barfoo->chars, "barfoo");
+  EXPECT_EQ(copy_string(&vm, "barfoo", 6), barfoo);
+  free_vm(&vm);
+}
+
+TEST(TestObject, StringsAreFreedWithTheVM) {
+  size_t live = memory_stats()->categories[MEM_OBJECTS].live;
+  VM vm;
+  init_vm(&vm);
+  for (int i = 0; i < 100; i++) {
+    std::string chars = std::to_string(i);
+    copy_string(&vm, chars.c_str(), chars.size());
+  }
+  EXPECT_GT(memory_stats()->categories[MEM_OBJECTS].live, live);
+  free_vm(&vm);
+  EXPECT_EQ(memory_stats()->categories[MEM_OBJECTS].live, live);
+}
+
+TEST(TestTable, SetGetDelete) {
+  VM vm;
+  init_vm(&vm);
+  Table table;
+  init_table(&table);
+
+  ObjString *keys[200];
+  for (int i = 0; i < 200; i++) {
+    std::string chars = "key" + std::to_string(i);
+    keys[i] = copy_string(&vm, chars.c_str(), chars.size());
+    EXPECT_TRUE(table_set(&table, keys[i], NUMBER_VAL(i)));
+  }
+  EXPECT_FALSE(table_set(&table, keys[7], NUMBER_VAL(-7)));
+
+  for (int i = 0; i < 200; i += 2) {
+    EXPECT_TRUE(table_delete(&table, keys[i]));
+  }
+  EXPECT_FALSE(table_delete(&table, keys[0]));
+
+  for (int i = 0; i < 200; i++) {
+    Value value;
+    if (i % 2 == 0) {
+      EXPECT_FALSE(table_get(&table, keys[i], &value)) << i;
+    } else {
+      ASSERT_TRUE(table_get(&table, keys[i], &value)) << i;
+      EXPECT_EQ(AS_NUMBER(value), i == 7 ? -7 : i);
+    }
+  }
+
+  // deleted keys come back through their tombstones
+  EXPECT_TRUE(table_set(&table, keys[0], NUMBER_VAL(0)));
+  Value value;
+  EXPECT_TRUE(table_get(&table, keys[0], &value));
+
+  free_table(&table);
+  free_vm(&vm);
+}
+
+TEST(TestTable, AddAll) {
+  VM vm;
+  init_vm(&vm);
+  Table from, to;
+  init_table(&from);
+  init_table(&to);
+  ObjString *a = copy_string(&vm, "a", 1);
+  ObjString *b = copy_string(&vm, "b", 1);
+  table_set(&from, a, NUMBER_VAL(1));
+  table_set(&from, b, NUMBER_VAL(2));
+  table_set(&to, a, NUMBER_VAL(0));
+
+  table_add_all(&from, &to);
+  Value value;
+  ASSERT_TRUE(table_get(&to, a, &value));
+  EXPECT_EQ(AS_NUMBER(value), 1);
+  ASSERT_TRUE(table_get(&to, b, &value));
+  EXPECT_EQ(AS_NUMBER(value), 2);
+
+  free_table(&from);
+  free_table(&to);
+  free_vm(&vm);
+}
+
+TEST(TestTable, MatchesReferenceUnderChurn) {
+  VM vm;
+  init_vm(&vm);
+  Table table;
+  init_table(&table);
+
+  std::vector<ObjString *> keys;
+  for (int i = 0; i < 1000; i++) {
+    std::string chars = "k" + std::to_string(i);
+    keys.push_back(copy_string(&vm, chars.c_str(), chars.size()));
+  }
+
+  // long runs of inserts and deletes leave plenty of deleted slots behind
+  std::unordered_map<ObjString *, double> reference;
+  std::mt19937 random(42);
+  for (int step = 0; step < 100000; step++) {
+    ObjString *key = keys[random() % keys.size()];
+    bool inserting = (step / 5000) % 2 == 0 ? random() % 4 != 0 : random() % 4 == 0;
+    if (inserting) {
+      EXPECT_EQ(table_set(&table, key, NUMBER_VAL(step)), reference.count(key) == 0);
+      reference[key] = step;
+    } else {
+      EXPECT_EQ(table_delete(&table, key), reference.erase(key) == 1);
+    }
+  }
+
+  for (ObjString *key : keys) {
+    Value value;
+    auto expected = reference.find(key);
+    ASSERT_EQ(table_get(&table, key, &value), expected != reference.end());
+    if (expected != reference.end()) {
+      EXPECT_EQ(AS_NUMBER(value), expected->second);
+    }
+  }
+  // interned lookups by content still work after all the churn
+  EXPECT_EQ(table_find_string(&vm.strings, "k999", 4, hash_string("k999", 4)), keys[999]);
+
+  free_table(&table);
+  free_vm(&vm);
+}
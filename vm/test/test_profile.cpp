@@ -0,0 +1,58 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+extern "C" {
+#include "clox/chunk.h"
+#include "clox/profile.h"
+}
+
+TEST(TestProfile, CountsOpcodesAndPairs) {
+  Profiler *profiler = new_profiler(NULL);
+  ASSERT_NE(profiler, nullptr);
+
+  const uint8_t run[] = {OP_CONSTANT, OP_CONSTANT, OP_ADD, OP_NEGATE, OP_RETURN};
+  for (int i = 0; i < 3; i++) {
+    profile_start_run(profiler);
+    for (uint8_t op : run) {
+      profile_instruction(profiler, op);
+    }
+    profile_end_run(profiler);
+  }
+
+  EXPECT_EQ(profiler->counts[OP_CONSTANT], 6);
+  EXPECT_EQ(profiler->counts[OP_ADD], 3);
+  EXPECT_EQ(profiler->counts[OP_RETURN], 3);
+  EXPECT_EQ(profiler->pairs[OP_CONSTANT][OP_CONSTANT], 3);
+  EXPECT_EQ(profiler->pairs[OP_CONSTANT][OP_ADD], 3);
+  EXPECT_EQ(profiler->pairs[OP_ADD][OP_NEGATE], 3);
+  // pairs never span two runs
+  EXPECT_EQ(profiler->pairs[OP_RETURN][OP_CONSTANT], 0);
+
+  free_profiler(profiler);
+}
+
+TEST(TestProfile, WritesCsv) {
+  Profiler *profiler = new_profiler(NULL);
+  profile_start_run(profiler);
+  profile_instruction(profiler, OP_CONSTANT);
+  profile_instruction(profiler, OP_NEGATE);
+  profile_instruction(profiler, OP_RETURN);
+  profile_end_run(profiler);
+
+  std::string path = testing::TempDir() + "clox_profile.csv";
+  ASSERT_TRUE(write_profile_csv(profiler, path.c_str()));
+  free_profiler(profiler);
+
+  std::ifstream csv(path);
+  std::stringstream contents;
+  contents << csv.rdbuf();
+  std::string text = contents.str();
+
+  EXPECT_EQ(text.rfind("kind,opcode,next,count,", 0), 0) << text;
+  EXPECT_NE(text.find("opcode,OP_NEGATE,,1,"), std::string::npos) << text;
+  EXPECT_NE(text.find("pair,OP_CONSTANT,OP_NEGATE,1,"), std::string::npos) << text;
+  EXPECT_NE(text.find("pair,OP_NEGATE,OP_RETURN,1,"), std::string::npos) << text;
+}
@@ -0,0 +1,186 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "clox/bytecode.h"
+#include "clox/compiler.h"
+#include "clox/debug.h"
+#include "clox/vm.h"
+}
+
+class TestQuicken : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    out = open_memstream(&buffer, &size);
+    err = fopen("/dev/null", "w");
+    init_vm(&vm);
+    vm.out = out;
+    // counts hits, the reports go nowhere
+    vm.err = err;
+    vm.quicken_stats = true;
+    // a superinstruction would hide the sites from quickening
+    vm.superinstructions = false;
+    init_chunk(&chunk);
+  }
+
+  void TearDown() override {
+    free_chunk(&chunk);
+    free_vm(&vm);
+    fclose(out);
+    fclose(err);
+    free(buffer);
+  }
+
+  /**
+   * Everything the VM printed since the last call.
+   */
+  std::string printed() {
+    fflush(out);
+    std::string text(buffer + consumed, size - consumed);
+    consumed = size;
+    return text;
+  }
+
+  /**
+   * Offset of the first instruction in chunk whose generic form is
+   * opcode.
+   */
+  size_t find(OpCode opcode) {
+    for (size_t offset = 0; offset < chunk.count; offset += instruction_length((OpCode) chunk.code[offset])) {
+      if (generic_opcode((OpCode) chunk.code[offset]) == opcode) {
+        return offset;
+      }
+    }
+    ADD_FAILURE() << "no " << opcode_name(opcode);
+    return 0;
+  }
+
+  VM vm;
+  Chunk chunk;
+  FILE *out;
+  FILE *err;
+  char *buffer = NULL;
+  size_t size = 0;
+  size_t consumed = 0;
+};
+
+TEST_F(TestQuicken, SpecializesAfterSeeingTypes) {
+  ASSERT_TRUE(compile(&vm, "var a = 1; var b = 2; print a + b; print a == b;", &chunk));
+  size_t add = find(OP_ADD);
+  size_t equal = find(OP_EQUAL);
+
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_EQ(chunk.code[add], OP_ADD_NUM);
+  EXPECT_EQ(chunk.code[equal], OP_EQUAL_NUM);
+  EXPECT_EQ(chunk.sites[add].hits, 0u);
+
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_EQ(printed(), "3\nfalse\n3\nfalse\n3\nfalse\n");
+  EXPECT_EQ(chunk.sites[add].hits, 2u);
+  EXPECT_EQ(chunk.sites[add].misses, 0u);
+  EXPECT_EQ(chunk.sites[equal].hits, 2u);
+}
+
+TEST_F(TestQuicken, MissGoesBackToGenericForm) {
+  ASSERT_EQ(interpret(&vm, "var a = 1; var b = 2;"), INTERPRET_OK);
+  ASSERT_TRUE(compile(&vm, "print a + b;", &chunk));
+  size_t add = find(OP_ADD);
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_EQ(chunk.code[add], OP_ADD_NUM);
+
+  // the same site now adds strings
+  ASSERT_EQ(interpret(&vm, "a = \"x\"; b = \"y\";"), INTERPRET_OK);
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_EQ(chunk.code[add], OP_ADD_STR);
+  EXPECT_EQ(chunk.sites[add].misses, 1u);
+
+  // and then neither, the generic form reports the error
+  ASSERT_EQ(interpret(&vm, "b = 1;"), INTERPRET_OK);
+  EXPECT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_RUNTIME_ERROR);
+  EXPECT_EQ(chunk.code[add], OP_ADD);
+  EXPECT_EQ(chunk.sites[add].misses, 2u);
+  EXPECT_EQ(printed(), "3\nxy\n");
+}
+
+TEST_F(TestQuicken, SitesThatKeepMissingStayGeneric) {
+  ASSERT_EQ(interpret(&vm, "var a = 1;"), INTERPRET_OK);
+  ASSERT_TRUE(compile(&vm, "print a + a;", &chunk));
+  size_t add = find(OP_ADD);
+  for (int i = 0; i < 2 * QUICKEN_MISSES_MAX; i++) {
+    ASSERT_EQ(interpret(&vm, i % 2 ? "a = \"s\";" : "a = 1;"), INTERPRET_OK);
+    ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  }
+  EXPECT_EQ(chunk.code[add], OP_ADD);
+  EXPECT_EQ(chunk.sites[add].misses, (uint32_t) QUICKEN_MISSES_MAX);
+}
+
+TEST_F(TestQuicken, HitsAreOnlyCountedWithStats) {
+  vm.quicken_stats = false;
+  ASSERT_TRUE(compile(&vm, "var a = 1; print a + a;", &chunk));
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  size_t add = find(OP_ADD);
+  EXPECT_EQ(chunk.code[add], OP_ADD_NUM);
+  EXPECT_EQ(chunk.sites[add].hits, 0u);
+}
+
+TEST_F(TestQuicken, CanBeTurnedOff) {
+  vm.quicken = false;
+  ASSERT_TRUE(compile(&vm, "var a = 1; print a + a;", &chunk));
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_EQ(chunk.code[find(OP_ADD)], OP_ADD);
+  EXPECT_EQ(chunk.sites, nullptr);
+}
+
+TEST_F(TestQuicken, BorrowedCodeIsCopiedAndSavedGeneric) {
+  ASSERT_TRUE(compile(&vm, "var a = 1; print a + a; print a == 1;", &chunk));
+  char *bytes = NULL;
+  size_t length = 0;
+  FILE *file = open_memstream(&bytes, &length);
+  ASSERT_TRUE(write_bytecode(&vm, &chunk, file));
+  fclose(file);
+  std::string original(bytes, length);
+  free(bytes);
+
+  // the mapped file stays as it is while the chunk is quickened
+  uint8_t *storage = (uint8_t *) malloc(original.size());
+  memcpy(storage, original.data(), original.size());
+  Chunk loaded;
+  ASSERT_TRUE(read_bytecode(&vm, &loaded, storage, original.size(), err));
+  ASSERT_EQ(interpret_chunk(&vm, &loaded), INTERPRET_OK);
+  ASSERT_EQ(interpret_chunk(&vm, &loaded), INTERPRET_OK);
+  EXPECT_EQ(printed(), "2\ntrue\n2\ntrue\n");
+  EXPECT_NE(loaded.code, storage + sizeof(BytecodeHeader));
+  EXPECT_EQ(memcmp(storage, original.data(), original.size()), 0);
+  EXPECT_NE(memcmp(loaded.code, chunk.code, chunk.count), 0);
+
+  // saving writes what the compiler emitted
+  file = open_memstream(&bytes, &length);
+  ASSERT_TRUE(write_bytecode(&vm, &loaded, file));
+  fclose(file);
+  EXPECT_EQ(std::string(bytes, length), original);
+  free(bytes);
+
+  free_chunk(&loaded);
+  free(storage);
+}
+
+TEST_F(TestQuicken, ReportListsQuickenedSites) {
+  ASSERT_TRUE(compile(&vm, "var a = 1;\nprint a + a;", &chunk));
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+
+  char *report = NULL;
+  size_t length = 0;
+  FILE *file = open_memstream(&report, &length);
+  report_quickening(file, &chunk);
+  fclose(file);
+  std::string text(report, length);
+  free(report);
+  EXPECT_NE(text.find("OP_ADD_NUM"), std::string::npos) << text;
+  EXPECT_NE(text.find("100.0%"), std::string::npos) << text;
+}
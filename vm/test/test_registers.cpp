@@ -0,0 +1,245 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+#include "clox/bytecode.h"
+#include "clox/compiler.h"
+#include "clox/vm.h"
+}
+
+struct Outcome {
+  InterpretResult result;
+  std::string out;
+  std::string err;
+};
+
+static Outcome run(const std::string &source, bool registers, int opt_level = 0, size_t step_bytes = 0) {
+  char *out_buffer = NULL, *err_buffer = NULL;
+  size_t out_size = 0, err_size = 0;
+  FILE *out = open_memstream(&out_buffer, &out_size);
+  FILE *err = open_memstream(&err_buffer, &err_size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  vm.err = err;
+  vm.registers = registers;
+  vm.opt_level = opt_level;
+  if (step_bytes > 0) {
+    vm.gc.min_heap = 0;
+    vm.gc.next_cycle = 0;
+    vm.gc.step_bytes = step_bytes;
+  }
+  Outcome run;
+  run.result = interpret(&vm, source.c_str());
+  free_vm(&vm);
+  fclose(out);
+  fclose(err);
+
+  run.out = std::string(out_buffer, out_size);
+  run.err = std::string(err_buffer, err_size);
+  free(out_buffer);
+  free(err_buffer);
+  return run;
+}
+
+static const char *scripts[] = {
+  "var a = 1 + 2; var b = a * 3; print a + b; print b - a; print -a; print !a;",
+  "var a = 1; var b = 2; print a + b; print (a + b) * (a + b) / (b - a);",
+  "var s = \"a\"; var t = s + \"b\"; print t + t == \"abab\"; print t;",
+  "var x = 1; x = 2; print x = 3; print x; x = x + 1; print x;",
+  // values read from a global outlive assignments to it
+  "var x = 1; print x + (x = 5); print (x = 1) + (x = 2); print x;",
+  "var a = 1; var b = a; a = 2; print b; b = a = 3; print a + b; a = -b; print a;",
+  "var a = 1; var a = 2; print a; a = nil; print a == nil; print !nil == true;",
+  "1 + 2; \"a\" + \"b\"; var a = 3; a; -a; a == a; print a;",
+  "print 1; print \"one\"; print true; print nil;",
+  "",
+  // runtime errors stop on the same line
+  "var a = 1;\nprint a + 1;\nprint missing;\nprint a;",
+  "var a = \"s\";\nvar b = a - 1;\nprint b;",
+  "var a = 1;\nmissing = 2;\nprint a;",
+  "var a = 1;\nmissing = a + 1;\nprint a;",
+  "var a = 1;\na + nil;\nprint a;",
+  "var a = -\"s\";",
+  "var x = 1; var y = 2; var z = 3;\n"
+  "x = x * 0.999 + y - z / 7;\n"
+  "y = (x - y) * (x + y) / 1000 + 1;\n"
+  "z = z + y + x + 0.5;\n"
+  "print (x == y) == (z + 1 == x + z);\n"
+  "print x + y + z;",
+};
+
+TEST(TestRegisters, RunsLikeStackCode) {
+  for (int opt_level = 0; opt_level <= OPT_LEVEL_MAX; opt_level++) {
+    for (const char *script : scripts) {
+      Outcome stack = run(script, false, opt_level);
+      Outcome registers = run(script, true, opt_level);
+      EXPECT_EQ(registers.result, stack.result) << script;
+      EXPECT_EQ(registers.out, stack.out) << script;
+      EXPECT_EQ(registers.err, stack.err) << script;
+    }
+  }
+}
+
+TEST(TestRegisters, CompileErrorsAreTheSame) {
+  Outcome stack = run("print ;\nvar = 1;\nprint 1 +;", false);
+  Outcome registers = run("print ;\nvar = 1;\nprint 1 +;", true);
+  EXPECT_EQ(registers.result, INTERPRET_COMPILE_ERROR);
+  EXPECT_EQ(registers.err, stack.err);
+}
+
+TEST(TestRegisters, FewerInstructionsThanStackCode) {
+  const char *source = "var x = 1; var y = 2; var z = 3;\nx = x * 0.999 + y - z / 7;";
+  size_t counts[2];
+  for (int registers = 0; registers < 2; registers++) {
+    VM vm;
+    init_vm(&vm);
+    vm.registers = registers;
+    Chunk chunk;
+    init_chunk(&chunk);
+    ASSERT_TRUE(compile(&vm, source, &chunk));
+    EXPECT_EQ(chunk.registers, registers != 0);
+    size_t count = 0;
+    for (size_t offset = 0; offset < chunk.count; count++) {
+      offset += registers ? register_instruction_length((RegOpCode) chunk.code[offset]) :
+        instruction_length((OpCode) chunk.code[offset]);
+    }
+    counts[registers] = count;
+    free_chunk(&chunk);
+    free_vm(&vm);
+  }
+  // 3 * (constant, define), 11 for the assignment and the return
+  EXPECT_EQ(counts[0], 18u);
+  // 3 defines taking their constants, 4 operations reading the globals
+  // and writing x and the return
+  EXPECT_EQ(counts[1], 8u);
+}
+
+TEST(TestRegisters, ValuesOnlyTakeRegistersWhileTheyAreAlive) {
+  VM vm;
+  init_vm(&vm);
+  vm.registers = true;
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "var a = 1; print (a + a) * (a + a); print a + a + a + a;", &chunk));
+  // the constant 1 and a are in the frame, a + a needs a register and
+  // the other a + a one more while the first sum is alive
+  EXPECT_EQ(chunk.frame_constants, 1u);
+  EXPECT_EQ(chunk.frame_global_count, 1u);
+  EXPECT_EQ(chunk.register_count, 2u);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
+
+TEST(TestRegisters, ConstantsBeyondTheFrameAreLoaded) {
+  std::string source = "var a = 0;\n";
+  for (int i = 0; i < REG_CONSTANT_SLOTS + 10; i++) {
+    source += "a = " + std::to_string(i) + ";\n";
+  }
+  source += "print a + 0.5;";
+  Outcome registers = run(source, true);
+  EXPECT_EQ(registers.result, INTERPRET_OK);
+  EXPECT_EQ(registers.out, std::to_string(REG_CONSTANT_SLOTS + 9) + ".5\n");
+}
+
+static std::string nested(const char *operand, int depth, const char *left = "a") {
+  std::string source = std::string("var a = ") + operand + ";\nprint ";
+  for (int i = 0; i < depth; i++) {
+    source += std::string(left) + " + (";
+  }
+  return source + "a" + std::string(depth, ')') + ";";
+}
+
+TEST(TestRegisters, DeepExpressionsTakeManyRegisters) {
+  Outcome registers = run(nested("1", 5000, "-a"), true);
+  EXPECT_EQ(registers.result, INTERPRET_OK);
+  EXPECT_EQ(registers.out, "-4999\n");
+}
+
+TEST(TestRegisters, CollectorSeesTheRegisters) {
+  // every concatenation runs a collector step while the operands are
+  // only in registers
+  Outcome registers = run(nested("\"a\"", 200), true, 0, 1);
+  EXPECT_EQ(registers.result, INTERPRET_OK);
+  EXPECT_EQ(registers.out, std::string(201, 'a') + "\n");
+}
+
+TEST(TestRegisters, FrameBeyondTheStackLimitIsARuntimeError) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *err = open_memstream(&buffer, &size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = fopen("/dev/null", "w");
+  vm.err = err;
+  vm.registers = true;
+  vm.stack_limit = 64;
+  EXPECT_EQ(interpret(&vm, nested("1", 100, "-a").c_str()), INTERPRET_RUNTIME_ERROR);
+  fflush(err);
+  EXPECT_EQ(std::string(buffer, size), "Stack overflow.\n[line 1] in script\n");
+  // the VM stays usable and the globals are there
+  EXPECT_EQ(interpret(&vm, "var a = 2; print a;"), INTERPRET_OK);
+  EXPECT_EQ(vm.stack_top, vm.stack);
+  fclose(vm.out);
+  free_vm(&vm);
+  fclose(err);
+  free(buffer);
+}
+
+TEST(TestRegisters, ChunksShareGlobalsWithStackCode) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  EXPECT_EQ(interpret(&vm, "var a = \"stack\";"), INTERPRET_OK);
+  vm.registers = true;
+  EXPECT_EQ(interpret(&vm, "a = a + \" registers\"; print a;"), INTERPRET_OK);
+  vm.registers = false;
+  EXPECT_EQ(interpret(&vm, "print a;"), INTERPRET_OK);
+  free_vm(&vm);
+  fclose(out);
+  EXPECT_EQ(std::string(buffer, size), "stack registers\nstack registers\n");
+  free(buffer);
+}
+
+TEST(TestRegisters, GlobalsAreWrittenBackOnErrors) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  vm.err = fopen("/dev/null", "w");
+  vm.registers = true;
+  EXPECT_EQ(interpret(&vm, "var a = 1; a = a + 1; print missing;"), INTERPRET_RUNTIME_ERROR);
+  vm.registers = false;
+  EXPECT_EQ(interpret(&vm, "print a;"), INTERPRET_OK);
+  fclose(vm.err);
+  free_vm(&vm);
+  fclose(out);
+  EXPECT_EQ(std::string(buffer, size), "2\n");
+  free(buffer);
+}
+
+TEST(TestRegisters, AreNotSaved) {
+  VM vm;
+  init_vm(&vm);
+  vm.registers = true;
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, "print 1;", &chunk));
+  FILE *out = fopen("/dev/null", "w");
+  EXPECT_FALSE(write_bytecode(&vm, &chunk, out));
+  fclose(out);
+  free_chunk(&chunk);
+  free_vm(&vm);
+}
@@ -10,7 +10,7 @@ extern "C" {
 #define CHECK_TOKENS(correct)                       \
   do {                                              \
     for (size_t i = 0; i < correct.size(); i++) {   \
-      Token t = scan_token();                       \
+      Token t = scan_token(&scanner);               \
       ASSERT_EQ(t.type, correct[i].type);           \
       ASSERT_EQ(t.line, correct[i].line);           \
     }                                               \
@@ -18,7 +18,8 @@ extern "C" {
 
 
 TEST(TestScanner, TestWhitespaceSkipping) {
-  init_scanner(R"(( ) {   }  ,   .
+  Scanner scanner;
+  init_scanner(&scanner, R"(( ) {   }  ,   .
 -   +
 ;
     /
@@ -42,7 +43,8 @@ TEST(TestScanner, TestWhitespaceSkipping) {
 }
 
 TEST(TestScanner, TestOneCharAndTwoChar) {
-  init_scanner(R"(
+  Scanner scanner;
+  init_scanner(&scanner, R"(
 ! !=
 = ==
 > >=
@@ -65,7 +67,8 @@ TEST(TestScanner, TestOneCharAndTwoChar) {
 }
 
 TEST(TestScanner, TestKeywords) {
-  init_scanner("and class else false fun for if nil\n"
+  Scanner scanner;
+  init_scanner(&scanner, "and class else false fun for if nil\n"
                "or print return super this true var while");
 
   const std::vector<Token> correct({
@@ -92,7 +95,8 @@ TEST(TestScanner, TestKeywords) {
 }
 
 TEST(TestScanner, TestStrings) {
-  init_scanner(R"(
+  Scanner scanner;
+  init_scanner(&scanner, R"(
 "I am a string";
 "";    // The empty string.
 "123"; // This is a string, not a number.
@@ -119,7 +123,8 @@ a;     // and this is an identifier
 
 
 TEST(TestScanner, Bool) {
-  init_scanner(R"(
+  Scanner scanner;
+  init_scanner(&scanner, R"(
 true;  // Not false.
 false; // Not *not* false.
 )");
@@ -136,7 +141,8 @@ false; // Not *not* false.
 }
 
 TEST(TestScanner, HelloWorld) {
-  init_scanner(R"(
+  Scanner scanner;
+  init_scanner(&scanner, R"(
 // Your first Lox program!
 print "Hello, world!";
 )");
@@ -152,7 +158,8 @@ print "Hello, world!";
 }
 
 TEST(ScannerTest, Classes) {
-  init_scanner(R"(
+  Scanner scanner;
+  init_scanner(&scanner, R"(
 class Breakfast {
   init(meat, bread) {
 )");
@@ -175,7 +182,8 @@ class Breakfast {
 }
 
 TEST(ScannerTest, ClassMethodCall) {
-  init_scanner(R"(baconAndToast.serve("Dear Reader");)");
+  Scanner scanner;
+  init_scanner(&scanner, R"(baconAndToast.serve("Dear Reader");)");
 
   const std::vector<Token> correct{
     MAKE_TOKEN(TOKEN_IDENTIFIER, "baconAndToast", 1),
@@ -0,0 +1,248 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+extern "C" {
+#include "clox/bytecode.h"
+#include "clox/compiler.h"
+#include "clox/debug.h"
+#include "clox/vm.h"
+}
+
+struct Outcome {
+  InterpretResult result;
+  std::string out;
+  std::string err;
+};
+
+static Outcome run(const std::string &source, bool superinstructions, bool jit = false) {
+  char *out_buffer = NULL, *err_buffer = NULL;
+  size_t out_size = 0, err_size = 0;
+  FILE *out = open_memstream(&out_buffer, &out_size);
+  FILE *err = open_memstream(&err_buffer, &err_size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  vm.err = err;
+  vm.superinstructions = superinstructions;
+  vm.jit = jit;
+  vm.jit_hot_runs = 0;
+  Outcome run;
+  run.result = interpret(&vm, source.c_str());
+  free_vm(&vm);
+  fclose(out);
+  fclose(err);
+
+  run.out = std::string(out_buffer, out_size);
+  run.err = std::string(err_buffer, err_size);
+  free(out_buffer);
+  free(err_buffer);
+  return run;
+}
+
+/**
+ * Number of superinstructions in the code of chunk.
+ */
+static size_t fused_count(const Chunk &chunk) {
+  size_t count = 0;
+  for (size_t offset = 0; offset < chunk.count; offset += instruction_length((OpCode) chunk.code[offset])) {
+    OpCode first, second;
+    count += superinstruction_parts((OpCode) chunk.code[offset], &first, &second);
+  }
+  return count;
+}
+
+/**
+ * Emits opcode with operands that point at constant 0 or global slot 0.
+ */
+static void write_instruction(Chunk *chunk, OpCode opcode) {
+  write_chunk(chunk, opcode, 1);
+  for (size_t i = 1; i < instruction_length(opcode); i++) {
+    write_chunk(chunk, 0, 1);
+  }
+}
+
+static const char *scripts[] = {
+  "var a = 1; var b = 2; print a + b; print a + 1; print a == b;",
+  "var x = 1; var y = 2; var z = 3;\n"
+  "x = x * 0.999 + y - z / 7;\n"
+  "y = (x - y) * (x + y) / 1000 + 1;\n"
+  "z = -z + x * 2 - y;\n"
+  "print x + y + z;",
+  "var s = \"a\"; var t = \"b\"; print s + t + s; print s + t == \"ab\";",
+  // errors in the first and in the second part of a pair
+  "var a = 1;\nprint a +\nb;",
+  "var a = 1;\nvar b = \"s\";\nprint a +\nb;",
+  "var a = nil;\nprint a\n + 1;",
+  "var a = 1; a = a + 1; a = a + a; print a; print missing;",
+};
+
+TEST(TestSuperinstructions, TableNamesItsParts) {
+#define SUPERINSTRUCTION(name, first_part, second_part)                               \
+  {                                                                                   \
+    OpCode first, second;                                                             \
+    ASSERT_TRUE(superinstruction_parts(name, &first, &second));                       \
+    EXPECT_EQ(first, first_part);                                                     \
+    EXPECT_EQ(second, second_part);                                                   \
+    EXPECT_EQ(generic_opcode(name), first_part);                                      \
+    EXPECT_EQ(instruction_length(name), instruction_length(first_part) + instruction_length(second_part)); \
+    EXPECT_STREQ(opcode_name(name), #name);                                           \
+    EXPECT_EQ(std::string(#name), std::string("OP_") + (opcode_name(first_part) + 3) + \
+        "_" + (opcode_name(second_part) + 3));                                        \
+  }
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+
+  OpCode first, second;
+  EXPECT_FALSE(superinstruction_parts(OP_ADD, &first, &second));
+  EXPECT_FALSE(superinstruction_parts(OP_ADD_NUM, &first, &second));
+}
+
+TEST(TestSuperinstructions, FusesEveryPairInTheTable) {
+#define SUPERINSTRUCTION(name, first, second)                                         \
+  {                                                                                   \
+    Chunk chunk;                                                                      \
+    init_chunk(&chunk);                                                               \
+    add_constant(&chunk, NUMBER_VAL(1));                                              \
+    write_instruction(&chunk, first);                                                 \
+    write_instruction(&chunk, second);                                                \
+    write_chunk(&chunk, OP_RETURN, 1);                                                \
+    size_t count = chunk.count;                                                       \
+    ASSERT_TRUE(fuse_superinstructions(&chunk));                                      \
+    EXPECT_EQ(chunk.code[0], name);                                                   \
+    /* the second opcode and all operands stay where they were */                     \
+    EXPECT_EQ(chunk.code[instruction_length(first)], second);                         \
+    EXPECT_EQ(chunk.count, count);                                                    \
+    EXPECT_EQ(chunk.code[instruction_length(name)], OP_RETURN);                       \
+                                                                                      \
+    char *text = NULL;                                                                \
+    size_t length = 0;                                                                \
+    FILE *out = open_memstream(&text, &length);                                       \
+    EXPECT_EQ(fdisassemble_instruction(out, &chunk, 0), instruction_length(name));    \
+    fclose(out);                                                                      \
+    EXPECT_EQ(std::string(text, length).find(#name), 10u) << text;                    \
+    free(text);                                                                       \
+    free_chunk(&chunk);                                                               \
+  }
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+}
+
+TEST(TestSuperinstructions, FusesFromLeftToRight) {
+  struct { OpCode fused, first, second; } table[] = {
+#define SUPERINSTRUCTION(name, first, second) {name, first, second},
+#include "clox/superinstructions.h"
+#undef SUPERINSTRUCTION
+  };
+  for (const auto &entry : table) {
+    // whatever the second part could be fused with, each pair is taken
+    // whole before the next one starts
+    Chunk chunk;
+    init_chunk(&chunk);
+    add_constant(&chunk, NUMBER_VAL(1));
+    for (int i = 0; i < 2; i++) {
+      write_instruction(&chunk, entry.first);
+      write_instruction(&chunk, entry.second);
+    }
+    write_chunk(&chunk, OP_RETURN, 1);
+    ASSERT_TRUE(fuse_superinstructions(&chunk));
+    EXPECT_EQ(chunk.code[0], entry.fused);
+    EXPECT_EQ(chunk.code[instruction_length(entry.fused)], entry.fused);
+    EXPECT_EQ(fused_count(chunk), 2u);
+    free_chunk(&chunk);
+  }
+}
+
+TEST(TestSuperinstructions, RunsLikeThePairs) {
+  for (const char *script : scripts) {
+    Outcome generic = run(script, false);
+    Outcome fused = run(script, true);
+    EXPECT_EQ(fused.result, generic.result) << script;
+    EXPECT_EQ(fused.out, generic.out) << script;
+    // runtime errors name the line of the part that failed
+    EXPECT_EQ(fused.err, generic.err) << script;
+  }
+}
+
+TEST(TestSuperinstructions, JitRunsFusedCode) {
+  for (const char *script : scripts) {
+    Outcome generic = run(script, false);
+    Outcome native = run(script, true, true);
+    EXPECT_EQ(native.result, generic.result) << script;
+    EXPECT_EQ(native.out, generic.out) << script;
+    EXPECT_EQ(native.err, generic.err) << script;
+  }
+}
+
+TEST(TestSuperinstructions, FusedBeforeTheFirstRun) {
+  VM vm;
+  init_vm(&vm);
+  vm.out = fopen("/dev/null", "w");
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, scripts[1], &chunk));
+  EXPECT_EQ(fused_count(chunk), 0u);
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_TRUE(chunk.fused);
+  EXPECT_GT(fused_count(chunk), 0u);
+
+  free_chunk(&chunk);
+  fclose(vm.out);
+  free_vm(&vm);
+}
+
+TEST(TestSuperinstructions, CanBeTurnedOff) {
+  VM vm;
+  init_vm(&vm);
+  vm.out = fopen("/dev/null", "w");
+  vm.superinstructions = false;
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, scripts[1], &chunk));
+  ASSERT_EQ(interpret_chunk(&vm, &chunk), INTERPRET_OK);
+  EXPECT_FALSE(chunk.fused);
+  EXPECT_EQ(fused_count(chunk), 0u);
+
+  free_chunk(&chunk);
+  fclose(vm.out);
+  free_vm(&vm);
+}
+
+TEST(TestSuperinstructions, BorrowedCodeIsCopiedAndSavedUnfused) {
+  VM vm;
+  init_vm(&vm);
+  vm.out = fopen("/dev/null", "w");
+  Chunk chunk;
+  init_chunk(&chunk);
+  ASSERT_TRUE(compile(&vm, scripts[1], &chunk));
+  char *bytes = NULL;
+  size_t length = 0;
+  FILE *file = open_memstream(&bytes, &length);
+  ASSERT_TRUE(write_bytecode(&vm, &chunk, file));
+  fclose(file);
+  std::string original(bytes, length);
+  free(bytes);
+
+  uint8_t *storage = (uint8_t *) malloc(original.size());
+  memcpy(storage, original.data(), original.size());
+  Chunk loaded;
+  ASSERT_TRUE(read_bytecode(&vm, &loaded, storage, original.size(), vm.err));
+  ASSERT_EQ(interpret_chunk(&vm, &loaded), INTERPRET_OK);
+  EXPECT_GT(fused_count(loaded), 0u);
+  EXPECT_EQ(memcmp(storage, original.data(), original.size()), 0);
+
+  file = open_memstream(&bytes, &length);
+  ASSERT_TRUE(write_bytecode(&vm, &loaded, file));
+  fclose(file);
+  EXPECT_EQ(std::string(bytes, length), original);
+  free(bytes);
+
+  free_chunk(&loaded);
+  free(storage);
+  free_chunk(&chunk);
+  fclose(vm.out);
+  free_vm(&vm);
+}
@@ -0,0 +1,71 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+extern "C" {
+#include "clox/trace.h"
+}
+
+static std::string dump(const Tracer *tracer) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  dump_trace(tracer, out);
+  fclose(out);
+
+  std::string result(buffer, size);
+  free(buffer);
+  return result;
+}
+
+TEST(TestTrace, RingKeepsTheLastInstructions) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  for (int i = 0; i < 100; i++) {
+    write_chunk(&chunk, OP_NEGATE, i + 1);
+  }
+
+  Tracer tracer;
+  init_tracer(&tracer);
+  tracer.mode = TRACE_RING;
+  Value stack[1] = {NUMBER_VAL(1)};
+  for (size_t offset = 0; offset < 100; offset++) {
+    trace_instruction(&tracer, stdout, &chunk, offset, stack, stack + 1);
+  }
+  ASSERT_EQ(tracer.count, TRACE_CAPACITY);
+
+  std::string trace = dump(&tracer);
+  // oldest surviving instruction comes first, the newest one last
+  std::string first = "    [ 1 ]\n" + std::string("00") +
+    std::to_string(100 - TRACE_CAPACITY) + "   " + std::to_string(100 - TRACE_CAPACITY + 1);
+  EXPECT_EQ(trace.rfind(first, 0), 0) << trace;
+  EXPECT_NE(trace.find("0099  100 OP_NEGATE\n"), std::string::npos);
+  EXPECT_EQ(trace.find("0035 "), std::string::npos);
+
+  free_chunk(&chunk);
+}
+
+TEST(TestTrace, DeepStacksAreTruncated) {
+  Chunk chunk;
+  init_chunk(&chunk);
+  write_chunk(&chunk, OP_ADD, 1);
+
+  Value stack[TRACE_STACK_DEPTH + 2];
+  for (int i = 0; i < TRACE_STACK_DEPTH + 2; i++) {
+    stack[i] = NUMBER_VAL(i);
+  }
+
+  Tracer tracer;
+  init_tracer(&tracer);
+  tracer.mode = TRACE_RING;
+  trace_instruction(&tracer, stdout, &chunk, 0, stack, stack + TRACE_STACK_DEPTH + 2);
+
+  std::string trace = dump(&tracer);
+  // the two bottom values are dropped, the top one is kept
+  EXPECT_EQ(trace.rfind("    ... [ 2 ]", 0), 0) << trace;
+  EXPECT_NE(trace.find("[ 9 ]\n"), std::string::npos) << trace;
+
+  reset_tracer(&tracer);
+  EXPECT_EQ(dump(&tracer), "");
+  free_chunk(&chunk);
+}
@@ -0,0 +1,80 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <string>
+
+extern "C" {
+#include "clox/value.h"
+}
+
+TEST(TestValue, NumberRoundTrip) {
+  const double numbers[] = {0.0, -0.0, 1.5, -3.25, 1e300, -1e-300,
+                            std::numeric_limits<double>::infinity()};
+  for (double number : numbers) {
+    Value v = NUMBER_VAL(number);
+    ASSERT_TRUE(IS_NUMBER(v));
+    ASSERT_FALSE(IS_BOOL(v));
+    ASSERT_FALSE(IS_NIL(v));
+    ASSERT_EQ(AS_NUMBER(v), number);
+  }
+}
+
+TEST(TestValue, NaNIsStillANumber) {
+  Value v = NUMBER_VAL(std::nan(""));
+  ASSERT_TRUE(IS_NUMBER(v));
+  ASSERT_TRUE(std::isnan(AS_NUMBER(v)));
+
+  Value computed = NUMBER_VAL(0.0 / 0.0);
+  ASSERT_TRUE(IS_NUMBER(computed));
+}
+
+TEST(TestValue, NaNPrintsWithoutSign) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  fprint_value(out, NUMBER_VAL(std::nan("")));
+  fprint_value(out, NUMBER_VAL(-std::nan("")));
+  fclose(out);
+  EXPECT_EQ(std::string(buffer, size), "nannan");
+  free(buffer);
+}
+
+TEST(TestValue, BoolAndNil) {
+  Value t = BOOL_VAL(true);
+  Value f = BOOL_VAL(false);
+  Value nil = NIL_VAL(0);
+
+  ASSERT_TRUE(IS_BOOL(t));
+  ASSERT_TRUE(IS_BOOL(f));
+  ASSERT_TRUE(AS_BOOL(t));
+  ASSERT_FALSE(AS_BOOL(f));
+  ASSERT_FALSE(IS_NUMBER(t));
+  ASSERT_FALSE(IS_NIL(t));
+
+  ASSERT_TRUE(IS_NIL(nil));
+  ASSERT_FALSE(IS_BOOL(nil));
+  ASSERT_FALSE(IS_NUMBER(nil));
+}
+
+#ifdef CLOX_NAN_BOXING
+TEST(TestValue, NaNBoxedValueIsEightBytes) {
+  ASSERT_EQ(sizeof(Value), 8);
+}
+#endif // CLOX_NAN_BOXING
+
+TEST(TestValue, ValueArrayKeepsValues) {
+  ValueArray array;
+  init_value_array(&array);
+  for (int i = 0; i < 100; i++) {
+    write_value_array(&array, NUMBER_VAL(i));
+  }
+
+  ASSERT_EQ(array.count, 100);
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(AS_NUMBER(array.values[i]), i);
+  }
+  free_value_array(&array);
+}
@@ -0,0 +1,237 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "clox/vm.h"
+}
+
+/**
+ * Runs source on its own VM and returns everything the VM printed.
+ */
+static std::string run(const std::string &source, InterpretResult *result) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  *result = interpret(&vm, source.c_str());
+  free_vm(&vm);
+  fclose(out);
+
+  std::string printed(buffer, size);
+  free(buffer);
+  return printed;
+}
+
+TEST(TestVM, InterpretWritesToVMOutput) {
+  InterpretResult result;
+  EXPECT_EQ(run("print (-1 + 2) * 3 - -4;", &result), "7\n");
+  EXPECT_EQ(result, INTERPRET_OK);
+}
+
+TEST(TestVM, Strings) {
+  InterpretResult result;
+  EXPECT_EQ(run("print \"foo\" + \"bar\";", &result), "foobar\n");
+  EXPECT_EQ(run("print \"\";", &result), "\n");
+  EXPECT_EQ(run("print \"ab\" == \"a\" + \"b\";", &result), "true\n");
+  EXPECT_EQ(run("print \"1\" != 1;", &result), "true\n");
+  EXPECT_EQ(result, INTERPRET_OK);
+}
+
+TEST(TestVM, EqualityAndNot) {
+  InterpretResult result;
+  EXPECT_EQ(run("print !nil;", &result), "true\n");
+  EXPECT_EQ(run("print !0;", &result), "false\n");
+  EXPECT_EQ(run("print !(1 == 2) == !false;", &result), "true\n");
+  EXPECT_EQ(run("print nil == false;", &result), "false\n");
+  EXPECT_EQ(result, INTERPRET_OK);
+}
+
+TEST(TestVM, AddingStringAndNumberIsARuntimeError) {
+  InterpretResult result;
+  run("print \"a\" + 1;", &result);
+  EXPECT_EQ(result, INTERPRET_RUNTIME_ERROR);
+}
+
+TEST(TestVM, GlobalVariables) {
+  InterpretResult result;
+  EXPECT_EQ(run("var a = 1; var b; print b; b = a + 1; print a + b;", &result), "nil\n3\n");
+  EXPECT_EQ(run("var a = \"x\"; var a = a + \"y\"; print a;", &result), "xy\n");
+  EXPECT_EQ(run("var a = 1; var b = 2; a = b = 3; print a + b;", &result), "6\n");
+  EXPECT_EQ(result, INTERPRET_OK);
+}
+
+TEST(TestVM, UndefinedGlobalsAreRuntimeErrors) {
+  InterpretResult result;
+  run("print a; var a = 1;", &result);
+  EXPECT_EQ(result, INTERPRET_RUNTIME_ERROR);
+  run("a = 1; var a;", &result);
+  EXPECT_EQ(result, INTERPRET_RUNTIME_ERROR);
+}
+
+TEST(TestVM, GlobalsPersistAcrossInterpretCalls) {
+  VM vm;
+  init_vm(&vm);
+  char *buffer = NULL;
+  size_t size = 0;
+  vm.out = open_memstream(&buffer, &size);
+  EXPECT_EQ(interpret(&vm, "var a = 40;"), INTERPRET_OK);
+  EXPECT_EQ(interpret(&vm, "var b = a + 2;"), INTERPRET_OK);
+  EXPECT_EQ(interpret(&vm, "print b;"), INTERPRET_OK);
+  fclose(vm.out);
+  free_vm(&vm);
+  EXPECT_EQ(std::string(buffer, size), "42\n");
+  free(buffer);
+}
+
+TEST(TestVM, CompileErrorsGoToVMErrorStream) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *err = open_memstream(&buffer, &size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.err = err;
+  EXPECT_EQ(interpret(&vm, "print 1 +;"), INTERPRET_COMPILE_ERROR);
+  free_vm(&vm);
+  fclose(err);
+
+  EXPECT_NE(std::string(buffer, size).find("Expect expression"), std::string::npos);
+  free(buffer);
+}
+
+/**
+ * print a + (a + (a + ... a)) with depth additions, each of them keeps
+ * one more value on the stack.
+ */
+static std::string nested_sum(int depth) {
+  std::string source = "var a = 1;\nprint ";
+  for (int i = 0; i < depth; i++) {
+    source += "a + (";
+  }
+  source += "a";
+  source += std::string(depth, ')');
+  return source + ";";
+}
+
+TEST(TestVM, StackStartsEmptyAndGrows) {
+  VM vm;
+  init_vm(&vm);
+  EXPECT_EQ(vm.stack, nullptr);
+  ASSERT_TRUE(grow_stack(&vm, 1));
+  EXPECT_EQ(vm.stack_end - vm.stack, STACK_INITIAL);
+
+  for (int i = 0; i < STACK_INITIAL; i++) {
+    push(&vm, NUMBER_VAL(i));
+  }
+  ASSERT_TRUE(grow_stack(&vm, 1));
+  EXPECT_EQ(vm.stack_end - vm.stack, 2 * STACK_INITIAL);
+  // the values moved along
+  for (int i = STACK_INITIAL - 1; i >= 0; i--) {
+    EXPECT_EQ(AS_NUMBER(pop(&vm)), i);
+  }
+
+  vm.stack_limit = 100;
+  EXPECT_TRUE(grow_stack(&vm, 100));
+  EXPECT_EQ(vm.stack_end - vm.stack, 100);
+  EXPECT_FALSE(grow_stack(&vm, 101));
+  free_vm(&vm);
+}
+
+TEST(TestVM, DeepExpressionsGrowTheStack) {
+  InterpretResult result;
+  EXPECT_EQ(run(nested_sum(5000), &result), "5001\n");
+  EXPECT_EQ(result, INTERPRET_OK);
+}
+
+TEST(TestVM, CollectorSeesOperandsOfTheRunLoop) {
+  // every concatenation runs a collector step while its operands are only
+  // on the stack, the run loop must have written them there
+  std::string source = "var s = \"a\";\nprint ";
+  for (int i = 0; i < 200; i++) {
+    source += "s + (";
+  }
+  source += "s" + std::string(200, ')') + ";";
+
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&buffer, &size);
+  VM vm;
+  init_vm(&vm);
+  vm.out = out;
+  vm.gc.min_heap = 0;
+  vm.gc.next_cycle = 0;
+  vm.gc.step_bytes = 1;
+  EXPECT_EQ(interpret(&vm, source.c_str()), INTERPRET_OK);
+  free_vm(&vm);
+  fclose(out);
+  EXPECT_EQ(std::string(buffer, size), std::string(201, 'a') + "\n");
+  free(buffer);
+}
+
+TEST(TestVM, StackOverflowIsARuntimeError) {
+  char *buffer = NULL;
+  size_t size = 0;
+  FILE *err = open_memstream(&buffer, &size);
+
+  VM vm;
+  init_vm(&vm);
+  vm.out = fopen("/dev/null", "w");
+  vm.err = err;
+  vm.stack_limit = 64;
+  EXPECT_EQ(interpret(&vm, nested_sum(100).c_str()), INTERPRET_RUNTIME_ERROR);
+  fflush(err);
+  EXPECT_EQ(std::string(buffer, size), "Stack overflow.\n[line 2] in script\n");
+  // the VM stays usable
+  EXPECT_EQ(interpret(&vm, nested_sum(10).c_str()), INTERPRET_OK);
+  fclose(vm.out);
+  free_vm(&vm);
+  fclose(err);
+  free(buffer);
+}
+
+TEST(TestVM, DeepStackIsGivenBackAfterTheRun) {
+  VM vm;
+  init_vm(&vm);
+  vm.out = fopen("/dev/null", "w");
+  ASSERT_EQ(interpret(&vm, nested_sum(5000).c_str()), INTERPRET_OK);
+  EXPECT_EQ(vm.stack, nullptr);
+  ASSERT_EQ(interpret(&vm, nested_sum(10).c_str()), INTERPRET_OK);
+  EXPECT_EQ(vm.stack_end - vm.stack, STACK_INITIAL);
+  fclose(vm.out);
+  free_vm(&vm);
+}
+
+TEST(TestVM, IndependentVMsOnManyThreads) {
+  const int threads = 8;
+  const int runs = 200;
+  std::vector<std::string> outputs(threads);
+  std::vector<bool> ok(threads, true);
+
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([t, &outputs, &ok]() {
+      // every thread compiles its own expression so that shared compiler
+      // or scanner state would show up as a wrong result
+      std::string source = "print " + std::to_string(t) + " * (100 + " + std::to_string(t) + ");";
+      for (int i = 0; i < runs; i++) {
+        InterpretResult result;
+        outputs[t] = run(source, &result);
+        ok[t] = ok[t] && result == INTERPRET_OK &&
+          outputs[t] == std::to_string(t * (100 + t)) + "\n";
+      }
+    });
+  }
+
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  for (int t = 0; t < threads; t++) {
+    EXPECT_TRUE(ok[t]) << "thread " << t << " printed " << outputs[t];
+  }
+}